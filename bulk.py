@@ -0,0 +1,418 @@
+#!/usr/bin/env python3
+"""
+Bulk Ingest - static triage of whole zip/tar bundles
+
+Archive members are streamed straight out of the zip/tar (no extraction
+tree is written) and each one is scored by StaticAnalyzer in a process
+pool sized to the cores. Only samples whose static score reaches the
+triage gate (bulk.dynamic_min_score) are kept for the dynamic stage, so
+the VM queue sees the samples that need it and nothing else.
+
+The scanners take a path, so a member is staged as one short-lived file
+in a RAM-backed scratch directory (/dev/shm by default) while it is
+scanned; samples below the gate are deleted right after, those above it
+are moved to the output folder. Nested archives are triaged as samples,
+not unpacked.
+
+VirusTotal is not queried during triage: every worker would have its
+own token bucket and hundreds of members would burn the daily quota.
+Kept samples get their lookup when the dynamic job re-runs the static
+stage, which is served from the shared result cache.
+
+Usage:
+    python3 bulk.py bundle.zip [--out downloads/bulk] [--min-score 15] [--dynamic]
+"""
+
+import os
+import re
+import sys
+import shutil
+import hashlib
+import zipfile
+import tarfile
+import argparse
+import tempfile
+import multiprocessing
+from concurrent.futures import ProcessPoolExecutor, ThreadPoolExecutor, FIRST_COMPLETED, wait
+from concurrent.futures.process import BrokenProcessPool
+from dataclasses import dataclass, field
+from typing import Callable, Dict, Iterator, List, Optional, Tuple
+
+try:
+    import yaml
+except ImportError:
+    yaml = None
+
+DEFAULT_MIN_SCORE = 15      # the SUSPICIOUS threshold of the default verdict config
+DEFAULT_MAX_MEMBERS = 1000
+DEFAULT_MAX_MEMBER_MB = 64
+
+SAFE_NAME_RE = re.compile(r'[^A-Za-z0-9._-]+')
+
+
+@dataclass
+class Member:
+    """One regular file read out of an archive"""
+    name: str
+    data: bytes
+
+
+@dataclass
+class TriageResult:
+    """Static verdict for one archive member"""
+    name: str
+    sha256: str = ''
+    score: int = 0
+    verdict: str = 'UNKNOWN'
+    yara_matches: List[str] = field(default_factory=list)
+    path: Optional[str] = None          # kept copy for the dynamic stage
+    error: Optional[str] = None
+
+
+@dataclass
+class BulkReport:
+    """Outcome of triaging one archive"""
+    archive: str
+    min_score: int
+    results: List[TriageResult] = field(default_factory=list)
+    skipped: List[Tuple[str, str]] = field(default_factory=list)   # (member, reason)
+    duplicates: int = 0
+    
+    @property
+    def gated(self) -> List[TriageResult]:
+        """Samples that passed the gate, highest score first"""
+        return sorted((r for r in self.results if r.path), key=lambda r: -r.score)
+    
+    def top(self, n: int = 5) -> List[TriageResult]:
+        return sorted(self.results, key=lambda r: -r.score)[:n]
+
+
+def is_archive(path: str) -> bool:
+    """True for files bulk ingest can unpack"""
+    try:
+        return zipfile.is_zipfile(path) or tarfile.is_tarfile(path)
+    except OSError:
+        return False
+
+
+def safe_name(member: str) -> str:
+    """Flat file name for a member path (no directories, no traversal)"""
+    base = os.path.basename(member.replace('\\', '/').rstrip('/'))
+    return SAFE_NAME_RE.sub('_', base).lstrip('.') or 'member'
+
+
+def iter_members(path: str, max_members: int = DEFAULT_MAX_MEMBERS,
+                 max_member_bytes: int = DEFAULT_MAX_MEMBER_MB << 20
+                 ) -> Iterator[Tuple[str, Optional[Member], Optional[str]]]:
+    """
+    Stream regular files out of a zip or tar archive in archive order.
+    
+    Member sizes are enforced on the decompressed stream, not on the
+    header, so a lying zip entry cannot blow past the limit.
+    
+    Args:
+        path: Archive file (zip, tar, tar.gz/bz2/xz)
+        max_members: Stop after this many files
+        max_member_bytes: Skip members larger than this
+    
+    Yields:
+        (member name, Member or None, skip reason or None)
+    """
+    def read(stream) -> Optional[bytes]:
+        data = stream.read(max_member_bytes + 1)
+        return data if len(data) <= max_member_bytes else None
+    
+    count = 0
+    if zipfile.is_zipfile(path):
+        with zipfile.ZipFile(path) as zf:
+            for info in zf.infolist():
+                if info.is_dir():
+                    continue
+                if count >= max_members:
+                    yield info.filename, None, 'member limit'
+                    return
+                count += 1
+                if info.file_size > max_member_bytes:
+                    yield info.filename, None, 'too large'
+                    continue
+                try:
+                    with zf.open(info) as stream:
+                        data = read(stream)
+                except (RuntimeError, zipfile.BadZipFile, NotImplementedError, OSError) as e:
+                    # Encrypted entries, unsupported methods, CRC errors
+                    yield info.filename, None, str(e) or type(e).__name__
+                    continue
+                if data is None:
+                    yield info.filename, None, 'too large'
+                    continue
+                yield info.filename, Member(info.filename, data), None
+        return
+    
+    # Stream mode reads the (possibly compressed) tar front to back once
+    with tarfile.open(path, 'r|*') as tf:
+        for info in tf:
+            if not info.isfile():
+                continue
+            if count >= max_members:
+                yield info.name, None, 'member limit'
+                return
+            count += 1
+            if info.size > max_member_bytes:
+                yield info.name, None, 'too large'
+                continue
+            data = read(tf.extractfile(info))
+            if data is None:
+                yield info.name, None, 'too large'
+                continue
+            yield info.name, Member(info.name, data), None
+
+
+def load_config(config_path: Optional[str]) -> Dict:
+    """The bulk: section of config.yaml"""
+    if not config_path or not yaml or not os.path.exists(config_path):
+        return {}
+    try:
+        with open(config_path) as f:
+            return (yaml.safe_load(f) or {}).get('bulk', {}) or {}
+    except (OSError, yaml.YAMLError):
+        return {}
+
+
+def default_scratch_dir() -> str:
+    return '/dev/shm' if os.path.isdir('/dev/shm') and os.access('/dev/shm', os.W_OK) \
+        else tempfile.gettempdir()
+
+
+def static_analyzer(config_path: Optional[str]):
+    """Triage analyzer: full local pipeline, VirusTotal off"""
+    from static import StaticAnalyzer
+    analyzer = StaticAnalyzer(config_path=config_path)
+    analyzer.vt.api_key = ''
+    return analyzer
+
+
+# Per-process analyzer, built once by the pool initializer
+_worker_analyzer = None
+
+
+def _init_worker(factory: Callable, config_path: Optional[str]):
+    global _worker_analyzer
+    _worker_analyzer = factory(config_path)
+
+
+def _triage(path: str) -> Dict:
+    from sample import describe
+    try:
+        sample = describe(path)
+        return _worker_analyzer.run(path, sample, wait_vt=False)
+    except Exception as e:
+        return {'verdict': 'ERROR', 'score': 0, 'error': str(e)}
+
+
+class BulkTriage:
+    """
+    Static triage of archives over a process pool.
+    
+    Usage:
+        triage = BulkTriage("config.yaml")
+        report = triage.run("bundle.zip", "downloads/bulk")
+        for r in report.gated:
+            queue_dynamic(r.path)
+    """
+    
+    def __init__(self, config_path: Optional[str] = "config.yaml", workers: Optional[int] = None,
+                 min_score: Optional[int] = None, scratch_dir: Optional[str] = None,
+                 analyzer_factory: Callable = static_analyzer):
+        cfg = load_config(config_path)
+        self.config_path = config_path
+        self.workers = workers or cfg.get('workers') or os.cpu_count() or 1
+        self.min_score = cfg.get('dynamic_min_score', DEFAULT_MIN_SCORE) if min_score is None else min_score
+        self.max_members = cfg.get('max_members', DEFAULT_MAX_MEMBERS)
+        self.max_member_bytes = int(cfg.get('max_member_mb', DEFAULT_MAX_MEMBER_MB)) << 20
+        self.scratch_dir = scratch_dir or cfg.get('scratch_dir') or default_scratch_dir()
+        self.analyzer_factory = analyzer_factory
+    
+    def run(self, archive: str, out_dir: str,
+            on_progress: Optional[Callable[[int], None]] = None) -> BulkReport:
+        """
+        Triage every member of an archive.
+        
+        Args:
+            archive: zip or tar file
+            out_dir: Where samples that pass the gate are kept
+            on_progress: Called with the number of members scored so far
+        
+        Returns:
+            BulkReport
+        """
+        report = BulkReport(archive=archive, min_score=self.min_score)
+        if not is_archive(archive):
+            report.skipped.append((os.path.basename(archive), 'not a zip/tar archive'))
+            return report
+        
+        os.makedirs(out_dir, exist_ok=True)
+        scratch = tempfile.mkdtemp(prefix='bulk-', dir=self.scratch_dir)
+        seen = set()
+        inflight = {}
+        # Bounded so a large archive is never held in RAM all at once
+        limit = self.workers * 2
+        
+        pool = self._pool()
+        
+        def replace_pool():
+            nonlocal pool
+            pool.shutdown(wait=True)
+            pool = self._pool()
+        
+        def finish(future, name, staged, sha256, lost):
+            try:
+                res = future.result()
+            except BrokenProcessPool:
+                lost.append((name, staged, sha256))
+                return
+            report.results.append(self._finish(name, staged, sha256, res, out_dir))
+        
+        def collect(done):
+            lost = []
+            for future in done:
+                finish(future, *inflight.pop(future), lost)
+            if lost:
+                # A worker was killed (OOM on a decompression bomb, ...) and took
+                # every member in flight with it; they all fail on the dead pool
+                for future in list(inflight):
+                    finish(future, *inflight.pop(future), lost)
+                replace_pool()
+                # Only the member that crashes a worker on its own is skipped,
+                # so a bomb cannot take innocent neighbours out of the triage
+                for member in lost:
+                    isolate(*member)
+            if on_progress and done:
+                on_progress(len(report.results))
+        
+        def isolate(name, staged, sha256):
+            lost = []
+            finish(pool.submit(_triage, staged), name, staged, sha256, lost)
+            if lost:
+                os.unlink(staged)
+                report.skipped.append((name, 'worker crashed'))
+                replace_pool()
+        
+        def submit(staged):
+            try:
+                return pool.submit(_triage, staged)
+            except BrokenProcessPool:
+                # Broke since the last collect(); its futures fail in the next one
+                replace_pool()
+                return pool.submit(_triage, staged)
+        
+        try:
+            for i, (name, member, reason) in enumerate(
+                    iter_members(archive, self.max_members, self.max_member_bytes)):
+                if member is None:
+                    report.skipped.append((name, reason))
+                    continue
+                sha256 = hashlib.sha256(member.data).hexdigest()
+                if sha256 in seen:
+                    report.duplicates += 1
+                    continue
+                seen.add(sha256)
+                
+                staged = os.path.join(scratch, f"{i}_{safe_name(name)}")
+                with open(staged, 'wb') as f:
+                    f.write(member.data)
+                del member
+                inflight[submit(staged)] = (name, staged, sha256)
+                if len(inflight) >= limit:
+                    collect(wait(inflight, return_when=FIRST_COMPLETED).done)
+            collect(wait(inflight).done)
+        except (tarfile.TarError, zipfile.BadZipFile, EOFError, OSError) as e:
+            # Truncated archive: keep what was triaged before the damage
+            report.skipped.append((os.path.basename(archive), f"archive error: {e}"))
+            collect(wait(inflight).done)
+        finally:
+            pool.shutdown(wait=True)
+            shutil.rmtree(scratch, ignore_errors=True)
+        
+        report.results.sort(key=lambda r: r.name)
+        return report
+    
+    def _pool(self) -> ProcessPoolExecutor:
+        # forkserver, not fork: the bot is multithreaded (polling, job workers, VT,
+        # metrics) and a forked worker would inherit locks held by those threads.
+        # Workers fork from a clean server process with the analysis modules loaded.
+        context = multiprocessing.get_context('forkserver')
+        context.set_forkserver_preload(['__main__', 'bulk', 'static'])
+        return ProcessPoolExecutor(max_workers=self.workers, mp_context=context,
+                                   initializer=_init_worker, initargs=(self.analyzer_factory, self.config_path))
+    
+    def _finish(self, name: str, staged: str, sha256: str, res: Dict, out_dir: str) -> TriageResult:
+        result = TriageResult(name=name, sha256=res.get('hash') or sha256, score=res.get('score', 0),
+                              verdict=res.get('verdict', 'UNKNOWN'), yara_matches=res.get('yara_matches', []),
+                              error=res.get('error'))
+        if result.error is None and result.score >= self.min_score:
+            result.path = self._keep(staged, name, result.sha256, out_dir)
+        else:
+            os.unlink(staged)
+        return result
+    
+    @staticmethod
+    def _keep(staged: str, name: str, sha256: str, out_dir: str) -> str:
+        fname = safe_name(name)
+        dest = os.path.join(out_dir, fname)
+        if os.path.exists(dest):
+            dest = os.path.join(out_dir, f"{sha256[:8]}_{fname}")
+        shutil.move(staged, dest)
+        return dest
+
+
+def run_dynamic(report: BulkReport, workers: int) -> Dict[str, Dict]:
+    """Analyze the gated samples in the VM, `workers` at a time"""
+    from dynamic import DynamicAnalyzer
+    from sample import describe
+    analyzer = DynamicAnalyzer(db_path="logs/dynamic_analysis.db")
+    
+    def analyze(result: TriageResult) -> Dict:
+        try:
+            return analyzer.run(result.path, sample=describe(result.path))
+        except Exception as e:
+            return {'error': str(e)}
+    
+    with ThreadPoolExecutor(max_workers=max(1, workers)) as pool:
+        return dict(zip((r.name for r in report.gated), pool.map(analyze, report.gated)))
+
+
+def main(argv: Optional[List[str]] = None) -> int:
+    parser = argparse.ArgumentParser(description="Statically triage every sample in a zip/tar archive")
+    parser.add_argument('archive')
+    parser.add_argument('--out', default='downloads/bulk', help="folder for samples passing the gate")
+    parser.add_argument('--config', default='config.yaml')
+    parser.add_argument('--min-score', type=int, help="static score needed for the dynamic stage")
+    parser.add_argument('--workers', type=int, help="triage processes (default: all cores)")
+    parser.add_argument('--dynamic', action='store_true', help="run the gated samples in the VM")
+    args = parser.parse_args(argv)
+    
+    triage = BulkTriage(args.config, workers=args.workers, min_score=args.min_score)
+    report = triage.run(args.archive, args.out)
+    for r in report.results:
+        mark = '->vm' if r.path else ''
+        print(f"{r.score:4d} {r.verdict:<10} {mark:<4} {r.name}" + (f"  ({r.error})" if r.error else ''))
+    for name, reason in report.skipped:
+        print(f"   - SKIPPED         {name}  ({reason})")
+    print(f"triaged={len(report.results)} gated={len(report.gated)} skipped={len(report.skipped)} "
+          f"duplicates={report.duplicates} min_score={report.min_score}")
+    
+    if args.dynamic and report.gated:
+        queue_cfg = {}
+        if yaml and os.path.exists(args.config):
+            with open(args.config) as f:
+                queue_cfg = (yaml.safe_load(f) or {}).get('queue', {}) or {}
+        for name, dyn in run_dynamic(report, queue_cfg.get('workers', 2)).items():
+            if dyn.get('error'):
+                print(f"dynamic {name}: error {dyn['error']}")
+            else:
+                print(f"dynamic {name}: {dyn['verdict']} threat={dyn['threat_score']}")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
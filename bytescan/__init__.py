@@ -0,0 +1,65 @@
+"""
+Byte Scan - string extraction and entropy kernels for binary analysis
+
+Uses the _bytescan C extension when it is built (see Makefile) and falls
+back to pure-Python versions with identical results otherwise. All
+functions accept bytes, memoryview or mmap objects.
+"""
+
+import re
+import math
+from collections import Counter
+from typing import List
+
+try:
+    from . import _bytescan
+except ImportError:
+    _bytescan = None
+
+NATIVE = _bytescan is not None
+
+# Default sliding window for packer detection
+WINDOW_SIZE = 4096
+
+
+def _py_strings(data, min_len: int = 4) -> bytes:
+    min_len = max(1, int(min_len))
+    return b'\n'.join(re.findall(rb'[\x20-\x7e]{%d,}' % min_len, data))
+
+
+def _py_histogram(data) -> List[int]:
+    counts = Counter(bytes(data))
+    return [counts[b] for b in range(256)]
+
+
+def _entropy_of(counts, total: int) -> float:
+    if not total:
+        return 0.0
+    return -sum(c / total * math.log2(c / total) for c in counts if c)
+
+
+def _py_entropy(data) -> float:
+    data = bytes(data)
+    return _entropy_of(_py_histogram(data), len(data))
+
+
+def _py_window_entropy(data, window: int = WINDOW_SIZE, step: int = 0) -> List[float]:
+    if window < 1:
+        raise ValueError("window must be positive")
+    step = step if step >= 1 else window
+    data = memoryview(data).cast('B')
+    return [_py_entropy(data[i:i + window]) for i in range(0, len(data) - window + 1, step)]
+
+
+if NATIVE:
+    strings = _bytescan.strings
+    histogram = _bytescan.histogram
+    entropy = _bytescan.entropy
+    window_entropy = _bytescan.window_entropy
+else:
+    strings = _py_strings
+    histogram = _py_histogram
+    entropy = _py_entropy
+    window_entropy = _py_window_entropy
+
+__all__ = ['NATIVE', 'WINDOW_SIZE', 'strings', 'histogram', 'entropy', 'window_entropy']
@@ -0,0 +1,292 @@
+/*
+ * _bytescan - byte-level kernels for the ELF analyzer
+ *
+ *   strings(data, min_len=4)              printable ASCII runs joined by '\n'
+ *   histogram(data)                       list of 256 byte counts
+ *   entropy(data)                         Shannon entropy in bits per byte
+ *   window_entropy(data, window, step)    entropy of each window
+ *
+ * data is anything supporting the buffer protocol (bytes, memoryview,
+ * mmap). Loops run with the GIL released. Printable-run scanning skips
+ * whole 16-byte blocks with SSE2 or NEON when every byte of the block is
+ * in the same class; window entropy is updated incrementally per byte.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define BLOCK 16
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define BLOCK 16
+#endif
+
+#define PRINTABLE(b) ((uint8_t)((b) - 0x20) < 0x5f)   /* 0x20..0x7e */
+
+#ifdef BLOCK
+/* 1 = all printable, 0 = none printable, -1 = mixed */
+static inline int block_class(const uint8_t *p)
+{
+#if defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    /* b + 0x60 maps 0x20..0x7e to signed -128..-34 */
+    __m128i t = _mm_add_epi8(v, _mm_set1_epi8(0x60));
+    int mask = _mm_movemask_epi8(_mm_cmplt_epi8(t, _mm_set1_epi8(-33)));
+#else
+    uint8x16_t v = vld1q_u8(p);
+    uint8x16_t m = vcltq_u8(vsubq_u8(v, vdupq_n_u8(0x20)), vdupq_n_u8(0x5f));
+    int mask = vminvq_u8(m) ? 0xffff : (vmaxvq_u8(m) ? 1 : 0);
+#endif
+    if (mask == 0xffff)
+        return 1;
+    return mask ? -1 : 0;
+}
+#endif
+
+static void count_bytes(const uint8_t *p, Py_ssize_t n, uint64_t counts[256])
+{
+    /* Four tables break the store-to-load dependency on repeated bytes */
+    uint64_t c[4][256];
+    Py_ssize_t i = 0;
+
+    memset(c, 0, sizeof(c));
+    for (; i + 4 <= n; i += 4) {
+        c[0][p[i]]++;
+        c[1][p[i + 1]]++;
+        c[2][p[i + 2]]++;
+        c[3][p[i + 3]]++;
+    }
+    for (; i < n; i++)
+        c[0][p[i]]++;
+    for (int b = 0; b < 256; b++)
+        counts[b] = c[0][b] + c[1][b] + c[2][b] + c[3][b];
+}
+
+static double entropy_of(const uint64_t counts[256], uint64_t total)
+{
+    double h = 0.0;
+
+    if (total == 0)
+        return 0.0;
+    for (int b = 0; b < 256; b++) {
+        if (counts[b]) {
+            double p = (double)counts[b] / (double)total;
+            h -= p * log2(p);
+        }
+    }
+    return h;
+}
+
+static PyObject *bs_strings(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "min_len", NULL};
+    Py_buffer buf;
+    Py_ssize_t min_len = 4;
+
+    (void)self;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|n", kwlist, &buf, &min_len))
+        return NULL;
+    if (min_len < 1)
+        min_len = 1;
+
+    const uint8_t *p = buf.buf;
+    Py_ssize_t n = buf.len;
+    /* Output never exceeds input (each run of >= 1 byte adds at most one '\n') */
+    char *out = PyMem_RawMalloc(n + 1);
+    if (!out) {
+        PyBuffer_Release(&buf);
+        return PyErr_NoMemory();
+    }
+    Py_ssize_t olen = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    Py_ssize_t i = 0, start = -1;
+    while (i < n) {
+#ifdef BLOCK
+        if (i + BLOCK <= n) {
+            int cls = block_class(p + i);
+            if (cls == 1) {
+                if (start < 0)
+                    start = i;
+                i += BLOCK;
+                continue;
+            }
+            if (cls == 0 && start < 0) {
+                i += BLOCK;
+                continue;
+            }
+        }
+#endif
+        if (PRINTABLE(p[i])) {
+            if (start < 0)
+                start = i;
+        } else if (start >= 0) {
+            if (i - start >= min_len) {
+                if (olen)
+                    out[olen++] = '\n';
+                memcpy(out + olen, p + start, i - start);
+                olen += i - start;
+            }
+            start = -1;
+        }
+        i++;
+    }
+    if (start >= 0 && n - start >= min_len) {
+        if (olen)
+            out[olen++] = '\n';
+        memcpy(out + olen, p + start, n - start);
+        olen += n - start;
+    }
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&buf);
+    PyObject *result = PyBytes_FromStringAndSize(out, olen);
+    PyMem_RawFree(out);
+    return result;
+}
+
+static PyObject *bs_histogram(PyObject *self, PyObject *arg)
+{
+    Py_buffer buf;
+    uint64_t counts[256];
+
+    (void)self;
+    if (PyObject_GetBuffer(arg, &buf, PyBUF_SIMPLE) < 0)
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    count_bytes(buf.buf, buf.len, counts);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&buf);
+
+    PyObject *list = PyList_New(256);
+    if (!list)
+        return NULL;
+    for (int b = 0; b < 256; b++)
+        PyList_SET_ITEM(list, b, PyLong_FromUnsignedLongLong(counts[b]));
+    return list;
+}
+
+static PyObject *bs_entropy(PyObject *self, PyObject *arg)
+{
+    Py_buffer buf;
+    uint64_t counts[256];
+    double h;
+
+    (void)self;
+    if (PyObject_GetBuffer(arg, &buf, PyBUF_SIMPLE) < 0)
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    count_bytes(buf.buf, buf.len, counts);
+    h = entropy_of(counts, buf.len);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&buf);
+    return PyFloat_FromDouble(h);
+}
+
+static PyObject *bs_window_entropy(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "window", "step", NULL};
+    Py_buffer buf;
+    Py_ssize_t window = 4096, step = 0;
+
+    (void)self;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|nn", kwlist, &buf, &window, &step))
+        return NULL;
+    if (window < 1) {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_ValueError, "window must be positive");
+        return NULL;
+    }
+    if (step < 1)
+        step = window;
+
+    const uint8_t *p = buf.buf;
+    Py_ssize_t n = buf.len;
+    Py_ssize_t nwin = n < window ? 0 : (n - window) / step + 1;
+    double *values = nwin ? PyMem_RawMalloc(nwin * sizeof(double)) : NULL;
+    /* clogc[c] = c * log2(c); H = log2(W) - sum(clogc[count]) / W */
+    double *clogc = nwin ? PyMem_RawMalloc((window + 1) * sizeof(double)) : NULL;
+    if (nwin && (!values || !clogc)) {
+        PyMem_RawFree(values);
+        PyMem_RawFree(clogc);
+        PyBuffer_Release(&buf);
+        return PyErr_NoMemory();
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (nwin) {
+        uint64_t counts[256];
+        double sum = 0.0, logw = log2((double)window);
+
+        clogc[0] = 0.0;
+        for (Py_ssize_t c = 1; c <= window; c++)
+            clogc[c] = (double)c * log2((double)c);
+
+        count_bytes(p, window, counts);
+        for (int b = 0; b < 256; b++)
+            sum += clogc[counts[b]];
+        values[0] = logw - sum / (double)window;
+
+        for (Py_ssize_t w = 1; w < nwin; w++) {
+            Py_ssize_t lo = (w - 1) * step, hi = lo + window;
+            if (step >= window) {
+                /* Disjoint windows: recount */
+                count_bytes(p + w * step, window, counts);
+                sum = 0.0;
+                for (int b = 0; b < 256; b++)
+                    sum += clogc[counts[b]];
+            } else {
+                for (Py_ssize_t k = 0; k < step; k++) {
+                    uint8_t out = p[lo + k], in = p[hi + k];
+                    if (out == in)
+                        continue;
+                    sum += clogc[counts[out] - 1] - clogc[counts[out]];
+                    counts[out]--;
+                    sum += clogc[counts[in] + 1] - clogc[counts[in]];
+                    counts[in]++;
+                }
+            }
+            values[w] = logw - sum / (double)window;
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&buf);
+    PyMem_RawFree(clogc);
+    PyObject *list = PyList_New(nwin);
+    if (list) {
+        for (Py_ssize_t w = 0; w < nwin; w++) {
+            /* Clamp rounding noise of the running sum */
+            double h = values[w] < 0.0 ? 0.0 : values[w];
+            PyList_SET_ITEM(list, w, PyFloat_FromDouble(h));
+        }
+    }
+    PyMem_RawFree(values);
+    return list;
+}
+
+static PyMethodDef bytescan_methods[] = {
+    {"strings", (PyCFunction)(void (*)(void))bs_strings, METH_VARARGS | METH_KEYWORDS,
+     "strings(data, min_len=4) -> bytes of printable runs joined by newlines"},
+    {"histogram", bs_histogram, METH_O, "histogram(data) -> list of 256 byte counts"},
+    {"entropy", bs_entropy, METH_O, "entropy(data) -> Shannon entropy in bits per byte"},
+    {"window_entropy", (PyCFunction)(void (*)(void))bs_window_entropy, METH_VARARGS | METH_KEYWORDS,
+     "window_entropy(data, window=4096, step=window) -> entropy of each full window"},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef bytescan_module = {
+    PyModuleDef_HEAD_INIT, "_bytescan", "Byte-level kernels for the ELF analyzer", -1,
+    bytescan_methods, NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit__bytescan(void)
+{
+    return PyModule_Create(&bytescan_module);
+}
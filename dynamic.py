@@ -9,16 +9,30 @@ virtual machines with realistic hardware emulation.
 import os
 import re
 import json
+import zlib
+import atexit
 import yaml
 import time
-import math
 import socket
 import sqlite3
 import hashlib
-import subprocess
+import threading
+from collections import OrderedDict
 from datetime import datetime
-from dataclasses import dataclass, field
-from typing import Dict, List, Optional, Set
+from dataclasses import dataclass, field, fields, asdict
+from typing import Dict, List, Optional, Set, Tuple
+
+import bytescan
+import metrics
+import pcap_iocs
+from sample import SCRIPT_TYPES, SampleDescriptor, describe
+from result_cache import ResultCache, fingerprint
+from similarity import Features, Neighbor, SimilarityIndex, extract_features
+
+try:
+    from re import _parser as sre_parse, _constants as sre_constants
+except ImportError:  # Python < 3.11
+    import sre_parse, sre_constants
 
 # Scoring constants
 SCORE_MODULES = {
@@ -70,6 +84,22 @@ SUSPICIOUS_STRINGS = [
     (r'PTRACE_TRACEME', 'T1622', 15, 'Anti-debugging')
 ]
 
+# Compiled once; matched against the extracted strings as bytes
+SUSPICIOUS_STRING_RES = [
+    (re.compile(pattern.encode(), re.IGNORECASE), mitre, score, desc)
+    for pattern, mitre, score, desc in SUSPICIOUS_STRINGS
+]
+
+# Entropy thresholds (bits per byte): whole section, and any sliding window
+HIGH_ENTROPY = 7.5
+PACKED_WINDOW_ENTROPY = 7.5
+
+# ELF section flags; only sections loaded at run time can hold a packed payload
+SHF_ALLOC = 0x2
+SHF_COMPRESSED = 0x800
+# Compressed by the toolchain, high entropy in any benign build
+DEBUG_SECTION_PREFIXES = ('.debug', '.zdebug', '.gnu_debugdata')
+
 # Suspicious network indicators
 SUSPICIOUS_TLDS = {
     '.shop', '.fun', '.xyz', '.top', '.club', '.online',
@@ -87,13 +117,6 @@ SUSPICIOUS_HOSTS = {
 }
 
 # File type detection
-FILE_TYPE_MAP = {
-    '.py': 'python', '.pyw': 'python',
-    '.js': 'javascript', '.mjs': 'javascript',
-    '.sh': 'shell', '.bash': 'shell'
-}
-
-
 @dataclass
 class ThreatEvent:
     """Represents a detected threat indicator"""
@@ -103,6 +126,8 @@ class ThreatEvent:
     score: int
     mitre: Optional[str] = None
     timestamp: str = field(default_factory=lambda: datetime.now().isoformat())
+    # Position of the first match in the scanned source (script rules)
+    offset: Optional[int] = None
 
 
 @dataclass
@@ -129,34 +154,168 @@ class AnalysisResult:
     mitre_techniques: List[str] = field(default_factory=list)
 
 
+YARA_RULE_RE = re.compile(r'^\s*(?:(?:private|global)\s+)*rule\s+(\w+)', re.M)
+
+
 class YaraScanner:
-    """YARA-based signature scanner"""
+    """
+    YARA-based signature scanner.
     
-    def __init__(self, rules_dir: str = "yara_rules"):
+    Compiled rules are saved to cache_dir with rules.save() under a
+    fingerprint of the rule sources (name, mtime, size) and loaded from
+    there on the next start; edited rules are picked up on the next scan
+    after RELOAD_CHECK_INTERVAL. Matches are remembered per sample hash
+    and ruleset version, so the static and dynamic reports of one upload
+    share a single scan. Use YaraScanner.shared() to get the process-wide
+    instance for a rules directory.
+    """
+    
+    RELOAD_CHECK_INTERVAL = 5.0
+    MATCH_CACHE_SIZE = 256
+    
+    _instances: Dict[Tuple[str, str], 'YaraScanner'] = {}
+    _instances_lock = threading.Lock()
+    
+    def __init__(self, rules_dir: str = "yara_rules", cache_dir: Optional[str] = "logs/yara_cache"):
         self.rules_dir = rules_dir
+        self.cache_dir = cache_dir
         self.rules = None
+        self.version = ''
         self._available = False
+        self._yara = None
+        self._lock = threading.Lock()
+        self._checked_at = 0.0
+        self._matches: 'OrderedDict[Tuple[str, str], List[YaraMatch]]' = OrderedDict()
         try:
             import yara
-            if os.path.exists(rules_dir):
-                rule_files = {
-                    f: os.path.join(rules_dir, f)
-                    for f in os.listdir(rules_dir)
-                    if f.endswith(('.yar', '.yara'))
-                }
-                if rule_files:
-                    self.rules = yara.compile(filepaths=rule_files)
-            self._available = self.rules is not None
+            self._yara = yara
+            self._load()
         except ImportError:
             pass
     
+    @classmethod
+    def shared(cls, rules_dir: str = "yara_rules",
+               cache_dir: Optional[str] = "logs/yara_cache") -> 'YaraScanner':
+        """Process-wide scanner for a rules directory"""
+        key = (os.path.abspath(rules_dir), os.path.abspath(cache_dir) if cache_dir else '')
+        with cls._instances_lock:
+            if key not in cls._instances:
+                cls._instances[key] = cls(rules_dir, cache_dir)
+            return cls._instances[key]
+    
     @property
     def available(self) -> bool:
         return self._available
     
-    def scan(self, file_path: str) -> List[YaraMatch]:
-        if not self._available or not os.path.exists(file_path):
+    def current_version(self) -> str:
+        """Ruleset version, after picking up edited rule files"""
+        if self._yara is not None:
+            self._maybe_reload()
+        return self.version
+    
+    def snapshot(self) -> Dict[str, Dict]:
+        """Content hash and rule names of every rule file (for rescoring)"""
+        files = {}
+        for name, path in self._rule_files().items():
+            try:
+                with open(path, 'rb') as f:
+                    source = f.read()
+            except OSError:
+                continue
+            files[name] = {
+                'sha1': hashlib.sha1(source).hexdigest(),
+                'rules': YARA_RULE_RE.findall(source.decode('utf-8', 'ignore'))
+            }
+        return files
+    
+    def _rule_files(self) -> Dict[str, str]:
+        if not os.path.isdir(self.rules_dir):
+            return {}
+        return {
+            f: os.path.join(self.rules_dir, f)
+            for f in sorted(os.listdir(self.rules_dir))
+            if f.endswith(('.yar', '.yara'))
+        }
+    
+    def _fingerprint(self, rule_files: Dict[str, str]) -> str:
+        h = hashlib.sha1(getattr(self._yara, '__version__', '').encode())
+        for name, path in rule_files.items():
+            st = os.stat(path)
+            h.update(f"{name}\0{st.st_mtime_ns}\0{st.st_size}\n".encode())
+        return h.hexdigest()[:16]
+    
+    def _load(self):
+        """Load rules from the compiled cache, compiling and saving on a miss"""
+        rule_files = self._rule_files()
+        version = self._fingerprint(rule_files) if rule_files else ''
+        if version == self.version and (self.rules is not None or not rule_files):
+            return
+        
+        rules = None
+        cached = os.path.join(self.cache_dir, f"rules-{version}.yarc") if self.cache_dir else None
+        if rule_files:
+            if cached and os.path.exists(cached):
+                try:
+                    rules = self._yara.load(cached)
+                except Exception:
+                    rules = None
+            if rules is None:
+                rules = self._yara.compile(filepaths=rule_files)
+                if cached:
+                    self._save(rules, cached)
+        
+        self.rules, self.version = rules, version
+        self._available = rules is not None
+        with self._lock:
+            self._matches.clear()
+    
+    def _save(self, rules, path: str):
+        try:
+            os.makedirs(self.cache_dir, exist_ok=True)
+            tmp = f"{path}.{os.getpid()}.tmp"
+            rules.save(tmp)
+            os.replace(tmp, path)
+            # Drop compiled sets of older rule versions
+            for f in os.listdir(self.cache_dir):
+                if f.startswith('rules-') and f.endswith('.yarc') and f != os.path.basename(path):
+                    os.unlink(os.path.join(self.cache_dir, f))
+        except OSError:
+            pass
+    
+    def _maybe_reload(self):
+        now = time.monotonic()
+        if now - self._checked_at < self.RELOAD_CHECK_INTERVAL:
+            return
+        self._checked_at = now
+        try:
+            self._load()
+        except Exception:
+            # Keep serving the last good rules while a source file is broken
+            pass
+    
+    @metrics.timed('yara')
+    def scan(self, file_path: str, sample: Optional[SampleDescriptor] = None) -> List[YaraMatch]:
+        """
+        Scan a file.
+        
+        Args:
+            file_path: File to scan
+            sample: Descriptor of file_path; repeated scans of the same
+                    content with the same rules return the first result
+        """
+        if self._yara is None or not os.path.exists(file_path):
+            return []
+        self._maybe_reload()
+        if not self._available:
             return []
+        
+        key = (sample.sha256, self.version) if sample else None
+        if key:
+            with self._lock:
+                if key in self._matches:
+                    self._matches.move_to_end(key)
+                    return self._matches[key]
+        
         try:
             matches = []
             for m in self.rules.match(file_path):
@@ -168,9 +327,15 @@ class YaraScanner:
                     mitre=meta.get('mitre', ''),
                     strings=[s.identifier for s in (m.strings[:5] if hasattr(m, 'strings') else [])]
                 ))
-            return matches
         except Exception:
             return []
+        
+        if key:
+            with self._lock:
+                self._matches[key] = matches
+                while len(self._matches) > self.MATCH_CACHE_SIZE:
+                    self._matches.popitem(last=False)
+        return matches
 
 
 class ELFAnalyzer:
@@ -188,6 +353,7 @@ class ELFAnalyzer:
     def available(self) -> bool:
         return self._available
     
+    @metrics.timed('elf')
     def analyze(self, file_path: str) -> List[ThreatEvent]:
         if not self._available or not os.path.exists(file_path):
             return []
@@ -198,8 +364,9 @@ class ELFAnalyzer:
                 elf = ELFFile(f)
                 events.extend(self._analyze_imports(elf))
                 f.seek(0)
-                events.extend(self._analyze_strings(f.read()))
-                events.extend(self._analyze_entropy(elf))
+                data = f.read()
+                events.extend(self._analyze_strings(data))
+                events.extend(self._analyze_entropy(elf, data))
         except Exception:
             pass
         return events
@@ -223,48 +390,144 @@ class ELFAnalyzer:
         return events
     
     def _analyze_strings(self, data: bytes) -> List[ThreatEvent]:
-        events, strings, current = [], [], []
-        for b in data:
-            if 32 <= b <= 126:
-                current.append(chr(b))
-            else:
-                if len(current) >= 4:
-                    strings.append(''.join(current))
-                current = []
-        all_strings = '\n'.join(strings)
-        for pattern, mitre, score, desc in SUSPICIOUS_STRINGS:
-            if re.search(pattern, all_strings, re.IGNORECASE):
+        events = []
+        all_strings = bytescan.strings(data, 4)
+        for regex, mitre, score, desc in SUSPICIOUS_STRING_RES:
+            if regex.search(all_strings):
                 events.append(ThreatEvent(
                     source='elf', event_type='string',
                     details=desc, score=score, mitre=mitre
                 ))
         return events
     
-    def _analyze_entropy(self, elf) -> List[ThreatEvent]:
+    def _analyze_entropy(self, elf, file_data: bytes = b'') -> List[ThreatEvent]:
         events = []
+        regions = []
+        has_sections = False
         for section in elf.iter_sections():
-            if section.name in ['.text', '.data']:
-                try:
-                    data = section.data()
-                    if len(data) > 100:
-                        counts = [0] * 256
-                        for b in data:
-                            counts[b] += 1
-                        entropy = -sum(
-                            c/len(data) * math.log2(c/len(data))
-                            for c in counts if c > 0
-                        )
-                        if entropy > 7.5:
-                            events.append(ThreatEvent(
-                                source='elf', event_type='entropy',
-                                details=f"High entropy {section.name}: {entropy:.2f}",
-                                score=15, mitre='T1027'
-                            ))
-                except Exception:
-                    pass
+            has_sections = True
+            if section['sh_type'] == 'SHT_NOBITS':
+                continue
+            try:
+                data = section.data()
+            except Exception:
+                continue
+            if section.name in ['.text', '.data'] and len(data) > 100:
+                entropy = bytescan.entropy(data)
+                if entropy > HIGH_ENTROPY:
+                    events.append(ThreatEvent(
+                        source='elf', event_type='entropy',
+                        details=f"High entropy {section.name}: {entropy:.2f}",
+                        score=15, mitre='T1027'
+                    ))
+                    continue
+            flags = section['sh_flags']
+            if (not flags & SHF_ALLOC or flags & SHF_COMPRESSED
+                    or section.name.startswith(DEBUG_SECTION_PREFIXES)):
+                continue
+            regions.append((section.name or '<unnamed>', data))
+        # Packers often strip the section table; scan the whole file then
+        if not has_sections:
+            regions.append(('file', file_data))
+        
+        # Compressed or encrypted payloads show up as high-entropy windows
+        # even when the section as a whole is diluted by code or padding
+        step = bytescan.WINDOW_SIZE // 2
+        for name, data in regions:
+            if len(data) < bytescan.WINDOW_SIZE:
+                continue
+            windows = bytescan.window_entropy(data, bytescan.WINDOW_SIZE, step)
+            peak = max(range(len(windows)), key=windows.__getitem__)
+            if windows[peak] > PACKED_WINDOW_ENTROPY:
+                events.append(ThreatEvent(
+                    source='elf', event_type='entropy',
+                    details=f"Packed region in {name} at +0x{peak * step:x}: {windows[peak]:.2f}",
+                    score=10, mitre='T1027.002'
+                ))
         return events
 
 
+def required_literal(pattern: str) -> str:
+    """Longest literal run that every match of a regex must contain ('' if none)"""
+    try:
+        tree = sre_parse.parse(pattern)
+    except (re.error, RecursionError):
+        return ''
+    if tree.state.flags & re.IGNORECASE:
+        return ''
+    
+    best = current = ''
+    for op, av in tree:
+        if op is sre_constants.LITERAL:
+            current += chr(av)
+        else:
+            best = max(best, current, key=len)
+            current = ''
+    return max(best, current, key=len)
+
+
+class ScriptMatcher:
+    """
+    Script rules of one language, compiled once.
+    
+    A single pass of one combined regex over the required literal of
+    every rule (RE2-style prefilter) finds which rules can match at all;
+    only those, plus rules without a usable literal, are then evaluated.
+    Cost grows with the number of candidate rules, not with the size of
+    the rule set.
+    """
+    
+    def __init__(self, rules: List[Tuple[str, Dict]]):
+        """
+        Args:
+            rules: (category, rule dict) pairs in patterns.yaml order
+        """
+        self.rules: List[Tuple[str, Dict, re.Pattern]] = []
+        self._always: List[int] = []
+        self._by_literal: Dict[str, List[int]] = {}
+        
+        for category, rule in rules:
+            try:
+                compiled = re.compile(rule['pattern'])
+            except re.error:
+                continue
+            index = len(self.rules)
+            self.rules.append((category, rule, compiled))
+            literal = required_literal(rule['pattern'])
+            if len(literal) >= 2:
+                self._by_literal.setdefault(literal, []).append(index)
+            else:
+                self._always.append(index)
+        
+        # Zero-width lookahead finds literals at every position, longest first.
+        # A literal hidden behind a longer one at the same position is a
+        # prefix of it, so it is present too.
+        literals = sorted(self._by_literal, key=len, reverse=True)
+        self._implied = {lit: {o for o in literals if lit.startswith(o)} for lit in literals}
+        self._prefilter = re.compile(
+            '(?=(' + '|'.join(map(re.escape, literals)) + '))') if literals else None
+    
+    def scan(self, code: str) -> List[Tuple[str, Dict, int]]:
+        """Return (category, rule, offset of first match) for every matching rule"""
+        present: Set[str] = set()
+        if self._prefilter:
+            for m in self._prefilter.finditer(code):
+                lit = m.group(1)
+                if lit not in present:
+                    present |= self._implied[lit]
+                    if len(present) == len(self._implied):
+                        break
+        
+        candidates = sorted(self._always + [i for lit in present for i in self._by_literal[lit]])
+        hits = []
+        for index in candidates:
+            category, rule, compiled = self.rules[index]
+            m = compiled.search(code)
+            if m:
+                hits.append((category, rule, m.start()))
+        return hits
+
+
 class RuleEngine:
     """Pattern-based rule matching engine"""
     
@@ -276,24 +539,63 @@ class RuleEngine:
                     self.patterns = yaml.safe_load(f) or {}
             except Exception:
                 pass
+        
+        # Script rules are compiled once per language
+        self._matchers: Dict[str, ScriptMatcher] = {}
+        for language, categories in (self.patterns.get('scripts') or {}).items():
+            rules = [
+                (category, p)
+                for category, patterns in (categories or {}).items() if isinstance(patterns, list)
+                for p in patterns if isinstance(p, dict) and p.get('pattern')
+            ]
+            self._matchers[language] = ScriptMatcher(rules)
+        
+        # Hostnames seen in the VM are matched by label suffix
+        self.domains = pcap_iocs.DomainIndex.from_rules(self.patterns, SUSPICIOUS_TLDS, SUSPICIOUS_HOSTS)
     
     def match_script(self, language: str, code: str) -> List[ThreatEvent]:
-        events = []
-        for category, patterns in self.patterns.get('scripts', {}).get(language, {}).items():
-            if isinstance(patterns, list):
-                for p in patterns:
-                    if isinstance(p, dict) and p.get('pattern'):
-                        try:
-                            if re.search(p['pattern'], code):
-                                events.append(ThreatEvent(
-                                    source='script', event_type=category,
-                                    details=p.get('description', 'Suspicious pattern'),
-                                    score=p.get('score', 10),
-                                    mitre=p.get('mitre')
-                                ))
-                        except Exception:
-                            pass
-        return events
+        matcher = self._matchers.get(language)
+        if not matcher:
+            return []
+        return [
+            ThreatEvent(
+                source='script', event_type=category,
+                details=p.get('description', 'Suspicious pattern'),
+                score=p.get('score', 10),
+                mitre=p.get('mitre'),
+                offset=offset
+            )
+            for category, p, offset in matcher.scan(code)
+        ]
+    
+    def snapshot(self) -> Dict:
+        """What verdicts depend on: script rules per language, network indicators and thresholds"""
+        network = self.patterns.get('network') or {}
+        return {
+            'scripts': {lang: fingerprint(categories)
+                        for lang, categories in (self.patterns.get('scripts') or {}).items()},
+            'network': fingerprint({k: network.get(k) for k in (
+                'suspicious_tlds', 'suspicious_endpoints', 'suspicious_paths', 'suspicious_user_agents')}),
+            'thresholds': self.patterns.get('verdict_thresholds') or {},
+        }
+    
+    def get_syscalls(self) -> List[str]:
+        """Syscall names listed in the patterns (what the guest tracer filters on)"""
+        names = []
+        for entries in self.patterns.get('syscalls', {}).values():
+            for e in entries or []:
+                if isinstance(e, dict) and e.get('syscall') and e['syscall'] not in names:
+                    names.append(e['syscall'])
+        return names
+    
+    def get_watch_paths(self) -> List[str]:
+        """filesystem.critical_paths (what the guest file monitor marks)"""
+        return [e['path'] for e in self.patterns.get('filesystem', {}).get('critical_paths') or []
+                if isinstance(e, dict) and e.get('path')]
+    
+    def get_capture_ports(self) -> List[int]:
+        """network.capture_ports (the guest packet filter)"""
+        return [int(p) for p in self.patterns.get('network', {}).get('capture_ports') or []]
     
     def get_threshold(self, level: str) -> int:
         return self.patterns.get('verdict_thresholds', {}).get(level, 50)
@@ -332,6 +634,10 @@ class ThreatScorer:
             return "SUSPICIOUS"
         return "MALICIOUS"
     
+    def reached_malicious(self) -> bool:
+        """Scores only add up, so past this threshold the verdict can no longer change"""
+        return self.total_score >= self.rule_engine.get_threshold('malicious')
+    
     def get_reasons(self) -> List[str]:
         return [
             f"[{e.source.upper()}] {e.details}" + (f" ({e.mitre})" if e.mitre else "")
@@ -342,14 +648,65 @@ class ThreatScorer:
         return list({e.mitre for e in self.events if e.mitre})
 
 
+EVENT_COLUMNS = [f.name for f in fields(ThreatEvent)]
+
+
+def pack_events(events: List[ThreatEvent]) -> bytes:
+    """Encode events column by column (repeated values compress well) into a zlib blob"""
+    columns = {name: [getattr(e, name) for e in events] for name in EVENT_COLUMNS}
+    return zlib.compress(json.dumps({'v': 1, 'n': len(events), 'columns': columns},
+                                    separators=(',', ':')).encode(), 6)
+
+
+def pack_raw(raw: Dict) -> bytes:
+    return zlib.compress(json.dumps(raw, separators=(',', ':')).encode(), 6)
+
+
+def unpack_raw(blob: Optional[bytes]) -> Optional[Dict]:
+    return json.loads(zlib.decompress(blob)) if blob else None
+
+
+def unpack_events(blob: Optional[bytes]) -> List[Dict]:
+    if not blob:
+        return []
+    data = json.loads(zlib.decompress(blob))
+    columns = data['columns']
+    names = [name for name in EVENT_COLUMNS if name in columns]
+    return [dict(zip(names, row)) for row in zip(*(columns[name] for name in names))]
+
+
 class AnalysisDB:
-    """SQLite database for caching analysis results"""
+    """
+    SQLite database for caching analysis results.
+    
+    One WAL-mode connection is kept open for the life of the object.
+    save() is write-behind: rows are queued and written in batches by a
+    background thread (one transaction per batch), while get_by_hash()
+    also sees rows that are still queued.
+    
+    Besides the verdict each row keeps the raw inputs it was scored from
+    and the version of the rules used (snapshots in the rulesets table),
+    so rescore.py can re-evaluate stored samples when rules change.
+    """
+    
+    FLUSH_INTERVAL = 0.5
+    BATCH_SIZE = 64
+    
+    COLUMNS = ('id', 'file_hash', 'file_name', 'file_type', 'verdict', 'threat_score',
+               'duration', 'reasons', 'yara_matches', 'mitre_techniques', 'rules_version',
+               'trace', 'created_at')
+    JSON_COLUMNS = ('reasons', 'yara_matches', 'mitre_techniques', 'trace')
     
     def __init__(self, db_path: str = "logs/dynamic_analysis.db"):
         self.db_path = db_path
-        os.makedirs(os.path.dirname(db_path), exist_ok=True)
-        with sqlite3.connect(db_path) as conn:
-            conn.execute("""
+        os.makedirs(os.path.dirname(db_path) or '.', exist_ok=True)
+        self._conn = sqlite3.connect(db_path, check_same_thread=False)
+        self._conn.row_factory = sqlite3.Row
+        self._lock = threading.Lock()
+        self._conn.execute("PRAGMA journal_mode=WAL")
+        self._conn.execute("PRAGMA synchronous=NORMAL")
+        with self._conn:
+            self._conn.execute("""
                 CREATE TABLE IF NOT EXISTS analyses (
                     id INTEGER PRIMARY KEY AUTOINCREMENT,
                     file_hash TEXT NOT NULL,
@@ -364,34 +721,181 @@ class AnalysisDB:
                     created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
                 )
             """)
+            columns = {row['name'] for row in self._conn.execute("PRAGMA table_info(analyses)")}
+            for name, kind in (('events', 'BLOB'), ('raw', 'BLOB'), ('rules_version', 'TEXT'),
+                               ('trace', 'TEXT')):
+                if name not in columns:
+                    self._conn.execute(f"ALTER TABLE analyses ADD COLUMN {name} {kind}")
+            self._conn.execute(
+                "CREATE INDEX IF NOT EXISTS idx_analyses_hash ON analyses (file_hash, id)")
+            self._conn.execute("""
+                CREATE TABLE IF NOT EXISTS rulesets (
+                    version TEXT PRIMARY KEY,
+                    snapshot TEXT NOT NULL,
+                    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+                )
+            """)
+        
+        # Rows waiting for the writer, and the newest queued row per hash
+        self._queue: List[Tuple] = []
+        self._queued: Dict[str, Dict] = {}
+        self._cond = threading.Condition()
+        self._closed = False
+        self._writer = threading.Thread(target=self._write_loop, daemon=True, name="analysis-db")
+        self._writer.start()
+        atexit.register(self.close)
     
-    def save(self, path: str, result: AnalysisResult) -> int:
-        with sqlite3.connect(self.db_path) as conn:
-            cur = conn.execute(
-                """INSERT INTO analyses 
-                   (file_hash, file_name, file_type, verdict, threat_score, 
-                    duration, reasons, yara_matches, mitre_techniques) 
-                   VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)""",
-                (result.file_hash, os.path.basename(path), result.file_type,
-                 result.verdict, result.threat_score, result.duration,
-                 json.dumps(result.reasons), json.dumps(result.yara_matches),
-                 json.dumps(result.mitre_techniques))
-            )
-            return cur.lastrowid
+    def save(self, path: str, result: AnalysisResult, raw: Optional[Dict] = None,
+             rules_version: Optional[str] = None, trace: Optional[Dict] = None):
+        """
+        Queue a result for writing (visible to get_by_hash immediately).
+        
+        Args:
+            raw: Inputs the result was scored from (see DynamicAnalyzer.replay)
+            rules_version: Ruleset version from DynamicAnalyzer.ruleset()
+            trace: Stage timings of the job (metrics.Trace.to_dict())
+        """
+        row = (result.file_hash, os.path.basename(path), result.file_type,
+               result.verdict, result.threat_score, result.duration,
+               json.dumps(result.reasons), json.dumps(result.yara_matches),
+               json.dumps(result.mitre_techniques), pack_events(result.events),
+               pack_raw(raw) if raw else None, rules_version,
+               json.dumps(trace) if trace else None)
+        with self._cond:
+            if self._closed:
+                raise RuntimeError("AnalysisDB is closed")
+            self._queue.append(row)
+            self._queued[result.file_hash] = {
+                'id': None, 'file_hash': result.file_hash, 'file_name': row[1],
+                'file_type': result.file_type, 'verdict': result.verdict,
+                'threat_score': result.threat_score, 'duration': result.duration,
+                'reasons': list(result.reasons), 'yara_matches': list(result.yara_matches),
+                'mitre_techniques': list(result.mitre_techniques),
+                'rules_version': rules_version, 'trace': trace,
+                'created_at': datetime.utcnow().strftime('%Y-%m-%d %H:%M:%S'),
+                '_events': row[9], '_raw': row[10]
+            }
+            if len(self._queue) >= self.BATCH_SIZE:
+                self._cond.notify()
+    
+    def _write_loop(self):
+        while True:
+            with self._cond:
+                if not self._queue and not self._closed:
+                    self._cond.wait(self.FLUSH_INTERVAL)
+                if not self._queue:
+                    if self._closed:
+                        return
+                    continue
+                batch, self._queue = self._queue, []
+            self._write(batch)
+    
+    def _write(self, batch: List[Tuple]):
+        try:
+            with self._lock, self._conn:
+                self._conn.executemany(
+                    """INSERT INTO analyses 
+                       (file_hash, file_name, file_type, verdict, threat_score, 
+                        duration, reasons, yara_matches, mitre_techniques, events,
+                        raw, rules_version, trace) 
+                       VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)""", batch)
+        except sqlite3.Error as e:
+            print(f"[AnalysisDB] Failed to write {len(batch)} results: {e}")
+        with self._cond:
+            written = {row[0] for row in batch}
+            # Newer saves of the same hash may have been queued meanwhile
+            still_queued = {row[0] for row in self._queue}
+            for file_hash in written - still_queued:
+                self._queued.pop(file_hash, None)
+            self._cond.notify_all()
+    
+    def flush(self):
+        """Write all queued results now"""
+        with self._cond:
+            batch, self._queue = self._queue, []
+        if batch:
+            self._write(batch)
     
-    def get_by_hash(self, file_hash: str) -> Optional[Dict]:
-        with sqlite3.connect(self.db_path) as conn:
-            conn.row_factory = sqlite3.Row
-            row = conn.execute(
-                "SELECT * FROM analyses WHERE file_hash=? ORDER BY created_at DESC LIMIT 1",
+    def close(self):
+        with self._cond:
+            if self._closed:
+                return
+            self._closed = True
+            self._cond.notify_all()
+        self._writer.join(5)
+        self.flush()
+        with self._lock:
+            self._conn.close()
+        atexit.unregister(self.close)
+    
+    def get_by_hash(self, file_hash: str, with_events: bool = False,
+                    with_raw: bool = False) -> Optional[Dict]:
+        """Latest result for a hash; with_events/with_raw add the stored events and raw inputs"""
+        with self._cond:
+            queued = self._queued.get(file_hash)
+        if queued:
+            result = {k: v for k, v in queued.items() if k not in ('_events', '_raw')}
+            if with_events:
+                result['events'] = unpack_events(queued['_events'])
+            if with_raw:
+                result['raw'] = unpack_raw(queued['_raw'])
+            return result
+        
+        extra = (('events',) if with_events else ()) + (('raw',) if with_raw else ())
+        with self._lock:
+            row = self._conn.execute(
+                f"SELECT {', '.join(self.COLUMNS + extra)} FROM analyses "
+                f"WHERE file_hash=? ORDER BY id DESC LIMIT 1",
                 (file_hash,)
             ).fetchone()
-        if row:
-            return {
-                k: json.loads(row[k]) if k in ('reasons', 'yara_matches', 'mitre_techniques') and row[k] else row[k]
-                for k in row.keys()
-            }
-        return None
+        if not row:
+            return None
+        result = self._decode(row)
+        if with_events:
+            result['events'] = unpack_events(row['events'])
+        if with_raw:
+            result['raw'] = unpack_raw(row['raw'])
+        return result
+    
+    def _decode(self, row: sqlite3.Row) -> Dict:
+        return {
+            k: json.loads(row[k]) if k in self.JSON_COLUMNS and row[k] else row[k]
+            for k in self.COLUMNS
+        }
+    
+    def latest(self) -> List[Dict]:
+        """Latest row of every stored hash (without events and raw inputs)"""
+        self.flush()
+        with self._lock:
+            rows = self._conn.execute(
+                f"SELECT {', '.join('a.' + c for c in self.COLUMNS)} FROM analyses a "
+                f"JOIN (SELECT MAX(id) AS id FROM analyses GROUP BY file_hash) l ON a.id = l.id"
+            ).fetchall()
+        return [self._decode(row) for row in rows]
+    
+    def get_raw(self, row_id: int) -> Optional[Dict]:
+        with self._lock:
+            row = self._conn.execute("SELECT raw FROM analyses WHERE id=?", (row_id,)).fetchone()
+        return unpack_raw(row['raw']) if row else None
+    
+    def set_rules_version(self, row_ids: List[int], rules_version: str):
+        """Mark rows as still valid under another ruleset"""
+        with self._lock, self._conn:
+            self._conn.executemany("UPDATE analyses SET rules_version=? WHERE id=?",
+                                   [(rules_version, i) for i in row_ids])
+    
+    def record_ruleset(self, version: str, snapshot: Dict):
+        with self._lock, self._conn:
+            self._conn.execute("INSERT OR IGNORE INTO rulesets (version, snapshot) VALUES (?, ?)",
+                               (version, json.dumps(snapshot, sort_keys=True)))
+    
+    def get_ruleset(self, version: Optional[str]) -> Optional[Dict]:
+        if not version:
+            return None
+        with self._lock:
+            row = self._conn.execute("SELECT snapshot FROM rulesets WHERE version=?",
+                                     (version,)).fetchone()
+        return json.loads(row['snapshot']) if row else None
 
 
 class DynamicAnalyzer:
@@ -402,14 +906,37 @@ class DynamicAnalyzer:
     suspicious files in an isolated environment with anti-VM detection measures.
     """
     
+    # Script sources up to this size are kept with the raw inputs for rescoring
+    SCRIPT_RAW_LIMIT = 1024 * 1024
+    
+    # Near-duplicate fast path (similarity: section of config.yaml)
+    SIMILARITY_DEFAULTS = {
+        'enabled': True,
+        'min_similarity': 0.5,           # Neighbors listed in the result
+        'neighbors': 5,
+        'inherit_threshold': 0.9,        # Skip the VM run of a sample this close to a confirmed one
+        'inherit_verdicts': ['MALICIOUS'],
+    }
+    
     def __init__(self, timeout: int = 60, db_path: str = "logs/dynamic_analysis.db",
                  yara_dir: str = "yara_rules", patterns_file: str = "patterns.yaml",
-                 vm_config_path: str = "vm_config.yaml"):
+                 vm_config_path: str = "vm_config.yaml", early_stop: bool = True,
+                 cache_path: str = "logs/result_cache.db", yara_cache_dir: str = "logs/yara_cache",
+                 similarity: Optional[Dict] = None):
         self.timeout = timeout
-        self.yara = YaraScanner(yara_dir)
+        # Stop the VM run once the score reaches the malicious threshold
+        self.early_stop = early_stop
+        # Same rules directory and cache as the static analyzer: one compiled ruleset
+        self.yara = YaraScanner.shared(yara_dir, yara_cache_dir)
         self.rules = RuleEngine(patterns_file)
         self.elf = ELFAnalyzer()
         self.db = AnalysisDB(db_path)
+        self.similarity_cfg = dict(self.SIMILARITY_DEFAULTS, **(similarity or {}))
+        # Near-duplicate lookup, in the same database as the analyses
+        self.similarity = SimilarityIndex(db_path) if self.similarity_cfg['enabled'] else None
+        # Shared with the static analyzer; db keeps the full history
+        self.cache = ResultCache.shared(cache_path)
+        self._ruleset: Optional[Tuple[str, Tuple[str, Dict]]] = None
         self.vm_config_path = vm_config_path
         self._vm_manager = None
         self._vm_available = False
@@ -431,41 +958,24 @@ class DynamicAnalyzer:
     def vm_available(self) -> bool:
         return self._vm_available and self._vm_manager is not None
     
-    def _hash_file(self, path: str) -> str:
-        h = hashlib.sha256()
-        try:
-            with open(path, 'rb') as f:
-                for chunk in iter(lambda: f.read(8192), b''):
-                    h.update(chunk)
-            return h.hexdigest()
-        except Exception:
-            return ''
+    @property
+    def version(self) -> str:
+        """Fingerprint of the rules and settings a cached result depends on"""
+        return fingerprint(self.yara.current_version(), self.rules.patterns, self.timeout,
+                           self.early_stop, self.vm_available, self.similarity_cfg)
     
-    def _detect_type(self, path: str) -> str:
-        ext = os.path.splitext(path)[1].lower()
-        if ext in FILE_TYPE_MAP:
-            return FILE_TYPE_MAP[ext]
-        try:
-            info = subprocess.run(
-                ['file', '-b', path],
-                capture_output=True, text=True, timeout=5
-            ).stdout.lower()
-            if 'elf' in info:
-                if 'x86-64' in info or 'amd64' in info:
-                    return 'elf_x64'
-                if 'aarch64' in info or 'arm64' in info:
-                    return 'elf_arm64'
-                return 'elf'
-            if 'python' in info:
-                return 'python'
-            if 'shell' in info:
-                return 'shell'
-        except Exception:
-            pass
-        return 'unknown'
+    def ruleset(self) -> Tuple[str, Dict]:
+        """Version and snapshot of the rules verdicts are computed with (recorded in db)"""
+        yara_version = self.yara.current_version()
+        if not self._ruleset or self._ruleset[0] != yara_version:
+            snapshot = {'patterns': self.rules.snapshot(), 'yara': self.yara.snapshot()}
+            version = fingerprint(snapshot)
+            self.db.record_ruleset(version, snapshot)
+            self._ruleset = (yara_version, (version, snapshot))
+        return self._ruleset[1]
     
     def run(self, file_path: str, use_cache: bool = True,
-            architecture: str = None) -> Dict:
+            architecture: str = None, sample: Optional[SampleDescriptor] = None) -> Dict:
         """
         Run dynamic analysis on a file.
         
@@ -473,6 +983,7 @@ class DynamicAnalyzer:
             file_path: Path to file to analyze
             use_cache: Use cached results if available
             architecture: Force specific architecture (arm64, x64)
+            sample: Descriptor from an earlier stage (built here if not given)
             
         Returns:
             Analysis result dictionary
@@ -482,44 +993,120 @@ class DynamicAnalyzer:
         if not os.path.exists(file_path):
             return {'verdict': 'ERROR', 'threat_score': 0, 'reasons': ['File not found']}
         
-        file_hash = self._hash_file(file_path)
+        sample = sample or describe(file_path)
+        if not sample:
+            return {'verdict': 'ERROR', 'threat_score': 0, 'reasons': ['File not readable']}
         
-        # Check cache
-        if use_cache and file_hash:
-            cached = self.db.get_by_hash(file_hash)
-            if cached:
-                cached['cached'] = True
-                return cached
+        if not use_cache:
+            return self._analyze(file_path, sample, architecture, start)
         
+        # One VM run per sample and rules version, also for concurrent uploads;
+        # results of failed sandbox runs are not kept
+        result, shared = self.cache.get_or_compute(
+            sample.sha256, 'dynamic', f"{self.version}-{architecture or ''}",
+            lambda: self._from_history(sample) or self._analyze(file_path, sample, architecture, start),
+            keep=lambda r: r['sandbox'].get('success') or not r['vm_used'])
+        if shared:
+            result['cached'] = True
+        return result
+    
+    def _from_history(self, sample: SampleDescriptor) -> Optional[Dict]:
+        """Stored result of a successful VM run that is valid under the current rules"""
+        try:
+            row = self.db.get_by_hash(sample.sha256, with_events=True, with_raw=True)
+        except sqlite3.Error:
+            return None
+        if not row or not (row['raw'] or {}).get('sandbox_ok'):
+            return None
+        if row['rules_version'] != self.ruleset()[0]:
+            return None
+        names = ('verdict', 'threat_score', 'duration', 'reasons', 'file_type', 'file_hash',
+                 'yara_matches', 'mitre_techniques')
+        return dict({k: row[k] for k in names}, sandbox={'success': True, 'from_history': True},
+                    event_count=len(row['events']), vm_used=True)
+    
+    def _analyze(self, file_path: str, sample: SampleDescriptor,
+                 architecture: Optional[str], start: float) -> Dict:
+        file_hash = sample.sha256
         scorer = ThreatScorer(self.rules)
-        file_type = self._detect_type(file_path)
+        file_type = sample.file_type
+        # Everything scored below, normalized, so replay() can redo it offline
+        raw = {'v': 1, 'path': os.path.abspath(file_path), 'yara': [], 'script': None, 'elf': [],
+               'vm': {'syscalls': [], 'network': [], 'files': [], 'iocs': []},
+               'sandbox_ok': False, 'stopped_early': False}
         
         # Static analysis (YARA)
-        scorer.add_yara_matches(self.yara.scan(file_path))
+        yara_matches = self.yara.scan(file_path, sample)
+        scorer.add_yara_matches(yara_matches)
+        raw['yara'] = [asdict(m) for m in yara_matches]
         
         # Script pattern matching
-        if file_type in ['python', 'javascript', 'shell']:
+        if sample.is_script:
             try:
                 with open(file_path, 'r', errors='ignore') as f:
-                    scorer.add_events(self.rules.match_script(file_type, f.read()))
+                    code = f.read()
+                with metrics.span('script_patterns'):
+                    scorer.add_events(self.rules.match_script(file_type, code))
+                if len(code) <= self.SCRIPT_RAW_LIMIT:
+                    raw['script'] = code
             except Exception:
                 pass
         
         # ELF analysis
-        elif file_type.startswith('elf'):
-            scorer.add_events(self.elf.analyze(file_path))
+        elif sample.is_elf:
+            elf_events = self.elf.analyze(file_path)
+            scorer.add_events(elf_events)
+            raw['elf'] = [asdict(e) for e in elf_events]
+        
+        # Known near-duplicates; a close one with a confirmed verdict replaces the VM run
+        features, similar = self._find_similar(file_path, sample)
+        inherit = self._inheritable(similar)
+        if inherit:
+            raw['similar'] = inherit.to_dict()
+            scorer.add_event(self._inherited_event(raw['similar']))
         
         # Dynamic analysis in VM
         sandbox_result = {}
         vm_used = False
         
-        if self.vm_available:
-            sandbox_result = self._run_in_vm(file_path, file_type, architecture)
+        if inherit:
+            sandbox_result = {'success': False, 'skipped': f"near-duplicate of {inherit.file_hash}"}
+        elif self.vm_available:
+            # Events are scored as the agent streams them; the time it takes
+            # is accounted once per run, not per batch
+            scoring = [0.0]
+            
+            def on_event(batch: Dict) -> Optional[str]:
+                t0 = time.monotonic()
+                self._process_vm_events(scorer, batch)
+                self._record_vm_events(raw, batch)
+                scoring[0] += time.monotonic() - t0
+                if self.early_stop and scorer.reached_malicious():
+                    return (f"score {scorer.total_score} reached malicious threshold "
+                            f"{self.rules.get_threshold('malicious')}")
+                return None
+            
+            sandbox_result = self._run_in_vm(file_path, sample, architecture, on_event=on_event)
             vm_used = True
+            metrics.record('event_scoring', scoring[0])
             
-            # Process VM events
+            # Events returned with the result (agent without streaming)
             if sandbox_result.get('success'):
                 self._process_vm_events(scorer, sandbox_result)
+                self._record_vm_events(raw, sandbox_result)
+            
+            # Names the sample resolved or connected to, from the packet capture
+            if sandbox_result.get('pcap'):
+                with metrics.span('pcap_iocs'):
+                    try:
+                        iocs = {'iocs': pcap_iocs.extract_file(sandbox_result['pcap'])}
+                    finally:
+                        self._discard_pcap(sandbox_result)
+                sandbox_result['iocs'] = iocs['iocs']
+                self._process_vm_events(scorer, iocs)
+                self._record_vm_events(raw, iocs)
+            raw['sandbox_ok'] = bool(sandbox_result.get('success'))
+            raw['stopped_early'] = bool(sandbox_result.get('cancelled'))
         else:
             sandbox_result = {'error': 'VM not available', 'success': False}
         
@@ -533,15 +1120,22 @@ class DynamicAnalyzer:
             duration=duration,
             file_type=file_type,
             file_hash=file_hash,
-            yara_matches=[m.rule for m in self.yara.scan(file_path)],
+            yara_matches=[m.rule for m in yara_matches],
             mitre_techniques=scorer.get_mitre_techniques()
         )
         
-        # Save to database
+        # Save to database, with the job's stage timings so far
+        trace = metrics.current_trace()
         try:
-            self.db.save(file_path, result)
+            self.db.save(file_path, result, raw=raw, rules_version=self.ruleset()[0],
+                         trace=trace.to_dict() if trace else None)
         except Exception:
             pass
+        if features and self.similarity is not None:
+            try:
+                self.similarity.add(features, result.verdict, result.threat_score, confirmed=raw['sandbox_ok'])
+            except sqlite3.Error as e:
+                print(f"[DynamicAnalyzer] Similarity index update failed: {e}")
         
         return {
             'verdict': result.verdict,
@@ -555,10 +1149,87 @@ class DynamicAnalyzer:
             'sandbox': sandbox_result,
             'event_count': len(scorer.events),
             'vm_used': vm_used,
+            'similar': [n.to_dict() for n in similar],
         }
     
+    @metrics.timed('similarity')
+    def _find_similar(self, file_path: str,
+                      sample: SampleDescriptor) -> Tuple[Optional[Features], List[Neighbor]]:
+        """Features of the sample and its nearest indexed samples"""
+        if self.similarity is None:
+            return None, []
+        features = extract_features(file_path, sample)
+        if not features:
+            return None, []
+        try:
+            return features, self.similarity.nearest(features, self.similarity_cfg['neighbors'],
+                                                      self.similarity_cfg['min_similarity'])
+        except sqlite3.Error as e:
+            print(f"[DynamicAnalyzer] Similarity lookup failed: {e}")
+            return features, []
+    
+    def _inheritable(self, similar: List[Neighbor]) -> Optional[Neighbor]:
+        """Closest neighbor whose verdict a sample may take over without a VM run"""
+        for n in similar:
+            if n.similarity < self.similarity_cfg['inherit_threshold']:
+                break
+            # Only verdicts observed in the sandbox, not inherited ones
+            if not n.confirmed or n.verdict not in self.similarity_cfg['inherit_verdicts']:
+                continue
+            # Shared strings or a close fuzzy hash are not enough for a binary (static
+            # ones are mostly the same libc): it also needs the same imports or a section
+            if n.file_type in SCRIPT_TYPES or n.structural:
+                return n
+        return None
+    
+    @staticmethod
+    def _inherited_event(neighbor: Dict) -> ThreatEvent:
+        return ThreatEvent(
+            source='similarity', event_type='near_duplicate',
+            details=(f"{neighbor['similarity']:.0%} similar ({neighbor['method']}) to "
+                     f"{neighbor['verdict']} sample {neighbor['file_hash'][:16]}"),
+            score=neighbor['threat_score']
+        )
+    
+    @staticmethod
+    def _record_vm_events(raw: Dict, sandbox_result: Dict):
+        for key in ('syscalls', 'network', 'files', 'iocs'):
+            raw['vm'][key].extend(sandbox_result.get(key) or [])
+    
+    def replay(self, raw: Dict, file_type: str,
+               yara_matches: Optional[List[YaraMatch]] = None) -> ThreatScorer:
+        """
+        Score stored raw inputs with the current rules, without a VM.
+        
+        Args:
+            raw: Inputs recorded by _analyze()
+            file_type: Sample type, selects the script rules
+            yara_matches: Fresh YARA matches (default: the recorded ones)
+        """
+        scorer = ThreatScorer(self.rules)
+        if yara_matches is None:
+            yara_matches = [YaraMatch(**m) for m in raw.get('yara', [])]
+        scorer.add_yara_matches(yara_matches)
+        
+        code = raw.get('script')
+        if code is None and file_type in SCRIPT_TYPES and os.path.exists(raw.get('path', '')):
+            # Too large to keep: read the sample again
+            try:
+                with open(raw['path'], 'r', errors='ignore') as f:
+                    code = f.read()
+            except OSError:
+                pass
+        if code is not None:
+            scorer.add_events(self.rules.match_script(file_type, code))
+        
+        scorer.add_events([ThreatEvent(**e) for e in raw.get('elf', [])])
+        if raw.get('similar'):
+            scorer.add_event(self._inherited_event(raw['similar']))
+        self._process_vm_events(scorer, raw.get('vm', {}))
+        return scorer
+    
     def _process_vm_events(self, scorer: ThreatScorer, sandbox_result: Dict):
-        """Process events from VM analysis"""
+        """Process events from VM analysis (a streamed batch or a full result)"""
         # Syscall events
         for event in sandbox_result.get('syscalls', []):
             syscall = event.get('syscall', '')
@@ -586,15 +1257,15 @@ class DynamicAnalyzer:
             dst = event.get('dst_addr', '')
             port = event.get('dst_port', 0)
             
-            # Check for suspicious hosts
-            for host, (mitre, score, desc) in SUSPICIOUS_HOSTS.items():
-                if host in dst:
-                    scorer.add_event(ThreatEvent(
-                        source='vm', event_type='network',
-                        details=f"{desc}: {dst}:{port}",
-                        score=score, mitre=mitre
-                    ))
-                    break
+            # Check for suspicious hosts (most specific rule)
+            hits = self.rules.domains.match_host(dst)
+            if hits:
+                score, mitre, desc = hits[0]
+                scorer.add_event(ThreatEvent(
+                    source='vm', event_type='network',
+                    details=f"{desc}: {dst}:{port}",
+                    score=score, mitre=mitre
+                ))
             else:
                 scorer.add_event(ThreatEvent(
                     source='vm', event_type='network',
@@ -602,6 +1273,16 @@ class DynamicAnalyzer:
                     score=5, mitre='T1071'
                 ))
         
+        # DNS/HTTP/TLS names from the packet capture
+        for ioc in sandbox_result.get('iocs', []):
+            for score, mitre, desc in self.rules.domains.match(ioc):
+                target = ioc.get('host') or ioc.get('dst_addr', '')
+                scorer.add_event(ThreatEvent(
+                    source='vm', event_type='network',
+                    details=f"{desc} ({ioc.get('kind')}): {target}{ioc.get('path', '')}",
+                    score=score, mitre=mitre
+                ))
+        
         # File events
         for event in sandbox_result.get('files', []):
             path = event.get('path', '')
@@ -621,29 +1302,28 @@ class DynamicAnalyzer:
                     score=15, mitre='T1552.004'
                 ))
     
-    def _run_in_vm(self, file_path: str, file_type: str,
-                   architecture: str = None) -> Dict:
-        """Run file in VM sandbox"""
+    @metrics.timed('vm')
+    def _run_in_vm(self, file_path: str, sample: SampleDescriptor,
+                   architecture: str = None, on_event=None) -> Dict:
+        """Run file in VM sandbox, passing streamed event batches to on_event"""
         if not self._vm_manager:
             return {'error': 'VM manager not available', 'success': False}
         
         try:
             from vm_manager.vm_config import VMArchitecture
             
-            # Determine architecture
+            # Determine architecture; by default the VM manager picks the
+            # tier (x86 static ELFs may run user-mode in the ARM64 VM)
+            arch = None
             if architecture:
                 arch = VMArchitecture.ARM64 if 'arm' in architecture.lower() else VMArchitecture.X64
-            elif file_type == 'elf_arm64':
-                arch = VMArchitecture.ARM64
-            elif file_type == 'elf_x64':
-                arch = VMArchitecture.X64
-            else:
-                # Default to ARM64 (native on RPi5)
-                arch = VMArchitecture.ARM64
             
             # Run analysis
             result = self._vm_manager.analyze_file(
-                file_path, arch=arch, timeout=self.timeout
+                file_path, arch=arch, timeout=self.timeout, on_event=on_event,
+                trace_syscalls=self.rules.get_syscalls() or None, sample=sample,
+                monitors={'watch_paths': self.rules.get_watch_paths() or None,
+                          'capture_ports': self.rules.get_capture_ports() or None}
             )
             
             return {
@@ -658,12 +1338,28 @@ class DynamicAnalyzer:
                 'files': result.file_activity,
                 'processes': result.process_activity,
                 'events': result.events,
+                'event_counts': result.event_counts,
+                'cancelled': result.cancelled,
+                'dropped_events': result.dropped_events,
                 'architecture': result.architecture,
+                'emulator': result.emulator,
+                'pcap': result.pcap_path,
             }
             
         except Exception as e:
             return {'error': str(e), 'success': False}
     
+    def _discard_pcap(self, sandbox_result: Dict):
+        """Delete the fetched capture once it was read, unless capture.keep_pcap is set"""
+        config = getattr(self._vm_manager, 'config', None)
+        if getattr(config, 'keep_pcap', False):
+            return
+        try:
+            os.unlink(sandbox_result['pcap'])
+        except OSError:
+            pass
+        sandbox_result['pcap'] = None
+    
     def start_vm(self, architecture: str = 'arm64') -> bool:
         """Start VM for specified architecture"""
         if not self._vm_manager:
@@ -677,6 +1373,16 @@ class DynamicAnalyzer:
             print(f"[DynamicAnalyzer] Failed to start VM: {e}")
             return False
     
+    def prewarm(self) -> int:
+        """Boot the VM clones that are not running yet (see VMManager.prewarm)"""
+        if not self._vm_manager:
+            return 0
+        try:
+            return self._vm_manager.prewarm()
+        except Exception as e:
+            print(f"[DynamicAnalyzer] VM pre-warm failed: {e}")
+            return 0
+    
     def stop_vm(self, architecture: str = None):
         """Stop VM(s)"""
         if not self._vm_manager:
@@ -692,6 +1398,10 @@ class DynamicAnalyzer:
         else:
             self._vm_manager.stop_all()
     
+    def slot_usage(self) -> Dict[Tuple[str, str], int]:
+        """VM clones per (architecture, state); empty without a VM manager"""
+        return self._vm_manager.slot_usage() if self._vm_manager else {}
+    
     def get_status(self) -> Dict:
         """Get analyzer status"""
         status = {
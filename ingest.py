@@ -0,0 +1,181 @@
+"""
+Streaming Ingest - download an upload in chunks straight into analysis
+
+An upload is read from the network in chunks. Every chunk is hashed
+and sniffed (sample.SampleStream), appended to the sample file and, when
+clamd is running, forwarded to an INSTREAM scan that runs alongside the
+transfer. After the last chunk the SampleDescriptor is complete and the
+ClamAV verdict is usually already in, so StaticAnalyzer.run() starts
+with both and nothing reads the file back for hashing or for ClamAV.
+
+Spill strategy: uploads up to spill_bytes are kept in memory and written
+with one call at the end. Larger ones go to a .part file next to the
+target - from the first chunk when the announced size is over the
+limit, otherwise once they pass it - so only a chunk is held in memory.
+Either way the sample appears under its final name only once complete.
+
+Usage:
+    upload = IngestStream(path, size_hint=doc.file_size, clamd=analyzer.clamav.clamd)
+    for chunk in response.iter_content(256 * 1024):
+        upload.write(chunk)
+    sample = upload.finish()
+    analyzer.run(path, sample, clamav=upload.clamav)
+"""
+
+import os
+import queue
+import logging
+import threading
+from typing import Dict, Iterable, Optional
+
+from sample import SampleDescriptor, SampleStream
+
+logger = logging.getLogger(__name__)
+
+DEFAULT_SPILL_BYTES = 8 * 1024 * 1024
+
+# Chunks in flight to clamd; the download waits when clamd falls behind
+TEE_QUEUE_CHUNKS = 32
+
+
+class IngestStream:
+    """
+    One upload being written to path.
+    
+    Args:
+        path: Final path of the sample
+        size_hint: Announced size, if known (large uploads spill from the start)
+        spill_bytes: Keep uploads up to this size in memory
+        clamd: static.ClamdClient to scan the stream with (None: no tee)
+    """
+    
+    def __init__(self, path: str, size_hint: Optional[int] = None,
+                 spill_bytes: int = DEFAULT_SPILL_BYTES, clamd=None):
+        self.path = path
+        self.spill_bytes = spill_bytes
+        self.stream = SampleStream()
+        # Descriptor, once finish() has run
+        self.sample: Optional[SampleDescriptor] = None
+        # Set when the tee'd scan finished with a verdict
+        self.clamav: Optional[Dict] = None
+        self._aborted = False
+        self._buffer: Optional[list] = []
+        self._file = None
+        if size_hint is not None and size_hint > spill_bytes:
+            self._spill()
+        self._tee: Optional[queue.Queue] = None
+        self._tee_done = threading.Event()
+        self._tee_thread = None
+        if clamd is not None:
+            self._tee = queue.Queue(TEE_QUEUE_CHUNKS)
+            self._tee_thread = threading.Thread(target=self._scan, args=(clamd,),
+                                                name='clamd-instream', daemon=True)
+            self._tee_thread.start()
+    
+    @property
+    def part_path(self) -> str:
+        return self.path + '.part'
+    
+    @property
+    def spilled(self) -> bool:
+        return self._file is not None
+    
+    def _spill(self):
+        self._file = open(self.part_path, 'wb')
+        for chunk in self._buffer:
+            self._file.write(chunk)
+        self._buffer = None
+    
+    def _scan(self, clamd):
+        def chunks():
+            for chunk in iter(self._tee.get, None):
+                if self._aborted:
+                    break
+                yield chunk
+            if self._aborted:
+                # An OSError makes scan_stream drop the half-sent session
+                raise ConnectionAbortedError("upload aborted")
+        try:
+            self.clamav = clamd.scan_stream(chunks())
+        except Exception as e:
+            # Over StreamMaxLength, daemon gone, ...: the analyzer scans the file itself
+            logger.info(f"Streamed ClamAV scan of {os.path.basename(self.path)} failed: {e}")
+        finally:
+            self._tee_done.set()
+    
+    def _forward(self, chunk: Optional[bytes]):
+        while self._tee is not None and not self._tee_done.is_set() and not self._aborted:
+            try:
+                self._tee.put(chunk, timeout=0.5)
+                return
+            except queue.Full:
+                continue
+    
+    def write(self, chunk: bytes):
+        """Append the next chunk"""
+        if not chunk:
+            return
+        self.stream.update(chunk)
+        self._forward(chunk)
+        if self._file is None:
+            self._buffer.append(chunk)
+            if self.stream.size > self.spill_bytes:
+                self._spill()
+        else:
+            self._file.write(chunk)
+    
+    def finish(self, scan_timeout: float = 60) -> SampleDescriptor:
+        """
+        Complete the upload: write/rename the file and wait for the tee'd scan.
+        
+        Returns:
+            Descriptor of the sample at path
+        """
+        self._forward(None)
+        if self._file is None:
+            with open(self.part_path, 'wb') as f:
+                f.write(b''.join(self._buffer))
+            self._buffer = None
+        else:
+            self._file.close()
+        os.replace(self.part_path, self.path)
+        if self._tee_thread is not None:
+            self._tee_thread.join(scan_timeout)
+        self.sample = self.stream.descriptor(self.path)
+        return self.sample
+    
+    def abort(self):
+        """Drop a failed upload (the partial file and the scan)"""
+        self._aborted = True
+        if self._tee is not None:
+            try:
+                self._tee.put_nowait(None)
+            except queue.Full:
+                # The scan thread sees the flag with its next chunk
+                pass
+        self._buffer = None
+        if self._file is not None:
+            self._file.close()
+        try:
+            os.unlink(self.part_path)
+        except FileNotFoundError:
+            pass
+
+
+def ingest(chunks: Iterable[bytes], path: str, size_hint: Optional[int] = None,
+           spill_bytes: int = DEFAULT_SPILL_BYTES, clamd=None) -> IngestStream:
+    """
+    Stream chunks into path.
+    
+    Returns:
+        The finished IngestStream (.sample: descriptor, .clamav: verdict or None)
+    """
+    stream = IngestStream(path, size_hint, spill_bytes, clamd)
+    try:
+        for chunk in chunks:
+            stream.write(chunk)
+        stream.finish()
+    except BaseException:
+        stream.abort()
+        raise
+    return stream
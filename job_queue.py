@@ -0,0 +1,317 @@
+"""
+Analysis Job Queue - Persistent, fair, prioritized background workers
+
+Bot handlers only enqueue jobs and return. Worker threads pick jobs by
+priority and, within one priority, round-robin between users so that a
+single user's batch of uploads cannot starve everyone else. Jobs are
+persisted in SQLite and re-queued after a restart.
+"""
+
+import os
+import json
+import time
+import sqlite3
+import logging
+import threading
+from dataclasses import dataclass, field
+from typing import Dict, List, Optional, Any, Callable
+
+import metrics
+
+logger = logging.getLogger(__name__)
+
+# Lower value runs first
+PRIORITY_HIGH = 0
+PRIORITY_NORMAL = 10
+PRIORITY_LOW = 20
+
+STATE_QUEUED = "queued"
+STATE_RUNNING = "running"
+STATE_DONE = "done"
+STATE_FAILED = "failed"
+
+
+@dataclass
+class Job:
+    """Queued analysis job"""
+    id: int
+    kind: str
+    user_id: int
+    payload: Dict[str, Any]
+    priority: int = PRIORITY_NORMAL
+    chat_id: Optional[int] = None
+    message_id: Optional[int] = None
+    state: str = STATE_QUEUED
+    error: Optional[str] = None
+    created_at: float = field(default_factory=time.time)
+    started_at: Optional[float] = None
+    finished_at: Optional[float] = None
+    # Stage timings of the run (metrics.Trace.to_dict()), not persisted
+    trace: Optional[Dict[str, Any]] = None
+
+
+@dataclass
+class JobHandler:
+    """Callbacks registered for a job kind"""
+    run: Callable[[Job, Callable[[str], None]], Any]
+    on_done: Optional[Callable[[Job, Any], None]] = None
+    on_error: Optional[Callable[[Job, Exception], None]] = None
+    on_progress: Optional[Callable[[Job, str], None]] = None
+
+
+class JobQueue:
+    """
+    Persistent job queue with worker threads.
+
+    Usage:
+        queue = JobQueue("logs/jobs.db", workers=2)
+        queue.register("static", run_fn, on_done=done_fn, on_progress=progress_fn)
+        queue.start()
+        queue.submit("static", user_id, {"path": ...}, priority=PRIORITY_HIGH)
+
+    `run(job, progress)` executes in a worker thread; calling
+    `progress("text")` forwards to the kind's on_progress callback.
+    It runs inside metrics.trace(), so the stages it goes through end up
+    in job.trace by the time on_done/on_error is called.
+    """
+
+    def __init__(self, db_path: str = "logs/jobs.db", workers: int = 2,
+                 keep_finished_hours: int = 24):
+        self.db_path = db_path
+        self.workers = max(1, workers)
+        self.keep_finished_hours = keep_finished_hours
+        self._handlers: Dict[str, JobHandler] = {}
+        self._pending: Dict[int, Job] = {}
+        self._running: Dict[int, Job] = {}
+        self._running_by_user: Dict[int, int] = {}
+        self._last_served: Dict[int, float] = {}
+        self._cond = threading.Condition()
+        self._threads: List[threading.Thread] = []
+        self._stopping = False
+
+        os.makedirs(os.path.dirname(db_path) or '.', exist_ok=True)
+        self._db_lock = threading.Lock()
+        self._conn = sqlite3.connect(db_path, check_same_thread=False)
+        self._conn.execute("""
+            CREATE TABLE IF NOT EXISTS jobs (
+                id INTEGER PRIMARY KEY AUTOINCREMENT,
+                kind TEXT NOT NULL,
+                user_id INTEGER,
+                chat_id INTEGER,
+                message_id INTEGER,
+                priority INTEGER,
+                payload TEXT,
+                state TEXT,
+                error TEXT,
+                created_at REAL,
+                started_at REAL,
+                finished_at REAL
+            )
+        """)
+        self._conn.execute("CREATE INDEX IF NOT EXISTS idx_jobs_state ON jobs(state)")
+        self._conn.commit()
+
+    def register(self, kind: str, run: Callable, on_done: Optional[Callable] = None,
+                 on_error: Optional[Callable] = None, on_progress: Optional[Callable] = None):
+        """Register handler callbacks for a job kind"""
+        self._handlers[kind] = JobHandler(run=run, on_done=on_done, on_error=on_error,
+                                          on_progress=on_progress)
+
+    def start(self):
+        """Recover persisted jobs and start worker threads"""
+        self._recover()
+        self._stopping = False
+        for i in range(self.workers):
+            t = threading.Thread(target=self._worker, name=f"job-worker-{i}", daemon=True)
+            t.start()
+            self._threads.append(t)
+        logger.info(f"Job queue started with {self.workers} workers, {len(self._pending)} pending")
+
+    def stop(self, timeout: float = 5):
+        """Stop workers (running jobs are re-queued on next start)"""
+        with self._cond:
+            self._stopping = True
+            self._cond.notify_all()
+        for t in self._threads:
+            t.join(timeout=timeout)
+        self._threads = []
+
+    def submit(self, kind: str, user_id: int, payload: Dict[str, Any],
+               priority: int = PRIORITY_NORMAL, chat_id: Optional[int] = None,
+               message_id: Optional[int] = None) -> Job:
+        """
+        Enqueue a job.
+
+        Args:
+            kind: Registered job kind
+            user_id: Submitting user (fairness key)
+            payload: JSON-serializable job arguments
+            priority: PRIORITY_* value, lower runs first
+            chat_id: Chat to report progress to
+            message_id: Status message to edit
+
+        Returns:
+            Queued Job
+        """
+        if kind not in self._handlers:
+            raise ValueError(f"Unknown job kind: {kind}")
+
+        job = Job(id=0, kind=kind, user_id=user_id, payload=payload, priority=priority,
+                  chat_id=chat_id, message_id=message_id)
+
+        with self._db_lock:
+            cur = self._conn.execute(
+                """INSERT INTO jobs (kind, user_id, chat_id, message_id, priority,
+                                     payload, state, created_at)
+                   VALUES (?, ?, ?, ?, ?, ?, ?, ?)""",
+                (kind, user_id, chat_id, message_id, priority,
+                 json.dumps(payload), STATE_QUEUED, job.created_at)
+            )
+            self._conn.commit()
+            job.id = cur.lastrowid
+
+        with self._cond:
+            self._pending[job.id] = job
+            self._cond.notify()
+
+        return job
+
+    def position(self, job_id: int) -> int:
+        """Number of queued jobs scheduled before this one (0 = next)"""
+        with self._cond:
+            job = self._pending.get(job_id)
+            if not job:
+                return 0
+            return sum(
+                1 for j in self._pending.values()
+                if j.priority < job.priority or (j.priority == job.priority and j.id < job.id)
+            )
+
+    def get_stats(self) -> Dict[str, Any]:
+        """Get queue statistics"""
+        with self._cond:
+            return {
+                'pending': len(self._pending),
+                'running': len(self._running),
+                'workers': self.workers,
+                'users_waiting': len({j.user_id for j in self._pending.values()}),
+            }
+
+    def _recover(self):
+        """Re-queue jobs that were queued or interrupted before a restart"""
+        cutoff = time.time() - self.keep_finished_hours * 3600
+        with self._db_lock:
+            self._conn.execute(
+                "DELETE FROM jobs WHERE state IN (?, ?) AND finished_at < ?",
+                (STATE_DONE, STATE_FAILED, cutoff)
+            )
+            rows = self._conn.execute(
+                """SELECT id, kind, user_id, chat_id, message_id, priority, payload, created_at
+                   FROM jobs WHERE state IN (?, ?) ORDER BY id""",
+                (STATE_QUEUED, STATE_RUNNING)
+            ).fetchall()
+            self._conn.execute("UPDATE jobs SET state=? WHERE state=?", (STATE_QUEUED, STATE_RUNNING))
+            self._conn.commit()
+
+        with self._cond:
+            for row in rows:
+                job_id, kind, user_id, chat_id, message_id, priority, payload, created_at = row
+                if kind not in self._handlers:
+                    logger.warning(f"Dropping job {job_id}: no handler for '{kind}'")
+                    self._update(job_id, state=STATE_FAILED, error='No handler',
+                                 finished_at=time.time())
+                    continue
+                self._pending[job_id] = Job(
+                    id=job_id, kind=kind, user_id=user_id, payload=json.loads(payload or '{}'),
+                    priority=priority, chat_id=chat_id, message_id=message_id,
+                    created_at=created_at or time.time()
+                )
+
+    def _update(self, job_id: int, **columns):
+        """Persist job column changes"""
+        assignments = ', '.join(f"{k}=?" for k in columns)
+        with self._db_lock:
+            self._conn.execute(f"UPDATE jobs SET {assignments} WHERE id=?",
+                               (*columns.values(), job_id))
+            self._conn.commit()
+
+    def _next_job(self) -> Optional[Job]:
+        """Pick next job: best priority, then the least-served user, then FIFO"""
+        if not self._pending:
+            return None
+        best = min(j.priority for j in self._pending.values())
+        candidates = [j for j in self._pending.values() if j.priority == best]
+        return min(candidates, key=lambda j: (
+            self._running_by_user.get(j.user_id, 0),
+            self._last_served.get(j.user_id, 0.0),
+            j.id
+        ))
+
+    def _worker(self):
+        """Worker thread loop"""
+        while True:
+            with self._cond:
+                job = self._next_job()
+                while job is None and not self._stopping:
+                    self._cond.wait()
+                    job = self._next_job()
+                if self._stopping:
+                    return
+
+                del self._pending[job.id]
+                self._running[job.id] = job
+                self._running_by_user[job.user_id] = self._running_by_user.get(job.user_id, 0) + 1
+                self._last_served[job.user_id] = time.time()
+
+            self._execute(job)
+
+            with self._cond:
+                self._running.pop(job.id, None)
+                self._running_by_user[job.user_id] -= 1
+                if self._running_by_user[job.user_id] <= 0:
+                    del self._running_by_user[job.user_id]
+
+    def _execute(self, job: Job):
+        """Run a job and dispatch its callbacks"""
+        handler = self._handlers[job.kind]
+        job.state = STATE_RUNNING
+        job.started_at = time.time()
+        self._update(job.id, state=STATE_RUNNING, started_at=job.started_at)
+        metrics.QUEUE_WAIT_SECONDS.observe(max(0.0, job.started_at - job.created_at), kind=job.kind)
+
+        def progress(text: str):
+            if handler.on_progress:
+                try:
+                    handler.on_progress(job, text)
+                except Exception as e:
+                    logger.debug(f"Progress callback failed for job {job.id}: {e}")
+
+        try:
+            with metrics.trace(f"{job.kind}:{job.id}") as trace:
+                try:
+                    result = handler.run(job, progress)
+                finally:
+                    job.trace = trace.to_dict()
+        except Exception as e:
+            logger.error(f"Job {job.id} ({job.kind}) failed: {e}")
+            job.state = STATE_FAILED
+            job.error = str(e)
+            job.finished_at = time.time()
+            metrics.JOB_SECONDS.observe(job.finished_at - job.started_at, kind=job.kind, state=STATE_FAILED)
+            self._update(job.id, state=STATE_FAILED, error=job.error, finished_at=job.finished_at)
+            if handler.on_error:
+                try:
+                    handler.on_error(job, e)
+                except Exception:
+                    pass
+            return
+
+        job.state = STATE_DONE
+        job.finished_at = time.time()
+        metrics.JOB_SECONDS.observe(job.finished_at - job.started_at, kind=job.kind, state=STATE_DONE)
+        self._update(job.id, state=STATE_DONE, finished_at=job.finished_at)
+        if handler.on_done:
+            try:
+                handler.on_done(job, result)
+            except Exception as e:
+                logger.error(f"Done callback failed for job {job.id}: {e}")
@@ -0,0 +1,387 @@
+"""
+Pipeline Metrics - stage timings, per-job traces and a Prometheus endpoint
+
+Each pipeline stage is timed with
+
+    with metrics.span('yara'):
+        ...
+
+Every span is observed in the sandbox_stage_seconds{stage} histogram.
+When the calling thread runs inside metrics.trace() (the job queue opens
+one per job) the span is also appended to that job's Trace, which the
+dynamic stage stores with its analyses row, so a slow report can be
+explained stage by stage afterwards. Durations measured elsewhere (QEMU
+restore times, timings reported by the guest agent) go in with record().
+
+The exporter writes the Prometheus text format by hand, so there is no
+client library to install on the Pi. Quantiles are left to the server:
+
+    histogram_quantile(0.99, sum by (stage, le) (rate(sandbox_stage_seconds_bucket[5m])))
+"""
+
+import time
+import bisect
+import logging
+import functools
+import threading
+import contextvars
+from contextlib import contextmanager
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from typing import Any, Callable, Dict, Iterator, List, Optional, Tuple
+
+logger = logging.getLogger(__name__)
+
+# Upper bounds in seconds: from a cached hash lookup to a full VM run
+DEFAULT_BUCKETS = (0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300)
+
+LabelValues = Tuple[str, ...]
+
+
+def _escape(value: str) -> str:
+    return value.replace('\\', '\\\\').replace('\n', '\\n').replace('"', '\\"')
+
+
+def _labels(names: Tuple[str, ...], values: LabelValues, extra: str = '') -> str:
+    parts = [f'{n}="{_escape(v)}"' for n, v in zip(names, values)]
+    if extra:
+        parts.append(extra)
+    return '{' + ','.join(parts) + '}' if parts else ''
+
+
+def _number(value: float) -> str:
+    if value == float('inf'):
+        return '+Inf'
+    return repr(float(value)) if value != int(value) else str(int(value))
+
+
+class _Metric:
+    """Base of the metric types: name, help text and label names"""
+    
+    kind = 'untyped'
+    
+    def __init__(self, name: str, help_text: str, labelnames: Tuple[str, ...] = ()):
+        self.name = name
+        self.help = help_text
+        self.labelnames = tuple(labelnames)
+        self._lock = threading.Lock()
+    
+    def _key(self, labels: Dict[str, Any]) -> LabelValues:
+        if set(labels) != set(self.labelnames):
+            raise ValueError(f"{self.name} takes labels {self.labelnames}, got {tuple(labels)}")
+        return tuple(str(labels[n]) for n in self.labelnames)
+    
+    def samples(self) -> Iterator[str]:
+        return iter(())
+    
+    def render(self) -> str:
+        lines = [f"# HELP {self.name} {self.help}", f"# TYPE {self.name} {self.kind}"]
+        lines.extend(self.samples())
+        return '\n'.join(lines)
+
+
+class Counter(_Metric):
+    """Monotonic count per label set"""
+    
+    kind = 'counter'
+    
+    def __init__(self, name: str, help_text: str, labelnames: Tuple[str, ...] = ()):
+        super().__init__(name, help_text, labelnames)
+        self._values: Dict[LabelValues, float] = {}
+    
+    def inc(self, amount: float = 1, **labels):
+        key = self._key(labels)
+        with self._lock:
+            self._values[key] = self._values.get(key, 0) + amount
+    
+    def value(self, **labels) -> float:
+        with self._lock:
+            return self._values.get(self._key(labels), 0)
+    
+    def samples(self) -> Iterator[str]:
+        with self._lock:
+            values = sorted(self._values.items())
+        for key, value in values:
+            yield f"{self.name}{_labels(self.labelnames, key)} {_number(value)}"
+
+
+class Gauge(_Metric):
+    """
+    Current value per label set.
+    
+    With set_function() the values are read at scrape time instead; the
+    function returns {label values tuple: value} (or a number when the
+    gauge has no labels).
+    """
+    
+    kind = 'gauge'
+    
+    def __init__(self, name: str, help_text: str, labelnames: Tuple[str, ...] = ()):
+        super().__init__(name, help_text, labelnames)
+        self._values: Dict[LabelValues, float] = {}
+        self._function: Optional[Callable[[], Any]] = None
+    
+    def set(self, value: float, **labels):
+        key = self._key(labels)
+        with self._lock:
+            self._values[key] = value
+    
+    def set_function(self, function: Optional[Callable[[], Any]]):
+        """Collect values from function() on every scrape (None: back to set())"""
+        self._function = function
+    
+    def values(self) -> Dict[LabelValues, float]:
+        function = self._function
+        if function is None:
+            with self._lock:
+                return dict(self._values)
+        try:
+            values = function()
+        except Exception as e:
+            logger.debug(f"Collector of {self.name} failed: {e}")
+            return {}
+        if not isinstance(values, dict):
+            return {(): values}
+        return {tuple(str(v) for v in (k if isinstance(k, tuple) else (k,))): value
+                for k, value in values.items()}
+    
+    def samples(self) -> Iterator[str]:
+        for key, value in sorted(self.values().items()):
+            yield f"{self.name}{_labels(self.labelnames, key)} {_number(value)}"
+
+
+class Histogram(_Metric):
+    """Cumulative bucket counts, sum and count per label set"""
+    
+    kind = 'histogram'
+    
+    def __init__(self, name: str, help_text: str, labelnames: Tuple[str, ...] = (),
+                 buckets: Tuple[float, ...] = DEFAULT_BUCKETS):
+        super().__init__(name, help_text, labelnames)
+        self.buckets = tuple(sorted(buckets))
+        # label values -> [per-bucket counts (+Inf last), sum]
+        self._series: Dict[LabelValues, List] = {}
+    
+    def observe(self, value: float, **labels):
+        key = self._key(labels)
+        index = bisect.bisect_left(self.buckets, value)
+        with self._lock:
+            series = self._series.get(key)
+            if series is None:
+                series = self._series[key] = [[0] * (len(self.buckets) + 1), 0.0]
+            series[0][index] += 1
+            series[1] += value
+    
+    def count(self, **labels) -> int:
+        with self._lock:
+            series = self._series.get(self._key(labels))
+            return sum(series[0]) if series else 0
+    
+    def labels(self) -> List[Dict[str, str]]:
+        """Label sets observed so far"""
+        with self._lock:
+            keys = sorted(self._series)
+        return [dict(zip(self.labelnames, key)) for key in keys]
+    
+    def quantile(self, q: float, **labels) -> Optional[float]:
+        """Estimate like PromQL histogram_quantile (linear within a bucket)"""
+        with self._lock:
+            series = self._series.get(self._key(labels))
+            counts = list(series[0]) if series else []
+        total = sum(counts)
+        if not total:
+            return None
+        rank = q * total
+        seen = 0
+        for i, n in enumerate(counts):
+            if seen + n >= rank and n:
+                if i == len(self.buckets):
+                    return self.buckets[-1]
+                lower = self.buckets[i - 1] if i else 0.0
+                return lower + (self.buckets[i] - lower) * (rank - seen) / n
+            seen += n
+        return self.buckets[-1]
+    
+    def samples(self) -> Iterator[str]:
+        with self._lock:
+            series = sorted((k, (list(c), s)) for k, (c, s) in self._series.items())
+        for key, (counts, total) in series:
+            cumulative = 0
+            for bound, n in zip(self.buckets + (float('inf'),), counts):
+                cumulative += n
+                le = f'le="{_number(bound)}"'
+                yield f"{self.name}_bucket{_labels(self.labelnames, key, le)} {cumulative}"
+            yield f"{self.name}_sum{_labels(self.labelnames, key)} {_number(total)}"
+            yield f"{self.name}_count{_labels(self.labelnames, key)} {cumulative}"
+
+
+class Registry:
+    """Named metrics of a process, rendered together for a scrape"""
+    
+    def __init__(self):
+        self._metrics: Dict[str, _Metric] = {}
+        self._lock = threading.Lock()
+    
+    def _get(self, cls, name: str, *args, **kwargs):
+        with self._lock:
+            metric = self._metrics.get(name)
+            if metric is None:
+                metric = self._metrics[name] = cls(name, *args, **kwargs)
+            elif not isinstance(metric, cls):
+                raise ValueError(f"{name} is already a {metric.kind}")
+            return metric
+    
+    def counter(self, name: str, help_text: str, labelnames: Tuple[str, ...] = ()) -> Counter:
+        return self._get(Counter, name, help_text, labelnames)
+    
+    def gauge(self, name: str, help_text: str, labelnames: Tuple[str, ...] = ()) -> Gauge:
+        return self._get(Gauge, name, help_text, labelnames)
+    
+    def histogram(self, name: str, help_text: str, labelnames: Tuple[str, ...] = (),
+                  buckets: Tuple[float, ...] = DEFAULT_BUCKETS) -> Histogram:
+        return self._get(Histogram, name, help_text, labelnames, buckets)
+    
+    def render(self) -> str:
+        """Prometheus text exposition format (version 0.0.4)"""
+        with self._lock:
+            metrics = sorted(self._metrics.items())
+        return '\n'.join(m.render() for _, m in metrics) + '\n'
+
+
+REGISTRY = Registry()
+
+STAGE_SECONDS = REGISTRY.histogram(
+    'sandbox_stage_seconds', 'Time spent per pipeline stage', ('stage',))
+JOB_SECONDS = REGISTRY.histogram(
+    'sandbox_job_seconds', 'Job run time from start to result', ('kind', 'state'))
+QUEUE_WAIT_SECONDS = REGISTRY.histogram(
+    'sandbox_queue_wait_seconds', 'Time a job waited in the queue', ('kind',))
+RESTORE_SECONDS = REGISTRY.histogram(
+    'sandbox_vm_restore_seconds', 'Time to bring a clone back to its clean state', ('arch',))
+QUEUE_JOBS = REGISTRY.gauge(
+    'sandbox_queue_jobs', 'Jobs in the queue by state', ('state',))
+VM_SLOTS = REGISTRY.gauge(
+    'sandbox_vm_slots', 'Pool clones by architecture and state', ('arch', 'state'))
+
+
+class Trace:
+    """Spans of one job, offsets relative to the start of the trace"""
+    
+    def __init__(self, name: str = ''):
+        self.name = name
+        self.started = time.time()
+        self._t0 = time.monotonic()
+        self.spans: List[Dict[str, Any]] = []
+        self._lock = threading.Lock()
+    
+    def add(self, stage: str, start: float, duration: float, **attrs):
+        """Append a span that started at monotonic time `start`"""
+        span = {'stage': stage, 'start': round(start - self._t0, 4), 'duration': round(duration, 4)}
+        span.update(attrs)
+        with self._lock:
+            self.spans.append(span)
+    
+    def totals(self) -> Dict[str, float]:
+        """Seconds per stage (spans of one stage summed)"""
+        totals: Dict[str, float] = {}
+        with self._lock:
+            for span in self.spans:
+                totals[span['stage']] = round(totals.get(span['stage'], 0) + span['duration'], 4)
+        return totals
+    
+    def to_dict(self) -> Dict[str, Any]:
+        with self._lock:
+            spans = [dict(s) for s in self.spans]
+        return {'name': self.name, 'started': self.started,
+                'elapsed': round(time.monotonic() - self._t0, 4), 'spans': spans}
+
+
+_current: contextvars.ContextVar[Optional[Trace]] = contextvars.ContextVar('trace', default=None)
+
+
+def current_trace() -> Optional[Trace]:
+    return _current.get()
+
+
+@contextmanager
+def trace(name: str = '') -> Iterator[Trace]:
+    """Collect the spans of the code run inside into a new Trace"""
+    t = Trace(name)
+    token = _current.set(t)
+    try:
+        yield t
+    finally:
+        _current.reset(token)
+
+
+def record(stage: str, seconds: float, start: Optional[float] = None, **attrs):
+    """
+    Account for a stage timed by someone else.
+    
+    Args:
+        stage: Stage name (label of sandbox_stage_seconds)
+        seconds: Its duration
+        start: Monotonic start time (default: it just ended)
+        attrs: Extra fields stored with the span in the trace
+    """
+    STAGE_SECONDS.observe(seconds, stage=stage)
+    t = _current.get()
+    if t is not None:
+        t.add(stage, time.monotonic() - seconds if start is None else start, seconds, **attrs)
+
+
+@contextmanager
+def span(stage: str, **attrs) -> Iterator[Dict[str, Any]]:
+    """
+    Time a stage.
+    
+    Yields the attrs dict, so the body can add fields for the trace
+    (e.g. whether a result came from the cache). Failed stages are
+    recorded too, with error set.
+    """
+    start = time.monotonic()
+    try:
+        yield attrs
+    except BaseException as e:
+        attrs['error'] = type(e).__name__
+        raise
+    finally:
+        record(stage, time.monotonic() - start, start, **attrs)
+
+
+def timed(stage: str) -> Callable:
+    """Decorator: run the function in span(stage)"""
+    def decorate(function: Callable) -> Callable:
+        @functools.wraps(function)
+        def wrapper(*args, **kwargs):
+            with span(stage):
+                return function(*args, **kwargs)
+        return wrapper
+    return decorate
+
+
+class _Handler(BaseHTTPRequestHandler):
+    registry = REGISTRY
+    
+    def do_GET(self):
+        if self.path.split('?')[0] not in ('/metrics', '/'):
+            self.send_error(404)
+            return
+        body = self.registry.render().encode()
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/plain; version=0.0.4; charset=utf-8')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+    
+    def log_message(self, format, *args):
+        pass
+
+
+def serve(port: int, addr: str = '127.0.0.1', registry: Registry = REGISTRY) -> ThreadingHTTPServer:
+    """Serve /metrics from a daemon thread; returns the server (port 0 picks one)"""
+    handler = type('MetricsHandler', (_Handler,), {'registry': registry})
+    server = ThreadingHTTPServer((addr, port), handler)
+    server.daemon_threads = True
+    threading.Thread(target=server.serve_forever, name='metrics-http', daemon=True).start()
+    logger.info(f"Metrics on http://{addr}:{server.server_address[1]}/metrics")
+    return server
@@ -0,0 +1,338 @@
+"""
+Pcap IOCs - DNS queries, HTTP requests and TLS SNI from a packet capture
+
+The guest agent writes a pcap of the sample's TCP/UDP traffic; it is
+copied to the host's pcap directory after the run. This module walks
+the capture in place (mmap + memoryview, no per-packet copies) and pulls
+out the names the sample asked for:
+
+  - DNS: query names of outgoing requests
+  - HTTP: Host, path and User-Agent of request heads
+  - TLS: server_name of ClientHello messages
+
+Only the first segment of each TCP payload is looked at (no stream
+reassembly); request heads and ClientHellos virtually always fit.
+DomainIndex then matches the names against suspicious domains, TLDs,
+paths and user agents from patterns.yaml with one dict lookup per label.
+"""
+
+import os
+import mmap
+import struct
+import socket
+from dataclasses import dataclass, asdict
+from typing import Dict, Iterator, List, Optional, Set, Tuple
+
+PCAP_HEADER = struct.Struct('<IHHiIII')
+PCAP_RECORD = struct.Struct('<IIII')
+PCAP_MAGIC = 0xa1b2c3d4
+PCAP_MAGIC_NS = 0xa1b23c4d
+
+LINKTYPE_ETHERNET = 1
+LINKTYPE_RAW = 101
+LINKTYPE_LINUX_SLL = 113
+
+ETHERTYPE_IP = 0x0800
+ETHERTYPE_IPV6 = 0x86dd
+ETHERTYPE_VLAN = 0x8100
+
+IPPROTO_TCP = 6
+IPPROTO_UDP = 17
+
+HTTP_METHODS = (b'GET ', b'POST ', b'PUT ', b'HEAD ', b'DELETE ', b'OPTIONS ', b'PATCH ', b'CONNECT ')
+
+# Score of a name under a suspicious TLD (patterns.yaml lists no scores)
+TLD_SCORE = 10
+
+
+@dataclass
+class NetworkIOC:
+    """A name the sample looked up or connected to"""
+    kind: str  # dns, http, sni
+    host: str
+    dst_addr: str = ""
+    dst_port: int = 0
+    path: str = ""
+    user_agent: str = ""
+
+
+def iter_packets(data) -> Iterator[Tuple[float, memoryview]]:
+    """
+    Walk a pcap capture.
+    
+    Args:
+        data: Whole capture (bytes or mmap)
+    
+    Yields:
+        (timestamp, IP packet view); non-IP frames are skipped
+    """
+    view = memoryview(data)
+    if len(view) < PCAP_HEADER.size:
+        return
+    magic = struct.unpack_from('<I', view)[0]
+    if magic in (PCAP_MAGIC, PCAP_MAGIC_NS):
+        endian = '<'
+    elif magic in (0xd4c3b2a1, 0x4d3cb2a1):
+        endian = '>'
+        magic = struct.unpack_from('>I', view)[0]
+    else:
+        return
+    linktype = struct.unpack_from(endian + 'I', view, 20)[0]
+    record = struct.Struct(endian + 'IIII')
+    divisor = 1e9 if magic == PCAP_MAGIC_NS else 1e6
+    
+    offset = PCAP_HEADER.size
+    while offset + record.size <= len(view):
+        sec, frac, incl, _ = record.unpack_from(view, offset)
+        offset += record.size
+        frame = view[offset:offset + incl]
+        offset += incl
+        packet = _ip_payload(frame, linktype)
+        if packet is not None:
+            yield sec + frac / divisor, packet
+
+
+def _ip_payload(frame: memoryview, linktype: int) -> Optional[memoryview]:
+    """Network-layer part of a link-layer frame"""
+    if linktype == LINKTYPE_RAW:
+        return frame
+    if linktype == LINKTYPE_ETHERNET:
+        offset, type_at = 14, 12
+    elif linktype == LINKTYPE_LINUX_SLL:
+        offset, type_at = 16, 14
+    else:
+        return None
+    if len(frame) < offset:
+        return None
+    ethertype = struct.unpack_from('!H', frame, type_at)[0]
+    if ethertype == ETHERTYPE_VLAN and len(frame) >= offset + 4:
+        ethertype = struct.unpack_from('!H', frame, offset + 2)[0]
+        offset += 4
+    if ethertype not in (ETHERTYPE_IP, ETHERTYPE_IPV6):
+        return None
+    return frame[offset:]
+
+
+def split_packet(packet: memoryview) -> Optional[Tuple[int, str, int, memoryview]]:
+    """
+    Transport payload of an IP packet.
+    
+    Returns:
+        (protocol, dst address, dst port, payload view), or None for
+        fragments, truncated packets and protocols other than TCP/UDP
+    """
+    if len(packet) < 20:
+        return None
+    version = packet[0] >> 4
+    if version == 4:
+        ihl = (packet[0] & 0x0f) * 4
+        if struct.unpack_from('!H', packet, 6)[0] & 0x1fff:
+            return None
+        proto, offset = packet[9], ihl
+        dst = socket.inet_ntop(socket.AF_INET, packet[16:20].tobytes())
+        end = min(len(packet), struct.unpack_from('!H', packet, 2)[0] or len(packet))
+    elif version == 6 and len(packet) >= 40:
+        proto, offset = packet[6], 40
+        dst = socket.inet_ntop(socket.AF_INET6, packet[24:40].tobytes())
+        end = min(len(packet), 40 + struct.unpack_from('!H', packet, 4)[0])
+    else:
+        return None
+    
+    if proto == IPPROTO_UDP and end >= offset + 8:
+        return proto, dst, struct.unpack_from('!H', packet, offset + 2)[0], packet[offset + 8:end]
+    if proto == IPPROTO_TCP and end >= offset + 20:
+        data_offset = (packet[offset + 12] >> 4) * 4
+        return proto, dst, struct.unpack_from('!H', packet, offset + 2)[0], packet[offset + data_offset:end]
+    return None
+
+
+def parse_dns_query(payload: memoryview) -> Optional[str]:
+    """First question name of a DNS query (None for responses)"""
+    if len(payload) < 17 or payload[2] & 0x80:
+        return None
+    qdcount = struct.unpack_from('!H', payload, 4)[0]
+    if not qdcount:
+        return None
+    labels = []
+    offset = 12
+    while offset < len(payload):
+        length = payload[offset]
+        if length == 0:
+            return '.'.join(labels).lower() if labels else None
+        # Compression pointers do not occur in the first question
+        if length & 0xc0 or offset + 1 + length > len(payload):
+            return None
+        labels.append(payload[offset + 1:offset + 1 + length].tobytes().decode('ascii', 'replace'))
+        offset += 1 + length
+    return None
+
+
+def parse_http_request(payload: memoryview) -> Optional[Tuple[str, str, str]]:
+    """(host, path, user agent) of an HTTP request head"""
+    head = payload[:8].tobytes()
+    if not head.startswith(HTTP_METHODS):
+        return None
+    data = payload[:4096].tobytes()
+    lines = data.split(b'\r\n\r\n', 1)[0].split(b'\r\n')
+    parts = lines[0].split(b' ')
+    path = parts[1].decode('latin-1') if len(parts) > 1 else ''
+    host = user_agent = ''
+    for line in lines[1:]:
+        name, _, value = line.partition(b':')
+        name = name.strip().lower()
+        if name == b'host':
+            host = value.strip().decode('latin-1').split(':')[0].lower()
+        elif name == b'user-agent':
+            user_agent = value.strip().decode('latin-1')
+    return host, path, user_agent
+
+
+def parse_tls_sni(payload: memoryview) -> Optional[str]:
+    """server_name of a TLS ClientHello"""
+    # Handshake record carrying a ClientHello
+    if len(payload) < 43 or payload[0] != 0x16 or payload[5] != 0x01:
+        return None
+    try:
+        offset = 5 + 4 + 2 + 32  # record and handshake headers, version, random
+        offset += 1 + payload[offset]  # session id
+        offset += 2 + struct.unpack_from('!H', payload, offset)[0]  # cipher suites
+        offset += 1 + payload[offset]  # compression methods
+        end = offset + 2 + struct.unpack_from('!H', payload, offset)[0]
+        offset += 2
+        while offset + 4 <= min(end, len(payload)):
+            ext_type, ext_len = struct.unpack_from('!HH', payload, offset)
+            offset += 4
+            if ext_type == 0:
+                # server_name_list: u16 length, u8 type, u16 name length, name
+                name_len = struct.unpack_from('!H', payload, offset + 3)[0]
+                name = payload[offset + 5:offset + 5 + name_len].tobytes()
+                return name.decode('ascii', 'replace').lower() or None
+            offset += ext_len
+    except (IndexError, struct.error):
+        pass
+    return None
+
+
+def extract_iocs(data) -> List[NetworkIOC]:
+    """
+    DNS, HTTP and SNI indicators of a capture, each once.
+    
+    Args:
+        data: Whole capture (bytes or mmap)
+    """
+    iocs: List[NetworkIOC] = []
+    seen: Set[Tuple] = set()
+    
+    def add(ioc: NetworkIOC):
+        key = (ioc.kind, ioc.host, ioc.path, ioc.user_agent)
+        if key not in seen:
+            seen.add(key)
+            iocs.append(ioc)
+    
+    for _, packet in iter_packets(data):
+        parts = split_packet(packet)
+        if parts is None:
+            continue
+        proto, dst, port, payload = parts
+        if not len(payload):
+            continue
+        if proto == IPPROTO_UDP:
+            if port == 53:
+                name = parse_dns_query(payload)
+                if name:
+                    add(NetworkIOC('dns', name, dst, port))
+            continue
+        http = parse_http_request(payload)
+        if http:
+            add(NetworkIOC('http', http[0], dst, port, path=http[1], user_agent=http[2]))
+            continue
+        sni = parse_tls_sni(payload)
+        if sni:
+            add(NetworkIOC('sni', sni, dst, port))
+    return iocs
+
+
+def extract_file(path: str) -> List[Dict]:
+    """extract_iocs() of a pcap file, as dicts (empty if unreadable)"""
+    try:
+        with open(path, 'rb') as f:
+            if os.fstat(f.fileno()).st_size <= PCAP_HEADER.size:
+                return []
+            with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as mm:
+                return [asdict(ioc) for ioc in extract_iocs(mm)]
+    except (OSError, ValueError):
+        return []
+
+
+class DomainIndex:
+    """
+    Suspicious domains, TLDs, URL paths and user agents.
+    
+    Domains and TLDs are keyed by their reversed labels, so a hostname
+    is checked with one dict lookup per suffix ("api.telegram.org",
+    "telegram.org", "org") instead of a substring test per rule.
+    """
+    
+    def __init__(self):
+        # suffix -> (score, mitre, description, path prefix or "")
+        self._suffixes: Dict[str, List[Tuple[int, str, str, str]]] = {}
+        self.paths: List[Tuple[str, int, str]] = []
+        self.user_agents: List[Tuple[str, int, str]] = []
+    
+    def add_domain(self, domain: str, score: int, mitre: str, description: str):
+        """Register a domain (optionally with a path: "discord.com/api") or a TLD (".xyz")"""
+        domain, _, path = domain.lower().strip().lstrip('.').partition('/')
+        if domain:
+            rules = self._suffixes.setdefault(domain, [])
+            rules.append((score, mitre, description, path and '/' + path))
+            # Rules with a path are more specific than the bare domain
+            rules.sort(key=lambda r: -len(r[3]))
+    
+    @classmethod
+    def from_rules(cls, patterns: Dict, tlds=(), hosts: Optional[Dict] = None) -> 'DomainIndex':
+        """
+        Build from patterns.yaml `network` rules plus built-in lists.
+        
+        Args:
+            patterns: Loaded patterns.yaml
+            tlds: Extra suspicious TLDs (".xyz")
+            hosts: Extra {host: (mitre, score, description)}
+        """
+        index = cls()
+        network = patterns.get('network') or {}
+        for tld in set(tlds) | set(network.get('suspicious_tlds') or []):
+            index.add_domain(tld, TLD_SCORE, 'T1071', f"suspicious TLD {tld}")
+        for host, (mitre, score, desc) in (hosts or {}).items():
+            index.add_domain(host, score, mitre, desc)
+        for e in network.get('suspicious_endpoints') or []:
+            if isinstance(e, dict) and e.get('host'):
+                index.add_domain(e['host'], e.get('score', 10), e.get('mitre', 'T1102'),
+                                 e.get('description', e['host']))
+        for p in network.get('suspicious_paths') or []:
+            index.paths.append((p, 10, f"suspicious URL path {p}"))
+        for e in network.get('suspicious_user_agents') or []:
+            if isinstance(e, dict) and e.get('pattern'):
+                index.user_agents.append((e['pattern'], e.get('score', 10), e.get('description', '')))
+        return index
+    
+    def match_host(self, host: str, path: str = '') -> List[Tuple[int, str, str]]:
+        """(score, mitre, description) of every rule covering host (and path), most specific first"""
+        labels = host.lower().rstrip('.').split('.')
+        matches = []
+        for i in range(len(labels)):
+            for score, mitre, desc, prefix in self._suffixes.get('.'.join(labels[i:]), ()):
+                if not prefix or path.startswith(prefix):
+                    matches.append((score, mitre, desc))
+        return matches
+    
+    def match(self, ioc: Dict) -> List[Tuple[int, str, str]]:
+        """Rules hit by one NetworkIOC dict (only the most specific domain rule)"""
+        matches = self.match_host(ioc.get('host', ''), ioc.get('path', ''))[:1]
+        path, agent = ioc.get('path', ''), ioc.get('user_agent', '')
+        if path:
+            matches += [(score, 'T1071.001', desc) for p, score, desc in self.paths if p in path]
+        if agent:
+            lowered = agent.lower()
+            matches += [(score, 'T1071.001', f"{desc}: {agent}") for p, score, desc in self.user_agents
+                        if p.lower() in lowered]
+        return matches
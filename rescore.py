@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""
+Rescore - re-evaluate stored analyses after patterns.yaml or YARA rules change
+
+Every dynamic analysis keeps the raw inputs it was scored from (YARA
+matches, script source, ELF findings, normalized VM events) and the
+version of the ruleset it used. This tool diffs each stored ruleset
+against the current one, works out which samples a change can affect
+and replays only those through the current rules, without a VM:
+
+  - changed verdict thresholds affect every sample
+  - changed script rules affect samples of that language
+  - changed network indicators (suspicious domains, TLDs, URL paths,
+    user agents) affect every sample, since any may have used the network
+  - a removed or edited YARA file affects samples that matched its rules;
+    an added or edited one may match anything, so every sample whose
+    file is still on disk is rescanned
+
+Unaffected rows are only marked as valid under the new ruleset. Runs
+stopped early at the malicious threshold are replayed with the events
+seen before the stop.
+
+Usage:
+    python3 rescore.py [--dry-run] [--db logs/dynamic_analysis.db]
+"""
+
+import os
+import sys
+import argparse
+from dataclasses import dataclass, field, asdict
+from typing import Dict, List, Optional, Set
+
+from dynamic import AnalysisResult, DynamicAnalyzer
+from sample import describe
+
+
+@dataclass
+class RulesDiff:
+    """What changed between two ruleset snapshots"""
+    thresholds: bool = False
+    languages: Set[str] = field(default_factory=set)
+    network: bool = False
+    # Rules whose definition changed or disappeared
+    yara_stale: Set[str] = field(default_factory=set)
+    # A rule file was added or edited
+    yara_rescan: bool = False
+    
+    @classmethod
+    def between(cls, old: Optional[Dict], new: Dict) -> 'RulesDiff':
+        if old is None:
+            # Ruleset not recorded (row from before rescoring existed)
+            return cls(thresholds=True, network=True, yara_rescan=True)
+        old_p, new_p = old.get('patterns', {}), new.get('patterns', {})
+        old_s, new_s = old_p.get('scripts', {}), new_p.get('scripts', {})
+        old_y, new_y = old.get('yara', {}), new.get('yara', {})
+        changed = {f for f in set(old_y) | set(new_y)
+                   if old_y.get(f, {}).get('sha1') != new_y.get(f, {}).get('sha1')}
+        return cls(
+            thresholds=old_p.get('thresholds') != new_p.get('thresholds'),
+            languages={lang for lang in set(old_s) | set(new_s) if old_s.get(lang) != new_s.get(lang)},
+            network=old_p.get('network') != new_p.get('network'),
+            yara_stale={rule for f in changed for rule in old_y.get(f, {}).get('rules', [])},
+            yara_rescan=any(f in new_y for f in changed),
+        )
+    
+    @property
+    def empty(self) -> bool:
+        return not (self.thresholds or self.languages or self.network or self.yara_stale or self.yara_rescan)
+    
+    def affects(self, row: Dict, on_disk: bool) -> bool:
+        return (self.thresholds or self.network or row['file_type'] in self.languages
+                or bool(self.yara_stale & set(row['yara_matches'] or []))
+                or (self.yara_rescan and on_disk))
+
+
+class Rescorer:
+    """Bulk offline re-evaluation of the rows in an AnalysisDB"""
+    
+    def __init__(self, analyzer: DynamicAnalyzer):
+        self.analyzer = analyzer
+        self.db = analyzer.db
+    
+    def _on_disk(self, raw: Optional[Dict], file_hash: str) -> bool:
+        """The recorded path still holds this sample's bytes"""
+        path = (raw or {}).get('path')
+        if not path or not os.path.exists(path):
+            return False
+        sample = describe(path)
+        return sample is not None and sample.sha256 == file_hash
+    
+    def run(self, dry_run: bool = False) -> Dict[str, int]:
+        """
+        Rescore every stored sample affected by rule changes.
+        
+        Returns:
+            Counters: checked, current (already on this ruleset), unaffected,
+            rescored, changed (verdict differs), no_raw (needs a VM rerun)
+        """
+        version, snapshot = self.analyzer.ruleset()
+        stats = dict.fromkeys(('checked', 'current', 'unaffected', 'rescored', 'changed', 'no_raw'), 0)
+        diffs: Dict[Optional[str], RulesDiff] = {}
+        unaffected: List[int] = []
+        
+        for row in self.db.latest():
+            stats['checked'] += 1
+            if row['rules_version'] == version:
+                stats['current'] += 1
+                continue
+            old = row['rules_version']
+            if old not in diffs:
+                diffs[old] = RulesDiff.between(self.db.get_ruleset(old), snapshot)
+            diff = diffs[old]
+            
+            if diff.empty:
+                unaffected.append(row['id'])
+                continue
+            raw = self.db.get_raw(row['id'])
+            if raw is None:
+                stats['no_raw'] += 1
+                continue
+            # Hashing the file is only needed when rescanning could matter
+            on_disk = (diff.yara_rescan or diff.affects(row, False)) and self._on_disk(raw, row['file_hash'])
+            if not diff.affects(row, on_disk):
+                unaffected.append(row['id'])
+                continue
+            
+            stats['rescored'] += 1
+            result = self._rescore(row, raw, on_disk)
+            if result.verdict != row['verdict'] or result.threat_score != row['threat_score']:
+                stats['changed'] += 1
+            if not dry_run:
+                self.db.save(raw['path'] or row['file_name'] or '', result, raw=raw, rules_version=version)
+        
+        stats['unaffected'] = len(unaffected)
+        if not dry_run:
+            self.db.set_rules_version(unaffected, version)
+            self.db.flush()
+        return stats
+    
+    def _rescore(self, row: Dict, raw: Dict, on_disk: bool) -> AnalysisResult:
+        yara_matches = None
+        if on_disk and self.analyzer.yara.available:
+            yara_matches = self.analyzer.yara.scan(raw['path'])
+            raw['yara'] = [asdict(m) for m in yara_matches]
+        else:
+            # Bytes are gone: keep the recorded matches of rules that still exist
+            current = {r for f in self.analyzer.ruleset()[1]['yara'].values() for r in f['rules']}
+            raw['yara'] = [m for m in raw.get('yara', []) if m['rule'] in current]
+        # Never read a path that now holds other content
+        scorer = self.analyzer.replay(raw if on_disk else dict(raw, path=''), row['file_type'], yara_matches)
+        return AnalysisResult(
+            verdict=scorer.get_verdict(),
+            threat_score=min(scorer.total_score, 100),
+            reasons=scorer.get_reasons(),
+            events=scorer.events,
+            duration=row['duration'] or 0.0,
+            file_type=row['file_type'],
+            file_hash=row['file_hash'],
+            yara_matches=[m['rule'] for m in raw['yara']],
+            mitre_techniques=scorer.get_mitre_techniques()
+        )
+
+
+def main(argv: Optional[List[str]] = None) -> int:
+    parser = argparse.ArgumentParser(description="Re-evaluate stored analyses with the current rules")
+    parser.add_argument('--db', default='logs/dynamic_analysis.db')
+    parser.add_argument('--patterns', default='patterns.yaml')
+    parser.add_argument('--yara-dir', default='yara_rules')
+    parser.add_argument('--dry-run', action='store_true', help="only report what would change")
+    args = parser.parse_args(argv)
+    
+    # No VM config: nothing here boots a VM
+    analyzer = DynamicAnalyzer(db_path=args.db, yara_dir=args.yara_dir, patterns_file=args.patterns,
+                               vm_config_path='')
+    try:
+        stats = Rescorer(analyzer).run(dry_run=args.dry_run)
+    finally:
+        analyzer.db.close()
+    print(' '.join(f"{k}={v}" for k, v in stats.items()))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,156 @@
+"""
+Result Cache - content-addressed analysis results shared by all stages
+
+Results are stored under (sample SHA-256, kind, version), where version
+fingerprints whatever produced the result (rules, thresholds, engines),
+so editing a YARA rule or a threshold simply stops old entries from
+matching. Concurrent requests for the same key are single-flighted: the
+first caller runs the analysis and the others wait for its result, so a
+sample forwarded to several chats at once is analyzed one time.
+"""
+
+import os
+import json
+import time
+import sqlite3
+import hashlib
+import threading
+from typing import Any, Callable, Dict, Optional, Tuple
+
+
+def fingerprint(*parts: Any) -> str:
+    """Short stable hash of JSON-encodable config values"""
+    data = json.dumps(parts, sort_keys=True, default=str, separators=(',', ':'))
+    return hashlib.sha1(data.encode()).hexdigest()[:16]
+
+
+class _Flight:
+    """An analysis in progress that other callers can wait on"""
+    
+    def __init__(self):
+        self.done = threading.Event()
+        self.result: Optional[str] = None
+        self.error: Optional[BaseException] = None
+
+
+class ResultCache:
+    """
+    SQLite store of finished results with in-flight deduplication.
+    
+    Use ResultCache.shared() so the static and dynamic analyzers of one
+    process share the store and the in-flight table.
+    """
+    
+    _instances: Dict[str, 'ResultCache'] = {}
+    _instances_lock = threading.Lock()
+    
+    def __init__(self, db_path: str = "logs/result_cache.db", ttl: float = 86400):
+        self.db_path = db_path
+        # Entries expire so ClamAV signature updates are eventually picked up
+        self.ttl = ttl
+        os.makedirs(os.path.dirname(db_path) or '.', exist_ok=True)
+        self._conn = sqlite3.connect(db_path, check_same_thread=False)
+        self._lock = threading.Lock()
+        self._inflight: Dict[Tuple[str, str, str], _Flight] = {}
+        self._conn.execute("PRAGMA journal_mode=WAL")
+        self._conn.execute("PRAGMA synchronous=NORMAL")
+        with self._conn:
+            self._conn.execute("""
+                CREATE TABLE IF NOT EXISTS results (
+                    sha256 TEXT NOT NULL,
+                    kind TEXT NOT NULL,
+                    version TEXT NOT NULL,
+                    result TEXT NOT NULL,
+                    created_at REAL NOT NULL,
+                    PRIMARY KEY (sha256, kind, version)
+                ) WITHOUT ROWID
+            """)
+            self._conn.execute("DELETE FROM results WHERE created_at < ?", (time.time() - ttl,))
+    
+    @classmethod
+    def shared(cls, db_path: str = "logs/result_cache.db", ttl: float = 86400) -> 'ResultCache':
+        """Process-wide cache for a database file"""
+        key = os.path.abspath(db_path)
+        with cls._instances_lock:
+            if key not in cls._instances:
+                cls._instances[key] = cls(db_path, ttl)
+            return cls._instances[key]
+    
+    def get(self, sha256: str, kind: str, version: str) -> Optional[Dict]:
+        with self._lock:
+            row = self._conn.execute(
+                "SELECT result, created_at FROM results WHERE sha256=? AND kind=? AND version=?",
+                (sha256, kind, version)
+            ).fetchone()
+        if not row or time.time() - row[1] > self.ttl:
+            return None
+        return json.loads(row[0])
+    
+    def put(self, sha256: str, kind: str, version: str, result: Dict):
+        self._put((sha256, kind, version), json.dumps(result, default=str))
+    
+    def _put(self, key: Tuple[str, str, str], data: str):
+        with self._lock, self._conn:
+            # Older versions of the same analysis can no longer match
+            self._conn.execute("DELETE FROM results WHERE sha256=? AND kind=?", key[:2])
+            self._conn.execute(
+                "INSERT INTO results (sha256, kind, version, result, created_at) VALUES (?, ?, ?, ?, ?)",
+                key + (data, time.time()))
+    
+    def get_or_compute(self, sha256: str, kind: str, version: str, compute: Callable[[], Dict],
+                       keep: Optional[Callable[[Dict], bool]] = None) -> Tuple[Dict, bool]:
+        """
+        Cached result for a key, or the result of compute().
+        
+        Args:
+            compute: Runs the analysis; called at most once per key at a time
+            keep: Decides whether a computed result is stored (e.g. not
+                  when the sandbox failed); waiters get it either way
+        
+        Returns:
+            (result, shared) - shared is True when the result came from
+            the store or from another caller's computation
+        """
+        key = (sha256, kind, version)
+        cached = self.get(*key)
+        if cached is not None:
+            return cached, True
+        
+        with self._lock:
+            flight = self._inflight.get(key)
+            leader = flight is None
+            if leader:
+                flight = self._inflight[key] = _Flight()
+        
+        if not leader:
+            flight.done.wait()
+            if flight.error is not None:
+                raise flight.error
+            # Each waiter gets its own copy to annotate
+            return json.loads(flight.result), True
+        
+        try:
+            # The previous leader may have stored it between get() and registering
+            cached = self.get(*key)
+            if cached is not None:
+                flight.result = json.dumps(cached)
+                return cached, True
+            result = compute()
+            flight.result = json.dumps(result, default=str)
+            if keep is None or keep(result):
+                try:
+                    self._put(key, flight.result)
+                except sqlite3.Error as e:
+                    print(f"[ResultCache] Failed to store {kind} result: {e}")
+            return result, False
+        except BaseException as e:
+            flight.error = e
+            raise
+        finally:
+            with self._lock:
+                self._inflight.pop(key, None)
+            flight.done.set()
+    
+    def close(self):
+        with self._lock:
+            self._conn.close()
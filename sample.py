@@ -0,0 +1,262 @@
+"""
+Sample Descriptor - one pass over an uploaded file, shared by all analyzers
+
+The file is memory-mapped once; SHA-256, MD5, SHA-1 and (when the
+modules are installed) ssdeep and TLSH are computed in the same pass,
+and the type is sniffed from the ELF header or script shebang in-process
+instead of forking `file`.
+"""
+
+import os
+import mmap
+import struct
+import hashlib
+from dataclasses import dataclass, asdict
+from typing import Dict, Optional, Tuple
+
+import metrics
+
+try:
+    import ssdeep
+except ImportError:
+    ssdeep = None
+
+try:
+    import tlsh
+except ImportError:
+    tlsh = None
+
+# Hash in slices so ssdeep/TLSH/hashlib share each page while it is hot
+HASH_CHUNK = 1024 * 1024
+
+# e_machine -> (file type, VM architecture)
+ELF_MACHINES = {
+    62: ('elf_x64', 'x64'),       # EM_X86_64
+    183: ('elf_arm64', 'arm64'),  # EM_AARCH64
+    3: ('elf_x86', 'x64'),        # EM_386, runs in the x64 VM
+    40: ('elf_arm', 'arm64'),     # EM_ARM
+}
+
+EXT_TYPES = {
+    '.py': 'python', '.pyw': 'python',
+    '.js': 'javascript', '.mjs': 'javascript',
+    '.sh': 'shell', '.bash': 'shell'
+}
+
+# Interpreter name in a #! line -> file type
+SHEBANG_TYPES = (
+    ('python', 'python'), ('node', 'javascript'),
+    ('bash', 'shell'), ('dash', 'shell'), ('zsh', 'shell'), ('sh', 'shell'),
+)
+
+SCRIPT_TYPES = ('python', 'javascript', 'shell')
+
+# Program header naming the dynamic loader
+PT_INTERP = 3
+
+
+@dataclass
+class SampleDescriptor:
+    """Hashes and type of a sample, computed once per upload"""
+    path: str
+    size: int
+    sha256: str
+    md5: str
+    sha1: str
+    file_type: str = 'unknown'
+    arch: Optional[str] = None
+    ssdeep: Optional[str] = None
+    tlsh: Optional[str] = None
+    # ELF without a dynamic loader (None: not an ELF or unreadable headers)
+    static: Optional[bool] = None
+    
+    @property
+    def is_elf(self) -> bool:
+        return self.file_type.startswith('elf')
+    
+    @property
+    def is_script(self) -> bool:
+        return self.file_type in SCRIPT_TYPES
+    
+    def to_dict(self) -> Dict:
+        return asdict(self)
+
+
+def sniff_type(header: bytes, path: str = '') -> Tuple[str, Optional[str]]:
+    """
+    Detect file type from the first bytes of a file.
+    
+    Args:
+        header: At least the first 64 bytes (fewer for short files)
+        path: File name, for script extensions
+    
+    Returns:
+        (file_type, arch) - arch is 'x64', 'arm64' or None
+    """
+    if header[:4] == b'\x7fELF' and len(header) >= 20:
+        endian = '<' if header[5] == 1 else '>'
+        machine = struct.unpack_from(endian + 'H', header, 18)[0]
+        return ELF_MACHINES.get(machine, ('elf', None))
+    
+    ext = os.path.splitext(path)[1].lower()
+    if ext in EXT_TYPES:
+        return EXT_TYPES[ext], None
+    
+    if header[:2] == b'#!':
+        line = header[2:].split(b'\n', 1)[0].decode('latin-1').strip()
+        words = line.split()
+        # "#!/usr/bin/env python3" names the interpreter in its second word
+        interp = os.path.basename(words[1] if len(words) > 1 and words[0].endswith('/env')
+                                  else words[0] if words else '')
+        for name, file_type in SHEBANG_TYPES:
+            if interp.startswith(name):
+                return file_type, None
+    return 'unknown', None
+
+
+def elf_is_static(data) -> Optional[bool]:
+    """
+    Check whether an ELF image runs without a dynamic loader.
+    
+    Args:
+        data: The whole file (bytes or mmap)
+    
+    Returns:
+        True if no program header is PT_INTERP, None if the program
+        headers are missing or out of bounds
+    """
+    if len(data) < 52 or data[:4] != b'\x7fELF':
+        return None
+    endian = '<' if data[5] == 1 else '>'
+    if data[4] == 2:
+        if len(data) < 64:
+            return None
+        phoff = struct.unpack_from(endian + 'Q', data, 32)[0]
+        phentsize, phnum = struct.unpack_from(endian + 'HH', data, 54)
+    else:
+        phoff = struct.unpack_from(endian + 'I', data, 28)[0]
+        phentsize, phnum = struct.unpack_from(endian + 'HH', data, 42)
+    if not phnum or phentsize < 4 or phoff + phnum * phentsize > len(data):
+        return None
+    for i in range(phnum):
+        if struct.unpack_from(endian + 'I', data, phoff + i * phentsize)[0] == PT_INTERP:
+            return False
+    return True
+
+
+def sniff_file(path: str) -> Tuple[str, Optional[str]]:
+    """Detect file type and architecture from the file header only"""
+    try:
+        with open(path, 'rb') as f:
+            return sniff_type(f.read(256), path)
+    except OSError:
+        return 'unknown', None
+
+
+class _Digests:
+    """SHA-256, MD5, SHA-1 and the fuzzy hashes of one byte stream"""
+    
+    def __init__(self):
+        self.hashers = [hashlib.sha256(), hashlib.md5(), hashlib.sha1()]
+        self.fuzzy = ssdeep.Hash() if ssdeep else None
+        self.locality = tlsh.Tlsh() if tlsh else None
+    
+    def update(self, chunk):
+        for h in self.hashers:
+            h.update(chunk)
+        if self.fuzzy:
+            self.fuzzy.update(bytes(chunk))
+        if self.locality:
+            self.locality.update(bytes(chunk))
+    
+    def descriptor(self, path: str, size: int, header: bytes, static: Optional[bool]) -> SampleDescriptor:
+        file_type, arch = sniff_type(header, path)
+        
+        tlsh_digest = None
+        if self.locality:
+            try:
+                self.locality.final()
+                tlsh_digest = self.locality.hexdigest()
+                if tlsh_digest in ('', 'TNULL'):
+                    tlsh_digest = None
+            except ValueError:
+                # Too little data or variation for a TLSH digest
+                pass
+        
+        return SampleDescriptor(
+            path=path, size=size,
+            sha256=self.hashers[0].hexdigest(), md5=self.hashers[1].hexdigest(),
+            sha1=self.hashers[2].hexdigest(),
+            file_type=file_type, arch=arch,
+            ssdeep=self.fuzzy.digest() if self.fuzzy else None,
+            tlsh=tlsh_digest,
+            static=static
+        )
+
+
+@metrics.timed('hash')
+def describe(path: str) -> Optional[SampleDescriptor]:
+    """
+    Build the descriptor of a file with a single read.
+    
+    Args:
+        path: Sample path
+    
+    Returns:
+        SampleDescriptor, or None if the file cannot be read
+    """
+    digests = _Digests()
+    
+    try:
+        with open(path, 'rb') as f:
+            size = os.fstat(f.fileno()).st_size
+            static = None
+            if size == 0:
+                header = b''
+            else:
+                with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as mm:
+                    header = mm[:256]
+                    with memoryview(mm) as view:
+                        for offset in range(0, size, HASH_CHUNK):
+                            with view[offset:offset + HASH_CHUNK] as chunk:
+                                digests.update(chunk)
+                    if header[:4] == b'\x7fELF':
+                        static = elf_is_static(mm)
+    except (OSError, ValueError):
+        return None
+    
+    return digests.descriptor(path, size, header, static)
+
+
+class SampleStream:
+    """
+    describe() for a file that is still arriving.
+    
+    Feed the chunks in order with update(); descriptor() then gives the
+    same hashes and type as describe() on the finished file without
+    reading it back. The static-linking check looks at the program
+    headers within the first PREFIX_SIZE bytes (where linkers put them).
+    """
+    
+    PREFIX_SIZE = 64 * 1024
+    
+    def __init__(self):
+        self._digests = _Digests()
+        self._prefix = bytearray()
+        self.size = 0
+    
+    @property
+    def header(self) -> bytes:
+        """First bytes received so far (enough to sniff once 256 have arrived)"""
+        return bytes(self._prefix[:256])
+    
+    def update(self, chunk: bytes):
+        self._digests.update(chunk)
+        if len(self._prefix) < self.PREFIX_SIZE:
+            self._prefix += chunk[:self.PREFIX_SIZE - len(self._prefix)]
+        self.size += len(chunk)
+    
+    def descriptor(self, path: str) -> SampleDescriptor:
+        """Descriptor of the complete stream, stored at path"""
+        static = elf_is_static(self._prefix) if self._prefix[:4] == b'\x7fELF' else None
+        return self._digests.descriptor(path, self.size, self.header, static)
@@ -0,0 +1,496 @@
+#!/usr/bin/env python3
+"""
+Similarity Index - nearest known samples for near-duplicate reuse
+
+Only identical files used to find an earlier analysis; a recompiled or
+repacked variant of a known family still got a full VM run. Every
+analyzed sample is now also indexed by what survives such changes:
+
+- ELF import hash (sorted undefined dynamic symbols) and the hashes of
+  its larger sections, each an exact-match bucket
+- a MinHash signature over its features (imports, section hashes and
+  printable strings for binaries, word shingles for scripts), split
+  into LSH bands so that samples with a high Jaccard similarity share
+  at least one band bucket
+- TLSH and ssdeep digests when the modules are installed, used to score
+  the candidates more precisely
+
+Candidates are scored by the Jaccard similarity of their stored feature
+sets, leaving out features found in more than COMMON_FEATURE_SHARE of
+the indexed samples. Most strings of a static binary come from the
+linked libc, so without this any two static binaries look alike; the
+per-feature sample counts are kept in similarity_df. Strings alone are
+still weak evidence: Neighbor.structural tells whether the match is
+backed by the same import hash or an identical section.
+
+The tables live next to `analyses` in the analysis database. A lookup
+only reads the buckets of its own sample (one indexed query) and scores
+the few candidates it finds, so it takes milliseconds at any index size.
+DynamicAnalyzer uses it as a fast path: a sample close enough to a
+VM-confirmed one inherits its verdict instead of booting a VM.
+
+Usage:
+    python3 similarity.py sample.bin [--db logs/dynamic_analysis.db]   # nearest known samples
+    python3 similarity.py --backfill                                    # index stored analyses
+"""
+
+import os
+import re
+import sys
+import mmap
+import json
+import random
+import struct
+import sqlite3
+import hashlib
+import argparse
+import threading
+from dataclasses import dataclass, asdict, field
+from typing import Dict, List, Optional, Set, Tuple
+
+import bytescan
+from sample import SampleDescriptor, describe
+
+try:
+    import ssdeep
+except ImportError:
+    ssdeep = None
+
+try:
+    import tlsh
+except ImportError:
+    tlsh = None
+
+# MinHash signature: NUM_PERM values in BANDS bands of ROWS rows; two
+# samples of Jaccard similarity s share a band with 1 - (1 - s^ROWS)^BANDS
+# (0.5 -> 64%, 0.7 -> 99%)
+NUM_PERM = 64
+BANDS = 16
+ROWS = NUM_PERM // BANDS
+
+# Features per sample: a consistent (bottom-k by hash) subset beyond this
+MAX_FEATURES = 1024
+# Features in more than this share of the indexed samples do not count
+# (libc and toolchain strings, runtime sections) ...
+COMMON_FEATURE_SHARE = 0.1
+# ... once there are enough samples to tell
+COMMON_FEATURE_MIN_SAMPLES = 20
+# Smaller import sets are shared by unrelated programs: no import hash
+MIN_IMPHASH_IMPORTS = 8
+# Bytes of a sample the features are extracted from
+MAX_SCAN_BYTES = 16 * 1024 * 1024
+# Sections below this size (.interp, notes, ...) are the same across unrelated binaries
+MIN_SECTION_BYTES = 512
+MIN_STRING_LEN = 6
+
+# Candidates scored per lookup, by number of shared buckets
+MAX_CANDIDATES = 200
+# TLSH distance mapped to similarity 0 (0 = identical)
+TLSH_SCALE = 200.0
+
+_MERSENNE = (1 << 61) - 1
+_rng = random.Random(0x51A7)
+PERMUTATIONS = [(_rng.randrange(1, _MERSENNE), _rng.randrange(0, _MERSENNE)) for _ in range(NUM_PERM)]
+
+SHT_DYNSYM = 11
+WORD_RE = re.compile(rb'[A-Za-z_][A-Za-z0-9_.]{2,}')
+
+
+@dataclass
+class Features:
+    """What a sample is indexed and compared by"""
+    file_hash: str
+    file_type: str
+    signature: Optional[List[int]] = None
+    imphash: Optional[str] = None
+    sections: List[str] = field(default_factory=list)
+    tlsh: Optional[str] = None
+    ssdeep: Optional[str] = None
+    # Feature hashes, sorted (the MAX_FEATURES lowest)
+    tokens: List[int] = field(default_factory=list)
+    
+    def set_tokens(self, tokens: Set[bytes]):
+        """Take a feature set: its hashes and MinHash signature"""
+        self.tokens = sorted({_token_hash(t) for t in tokens})[:MAX_FEATURES]
+        self.signature = minhash(self.tokens)
+    
+    def buckets(self) -> List[str]:
+        keys = []
+        if self.signature:
+            for band in range(BANDS):
+                rows = self.signature[band * ROWS:(band + 1) * ROWS]
+                keys.append(f"lsh{band}:{self.file_type}:{struct.pack(f'<{ROWS}I', *rows).hex()}")
+        if self.imphash:
+            keys.append(f"imp:{self.imphash}")
+        keys.extend(f"sec:{s}" for s in self.sections)
+        return keys
+
+
+@dataclass
+class Neighbor:
+    """A known sample similar to a query"""
+    file_hash: str
+    similarity: float
+    method: str
+    file_type: str
+    verdict: str
+    threat_score: int
+    # Verdict came from a successful VM run (not itself inherited)
+    confirmed: bool
+    # Same import hash or an identical (not common) section as the query
+    structural: bool = False
+    
+    def to_dict(self) -> Dict:
+        return asdict(self)
+
+
+def _token_hash(token: bytes) -> int:
+    # 63 bits: stored as a (signed) sqlite INTEGER
+    return int.from_bytes(hashlib.blake2b(token, digest_size=8).digest(), 'little') >> 1
+
+
+def section_token(key: str) -> int:
+    return _token_hash(b'sec:' + key.encode())
+
+
+def minhash(hashes: List[int]) -> Optional[List[int]]:
+    """MinHash signature of a set of feature hashes (None when empty)"""
+    if not hashes:
+        return None
+    return [min((a * h + b) % _MERSENNE for h in hashes) & 0xffffffff for a, b in PERMUTATIONS]
+
+
+def elf_structure(data) -> Tuple[List[Tuple[str, bytes]], List[str]]:
+    """
+    Sections and imports of an ELF image.
+    
+    Args:
+        data: The file (bytes or mmap)
+    
+    Returns:
+        ([(section name, content)], [imported symbol names]); empty lists
+        when the section headers are missing or out of bounds
+    """
+    if len(data) < 52 or data[:4] != b'\x7fELF':
+        return [], []
+    endian = '<' if data[5] == 1 else '>'
+    is64 = data[4] == 2
+    try:
+        if is64:
+            shoff = struct.unpack_from(endian + 'Q', data, 40)[0]
+            shentsize, shnum, shstrndx = struct.unpack_from(endian + 'HHH', data, 58)
+            fmt, sym_size = endian + 'IIQQQQIIQQ', 24
+        else:
+            shoff = struct.unpack_from(endian + 'I', data, 32)[0]
+            shentsize, shnum, shstrndx = struct.unpack_from(endian + 'HHH', data, 46)
+            fmt, sym_size = endian + 'IIIIIIIIII', 16
+        if not shnum or shoff + shnum * shentsize > len(data) or shentsize < struct.calcsize(fmt):
+            return [], []
+        headers = [struct.unpack_from(fmt, data, shoff + i * shentsize) for i in range(shnum)]
+        # name, type, flags, addr, offset, size, link, ...
+        names_hdr = headers[shstrndx] if shstrndx < shnum else None
+        
+        def content(h) -> bytes:
+            offset, size = h[4], h[5]
+            return bytes(data[offset:offset + size]) if h[1] != 8 and offset + size <= len(data) else b''
+        
+        names = content(names_hdr) if names_hdr else b''
+        
+        def cstr(table: bytes, index: int) -> str:
+            end = table.find(b'\0', index)
+            return table[index:end if end >= 0 else len(table)].decode('latin-1')
+        
+        sections = [(cstr(names, h[0]), content(h)) for h in headers[1:]]
+        imports = []
+        for h in headers:
+            if h[1] != SHT_DYNSYM or h[6] >= shnum:
+                continue
+            symbols, strtab = content(h), content(headers[h[6]])
+            for off in range(sym_size, len(symbols) - sym_size + 1, sym_size):
+                name = struct.unpack_from(endian + 'I', symbols, off)[0]
+                # st_shndx 0: undefined, resolved from a library
+                shndx = struct.unpack_from(endian + 'H', symbols, off + (6 if is64 else 14))[0]
+                if shndx == 0 and name:
+                    imports.append(cstr(strtab, name))
+        return sections, imports
+    except (struct.error, IndexError):
+        return [], []
+
+
+def extract_features(path: str, sample: Optional[SampleDescriptor] = None) -> Optional[Features]:
+    """
+    Features of a sample file.
+    
+    Args:
+        path: Sample path
+        sample: Its descriptor (built here if not given)
+    
+    Returns:
+        Features, or None if the file cannot be read
+    """
+    sample = sample or describe(path)
+    if not sample:
+        return None
+    tokens: Set[bytes] = set()
+    features = Features(sample.sha256, sample.file_type, tlsh=sample.tlsh, ssdeep=sample.ssdeep)
+    try:
+        with open(path, 'rb') as f:
+            if sample.size == 0:
+                return features
+            with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as mm:
+                data = mm[:MAX_SCAN_BYTES]
+    except (OSError, ValueError):
+        return None
+    
+    if sample.is_script:
+        words = WORD_RE.findall(data)
+        tokens.update(b'sh:' + b' '.join(words[i:i + 3]) for i in range(max(1, len(words) - 2)))
+    else:
+        if sample.is_elf:
+            sections, imports = elf_structure(data)
+            names = sorted({i.lower() for i in imports})
+            if len(names) >= MIN_IMPHASH_IMPORTS:
+                features.imphash = hashlib.md5(','.join(names).encode()).hexdigest()
+            tokens.update(b'imp:' + i.encode() for i in imports)
+            for name, body in sections:
+                if len(body) >= MIN_SECTION_BYTES:
+                    key = f"{name}:{hashlib.sha1(body).hexdigest()[:16]}"
+                    features.sections.append(key)
+                    tokens.add(b'sec:' + key.encode())
+        tokens.update(b'str:' + s for s in bytescan.strings(data, MIN_STRING_LEN).split(b'\n') if s)
+    features.set_tokens(tokens)
+    return features
+
+
+def jaccard(a: List[int], b: List[int], common: Set[int] = frozenset()) -> Optional[float]:
+    """
+    Jaccard similarity of two bottom-k feature sets without the common features.
+    
+    Only hashes below the cut-off of both sets are compared, where both
+    are complete. None when nothing is left to compare.
+    """
+    limit = min(a[-1] if len(a) >= MAX_FEATURES else float('inf'),
+                b[-1] if len(b) >= MAX_FEATURES else float('inf'))
+    sa = {h for h in a if h <= limit and h not in common}
+    sb = {h for h in b if h <= limit and h not in common}
+    if not sa or not sb:
+        return None
+    return len(sa & sb) / len(sa | sb)
+
+
+def similarity(a: Features, b: Features, common: Set[int] = frozenset()) -> Tuple[float, str]:
+    """Best similarity estimate of two samples and the measure it came from"""
+    scores = []
+    if a.tokens and b.tokens:
+        score = jaccard(a.tokens, b.tokens, common)
+        if score is not None:
+            scores.append((score, 'features'))
+    elif a.signature and b.signature:
+        scores.append((sum(x == y for x, y in zip(a.signature, b.signature)) / NUM_PERM, 'minhash'))
+    if tlsh and a.tlsh and b.tlsh:
+        try:
+            scores.append((max(0.0, 1 - tlsh.diff(a.tlsh, b.tlsh) / TLSH_SCALE), 'tlsh'))
+        except (ValueError, TypeError):
+            pass
+    if ssdeep and a.ssdeep and b.ssdeep:
+        try:
+            scores.append((ssdeep.compare(a.ssdeep, b.ssdeep) / 100.0, 'ssdeep'))
+        except Exception:
+            pass
+    if not scores and a.imphash and a.imphash == b.imphash:
+        scores.append((0.5, 'imphash'))
+    return max(scores) if scores else (0.0, 'none')
+
+
+class SimilarityIndex:
+    """
+    Near-duplicate index in the analysis database.
+    
+    add() records a sample with its verdict; nearest() returns the known
+    samples most similar to a query, best first.
+    """
+    
+    def __init__(self, db_path: str = "logs/dynamic_analysis.db"):
+        self.db_path = db_path
+        os.makedirs(os.path.dirname(db_path) or '.', exist_ok=True)
+        self._conn = sqlite3.connect(db_path, check_same_thread=False)
+        self._conn.row_factory = sqlite3.Row
+        self._lock = threading.Lock()
+        self._conn.execute("PRAGMA journal_mode=WAL")
+        self._conn.execute("PRAGMA synchronous=NORMAL")
+        with self._conn:
+            self._conn.execute("""
+                CREATE TABLE IF NOT EXISTS similarity (
+                    file_hash TEXT PRIMARY KEY,
+                    file_type TEXT,
+                    signature BLOB,
+                    imphash TEXT,
+                    sections TEXT,
+                    tlsh TEXT,
+                    ssdeep TEXT,
+                    verdict TEXT,
+                    threat_score INTEGER,
+                    confirmed INTEGER,
+                    tokens BLOB,
+                    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+                )
+            """)
+            columns = {row['name'] for row in self._conn.execute("PRAGMA table_info(similarity)")}
+            if 'tokens' not in columns:
+                self._conn.execute("ALTER TABLE similarity ADD COLUMN tokens BLOB")
+            self._conn.execute("""
+                CREATE TABLE IF NOT EXISTS similarity_buckets (
+                    bucket TEXT NOT NULL,
+                    file_hash TEXT NOT NULL,
+                    PRIMARY KEY (bucket, file_hash)
+                ) WITHOUT ROWID
+            """)
+            # Indexed samples per feature
+            self._conn.execute("""
+                CREATE TABLE IF NOT EXISTS similarity_df (
+                    token INTEGER PRIMARY KEY,
+                    samples INTEGER NOT NULL
+                )
+            """)
+            self._conn.execute(
+                "CREATE INDEX IF NOT EXISTS idx_similarity_df_samples ON similarity_df (samples)")
+    
+    def close(self):
+        with self._lock:
+            self._conn.close()
+    
+    def __len__(self) -> int:
+        with self._lock:
+            return self._conn.execute("SELECT COUNT(*) FROM similarity").fetchone()[0]
+    
+    @staticmethod
+    def _unpack_tokens(blob: Optional[bytes]) -> List[int]:
+        return list(struct.unpack(f'<{len(blob) // 8}q', blob)) if blob else []
+    
+    def add(self, features: Features, verdict: str, threat_score: int, confirmed: bool):
+        """Index a sample (replaces an earlier entry of the same hash)"""
+        signature = struct.pack(f'<{NUM_PERM}I', *features.signature) if features.signature else None
+        tokens = struct.pack(f'<{len(features.tokens)}q', *features.tokens)
+        with self._lock, self._conn:
+            old = self._conn.execute("SELECT tokens FROM similarity WHERE file_hash=?",
+                                     (features.file_hash,)).fetchone()
+            if old:
+                self._conn.executemany("UPDATE similarity_df SET samples = samples - 1 WHERE token=?",
+                                       [(t,) for t in self._unpack_tokens(old['tokens'])])
+            self._conn.executemany(
+                """INSERT INTO similarity_df (token, samples) VALUES (?, 1)
+                   ON CONFLICT (token) DO UPDATE SET samples = samples + 1""",
+                [(t,) for t in features.tokens])
+            self._conn.execute("DELETE FROM similarity_buckets WHERE file_hash=?", (features.file_hash,))
+            self._conn.execute(
+                """INSERT OR REPLACE INTO similarity
+                   (file_hash, file_type, signature, imphash, sections, tlsh, ssdeep,
+                    verdict, threat_score, confirmed, tokens)
+                   VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)""",
+                (features.file_hash, features.file_type, signature, features.imphash,
+                 json.dumps(features.sections), features.tlsh, features.ssdeep,
+                 verdict, threat_score, int(confirmed), tokens))
+            self._conn.executemany(
+                "INSERT OR IGNORE INTO similarity_buckets (bucket, file_hash) VALUES (?, ?)",
+                [(b, features.file_hash) for b in features.buckets()])
+    
+    def _common(self) -> Set[int]:
+        # Caller holds the lock
+        total = self._conn.execute("SELECT COUNT(*) FROM similarity").fetchone()[0]
+        if total < COMMON_FEATURE_MIN_SAMPLES:
+            return set()
+        rows = self._conn.execute("SELECT token FROM similarity_df WHERE samples > ?",
+                                  (total * COMMON_FEATURE_SHARE,))
+        return {row[0] for row in rows}
+    
+    def common_features(self) -> Set[int]:
+        """Hashes of the features too widespread to count"""
+        with self._lock:
+            return self._common()
+    
+    def nearest(self, features: Features, limit: int = 5, min_similarity: float = 0.5) -> List[Neighbor]:
+        """Known samples at least min_similarity close to features, best first"""
+        buckets = features.buckets()
+        if not buckets:
+            return []
+        with self._lock:
+            rows = self._conn.execute(
+                f"""SELECT s.* FROM similarity s JOIN (
+                        SELECT file_hash, COUNT(*) AS shared FROM similarity_buckets
+                        WHERE bucket IN ({','.join('?' * len(buckets))}) AND file_hash != ?
+                        GROUP BY file_hash ORDER BY shared DESC LIMIT ?
+                    ) c ON s.file_hash = c.file_hash""",
+                (*buckets, features.file_hash, MAX_CANDIDATES)).fetchall()
+            common = self._common() if rows else set()
+        sections = {s for s in features.sections if section_token(s) not in common}
+        neighbors = []
+        for row in rows:
+            known = Features(
+                row['file_hash'], row['file_type'],
+                signature=list(struct.unpack(f'<{NUM_PERM}I', row['signature'])) if row['signature'] else None,
+                imphash=row['imphash'], tlsh=row['tlsh'], ssdeep=row['ssdeep'],
+                sections=json.loads(row['sections'] or '[]'), tokens=self._unpack_tokens(row['tokens']))
+            score, method = similarity(features, known, common)
+            if score >= min_similarity:
+                structural = bool(features.imphash and features.imphash == known.imphash
+                                  or sections.intersection(known.sections))
+                neighbors.append(Neighbor(row['file_hash'], round(score, 3), method, row['file_type'],
+                                          row['verdict'], row['threat_score'], bool(row['confirmed']),
+                                          structural))
+        neighbors.sort(key=lambda n: (-n.similarity, not n.confirmed))
+        return neighbors[:limit]
+
+
+def backfill(db_path: str) -> int:
+    """Index the latest analysis of every stored sample whose file is still on disk"""
+    from dynamic import AnalysisDB
+    db = AnalysisDB(db_path)
+    index = SimilarityIndex(db_path)
+    added = 0
+    try:
+        for row in db.latest():
+            raw = db.get_raw(row['id']) or {}
+            path = raw.get('path')
+            if not path or not os.path.exists(path):
+                continue
+            features = extract_features(path)
+            if features and features.file_hash == row['file_hash']:
+                index.add(features, row['verdict'], row['threat_score'], bool(raw.get('sandbox_ok')))
+                added += 1
+    finally:
+        index.close()
+        db.close()
+    return added
+
+
+def main(argv: Optional[List[str]] = None) -> int:
+    parser = argparse.ArgumentParser(description="Nearest known samples by fuzzy and structural hashes")
+    parser.add_argument('files', nargs='*')
+    parser.add_argument('--db', default='logs/dynamic_analysis.db')
+    parser.add_argument('--limit', type=int, default=5)
+    parser.add_argument('--min-similarity', type=float, default=0.5)
+    parser.add_argument('--backfill', action='store_true', help="Index the stored analyses first")
+    args = parser.parse_args(argv)
+    
+    if args.backfill:
+        print(f"Indexed {backfill(args.db)} samples")
+    index = SimilarityIndex(args.db)
+    try:
+        for path in args.files:
+            features = extract_features(path)
+            if not features:
+                print(f"{path}: unreadable")
+                continue
+            neighbors = index.nearest(features, args.limit, args.min_similarity)
+            print(f"{path}: {len(neighbors)} similar")
+            for n in neighbors:
+                print(f"  {n.similarity:.2f} {n.method:8} {n.verdict:10} {n.threat_score:3} "
+                      f"{'confirmed' if n.confirmed else 'inherited'} "
+                      f"{'structural' if n.structural else 'strings'} {n.file_hash}")
+    finally:
+        index.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,5 +1,6 @@
-import os, re, hashlib, subprocess
-from typing import Dict, List, Optional
+import os, re, json, time, socket, struct, sqlite3, subprocess, threading
+from collections import deque
+from typing import Callable, Dict, List, Optional
 
 try:
     import requests
@@ -12,6 +13,9 @@ except ImportError:
     yaml = None
 
 from dynamic import YaraScanner, YaraMatch
+from sample import SampleDescriptor, describe
+from result_cache import ResultCache, fingerprint
+import metrics
 
 SUSPICIOUS_IMPORTS = {
     'python': ['subprocess', 'socket', 'ctypes', 'requests', 'urllib', 'paramiko',
@@ -21,23 +25,242 @@ SUSPICIOUS_IMPORTS = {
                    'vm', 'cluster', 'dns', 'tls', 'puppeteer', 'selenium-webdriver']
 }
 
+# One alternation per language so a file is scanned once (longest names first)
+IMPORT_RES = {
+    lang: re.compile(r'\b(' + '|'.join(sorted(map(re.escape, imps), key=len, reverse=True)) + r')\b')
+    for lang, imps in SUSPICIOUS_IMPORTS.items()
+}
+
 EXT_LANG = {'.py': 'python', '.pyw': 'python', '.js': 'javascript', '.mjs': 'javascript'}
 
 
+class ClamdError(Exception):
+    pass
+
+
+class ClamdClient:
+    """clamd protocol client with a pool of IDSESSION connections.
+
+    Files are passed as descriptors (FILDES) over the unix socket so clamd
+    reads them directly; over TCP, or when FILDES is refused, the content
+    is sent with INSTREAM.
+    """
+    CHUNK = 64 * 1024
+
+    def __init__(self, unix_socket: Optional[str] = None, host: Optional[str] = None,
+                 port: int = 3310, timeout: float = 30, pool_size: int = 4):
+        self.unix_socket = unix_socket
+        self.host = host
+        self.port = port
+        self.timeout = timeout
+        self.pool_size = pool_size
+        self._idle: List[socket.socket] = []
+        self._buffers: Dict[int, bytes] = {}
+        self._lock = threading.Lock()
+        self._fildes = True
+
+    @property
+    def local(self) -> bool:
+        """Talking over the unix socket (the TCP address is only used without it)"""
+        return bool(self.unix_socket) and os.path.exists(self.unix_socket)
+
+    def _connect(self) -> socket.socket:
+        try:
+            if self.local:
+                sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                try:
+                    sock.settimeout(self.timeout)
+                    sock.connect(self.unix_socket)
+                except OSError:
+                    sock.close()
+                    raise
+                return sock
+            if self.host:
+                return socket.create_connection((self.host, self.port), timeout=self.timeout)
+        except OSError as e:
+            raise ClamdError(f"clamd unreachable: {e}")
+        raise ClamdError("clamd not configured")
+
+    def _session(self) -> socket.socket:
+        with self._lock:
+            if self._idle:
+                return self._idle.pop()
+        sock = self._connect()
+        sock.sendall(b'zIDSESSION\0')
+        return sock
+
+    def _release(self, sock: socket.socket):
+        with self._lock:
+            if len(self._idle) < self.pool_size:
+                self._idle.append(sock)
+                return
+        self._close(sock)
+
+    def _discard(self, sock: socket.socket):
+        self._buffers.pop(sock.fileno(), None)
+        sock.close()
+
+    def _close(self, sock: socket.socket):
+        try:
+            sock.sendall(b'zEND\0')
+        except OSError:
+            pass
+        self._discard(sock)
+
+    def close(self):
+        with self._lock:
+            idle, self._idle = self._idle, []
+        for sock in idle:
+            self._close(sock)
+
+    def _reply(self, sock: socket.socket) -> str:
+        buf = self._buffers.pop(sock.fileno(), b'')
+        while b'\0' not in buf:
+            chunk = sock.recv(4096)
+            if not chunk:
+                raise ConnectionError("clamd closed the session")
+            buf += chunk
+        reply, rest = buf.split(b'\0', 1)
+        if rest:
+            self._buffers[sock.fileno()] = rest
+        # Session replies are "<id>: <target>: <result>"
+        return reply.decode('utf-8', 'replace').split(': ', 1)[-1]
+
+    def _call(self, send) -> str:
+        """Run one session command; a stale pooled session is retried once on a new one"""
+        for attempt in range(2):
+            sock = self._session()
+            try:
+                send(sock)
+                reply = self._reply(sock)
+            except OSError as e:
+                self._discard(sock)
+                if attempt:
+                    raise ClamdError(str(e))
+                continue
+            if reply.endswith('ERROR') or reply == 'UNKNOWN COMMAND':
+                # clamd may end the session after an error
+                self._close(sock)
+            else:
+                self._release(sock)
+            return reply
+
+    def ping(self) -> bool:
+        try:
+            return self._call(lambda sock: sock.sendall(b'zPING\0')) == 'PONG'
+        except ClamdError:
+            return False
+
+    @staticmethod
+    def _parse(reply: str) -> Dict:
+        # "stream: OK", "fd[7]: Eicar-Signature FOUND", "... ERROR"
+        result = reply.rsplit(': ', 1)[-1]
+        if result.endswith(' FOUND'):
+            return {"infected": True, "signature": result[:-len(' FOUND')]}
+        if result == 'OK':
+            return {"infected": False, "signature": None}
+        raise ClamdError(reply)
+
+    def scan_stream(self, chunks) -> Dict:
+        """INSTREAM scan of an iterable of byte chunks"""
+        chunks = iter(chunks)
+
+        def send(sock):
+            sock.sendall(b'zINSTREAM\0')
+            for chunk in chunks:
+                for i in range(0, len(chunk), self.CHUNK):
+                    part = chunk[i:i + self.CHUNK]
+                    sock.sendall(struct.pack('>I', len(part)) + part)
+            sock.sendall(b'\0\0\0\0')
+        # A half-sent stream cannot be replayed, so no retry on a new session
+        sock = self._session()
+        try:
+            send(sock)
+            reply = self._reply(sock)
+        except OSError as e:
+            self._discard(sock)
+            raise ClamdError(str(e))
+        self._release(sock)
+        return self._parse(reply)
+
+    def scan_file(self, path: str) -> Dict:
+        if self._fildes and self.local:
+            with open(path, 'rb') as f:
+                def send(sock):
+                    sock.sendall(b'zFILDES\0')
+                    socket.send_fds(sock, [b'\0'], [f.fileno()])
+                reply = self._call(send)
+            try:
+                return self._parse(reply)
+            except ClamdError:
+                # clamd without fd passing, or it could not scan the descriptor: stream instead
+                if 'UNKNOWN COMMAND' in reply:
+                    self._fildes = False
+
+        def read_chunks():
+            with open(path, 'rb') as f:
+                for chunk in iter(lambda: f.read(self.CHUNK), b''):
+                    yield chunk
+        return self.scan_stream(read_chunks())
+
+
 class ClamAVScanner:
-    def __init__(self, bin_path: str = "clamscan"):
+    """ClamAV through clamd when the daemon answers, else one clamscan per file.
+
+    The daemon is not picked once: while it is down (e.g. still loading its
+    signature DB at boot) it is pinged again at most every REPROBE_SECONDS,
+    and it is used as soon as it answers.
+    """
+    REPROBE_SECONDS = 30
+
+    def __init__(self, bin_path: str = "clamscan", unix_socket: Optional[str] = None,
+                 host: Optional[str] = None, port: int = 3310):
         self.bin = bin_path
+        self._client = ClamdClient(unix_socket, host, port) if unix_socket or host else None
+        self._up = False
+        self._probed = 0.0
+        self._probe_lock = threading.Lock()
+        if self._client is not None:
+            self._probe()
         try:
-            self._available = subprocess.run(['which', bin_path], capture_output=True, timeout=5).returncode == 0
+            self._has_bin = subprocess.run(['which', bin_path], capture_output=True, timeout=5).returncode == 0
         except:
-            self._available = False
+            self._has_bin = False
+
+    def _probe(self) -> bool:
+        with self._probe_lock:
+            self._probed = time.monotonic()
+            self._up = self._client.ping()
+            return self._up
+
+    @property
+    def clamd(self) -> Optional[ClamdClient]:
+        """The daemon client while clamd answers (None: use clamscan)"""
+        if self._client is None:
+            return None
+        if not self._up and time.monotonic() - self._probed >= self.REPROBE_SECONDS:
+            self._probe()
+        return self._client if self._up else None
 
     @property
     def available(self) -> bool:
-        return self._available
+        return self._has_bin or self.clamd is not None
+
+    @property
+    def engine(self) -> str:
+        return "clamd" if self.clamd else "clamscan" if self._has_bin else "none"
 
+    @metrics.timed('clamav')
     def scan(self, path: str) -> Dict:
-        if not self._available:
+        clamd = self.clamd
+        if clamd:
+            try:
+                return clamd.scan_file(path)
+            except (ClamdError, OSError):
+                # Daemon went away or rejected the file: one-off clamscan below;
+                # if it went away, clamscan is used until a re-probe succeeds
+                self._probe()
+        if not self._has_bin:
             return {"infected": False, "signature": None}
         try:
             r = subprocess.run([self.bin, '--no-summary', path], capture_output=True, text=True, timeout=60)
@@ -53,33 +276,197 @@ class ClamAVScanner:
             return {"infected": False, "signature": None}
 
 
+class TokenBucket:
+    """Allows `rate` acquisitions per `per` seconds, with bursts up to `rate`"""
+
+    def __init__(self, rate: float, per: float = 60.0):
+        self.capacity = float(rate)
+        self.tokens = float(rate)
+        self.fill_rate = rate / per
+        self._stamp = time.monotonic()
+        self._resume_at = 0.0
+        self._cond = threading.Condition()
+
+    def _refill(self, now: float):
+        if now >= self._resume_at:
+            self.tokens = min(self.capacity, self.tokens + (now - max(self._stamp, self._resume_at)) * self.fill_rate)
+        self._stamp = now
+
+    def acquire(self, timeout: Optional[float] = None) -> bool:
+        deadline = None if timeout is None else time.monotonic() + timeout
+        with self._cond:
+            while True:
+                now = time.monotonic()
+                self._refill(now)
+                if now >= self._resume_at and self.tokens >= 1:
+                    self.tokens -= 1
+                    return True
+                wait = self._resume_at - now if now < self._resume_at else (1 - self.tokens) / self.fill_rate
+                if deadline is not None:
+                    if now >= deadline:
+                        return False
+                    wait = min(wait, deadline - now)
+                self._cond.wait(wait)
+
+    def pause(self, seconds: float):
+        """Server said slow down: no tokens until `seconds` from now"""
+        with self._cond:
+            now = time.monotonic()
+            self.tokens = 0.0
+            self._resume_at = max(self._resume_at, now + seconds)
+            self._stamp = now
+
+
 class VirusTotalChecker:
+    """Hash lookups against VirusTotal within the API quota.
+
+    Lookups go through one worker thread that takes a token from the
+    per-minute and per-day buckets for each request. Results are kept in
+    a sqlite cache with a TTL (shorter for unknown hashes), and requests
+    for a hash that is already queued or in flight share one API call.
+    """
     API_URL = "https://www.virustotal.com/api/v3/files/{hash}"
+    NOT_FOUND = {"found": False, "malicious": 0}
+    RETRY_AFTER = 60
 
-    def __init__(self, api_key: Optional[str] = None, timeout: int = 25):
+    def __init__(self, api_key: Optional[str] = None, timeout: int = 25, rate_per_min: float = 4,
+                 daily_limit: int = 500, cache_path: Optional[str] = "logs/vt_cache.db",
+                 ttl: float = 86400, negative_ttl: float = 3600, wait_timeout: float = 60):
         self.api_key = api_key or os.environ.get('VIRUSTOTAL_API_KEY', '')
         self.timeout = timeout
+        self.ttl = ttl
+        self.negative_ttl = negative_ttl
+        self.wait_timeout = wait_timeout
+        self._minute = TokenBucket(rate_per_min, 60)
+        self._day = TokenBucket(daily_limit, 86400)
+        self._pending: Dict[str, List[Callable[[Dict], None]]] = {}
+        self._queue = deque()
+        self._cond = threading.Condition()
+        self._worker = None
+        self._db = None
+        self._db_lock = threading.Lock()
+        if cache_path:
+            try:
+                os.makedirs(os.path.dirname(cache_path) or '.', exist_ok=True)
+                self._db = sqlite3.connect(cache_path, check_same_thread=False)
+                self._db.execute("CREATE TABLE IF NOT EXISTS vt_cache "
+                                 "(hash TEXT PRIMARY KEY, result TEXT, expires REAL)")
+                self._db.commit()
+            except sqlite3.Error:
+                self._db = None
 
     @property
     def available(self) -> bool:
         return bool(self.api_key) and requests is not None
 
-    def check_hash(self, file_hash: str) -> Dict:
+    def cached(self, file_hash: str) -> Optional[Dict]:
+        if not self._db:
+            return None
+        with self._db_lock:
+            row = self._db.execute("SELECT result, expires FROM vt_cache WHERE hash = ?",
+                                   (file_hash.lower(),)).fetchone()
+        if row and row[1] > time.time():
+            return json.loads(row[0])
+        return None
+
+    def _store(self, file_hash: str, result: Dict):
+        if not self._db:
+            return
+        ttl = self.ttl if result.get("found") else self.negative_ttl
+        with self._db_lock:
+            self._db.execute("INSERT OR REPLACE INTO vt_cache VALUES (?, ?, ?)",
+                             (file_hash.lower(), json.dumps(result), time.time() + ttl))
+            self._db.commit()
+
+    def lookup(self, file_hash: str, callback: Optional[Callable[[Dict], None]] = None) -> Optional[Dict]:
+        """Return the verdict if known now; otherwise queue it and call callback(result) later"""
         if not self.available or len(file_hash) < 32:
-            return {"found": False, "malicious": 0}
+            result = dict(self.NOT_FOUND)
+        else:
+            result = self.cached(file_hash)
+        if result is not None:
+            if callback:
+                callback(result)
+            return result
+
+        file_hash = file_hash.lower()
+        with self._cond:
+            if file_hash not in self._pending:
+                self._pending[file_hash] = []
+                self._queue.append(file_hash)
+            if callback:
+                self._pending[file_hash].append(callback)
+            if not self._worker or not self._worker.is_alive():
+                self._worker = threading.Thread(target=self._run, daemon=True, name="vt-lookup")
+                self._worker.start()
+            self._cond.notify()
+        return None
+
+    def check_hash(self, file_hash: str, timeout: Optional[float] = None) -> Dict:
+        """Blocking lookup: waits for quota up to timeout (wait_timeout if None).
+
+        On expiry the lookup stays queued and a "pending" result is returned,
+        as run(wait_vt=False) does.
+        """
+        done = threading.Event()
+        box = {}
+
+        def deliver(result):
+            box.update(result)
+            done.set()
+        self.lookup(file_hash, deliver)
+        if not done.wait(self.wait_timeout if timeout is None else timeout):
+            return {"found": False, "malicious": 0, "pending": True}
+        return box
+
+    def _run(self):
+        while True:
+            with self._cond:
+                while not self._queue:
+                    if not self._cond.wait(300):
+                        self._worker = None
+                        return
+                file_hash = self._queue[0]
+            # Wait for quota before taking the hash off the queue; duplicates still coalesce meanwhile
+            self._minute.acquire()
+            self._day.acquire()
+            result = self._fetch(file_hash)
+            with self._cond:
+                if result is None:
+                    # Rate limited: keep it first in line
+                    continue
+                self._queue.popleft()
+                callbacks = self._pending.pop(file_hash, [])
+            for callback in callbacks:
+                try:
+                    callback(result)
+                except Exception:
+                    pass
+
+    @metrics.timed('virustotal')
+    def _fetch(self, file_hash: str) -> Optional[Dict]:
         try:
             r = requests.get(self.API_URL.format(hash=file_hash),
-                           headers={"x-apikey": self.api_key}, timeout=self.timeout)
-            if r.status_code == 200:
-                stats = r.json().get("data", {}).get("attributes", {}).get("last_analysis_stats", {})
-                return {"found": True, "malicious": stats.get("malicious", 0),
-                        "suspicious": stats.get("suspicious", 0)}
-            return {"found": False, "malicious": 0}
-        except:
-            return {"found": False, "malicious": 0}
+                             headers={"x-apikey": self.api_key}, timeout=self.timeout)
+        except Exception as e:
+            return {"found": False, "malicious": 0, "error": str(e)}
+        if r.status_code == 200:
+            stats = r.json().get("data", {}).get("attributes", {}).get("last_analysis_stats", {})
+            result = {"found": True, "malicious": stats.get("malicious", 0),
+                      "suspicious": stats.get("suspicious", 0)}
+        elif r.status_code == 404:
+            result = dict(self.NOT_FOUND)
+        elif r.status_code == 429:
+            self._minute.pause(self.RETRY_AFTER)
+            return None
+        else:
+            return {"found": False, "malicious": 0, "error": f"HTTP {r.status_code}"}
+        self._store(file_hash, result)
+        return result
 
 
 class ImportAnalyzer:
+    @metrics.timed('imports')
     def analyze_file(self, path: str) -> List[str]:
         ext = os.path.splitext(path)[1].lower()
         lang = EXT_LANG.get(ext)
@@ -88,7 +475,8 @@ class ImportAnalyzer:
         try:
             with open(path, 'r', errors='ignore') as f:
                 code = f.read()
-            return [imp for imp in SUSPICIOUS_IMPORTS.get(lang, []) if re.search(rf'\b{re.escape(imp)}\b', code)]
+            found = set(IMPORT_RES[lang].findall(code))
+            return [imp for imp in SUSPICIOUS_IMPORTS[lang] if imp in found]
         except:
             return []
 
@@ -104,49 +492,109 @@ class StaticAnalyzer:
             except:
                 pass
         
-        self.yara = YaraScanner(cfg.get('yara_rules_dir', yara_dir))
-        self.clamav = ClamAVScanner(cfg.get('clamscan_bin', clamscan))
-        self.vt = VirusTotalChecker(cfg.get('virustotal_api_key', vt_key))
+        self.yara = YaraScanner.shared(cfg.get('yara_rules_dir', yara_dir),
+                                       cfg.get('yara_cache_dir', 'logs/yara_cache'))
+        self.clamav = ClamAVScanner(cfg.get('clamscan_bin', clamscan), cfg.get('clamav_unix_socket'),
+                                    cfg.get('clamav_host'), cfg.get('clamav_port', 3310))
+        self.vt = VirusTotalChecker(
+            cfg.get('virustotal_api_key') or vt_key,
+            timeout=cfg.get('virustotal_timeout', 25),
+            rate_per_min=cfg.get('virustotal_rate_per_min', 4),
+            daily_limit=cfg.get('virustotal_daily_limit', 500),
+            cache_path=cfg.get('virustotal_cache_db', 'logs/vt_cache.db'),
+            ttl=cfg.get('virustotal_cache_ttl', 86400),
+            negative_ttl=cfg.get('virustotal_negative_ttl', 3600),
+            wait_timeout=cfg.get('virustotal_wait_timeout', 60))
+        if not cfg.get('virustotal_enabled', True):
+            self.vt.api_key = ''
         self.imports = ImportAnalyzer()
         self.thresholds = cfg.get('verdict', {'clean': 15, 'suspicious': 30})
+        self.cache = ResultCache.shared(cfg.get('result_cache_db', 'logs/result_cache.db'),
+                                        cfg.get('result_cache_ttl', 86400))
 
-    def _hash(self, path: str) -> str:
-        h = hashlib.sha256()
-        try:
-            with open(path, 'rb') as f:
-                for chunk in iter(lambda: f.read(8192), b''):
-                    h.update(chunk)
-            return h.hexdigest()
-        except:
-            return ''
+    @property
+    def version(self) -> str:
+        # Everything the cached local scan depends on; VT is cached separately
+        return fingerprint(self.yara.current_version(), self.clamav.engine != "none", SUSPICIOUS_IMPORTS)
 
-    def run(self, path: str) -> Dict:
+    def run(self, path: str, sample: Optional[SampleDescriptor] = None, wait_vt: bool = False,
+            use_cache: bool = True, clamav: Optional[Dict] = None) -> Dict:
+        # wait_vt=False: don't block on VirusTotal quota. An uncached lookup is queued,
+        # result["virustotal"]["pending"] is set and update_with_vt() delivers the rescore.
+        # wait_vt=True waits up to virustotal_wait_timeout, then returns pending as well.
+        # clamav: verdict already taken from the upload stream (ingest.IngestStream)
         if not os.path.exists(path):
             return {"verdict": "ERROR", "score": 0, "error": "File not found"}
 
-        file_hash = self._hash(path)
-        yara_matches = self.yara.scan(path)
-        clamav = self.clamav.scan(path)
-        vt = self.vt.check_hash(file_hash)
-        imports = self.imports.analyze_file(path)
+        sample = sample or describe(path)
+        file_hash = sample.sha256 if sample else ''
+        with metrics.span('vt_lookup', waited=wait_vt):
+            if wait_vt:
+                vt = self.vt.check_hash(file_hash)
+            else:
+                # Queue first so the request overlaps the local scans
+                vt = self.vt.lookup(file_hash) or {"found": False, "malicious": 0, "pending": True}
+
+        # YARA/ClamAV/imports are cached per content and rules version; concurrent
+        # uploads of one sample share a single scan
+        scan = lambda: self._scan_local(path, sample, clamav)
+        with metrics.span('static_scan') as span:
+            if use_cache and file_hash:
+                # The import check goes by extension, so it is part of the key
+                lang = EXT_LANG.get(os.path.splitext(path)[1].lower(), '')
+                local, cached = self.cache.get_or_compute(file_hash, "static", f"{self.version}-{lang}", scan)
+            else:
+                local, cached = scan(), False
+            span['cached'] = cached
+
+        result = {
+            "hash": file_hash,
+            "md5": sample.md5 if sample else '', "file_type": sample.file_type if sample else 'unknown',
+            **local, "virustotal": vt
+        }
+        if cached:
+            result["cached"] = True
+        self._score(result)
+        return result
+
+    def _scan_local(self, path: str, sample: Optional[SampleDescriptor],
+                    clamav: Optional[Dict] = None) -> Dict:
+        yara_matches = self.yara.scan(path, sample)
+        return {
+            "yara_matches": [m.rule for m in yara_matches],
+            "yara_score": sum(getattr(m, 'score', 10) for m in yara_matches),
+            "clamav": clamav or self.clamav.scan(path), "suspicious_imports": self.imports.analyze_file(path)
+        }
 
+    def _score(self, result: Dict):
         # Scoring: YARA +10, ClamAV +30, VT>5 +25, VT 1-5 +15, import +5
-        score = sum(getattr(m, 'score', 10) for m in yara_matches)
-        if clamav.get('infected'):
+        score = result["yara_score"]
+        if result["clamav"].get('infected'):
             score += 30
+        vt = result["virustotal"]
         if vt.get('found'):
             mal = vt.get('malicious', 0)
             score += 25 if mal > 5 else 15 if mal >= 1 else 0
-        score += len(imports) * 5
+        score += len(result["suspicious_imports"]) * 5
 
-        verdict = "CLEAN" if score < self.thresholds.get('clean', 15) else \
-                  "SUSPICIOUS" if score < self.thresholds.get('suspicious', 30) else "MALICIOUS"
+        result["score"] = score
+        result["verdict"] = "CLEAN" if score < self.thresholds.get('clean', 15) else \
+                            "SUSPICIOUS" if score < self.thresholds.get('suspicious', 30) else "MALICIOUS"
 
-        return {
-            "verdict": verdict, "score": score, "hash": file_hash,
-            "yara_matches": [m.rule for m in yara_matches],
-            "clamav": clamav, "virustotal": vt, "suspicious_imports": imports
-        }
+    def update_with_vt(self, result: Dict, callback: Callable[[Dict], None]) -> bool:
+        """Call callback(rescored copy of result) once VirusTotal answers a pending lookup.
+
+        Returns False (and never calls back) if result had no pending lookup.
+        """
+        if not result.get("virustotal", {}).get("pending") or not result.get("hash"):
+            return False
+
+        def deliver(vt: Dict):
+            updated = dict(result, virustotal=vt)
+            self._score(updated)
+            callback(updated)
+        self.vt.lookup(result["hash"], deliver)
+        return True
 
     def get_status(self) -> Dict:
         return {"yara": self.yara.available, "clamav": self.clamav.available, "virustotal": self.vt.available}
@@ -0,0 +1,353 @@
+#!/usr/bin/env python3
+"""
+Agent Event Streaming Tests
+
+Checks EventSink batching and limits in the guest agent, delivery of
+streamed batches to the host through AgentChannel.request(on_event=...),
+host-side backpressure on a slow consumer and early termination of a running analysis with the cancel command.
+"""
+
+import os
+import sys
+import time
+import json
+import shutil
+import socket
+import tempfile
+import unittest
+import threading
+from dataclasses import asdict
+
+# Add parent and agent directories to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+sys.path.insert(0, os.path.join(ROOT, 'vm_images', 'agent'))
+
+import agent
+from vm_manager.agent_channel import (AgentChannel, decode_event_batch, FRAME_HEADER, FRAME_EVENT,
+                                      FRAME_RESPONSE, FRAME_CREDIT, PENDING_FRAMES, CREDIT_BATCH)
+
+
+def _syscall(i: int) -> agent.SyscallEvent:
+    return agent.SyscallEvent(timestamp=float(i), syscall='openat',
+                              args=[f'/tmp/f{i}'], result='3', pid=1)
+
+
+class TestEventSink(unittest.TestCase):
+    """Test event buffering in the agent"""
+    
+    def test_batches_decode_to_events(self):
+        """Batches carry all events and decode back to dicts"""
+        batches = []
+        sink = agent.EventSink(batches.append)
+        sink.start()
+        for i in range(600):
+            sink.add('syscalls', _syscall(i))
+        sink.stop()
+        
+        decoded = [e for b in batches for e in decode_event_batch(b)['syscalls']]
+        self.assertEqual(len(decoded), 600)
+        self.assertEqual(decoded[5], asdict(_syscall(5)))
+        self.assertTrue(all(len(b['syscalls']) <= agent.EVENT_BATCH_SIZE for b in batches))
+        self.assertEqual([b['seq'] for b in batches], list(range(1, len(batches) + 1)))
+    
+    def test_queue_is_bounded(self):
+        """A stalled host makes the sink drop events instead of growing"""
+        release = threading.Event()
+        sent = []
+        
+        def emit(batch):
+            release.wait(5)
+            sent.append(batch)
+        
+        sink = agent.EventSink(emit)
+        sink.start()
+        total = agent.MAX_QUEUED_EVENTS + agent.EVENT_BATCH_SIZE * 4
+        for i in range(total):
+            sink.add('syscalls', _syscall(i))
+        release.set()
+        sink.stop()
+        
+        delivered = sum(len(b['syscalls']) for b in sent)
+        self.assertGreater(sink.dropped['syscalls'], 0)
+        self.assertEqual(delivered + sink.dropped['syscalls'], total)
+        self.assertEqual(sink.counts['syscalls'], total)
+    
+    def test_collect_mode(self):
+        """Without emit, events are returned with the result"""
+        sink = agent.EventSink()
+        sink.start()
+        sink.add('syscalls', _syscall(1))
+        sink.stop()
+        self.assertEqual(sink.get_events('syscalls'), [asdict(_syscall(1))])
+
+
+class StreamingAgent(agent.SandboxAgent):
+    """Agent whose analyze emits synthetic events instead of running a sample"""
+    
+    def analyze(self, file_path, timeout=60, emit=None, control=None, syscalls=None, **kwargs):
+        if file_path.endswith('slow.sh'):
+            return super().analyze(file_path, timeout, emit=emit, control=control, syscalls=syscalls,
+                                   **kwargs)
+        sink = agent.EventSink(emit)
+        sink.start()
+        for i in range(300):
+            sink.add('syscalls', _syscall(i))
+        sink.stop()
+        return agent.AnalysisResult(
+            success=True, file_hash='', start_time=0, end_time=0, duration=0,
+            exit_code=0, stdout='', stderr='',
+            syscalls=sink.get_events('syscalls'),
+            event_counts=dict(sink.counts), dropped_events=dict(sink.dropped))
+
+
+class TestEventStream(unittest.TestCase):
+    """Test streamed analysis over the agent channel"""
+    
+    @classmethod
+    def setUpClass(cls):
+        cls.tmp = tempfile.mkdtemp()
+        cls.socket_path = os.path.join(cls.tmp, "agent.sock")
+        cls.sample = os.path.join(cls.tmp, "sample.sh")
+        with open(cls.sample, 'w') as f:
+            f.write("true\n")
+        cls.agent = StreamingAgent()
+        threading.Thread(target=cls.agent.run_socket, args=(cls.socket_path,), daemon=True).start()
+        for _ in range(50):
+            if os.path.exists(cls.socket_path):
+                break
+            time.sleep(0.05)
+        cls.channel = AgentChannel(cls.socket_path)
+    
+    @classmethod
+    def tearDownClass(cls):
+        cls.channel.close()
+        cls.agent.stop()
+        shutil.rmtree(cls.tmp, ignore_errors=True)
+    
+    def test_events_arrive_before_response(self):
+        """Streamed events reach on_event; the response only has counts"""
+        received = []
+        response = self.channel.request(
+            {'command': 'analyze', 'file_path': self.sample, 'stream_events': True},
+            timeout=10, on_event=lambda b: received.extend(decode_event_batch(b)['syscalls']))
+        
+        self.assertTrue(response['success'])
+        self.assertEqual(len(received), 300)
+        self.assertEqual(response['syscalls'], [])
+        self.assertEqual(response['event_counts'], {'syscalls': 300})
+    
+    def test_without_streaming(self):
+        """Hosts that do not ask for streaming get the events in the response"""
+        response = self.channel.request(
+            {'command': 'analyze', 'file_path': self.sample}, timeout=10)
+        self.assertEqual(len(response['syscalls']), 300)
+    
+    def test_cancel_running_analysis(self):
+        """Cancel kills the sample and the analyze request returns the reason"""
+        slow = os.path.join(self.tmp, "slow.sh")
+        with open(slow, 'w') as f:
+            f.write("sleep 30\n")
+        
+        response = {}
+        t = threading.Thread(target=lambda: response.update(self.channel.request(
+            {'command': 'analyze', 'file_path': slow, 'timeout': 30, 'analysis_id': 'a1'},
+            timeout=40)))
+        start = time.time()
+        t.start()
+        time.sleep(0.5)
+        
+        cancel = self.channel.request(
+            {'command': 'cancel', 'analysis_id': 'a1', 'reason': 'score 120'}, timeout=5)
+        self.assertTrue(cancel['success'])
+        
+        t.join(15)
+        self.assertFalse(t.is_alive())
+        self.assertLess(time.time() - start, 10)
+        self.assertEqual(response['cancelled'], 'score 120')
+    
+    def test_cancel_unknown_analysis(self):
+        response = self.channel.request({'command': 'cancel', 'analysis_id': 'nope'}, timeout=5)
+        self.assertFalse(response['success'])
+
+
+def _recv_frame(sock: socket.socket):
+    """Read one frame from a fake guest socket; returns (frame_type, request_id, payload)"""
+    def exact(n):
+        buf = b''
+        while len(buf) < n:
+            chunk = sock.recv(n - len(buf))
+            if not chunk:
+                raise ConnectionError("closed")
+            buf += chunk
+        return buf
+    length, request_id, frame_type = FRAME_HEADER.unpack(exact(FRAME_HEADER.size))
+    return frame_type, request_id, exact(length) if length else b''
+
+
+class TestBackpressure(unittest.TestCase):
+    """A slow event consumer pauses its own event stream, not the channel"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.socket_path = os.path.join(self.tmp, "agent.sock")
+        self.server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.server.bind(self.socket_path)
+        self.server.listen(1)
+        self.channel = AgentChannel(self.socket_path)
+    
+    def tearDown(self):
+        self.channel.close()
+        self.server.close()
+        shutil.rmtree(self.tmp, ignore_errors=True)
+    
+    def _send(self, guest, frame_type, request_id, payload=b''):
+        guest.sendall(FRAME_HEADER.pack(len(payload), request_id, frame_type) + payload)
+    
+    def test_stalled_consumer_does_not_delay_ping(self):
+        release = threading.Event()
+        response = {}
+        
+        def analyze():
+            response.update(self.channel.request(
+                {'command': 'analyze'}, timeout=10, on_event=lambda b: release.wait(10)))
+        
+        t = threading.Thread(target=analyze, daemon=True)
+        t.start()
+        guest, _ = self.server.accept()
+        _, analyze_id, command = _recv_frame(guest)
+        self.assertEqual(json.loads(command)['event_credit'], PENDING_FRAMES)
+        
+        # Fill the whole window (and more, like an agent ignoring credit)
+        payload = json.dumps({'pad': 'x' * 65536}).encode()
+        for _ in range(PENDING_FRAMES * 2):
+            self._send(guest, FRAME_EVENT, analyze_id, payload)
+        
+        start = time.time()
+        ping = self.channel.open_request({'command': 'ping'})
+        _, ping_id, _ = _recv_frame(guest)
+        self._send(guest, FRAME_RESPONSE, ping_id, b'{}')
+        self.assertEqual(ping.next_frame(5)[0], FRAME_RESPONSE)
+        self.assertLess(time.time() - start, 1)
+        ping.close()
+        
+        # on_event is still stuck; events beyond the window were dropped
+        self.assertTrue(t.is_alive())
+        pending = self.channel._pending[analyze_id]
+        self.assertLessEqual(pending.frames.qsize(), PENDING_FRAMES)
+        
+        release.set()
+        self._send(guest, FRAME_RESPONSE, analyze_id, b'{"success": true}')
+        t.join(5)
+        self.assertEqual(response, {'success': True})
+        self.assertGreater(pending.dropped_events, 0)
+        guest.close()
+    
+    def test_consumed_events_return_credit(self):
+        pending = self.channel.open_request({'command': 'analyze'})
+        guest, _ = self.server.accept()
+        _recv_frame(guest)
+        for _ in range(CREDIT_BATCH):
+            self._send(guest, FRAME_EVENT, pending.request_id, b'{}')
+        for _ in range(CREDIT_BATCH):
+            self.assertEqual(pending.next_frame(5)[0], FRAME_EVENT)
+        
+        guest.settimeout(5)
+        frame_type, request_id, payload = _recv_frame(guest)
+        self.assertEqual((frame_type, request_id), (FRAME_CREDIT, pending.request_id))
+        self.assertEqual(json.loads(payload), {'events': CREDIT_BATCH})
+        pending.close()
+        guest.close()
+    
+    def test_closed_request_does_not_block_reader(self):
+        """Frames of an abandoned request are dropped, others still get through"""
+        abandoned = self.channel.open_request({'command': 'analyze'})
+        guest, _ = self.server.accept()
+        guest.recv(4096)
+        for _ in range(PENDING_FRAMES + 10):
+            self._send(guest, FRAME_EVENT, abandoned.request_id, b'{}')
+        time.sleep(0.2)
+        abandoned.close()
+        
+        other = self.channel.open_request({'command': 'ping'})
+        self._send(guest, FRAME_RESPONSE, other.request_id, b'{}')
+        self.assertEqual(other.next_frame(5)[0], FRAME_RESPONSE)
+        guest.close()
+
+
+class TestAgentCredit(unittest.TestCase):
+    """The agent holds back EVENT frames of a request until the host grants credit"""
+    
+    def setUp(self):
+        self.sent = []
+        self.conn = agent.AgentConnection(lambda view: 0, self.sent.append)
+    
+    def test_waits_for_credit(self):
+        self.conn.open_events(7, 1)
+        self.conn.send_event(7, {'n': 1})
+        
+        t = threading.Thread(target=self.conn.send_event, args=(7, {'n': 2}), daemon=True)
+        t.start()
+        time.sleep(0.2)
+        self.assertEqual(len(self.sent), 1)
+        # Other requests are not affected
+        self.conn.send_json(agent.FRAME_RESPONSE, 8, {'success': True})
+        self.assertEqual(len(self.sent), 2)
+        
+        self.conn.grant(7, 1)
+        t.join(2)
+        self.assertFalse(t.is_alive())
+        self.assertEqual(len(self.sent), 3)
+    
+    def test_host_without_credit(self):
+        """Requests without event_credit are not flow controlled"""
+        self.conn.open_events(7, None)
+        for i in range(PENDING_FRAMES * 2):
+            self.conn.send_event(7, {'n': i})
+        self.assertEqual(len(self.sent), PENDING_FRAMES * 2)
+    
+    def test_lost_connection_wakes_sender(self):
+        self.conn.open_events(7, 0)
+        t = threading.Thread(target=self.conn.send_event, args=(7, {}), daemon=True)
+        t.start()
+        self.conn.fail_inboxes()
+        t.join(2)
+        self.assertFalse(t.is_alive())
+
+
+class TestAgentInbox(unittest.TestCase):
+    """DATA frames of an upload never wedge the agent's reader"""
+    
+    def setUp(self):
+        self.conn = agent.AgentConnection(lambda view: 0, lambda data: None)
+    
+    def _deliver_until_blocked(self, request_id):
+        t = threading.Thread(target=lambda: [self.conn.deliver(request_id, b'x')
+                                             for _ in range(agent.INBOX_FRAMES + 1)], daemon=True)
+        t.start()
+        time.sleep(0.2)
+        self.assertTrue(t.is_alive())
+        return t
+    
+    def test_close_inbox_releases_reader(self):
+        """Handler fails before reading its DATA frames"""
+        self.conn.open_inbox(3)
+        t = self._deliver_until_blocked(3)
+        self.conn.close_inbox(3)
+        t.join(2)
+        self.assertFalse(t.is_alive())
+    
+    def test_lost_connection_releases_reader(self):
+        inbox = self.conn.open_inbox(3)
+        t = self._deliver_until_blocked(3)
+        self.conn.fail_inboxes()
+        t.join(2)
+        self.assertFalse(t.is_alive())
+        self.assertIsNone(inbox.get_nowait())
+    
+    def test_unknown_request_is_dropped(self):
+        self.conn.deliver(99, b'x')
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""
+Analysis Database Tests
+
+Checks write-behind saves, the file_hash index, the packed event blob
+and migration of databases created before the events column existed.
+"""
+
+import os
+import sys
+import shutil
+import sqlite3
+import tempfile
+import unittest
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+from dynamic import AnalysisDB, AnalysisResult, ThreatEvent, pack_events, unpack_events
+
+
+def _result(file_hash: str, score: int = 40, events: int = 3) -> AnalysisResult:
+    return AnalysisResult(
+        verdict='SUSPICIOUS', threat_score=score, reasons=['[vm] exec: /bin/sh'],
+        events=[ThreatEvent(source='vm', event_type='syscall', details=f'exec {i}',
+                            score=10, mitre='T1059') for i in range(events)],
+        duration=1.5, file_type='elf_arm64', file_hash=file_hash,
+        yara_matches=['Rule_A'], mitre_techniques=['T1059'])
+
+
+class TestAnalysisDB(unittest.TestCase):
+    """Test result storage"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.path = os.path.join(self.tmp, 'analysis.db')
+    
+    def tearDown(self):
+        shutil.rmtree(self.tmp, ignore_errors=True)
+    
+    def _db(self):
+        db = AnalysisDB(self.path)
+        self.addCleanup(db.close)
+        return db
+    
+    def test_queued_result_is_visible(self):
+        db = self._db()
+        db.FLUSH_INTERVAL = 60
+        db.save('/tmp/a.bin', _result('h1'))
+        cached = db.get_by_hash('h1', with_events=True)
+        self.assertEqual(cached['threat_score'], 40)
+        self.assertEqual(cached['reasons'], ['[vm] exec: /bin/sh'])
+        self.assertEqual([e['details'] for e in cached['events']], ['exec 0', 'exec 1', 'exec 2'])
+    
+    def test_persisted_after_close(self):
+        db = AnalysisDB(self.path)
+        for i in range(200):
+            db.save(f'/tmp/{i}.bin', _result(f'h{i}', score=i))
+        db.save('/tmp/again.bin', _result('h5', score=99))
+        db.close()
+        
+        db = self._db()
+        self.assertEqual(db.get_by_hash('h150')['threat_score'], 150)
+        # Latest save of a hash wins
+        latest = db.get_by_hash('h5', with_events=True)
+        self.assertEqual(latest['threat_score'], 99)
+        self.assertEqual(latest['file_name'], 'again.bin')
+        self.assertEqual(len(latest['events']), 3)
+        self.assertIsNone(db.get_by_hash('missing'))
+        self.assertNotIn('events', db.get_by_hash('h1'))
+    
+    def test_hash_lookup_uses_index(self):
+        self._db().close()
+        with sqlite3.connect(self.path) as conn:
+            self.assertEqual(conn.execute("PRAGMA journal_mode").fetchone()[0], 'wal')
+            plan = ' '.join(row[-1] for row in conn.execute(
+                "EXPLAIN QUERY PLAN SELECT * FROM analyses WHERE file_hash=? ORDER BY id DESC LIMIT 1",
+                ('x',)))
+        self.assertIn('idx_analyses_hash', plan)
+    
+    def test_migrates_old_schema(self):
+        with sqlite3.connect(self.path) as conn:
+            conn.execute("""CREATE TABLE analyses (
+                id INTEGER PRIMARY KEY AUTOINCREMENT, file_hash TEXT NOT NULL, file_name TEXT,
+                file_type TEXT, verdict TEXT, threat_score INTEGER, duration REAL, reasons TEXT,
+                yara_matches TEXT, mitre_techniques TEXT,
+                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP)""")
+            conn.execute("INSERT INTO analyses (file_hash, verdict, threat_score, reasons) "
+                         "VALUES ('old', 'CLEAN', 0, '[]')")
+        db = self._db()
+        old = db.get_by_hash('old', with_events=True)
+        self.assertEqual(old['verdict'], 'CLEAN')
+        self.assertEqual(old['events'], [])
+    
+    def test_event_blob_is_compact(self):
+        events = _result('h', events=5000).events
+        blob = pack_events(events)
+        self.assertLess(len(blob), 5000 * 10)
+        decoded = unpack_events(blob)
+        self.assertEqual(len(decoded), 5000)
+        self.assertEqual(decoded[42]['details'], 'exec 42')
+        self.assertEqual(decoded[42]['mitre'], 'T1059')
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
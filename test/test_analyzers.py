@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""
+Analyzer Registry Tests
+
+Checks that components are built once on first use, also under
+concurrent access, that the static and dynamic analyzers share one YARA
+scanner, and that warm_up() builds everything and pre-warms the VMs.
+"""
+
+import os
+import sys
+import time
+import shutil
+import tempfile
+import threading
+import unittest
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+from analyzers import Analyzers
+
+
+class FakeDynamic:
+    def __init__(self):
+        self.prewarmed = 0
+    
+    def prewarm(self):
+        self.prewarmed += 1
+        return 1
+
+
+class TestAnalyzers(unittest.TestCase):
+    """Test lazy, shared analyzer construction"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+    
+    def registry(self, **builders) -> Analyzers:
+        analyzers = Analyzers(os.path.join(self.tmp, 'missing.yaml'))
+        analyzers._builders.update(builders)
+        return analyzers
+    
+    def test_built_once_on_first_use(self):
+        calls = []
+        
+        def slow():
+            calls.append(threading.current_thread().name)
+            time.sleep(0.1)
+            return object()
+        
+        analyzers = self.registry(static=slow)
+        self.assertEqual(calls, [])
+        self.assertFalse(analyzers.loaded('static'))
+        results = []
+        threads = [threading.Thread(target=lambda: results.append(analyzers.static)) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(len(calls), 1)
+        self.assertEqual(len(set(map(id, results))), 1)
+        self.assertTrue(analyzers.loaded('static'))
+    
+    def test_failed_and_missing_components(self):
+        calls = []
+        
+        def broken():
+            calls.append(1)
+            raise OSError('no rules')
+        
+        analyzers = self.registry(static=broken, dynamic=lambda: None)
+        for _ in range(2):
+            with self.assertRaises(OSError):
+                analyzers.static
+        self.assertEqual(len(calls), 1)
+        self.assertFalse(analyzers.loaded('static'))
+        
+        # Optimistic until the dynamic analyzer is known to be missing
+        self.assertTrue(analyzers.dynamic_enabled)
+        self.assertIsNone(analyzers.dynamic)
+        self.assertFalse(analyzers.dynamic_enabled)
+    
+    def test_warm_up(self):
+        dynamic = FakeDynamic()
+        gate = threading.Event()
+        analyzers = self.registry(static=lambda: gate.wait(5) and 'static', dynamic=lambda: dynamic,
+                                  bulk=lambda: 'bulk')
+        thread = analyzers.warm_up(prewarm_vms=True)
+        self.assertIs(analyzers.warm_up(), thread)
+        # A slow component does not hold up the others
+        self.assertEqual(analyzers.bulk, 'bulk')
+        self.assertIs(analyzers.dynamic, dynamic)
+        gate.set()
+        thread.join(5)
+        self.assertEqual(analyzers.static, 'static')
+        self.assertEqual(dynamic.prewarmed, 1)
+    
+    def test_static_and_dynamic_share_rules(self):
+        rules = os.path.join(self.tmp, 'rules')
+        os.makedirs(rules)
+        config = os.path.join(self.tmp, 'config.yaml')
+        with open(config, 'w') as f:
+            f.write(f"static:\n"
+                    f"  yara_rules_dir: {rules}\n"
+                    f"  yara_cache_dir: {os.path.join(self.tmp, 'yara_cache')}\n"
+                    f"  result_cache_db: {os.path.join(self.tmp, 'cache.db')}\n"
+                    f"  virustotal_cache_db: {os.path.join(self.tmp, 'vt.db')}\n"
+                    f"  virustotal_enabled: false\n")
+        analyzers = Analyzers(config, db_path=os.path.join(self.tmp, 'analysis.db'),
+                              vm_config_path=os.path.join(self.tmp, 'vm_config.yaml'))
+        dynamic = analyzers.dynamic
+        self.addCleanup(dynamic.db.close)
+        self.assertIs(analyzers.static.yara, dynamic.yara)
+        self.assertIs(analyzers.static.cache, dynamic.cache)
+        self.assertFalse(dynamic.vm_available)
+        self.assertEqual(dynamic.prewarm(), 0)
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
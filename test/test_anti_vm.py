@@ -8,6 +8,7 @@ anti-VM detection techniques used by malware.
 
 import os
 import sys
+import shutil
 import unittest
 import subprocess
 import tempfile
@@ -316,14 +317,23 @@ class TestVMDynamicAnalyzer(unittest.TestCase):
         """Test initialization without VM config"""
         from dynamic import VMDynamicAnalyzer
         
-        analyzer = VMDynamicAnalyzer(vm_config_path="/nonexistent/path.yaml")
+        tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmp, True)
+        analyzer = VMDynamicAnalyzer(vm_config_path="/nonexistent/path.yaml",
+                                     db_path=os.path.join(tmp, 'dyn.db'),
+                                     cache_path=os.path.join(tmp, 'results.db'),
+                                     yara_cache_dir=os.path.join(tmp, 'yara_cache'))
         self.assertFalse(analyzer.vm_available)
     
     def test_get_status(self):
         """Test status retrieval"""
         from dynamic import VMDynamicAnalyzer
         
-        analyzer = VMDynamicAnalyzer()
+        tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmp, True)
+        analyzer = VMDynamicAnalyzer(db_path=os.path.join(tmp, 'dyn.db'),
+                                     cache_path=os.path.join(tmp, 'results.db'),
+                                     yara_cache_dir=os.path.join(tmp, 'yara_cache'))
         status = analyzer.get_status()
         
         self.assertIn('yara_available', status)
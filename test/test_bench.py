@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""
+Benchmark Harness Tests
+
+Checks that the generated corpus is reproducible and typed as intended,
+that a quick run appends parseable result lines, and that --compare
+reports a slower run as a regression.
+"""
+
+import os
+import sys
+import json
+import shutil
+import tempfile
+import unittest
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+import bench
+from sample import describe
+
+
+class TestBench(unittest.TestCase):
+    """Test corpus generation, result lines and comparison"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+    
+    def test_corpus_is_reproducible(self):
+        first = bench.build_corpus(os.path.join(self.tmp, 'a'), scale=0.05)
+        second = bench.build_corpus(os.path.join(self.tmp, 'b'), scale=0.05)
+        self.assertEqual(first['digest'], second['digest'])
+        self.assertNotEqual(first['digest'], bench.build_corpus(os.path.join(self.tmp, 'c'), seed=1,
+                                                                scale=0.05)['digest'])
+        types = {f['name']: describe(f['path']).file_type for f in first['files']}
+        self.assertEqual(types, {'benign.py': 'python', 'stealer.py': 'python', 'dropper.js': 'javascript',
+                                 'dropper.sh': 'shell', 'tool_x64.elf': 'elf_x64',
+                                 'tool_arm64.elf': 'elf_arm64', 'packed_arm64.elf': 'elf_arm64'})
+    
+    def test_run_and_compare(self):
+        out = os.path.join(self.tmp, 'bench_output.txt')
+        argv = ['--out', out, '--iterations', '1', '--scale', '0.05', '--only', 'rules,elf',
+                '--config', os.path.join(self.tmp, 'none.yaml')]
+        self.assertEqual(bench.main(argv), 0)
+        with open(out) as f:
+            rows = [json.loads(line) for line in f]
+        self.assertEqual([r['bench'] for r in rows], ['rules', 'elf'])
+        self.assertEqual(rows[0]['ops'], 4)
+        self.assertEqual(rows[0]['run'], rows[1]['run'])
+        self.assertTrue(all(r['p50_ms'] >= 0 and r['corpus'] for r in rows))
+        
+        # A second run three times slower than the first
+        with open(out, 'a') as f:
+            for row in rows:
+                f.write(json.dumps(dict(row, run='slower', p50_ms=row['p50_ms'] * 3 + 1)) + '\n')
+        lines, regressed = bench.compare(bench.load_runs(out), tolerance=0.2)
+        self.assertTrue(regressed)
+        self.assertIn('REGRESSION', lines[0])
+        self.assertEqual(bench.main(['--out', out, '--compare']), 1)
+        # Other corpus: nothing to compare with
+        with open(out, 'a') as f:
+            f.write(json.dumps(dict(rows[0], run='other', corpus='x')) + '\n')
+        self.assertEqual(bench.compare(bench.load_runs(out), 0.2),
+                         (["no earlier run of this corpus on this host"], False))
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
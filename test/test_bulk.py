@@ -0,0 +1,216 @@
+#!/usr/bin/env python3
+"""
+Bulk Ingest Tests
+
+Builds zip and tar bundles in a temporary directory and checks member
+streaming limits, the static triage gate over the process pool (with a
+stand-in analyzer and with the real StaticAnalyzer), that a crashed
+worker costs only the members in flight and that staged members never
+outlive the run.
+"""
+
+import io
+import os
+import sys
+import shutil
+import tarfile
+import zipfile
+import tempfile
+import unittest
+import threading
+
+import yaml
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+import bulk
+
+# Held by a parent thread in test_parent_locks; a forked worker would inherit it locked
+PARENT_LOCK = threading.Lock()
+
+
+class FakeAnalyzer:
+    """Scores a member by how often it says EVIL"""
+    
+    def __init__(self, config_path):
+        self.pid = os.getpid()
+    
+    def run(self, path, sample=None, wait_vt=False):
+        with open(path, 'rb') as f:
+            data = f.read()
+        if data.startswith(b'CRASH'):
+            raise RuntimeError('scanner failed')
+        if data.startswith(b'BOMB'):
+            # Like the OOM killer
+            os._exit(9)
+        if not PARENT_LOCK.acquire(timeout=5):
+            raise RuntimeError('lock inherited from the parent')
+        PARENT_LOCK.release()
+        score = data.count(b'EVIL') * 10
+        return {'hash': sample.sha256, 'score': score, 'verdict': 'MALICIOUS' if score >= 30 else 'CLEAN',
+                'yara_matches': [], 'worker': self.pid, 'vt_waited': wait_vt}
+
+
+class TestMembers(unittest.TestCase):
+    """Test streaming members out of archives"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+    
+    def _zip(self, files):
+        path = os.path.join(self.tmp, 'bundle.zip')
+        with zipfile.ZipFile(path, 'w', zipfile.ZIP_DEFLATED) as zf:
+            zf.writestr('dir/', '')
+            for name, data in files.items():
+                zf.writestr(name, data)
+        return path
+    
+    def _tar(self, files, mode='w:gz'):
+        path = os.path.join(self.tmp, 'bundle.tar.gz')
+        with tarfile.open(path, mode) as tf:
+            for name, data in files.items():
+                info = tarfile.TarInfo(name)
+                info.size = len(data)
+                tf.addfile(info, io.BytesIO(data))
+            link = tarfile.TarInfo('link')
+            link.type, link.linkname = tarfile.SYMTYPE, '/etc/passwd'
+            tf.addfile(link)
+        return path
+    
+    def test_zip_and_tar(self):
+        files = {'a.sh': b'echo a', 'sub/big.bin': b'x' * 100, 'c.py': b'print(1)'}
+        for path in (self._zip(files), self._tar(files)):
+            out = list(bulk.iter_members(path, max_members=10, max_member_bytes=50))
+            self.assertEqual([(n, m.data if m else None, r) for n, m, r in out],
+                             [('a.sh', b'echo a', None), ('sub/big.bin', None, 'too large'),
+                              ('c.py', b'print(1)', None)])
+            limited = list(bulk.iter_members(path, max_members=1))
+            self.assertEqual([(n, r) for n, _, r in limited], [('a.sh', None), ('sub/big.bin', 'member limit')])
+    
+    def test_names_and_detection(self):
+        self.assertEqual(bulk.safe_name('../../etc/passwd'), 'passwd')
+        self.assertEqual(bulk.safe_name('x\\..\\.bashrc'), 'bashrc')
+        self.assertEqual(bulk.safe_name('dir/evil file;rm.sh'), 'evil_file_rm.sh')
+        self.assertEqual(bulk.safe_name('dir/'), 'dir')
+        plain = os.path.join(self.tmp, 'plain.txt')
+        with open(plain, 'w') as f:
+            f.write('hello')
+        self.assertFalse(bulk.is_archive(plain))
+        self.assertTrue(bulk.is_archive(self._tar({'a': b'1'}, 'w')))
+
+
+class TestTriage(unittest.TestCase):
+    """Test the process pool and the dynamic-stage gate"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+        self.out = os.path.join(self.tmp, 'out')
+        self.scratch = os.path.join(self.tmp, 'scratch')
+        os.makedirs(self.scratch)
+    
+    def _archive(self, files):
+        path = os.path.join(self.tmp, 'bundle.zip')
+        with zipfile.ZipFile(path, 'w') as zf:
+            for name, data in files:
+                zf.writestr(name, data)
+        return path
+    
+    def test_gate(self):
+        archive = self._archive([
+            ('a/drop.sh', b'EVIL EVIL EVIL'), ('b/drop.sh', b'EVIL EVIL EVIL EVIL'),
+            ('clean.txt', b'nothing'), ('copy.sh', b'EVIL EVIL EVIL'), ('bad.bin', b'CRASH'),
+        ] + [(f'n{i}', b'EVIL %d' % i) for i in range(8)])
+        triage = bulk.BulkTriage(None, workers=2, min_score=30, scratch_dir=self.scratch,
+                                 analyzer_factory=FakeAnalyzer)
+        seen = []
+        report = triage.run(archive, self.out, on_progress=seen.append)
+        
+        self.assertEqual(report.duplicates, 1)
+        self.assertEqual(len(report.results), 12)
+        self.assertEqual([(r.name, r.score) for r in report.gated], [('b/drop.sh', 40), ('a/drop.sh', 30)])
+        # Same basename kept twice: the second copy is prefixed with its hash
+        kept = sorted(os.listdir(self.out))
+        self.assertEqual(len(kept), 2)
+        self.assertIn('drop.sh', kept)
+        self.assertTrue(all(os.path.dirname(r.path) == self.out for r in report.gated))
+        with open(report.gated[0].path, 'rb') as f:
+            self.assertEqual(f.read(), b'EVIL EVIL EVIL EVIL')
+        
+        crashed = [r for r in report.results if r.name == 'bad.bin'][0]
+        self.assertEqual((crashed.verdict, crashed.error, crashed.path), ('ERROR', 'scanner failed', None))
+        self.assertEqual(seen[-1], 12)
+        self.assertEqual(os.listdir(self.scratch), [])
+    
+    def test_worker_crash(self):
+        archive = self._archive([('bomb.bin', b'BOMB')] + [(f'n{i}', b'EVIL %d' % i) for i in range(10)])
+        triage = bulk.BulkTriage(None, workers=2, scratch_dir=self.scratch, analyzer_factory=FakeAnalyzer)
+        report = triage.run(archive, self.out)
+        
+        # Members in flight with the bomb are retried one by one: only the
+        # bomb itself is skipped, the pool is replaced for the rest
+        self.assertEqual(report.skipped, [('bomb.bin', 'worker crashed')])
+        self.assertEqual([r.name for r in report.results], [f'n{i}' for i in range(10)])
+        self.assertTrue(all(r.error is None for r in report.results))
+        self.assertEqual(os.listdir(self.scratch), [])
+    
+    def test_parent_locks(self):
+        """Workers do not inherit locks held by the caller's threads"""
+        archive = self._archive([('a.sh', b'EVIL')])
+        triage = bulk.BulkTriage(None, workers=1, scratch_dir=self.scratch, analyzer_factory=FakeAnalyzer)
+        with PARENT_LOCK:
+            report = triage.run(archive, self.out)
+        self.assertEqual([(r.name, r.error) for r in report.results], [('a.sh', None)])
+    
+    def test_config_and_bad_input(self):
+        config = os.path.join(self.tmp, 'config.yaml')
+        with open(config, 'w') as f:
+            yaml.safe_dump({'bulk': {'workers': 3, 'dynamic_min_score': 50, 'max_member_mb': 1}}, f)
+        triage = bulk.BulkTriage(config, scratch_dir=self.scratch, analyzer_factory=FakeAnalyzer)
+        self.assertEqual((triage.workers, triage.min_score, triage.max_member_bytes), (3, 50, 1 << 20))
+        
+        report = triage.run(config, self.out)
+        self.assertEqual((report.results, [r for _, r in report.skipped]), ([], ['not a zip/tar archive']))
+        
+        # A truncated tarball keeps what was read before the damage
+        data = io.BytesIO()
+        with tarfile.open(fileobj=data, mode='w') as tf:
+            for i in range(3):
+                info = tarfile.TarInfo(f'm{i}')
+                info.size = 4096
+                tf.addfile(info, io.BytesIO(b'EVIL' * 1024))
+        broken = os.path.join(self.tmp, 'broken.tar')
+        with open(broken, 'wb') as f:
+            f.write(data.getvalue()[:512 * 12])
+        report = triage.run(broken, self.out)
+        self.assertEqual([r.name for r in report.results], ['m0'])
+        self.assertTrue(report.skipped[-1][1].startswith('archive error'))
+        self.assertEqual(os.listdir(self.scratch), [])
+    
+    def test_static_analyzer(self):
+        """The real static pipeline runs in the workers without VirusTotal"""
+        config = os.path.join(self.tmp, 'config.yaml')
+        with open(config, 'w') as f:
+            yaml.safe_dump({'static': {
+                'yara_rules_dir': os.path.join(self.tmp, 'rules'),
+                'yara_cache_dir': os.path.join(self.tmp, 'yara_cache'),
+                'result_cache_db': os.path.join(self.tmp, 'results.db'),
+                'virustotal_cache_db': os.path.join(self.tmp, 'vt.db'),
+                'virustotal_api_key': 'not-used', 'clamscan_bin': '/nonexistent/clamscan',
+                'clamav_unix_socket': os.path.join(self.tmp, 'clamd.sock'), 'clamav_port': 1,
+            }}, f)
+        archive = self._archive([
+            ('stealer.py', b'import socket, subprocess, base64\n'),
+            ('hello.py', b'print("hello")\n'),
+        ])
+        report = bulk.BulkTriage(config, workers=2, min_score=15, scratch_dir=self.scratch).run(archive, self.out)
+        self.assertEqual([(r.name, r.score) for r in report.results], [('hello.py', 0), ('stealer.py', 15)])
+        self.assertEqual([os.path.basename(r.path) for r in report.gated], ['stealer.py'])
+        self.assertEqual(os.listdir(self.out), ['stealer.py'])
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
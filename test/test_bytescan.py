@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""
+Byte Scan Tests
+
+Builds the _bytescan extension and checks that it gives the same results
+as the pure-Python fallbacks, then runs ELFAnalyzer string and entropy
+checks on synthetic section data.
+"""
+
+import os
+import sys
+import random
+import shutil
+import tempfile
+import unittest
+import subprocess
+import importlib.util
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+import bytescan
+from dynamic import ELFAnalyzer, SHF_ALLOC, SHF_COMPRESSED
+
+
+def _build_extension(dest: str):
+    """Build _bytescan in a scratch copy of bytescan/ and load it"""
+    src = os.path.join(dest, 'bytescan')
+    shutil.copytree(os.path.join(ROOT, 'bytescan'), src,
+                    ignore=shutil.ignore_patterns('*.so', '__pycache__'))
+    subprocess.run(['make', '-s', '-C', src, f'PYTHON={sys.executable}'],
+                   check=True, capture_output=True)
+    path = next(os.path.join(src, f) for f in os.listdir(src) if f.endswith('.so'))
+    spec = importlib.util.spec_from_file_location('_bytescan', path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+def _samples():
+    rnd = random.Random(7)
+    for n in (0, 3, 4, 15, 16, 17, 255, 5000, 20000):
+        yield bytes(rnd.randrange(256) for _ in range(n))
+        yield bytes(rnd.choice(b'ab \x00\x7f~\x1f') for _ in range(n))
+        yield (b'/etc/shadow plain text run ' * (n // 20 + 1))[:n]
+
+
+@unittest.skipUnless(shutil.which('make') and shutil.which('cc'), "C toolchain not available")
+class TestNativeKernels(unittest.TestCase):
+    """Test the C extension against the pure-Python versions"""
+    
+    @classmethod
+    def setUpClass(cls):
+        cls.tmp = tempfile.mkdtemp()
+        try:
+            cls.native = _build_extension(cls.tmp)
+        except (subprocess.CalledProcessError, StopIteration):
+            raise unittest.SkipTest("Python headers not available")
+    
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls.tmp, ignore_errors=True)
+    
+    def test_strings(self):
+        for data in _samples():
+            for min_len in (1, 4, 8):
+                self.assertEqual(self.native.strings(data, min_len),
+                                 bytescan._py_strings(data, min_len))
+    
+    def test_histogram_and_entropy(self):
+        for data in _samples():
+            self.assertEqual(self.native.histogram(data), bytescan._py_histogram(data))
+            self.assertAlmostEqual(self.native.entropy(data), bytescan._py_entropy(data), places=9)
+    
+    def test_window_entropy(self):
+        for data in _samples():
+            for window, step in ((16, 4), (256, 0), (256, 300), (1000, 17)):
+                got = self.native.window_entropy(data, window, step)
+                expected = bytescan._py_window_entropy(data, window, step)
+                self.assertEqual(len(got), len(expected))
+                for a, b in zip(got, expected):
+                    self.assertAlmostEqual(a, b, places=6)
+    
+    def test_buffer_objects(self):
+        data = bytearray(b'abcdef\x00ghij')
+        self.assertEqual(self.native.strings(memoryview(data)), b'abcdef\nghij')
+        with self.assertRaises(ValueError):
+            self.native.window_entropy(b'abc', 0)
+
+
+class FakeSection:
+    def __init__(self, name, data, sh_type='SHT_PROGBITS', sh_flags=SHF_ALLOC):
+        self.name = name
+        self._data = data
+        self._header = {'sh_type': sh_type, 'sh_flags': sh_flags}
+    
+    def __getitem__(self, key):
+        return self._header[key]
+    
+    def data(self):
+        return self._data
+
+
+class FakeELF:
+    def __init__(self, sections):
+        self._sections = sections
+    
+    def iter_sections(self):
+        return iter(self._sections)
+
+
+class TestELFChecks(unittest.TestCase):
+    """Test ELFAnalyzer string and entropy checks"""
+    
+    def setUp(self):
+        self.analyzer = ELFAnalyzer()
+        rnd = random.Random(3)
+        self.code = bytes(rnd.choice(range(40)) for _ in range(64 * 1024))
+        self.packed = bytes(rnd.randrange(256) for _ in range(16 * 1024))
+    
+    def test_suspicious_strings(self):
+        data = b'\x00\x01ABC\x00cat /ETC/SHADOW\x00\xffLD_PRELOAD=x\x00'
+        details = [e.details for e in self.analyzer._analyze_strings(data)]
+        self.assertEqual(details, ['Shadow file', 'LD_PRELOAD'])
+    
+    def test_high_entropy_section(self):
+        elf = FakeELF([FakeSection('.text', self.packed)])
+        events = self.analyzer._analyze_entropy(elf)
+        self.assertEqual(len(events), 1)
+        self.assertTrue(events[0].details.startswith('High entropy .text'))
+    
+    def test_packed_region_inside_section(self):
+        """A packed blob diluted by code is found by the sliding window"""
+        data = self.code + self.packed + self.code
+        self.assertLess(bytescan.entropy(data), 7.5)
+        elf = FakeELF([FakeSection('.text', data), FakeSection('.bss', b'', 'SHT_NOBITS')])
+        events = self.analyzer._analyze_entropy(elf)
+        self.assertEqual(len(events), 1)
+        self.assertEqual(events[0].mitre, 'T1027.002')
+        offset = int(events[0].details.split('+0x')[1].split(':')[0], 16)
+        self.assertGreaterEqual(offset, len(self.code) - bytescan.WINDOW_SIZE)
+        self.assertLess(offset, len(self.code) + len(self.packed))
+    
+    def test_no_section_table(self):
+        events = self.analyzer._analyze_entropy(FakeELF([]), self.code + self.packed)
+        self.assertEqual([e.mitre for e in events], ['T1027.002'])
+    
+    def test_plain_code(self):
+        self.assertEqual(self.analyzer._analyze_entropy(FakeELF([FakeSection('.text', self.code)])), [])
+    
+    def test_compressed_debug_sections(self):
+        """A benign build with compressed debug info (gcc -gz, MiniDebugInfo) is not packed"""
+        elf = FakeELF([
+            FakeSection('.text', self.code),
+            FakeSection('.debug_info', self.packed, sh_flags=SHF_COMPRESSED),
+            FakeSection('.zdebug_line', self.packed, sh_flags=0),
+            FakeSection('.gnu_debugdata', self.packed, sh_flags=0),
+            FakeSection('.note.blob', self.packed, sh_flags=0),
+        ])
+        self.assertEqual(self.analyzer._analyze_entropy(elf, self.code + self.packed), [])
+    
+    def test_packed_region_in_loaded_section(self):
+        elf = FakeELF([FakeSection('.text', self.code), FakeSection('.upx0', self.code + self.packed)])
+        events = self.analyzer._analyze_entropy(elf)
+        self.assertEqual([e.details.split(' at ')[0] for e in events], ['Packed region in .upx0'])
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+"""
+clamd Client Tests
+
+Runs ClamdClient against a small in-process clamd stand-in speaking the
+IDSESSION / FILDES / INSTREAM protocol over a unix socket and TCP.
+"""
+
+import os
+import sys
+import socket
+import struct
+import shutil
+import tempfile
+import unittest
+import threading
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+from static import ClamdClient, ClamAVScanner
+
+SIGNATURE = b'X5O!P%@AP'
+
+
+class FakeClamd:
+    """Minimal clamd: flags any content containing SIGNATURE"""
+    
+    def __init__(self, family, address, fildes=True):
+        self.fildes = fildes
+        self.connections = 0
+        self.commands = []
+        self.server = socket.socket(family, socket.SOCK_STREAM)
+        self.server.bind(address)
+        self.server.listen(8)
+        self.address = self.server.getsockname()
+        self.clients = []
+        threading.Thread(target=self._accept, daemon=True).start()
+    
+    def close(self):
+        self.server.close()
+        for conn in self.clients:
+            conn.close()
+    
+    def drop_sessions(self):
+        """Simulate clamd's idle timeout"""
+        for conn in self.clients:
+            conn.shutdown(socket.SHUT_RDWR)
+            conn.close()
+        self.clients = []
+    
+    def _accept(self):
+        while True:
+            try:
+                conn, _ = self.server.accept()
+            except OSError:
+                return
+            self.connections += 1
+            self.clients.append(conn)
+            threading.Thread(target=self._serve, args=(conn,), daemon=True).start()
+    
+    def _read_exact(self, f, n):
+        data = f.read(n)
+        if len(data) < n:
+            raise ConnectionError
+        return data
+    
+    def _read_command(self, conn, f):
+        command = b''
+        while not command.endswith(b'\0'):
+            byte = f.read(1)
+            if not byte:
+                raise ConnectionError
+            command += byte
+        return command[1:-1].decode()
+    
+    def _verdict(self, target, data):
+        return f"{target}: Eicar-Test-Signature FOUND" if SIGNATURE in data else f"{target}: OK"
+    
+    def _serve(self, conn):
+        f = conn.makefile('rb', buffering=0)
+        request = 0
+        try:
+            if self._read_command(conn, f) != 'IDSESSION':
+                return
+            while True:
+                command = self._read_command(conn, f)
+                self.commands.append(command)
+                request += 1
+                if command == 'END':
+                    return
+                if command == 'PING':
+                    reply = 'PONG'
+                elif command == 'INSTREAM':
+                    data = b''
+                    while True:
+                        size = struct.unpack('>I', self._read_exact(f, 4))[0]
+                        if not size:
+                            break
+                        data += self._read_exact(f, size)
+                    reply = self._verdict('stream', data)
+                elif command == 'FILDES' and self.fildes:
+                    _, fds, _, _ = socket.recv_fds(conn, 1, 1)
+                    with os.fdopen(fds[0], 'rb') as sample:
+                        reply = self._verdict(f'fd[{fds[0]}]', sample.read())
+                else:
+                    # Like clamd, end the session on an unknown command
+                    conn.sendall(f"{request}: UNKNOWN COMMAND\0".encode())
+                    return
+                conn.sendall(f"{request}: {reply}\0".encode())
+        except (ConnectionError, OSError):
+            pass
+        finally:
+            conn.close()
+
+
+class TestClamdClient(unittest.TestCase):
+    """Test clamd session protocol handling"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.clean = self._write('clean.txt', b'hello' * 1000)
+        self.infected = self._write('eicar.com', b'junk' * 20000 + SIGNATURE)
+    
+    def tearDown(self):
+        shutil.rmtree(self.tmp, ignore_errors=True)
+    
+    def _write(self, name, data):
+        path = os.path.join(self.tmp, name)
+        with open(path, 'wb') as f:
+            f.write(data)
+        return path
+    
+    def _unix_daemon(self, **kwargs):
+        path = os.path.join(self.tmp, 'clamd.ctl')
+        daemon = FakeClamd(socket.AF_UNIX, path, **kwargs)
+        self.addCleanup(daemon.close)
+        return daemon, ClamdClient(unix_socket=path, timeout=5)
+    
+    def test_fildes_over_pooled_session(self):
+        daemon, client = self._unix_daemon()
+        self.addCleanup(client.close)
+        self.assertTrue(client.ping())
+        self.assertEqual(client.scan_file(self.clean), {"infected": False, "signature": None})
+        self.assertEqual(client.scan_file(self.infected),
+                         {"infected": True, "signature": "Eicar-Test-Signature"})
+        self.assertEqual(daemon.connections, 1)
+        self.assertEqual(daemon.commands, ['PING', 'FILDES', 'FILDES'])
+    
+    def test_instream_over_tcp(self):
+        daemon = FakeClamd(socket.AF_INET, ('127.0.0.1', 0))
+        self.addCleanup(daemon.close)
+        client = ClamdClient(unix_socket='/nonexistent/clamd.ctl', host='127.0.0.1',
+                             port=daemon.address[1], timeout=5)
+        self.addCleanup(client.close)
+        self.assertTrue(client.scan_file(self.infected)['infected'])
+        self.assertFalse(client.scan_stream([b'abc', b'def'])['infected'])
+        self.assertEqual(daemon.commands, ['INSTREAM', 'INSTREAM'])
+    
+    def test_falls_back_to_instream_without_fildes(self):
+        daemon, client = self._unix_daemon(fildes=False)
+        self.addCleanup(client.close)
+        self.assertTrue(client.scan_file(self.infected)['infected'])
+        self.assertFalse(client.scan_file(self.clean)['infected'])
+        self.assertEqual(daemon.commands, ['FILDES', 'INSTREAM', 'INSTREAM'])
+        self.assertEqual(daemon.connections, 2)
+    
+    def test_stale_session_is_replaced(self):
+        daemon, client = self._unix_daemon()
+        self.addCleanup(client.close)
+        self.assertTrue(client.ping())
+        daemon.drop_sessions()
+        self.assertTrue(client.scan_file(self.infected)['infected'])
+        self.assertEqual(daemon.connections, 2)
+
+
+class TestClamAVScanner(unittest.TestCase):
+    """Test engine selection"""
+    
+    def test_daemon_missing(self):
+        scanner = ClamAVScanner('no-such-clamscan', unix_socket='/nonexistent/clamd.ctl')
+        self.assertIsNone(scanner.clamd)
+        self.assertEqual(scanner.engine, 'none')
+        self.assertEqual(scanner.scan(__file__), {"infected": False, "signature": None})
+    
+    def test_uses_daemon(self):
+        tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmp, True)
+        path = os.path.join(tmp, 'clamd.ctl')
+        daemon = FakeClamd(socket.AF_UNIX, path)
+        self.addCleanup(daemon.close)
+        sample = os.path.join(tmp, 'sample')
+        with open(sample, 'wb') as f:
+            f.write(SIGNATURE)
+        
+        scanner = ClamAVScanner('no-such-clamscan', unix_socket=path)
+        self.addCleanup(scanner.clamd.close)
+        self.assertEqual(scanner.engine, 'clamd')
+        self.assertTrue(scanner.scan(sample)['infected'])
+
+    
+    def test_reprobes_daemon_that_starts_late(self):
+        """clamd still loading at startup is picked up once it answers"""
+        tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmp, True)
+        path = os.path.join(tmp, 'clamd.ctl')
+        sample = os.path.join(tmp, 'sample')
+        with open(sample, 'wb') as f:
+            f.write(SIGNATURE)
+        
+        scanner = ClamAVScanner('no-such-clamscan', unix_socket=path)
+        self.assertIsNone(scanner.clamd)
+        daemon = FakeClamd(socket.AF_UNIX, path)
+        self.addCleanup(daemon.close)
+        # Not before the re-probe interval
+        self.assertIsNone(scanner.clamd)
+        scanner._probed -= ClamAVScanner.REPROBE_SECONDS
+        self.assertEqual(scanner.engine, 'clamd')
+        self.addCleanup(scanner.clamd.close)
+        self.assertTrue(scanner.scan(sample)['infected'])
+        
+        daemon.drop_sessions()
+        daemon.close()
+        os.unlink(path)
+        self.assertFalse(scanner.scan(sample)['infected'])
+        self.assertIsNone(scanner.clamd)
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
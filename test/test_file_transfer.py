@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""
+File Transfer Tests
+
+Runs the guest agent in socket mode and checks streaming put_file/get_file,
+checksum verification, resume of interrupted transfers and request
+multiplexing on the persistent agent channel.
+"""
+
+import os
+import sys
+import time
+import shutil
+import tempfile
+import unittest
+import threading
+
+# Add parent and agent directories to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+sys.path.insert(0, os.path.join(ROOT, 'vm_images', 'agent'))
+
+from vm_manager.agent_channel import AgentChannel
+from vm_manager.file_transfer import TransferError, put_file, get_file
+
+
+class TestFileTransfer(unittest.TestCase):
+    """Test streaming transfer against a local agent"""
+    
+    @classmethod
+    def setUpClass(cls):
+        import agent
+        cls.tmp = tempfile.mkdtemp()
+        cls.socket_path = os.path.join(cls.tmp, "agent.sock")
+        cls.agent = agent.SandboxAgent()
+        threading.Thread(target=cls.agent.run_socket, args=(cls.socket_path,), daemon=True).start()
+        for _ in range(50):
+            if os.path.exists(cls.socket_path):
+                break
+            time.sleep(0.05)
+        cls.channel = AgentChannel(cls.socket_path)
+    
+    @classmethod
+    def tearDownClass(cls):
+        cls.channel.close()
+        cls.agent.stop()
+        shutil.rmtree(cls.tmp, ignore_errors=True)
+    
+    def _sample(self, name: str, size: int) -> str:
+        path = os.path.join(self.tmp, name)
+        with open(path, 'wb') as f:
+            f.write(os.urandom(size))
+        return path
+    
+    def _read(self, path: str) -> bytes:
+        with open(path, 'rb') as f:
+            return f.read()
+    
+    def test_roundtrip(self):
+        """File survives upload and download unchanged"""
+        src = self._sample("src.bin", 300 * 1024 + 17)
+        guest = os.path.join(self.tmp, "guest.bin")
+        back = os.path.join(self.tmp, "back.bin")
+        
+        put_file(self.channel, src, guest, mode=0o755)
+        self.assertEqual(self._read(guest), self._read(src))
+        self.assertEqual(os.stat(guest).st_mode & 0o777, 0o755)
+        
+        get_file(self.channel, guest, back)
+        self.assertEqual(self._read(back), self._read(src))
+    
+    def test_resume_upload(self):
+        """Upload continues from an existing partial file"""
+        src = self._sample("resume.bin", 200 * 1024)
+        guest = os.path.join(self.tmp, "resume_guest.bin")
+        with open(guest + '.part', 'wb') as f:
+            f.write(self._read(src)[:70000])
+        
+        put_file(self.channel, src, guest)
+        self.assertEqual(self._read(guest), self._read(src))
+        self.assertFalse(os.path.exists(guest + '.part'))
+    
+    def test_resume_download(self):
+        """Download continues from an existing local partial file"""
+        src = self._sample("dl.bin", 150 * 1024)
+        local = os.path.join(self.tmp, "dl_local.bin")
+        with open(local + '.part', 'wb') as f:
+            f.write(self._read(src)[:50000])
+        
+        get_file(self.channel, src, local)
+        self.assertEqual(self._read(local), self._read(src))
+    
+    def test_checksum_mismatch(self):
+        """Corrupted upload is rejected"""
+        src = self._sample("bad.bin", 1024)
+        guest = os.path.join(self.tmp, "bad_guest.bin")
+        with self.assertRaises(TransferError):
+            put_file(self.channel, src, guest, sha256="0" * 64)
+        self.assertFalse(os.path.exists(guest))
+    
+    def test_hello(self):
+        """Agent greets a new connection"""
+        channel = AgentChannel(self.socket_path)
+        self.addCleanup(channel.close)
+        channel.connect()
+        self.assertTrue(channel.wait_hello(5))
+        self.assertIn('pid', channel.hello_info)
+    
+    def test_ping_during_long_command(self):
+        """Requests on one connection are answered independently"""
+        slow = {}
+        t = threading.Thread(target=lambda: slow.update(
+            self.channel.request({'command': 'execute', 'cmd': 'sleep 1'}, timeout=10)))
+        t.start()
+        time.sleep(0.1)
+        
+        start = time.time()
+        response = self.channel.request({'command': 'ping'}, timeout=5)
+        self.assertTrue(response['success'])
+        self.assertLess(time.time() - start, 0.5)
+        
+        t.join()
+        self.assertTrue(slow['success'])
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
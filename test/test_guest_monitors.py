@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+"""
+Guest Monitor Tests
+
+Checks the agent's native file and network monitors: the classic BPF
+port filter (run through a small interpreter and, where the sandbox
+allows packet sockets, in the kernel), packet and fanotify record
+decoding, per-flow deduplication and that fallback monitors reap their
+child processes.
+"""
+
+import os
+import sys
+import time
+import socket
+import struct
+import shutil
+import tempfile
+import unittest
+import subprocess
+
+# Add parent and agent directories to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+sys.path.insert(0, os.path.join(ROOT, 'vm_images', 'agent'))
+
+import agent
+
+
+def run_bpf(program, packet: bytes) -> int:
+    """Interpret the subset of classic BPF that build_port_filter emits"""
+    a = x = pc = 0
+    while True:
+        code, jt, jf, k = program[pc]
+        pc += 1
+        if code == agent.BPF_LD_B_ABS:
+            a = packet[k]
+        elif code == agent.BPF_LD_H_ABS:
+            a = struct.unpack_from('!H', packet, k)[0]
+        elif code == agent.BPF_LD_H_IND:
+            a = struct.unpack_from('!H', packet, x + k)[0]
+        elif code == agent.BPF_LDX_B_MSH:
+            x = (packet[k] & 0x0f) * 4
+        elif code == agent.BPF_ALU_RSH_K:
+            a >>= k
+        elif code == agent.BPF_JEQ_K:
+            pc += jt if a == k else jf
+        elif code == agent.BPF_JSET_K:
+            pc += jt if a & k else jf
+        elif code == agent.BPF_RET_K:
+            return k
+        else:
+            raise AssertionError(f"unexpected opcode {code:#x}")
+
+
+def ipv4(l4: int, payload: bytes, frag: int = 0) -> bytes:
+    header = struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(payload), 1, frag, 64, l4, 0,
+                         socket.inet_aton('10.0.2.15'), socket.inet_aton('93.184.216.34'))
+    return header + payload
+
+
+def ipv6(l4: int, payload: bytes) -> bytes:
+    return (struct.pack('!IHBB', 6 << 28, len(payload), l4, 64)
+            + socket.inet_pton(socket.AF_INET6, 'fd00::2') + socket.inet_pton(socket.AF_INET6, '2001:db8::1')
+            + payload)
+
+
+def tcp(dport: int, flags: int = agent.TCP_SYN) -> bytes:
+    return struct.pack('!HHIIBBHHH', 40000, dport, 0, 0, 5 << 4, flags, 1024, 0, 0)
+
+
+def udp(dport: int) -> bytes:
+    return struct.pack('!HHHH', 40001, dport, 8, 0)
+
+
+class TestPortFilter(unittest.TestCase):
+    """Test the BPF program and packet decoding"""
+    
+    def test_filter_matches_ports(self):
+        program = agent.build_port_filter([53, 443], snaplen=96)
+        self.assertEqual(run_bpf(program, ipv4(agent.IPPROTO_TCP, tcp(443))), 96)
+        self.assertEqual(run_bpf(program, ipv4(agent.IPPROTO_UDP, udp(53))), 96)
+        self.assertEqual(run_bpf(program, ipv6(agent.IPPROTO_TCP, tcp(443))), 96)
+        self.assertEqual(run_bpf(program, ipv4(agent.IPPROTO_TCP, tcp(22))), 0)
+        self.assertEqual(run_bpf(program, ipv6(agent.IPPROTO_UDP, udp(5353))), 0)
+        # ICMP and non-first fragments carry no ports
+        self.assertEqual(run_bpf(program, ipv4(1, b'\x08\x00' + b'\x00' * 6)), 0)
+        self.assertEqual(run_bpf(program, ipv4(agent.IPPROTO_UDP, udp(53), frag=100)), 0)
+        # Any port when none are configured
+        self.assertEqual(run_bpf(agent.build_port_filter([]), ipv4(agent.IPPROTO_TCP, tcp(22))),
+                         agent.CAPTURE_SNAPLEN)
+        with self.assertRaises(ValueError):
+            agent.build_port_filter(list(range(1, 200)))
+    
+    def test_parse_packet(self):
+        self.assertEqual(agent.parse_packet(ipv4(agent.IPPROTO_TCP, tcp(443)), agent.ETH_P_IP),
+                         ('tcp', '10.0.2.15', '93.184.216.34', 40000, 443))
+        self.assertIsNone(agent.parse_packet(
+            ipv4(agent.IPPROTO_TCP, tcp(443, agent.TCP_SYN | agent.TCP_ACK)), agent.ETH_P_IP))
+        self.assertEqual(agent.parse_packet(ipv6(agent.IPPROTO_UDP, udp(53)), agent.ETH_P_IPV6),
+                         ('udp', 'fd00::2', '2001:db8::1', 40001, 53))
+        self.assertIsNone(agent.parse_packet(b'\x45' + b'\x00' * 10, agent.ETH_P_IP))
+    
+    def test_one_event_per_flow(self):
+        sink = agent.EventSink()
+        monitor = agent.PacketMonitor(sink, [53])
+        flow = agent.parse_packet(ipv4(agent.IPPROTO_UDP, udp(53)), agent.ETH_P_IP)
+        for _ in range(3):
+            monitor._record(flow)
+        events = sink.get_events('network')
+        self.assertEqual(len(events), 1)
+        self.assertEqual((events[0]['event_type'], events[0]['dst_port']), ('dns', 53))
+    
+    def test_kernel_capture(self):
+        """The filter attaches to a real packet socket and drops other ports"""
+        sink = agent.EventSink()
+        monitor = agent.PacketMonitor(sink, [8081])
+        try:
+            monitor.open()
+        except OSError as e:
+            self.skipTest(f"packet sockets unavailable: {e}")
+        monitor.start()
+        sender = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        try:
+            for port in (8081, 8082, 8081):
+                sender.sendto(b'x', ('127.0.0.1', port))
+            deadline = time.time() + 2
+            while not sink.get_events('network') and time.time() < deadline:
+                time.sleep(0.05)
+        finally:
+            sender.close()
+            monitor.stop()
+        events = sink.get_events('network')
+        self.assertEqual([(e['dst_addr'], e['dst_port'], e['protocol']) for e in events],
+                         [('127.0.0.1', 8081, 'udp')])
+
+
+class TestFanotify(unittest.TestCase):
+    """Test fanotify record decoding and filtering"""
+    
+    def test_parse_records(self):
+        record = lambda mask, fd, pid: agent.FAN_EVENT.pack(
+            agent.FAN_EVENT.size, agent.FANOTIFY_METADATA_VERSION, 0, agent.FAN_EVENT.size, mask, fd, pid)
+        buf = record(agent.FAN_OPEN, 7, 100) + record(agent.FAN_Q_OVERFLOW, agent.FAN_NOFD, 0)
+        self.assertEqual(list(agent.parse_fanotify_events(buf + b'\x00' * 5, len(buf) + 5)),
+                         [(agent.FAN_OPEN, 7, 100), (agent.FAN_Q_OVERFLOW, agent.FAN_NOFD, 0)])
+    
+    def test_record_filters(self):
+        sink = agent.EventSink()
+        monitor = agent.FanotifyMonitor(sink, ['/etc', '/tmp/'])
+        monitor._record(1.0, agent.FAN_OPEN | agent.FAN_CLOSE_WRITE, '/etc/cron.d/x', 50, 1)
+        monitor._record(1.0, agent.FAN_CLOSE_WRITE, '/etc/cron.d/x', 50, 1)
+        monitor._record(1.0, agent.FAN_OPEN, '/etcetera/x', 50, 1)
+        monitor._record(1.0, agent.FAN_OPEN, '/tmp/agent.log', 1, 1)
+        monitor._record(1.0, agent.FAN_OPEN_EXEC | agent.FAN_OPEN, '/tmp/payload', 51, 1)
+        self.assertEqual([(e['event_type'], e['path'], e['pid']) for e in sink.get_events('files')],
+                         [('write', '/etc/cron.d/x', 50), ('exec', '/tmp/payload', 51)])
+    
+    def test_kernel_events(self):
+        """Writes by another process under a watched path are reported with its pid"""
+        tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmp, True)
+        sink = agent.EventSink()
+        monitor = agent.FanotifyMonitor(sink, [tmp])
+        try:
+            monitor.open()
+        except OSError as e:
+            self.skipTest(f"fanotify unavailable: {e}")
+        monitor.start()
+        target = os.path.join(tmp, 'dropped')
+        try:
+            writer = subprocess.run(['sh', '-c', f'echo x > {target}; echo $$'],
+                                    capture_output=True, text=True)
+            deadline = time.time() + 2
+            while not sink.get_events('files') and time.time() < deadline:
+                time.sleep(0.05)
+        finally:
+            monitor.stop()
+        events = [e for e in sink.get_events('files') if e['path'] == target]
+        self.assertIn('write', {e['event_type'] for e in events})
+        self.assertEqual({e['pid'] for e in events}, {int(writer.stdout)})
+
+
+class TestFallbackMonitors(unittest.TestCase):
+    """Fallback monitors must not leave their tools running"""
+    
+    def test_stop_reaps_child(self):
+        monitor = agent.NetworkMonitor(agent.EventSink())
+        monitor._process = subprocess.Popen(['sleep', '30'])
+        monitor.stop()
+        self.assertIsNotNone(monitor._process.returncode)
+    
+    def test_open_monitors_falls_back(self):
+        def unavailable(self):
+            raise OSError(1, 'Operation not permitted')
+        originals = agent.FanotifyMonitor.open, agent.PacketMonitor.open
+        agent.FanotifyMonitor.open = agent.PacketMonitor.open = unavailable
+        try:
+            monitors = agent.open_monitors(agent.EventSink(), ['/srv'], [22])
+        finally:
+            agent.FanotifyMonitor.open, agent.PacketMonitor.open = originals
+        self.assertEqual([type(m) for m in monitors], [agent.FileMonitor, agent.NetworkMonitor])
+        self.assertEqual((monitors[0].watch_paths, monitors[1].ports), (['/srv'], [22]))
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""
+Streaming Ingest Tests
+
+Checks that a streamed upload gets the same descriptor as describe() on
+the finished file, the memory/disk spill, the ClamAV scan of the stream
+(against the clamd stand-in of test_clamd) and cleanup of failed uploads.
+"""
+
+import os
+import sys
+import socket
+import shutil
+import struct
+import tempfile
+import unittest
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from ingest import IngestStream, ingest
+from sample import describe
+from static import ClamdClient, StaticAnalyzer
+from test_clamd import FakeClamd, SIGNATURE
+from test_virustotal import static_config
+
+
+def elf_arm64(size: int) -> bytes:
+    """ELF64 header with one PT_LOAD program header, padded to size"""
+    header = b'\x7fELF' + bytes([2, 1, 1]) + b'\x00' * 9
+    header += struct.pack('<HHIQQQIHHHHHH', 2, 183, 1, 0x400000, 64, 0, 0, 64, 56, 1, 64, 0, 0)
+    header += struct.pack('<IIQQQQQQ', 1, 5, 0, 0x400000, 0x400000, size, size, 4096)
+    return header + bytes((i * 7) % 251 for i in range(size - len(header)))
+
+
+def chunked(data: bytes, n: int):
+    for i in range(0, len(data), n):
+        yield data[i:i + n]
+
+
+class TestIngest(unittest.TestCase):
+    """Test the streaming upload path"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+    
+    def test_descriptor_matches_describe(self):
+        for name, data in (('tool', elf_arm64(300 * 1024)), ('run.sh', b'#!/bin/sh\necho hi\n' * 100),
+                           ('empty', b'')):
+            path = os.path.join(self.tmp, name)
+            upload = ingest(chunked(data, 4096), path)
+            self.assertFalse(upload.spilled)
+            self.assertEqual(upload.sample, describe(path), name)
+            self.assertFalse(os.path.exists(upload.part_path))
+        self.assertEqual(upload.sample.size, 0)
+        self.assertTrue(describe(os.path.join(self.tmp, 'tool')).static)
+    
+    def test_spill(self):
+        data = elf_arm64(64 * 1024)
+        path = os.path.join(self.tmp, 'big')
+        upload = IngestStream(path, spill_bytes=10000)
+        chunks = chunked(data, 4096)
+        for chunk in (next(chunks), next(chunks)):
+            upload.write(chunk)
+        self.assertFalse(upload.spilled)
+        upload.write(next(chunks))
+        self.assertTrue(upload.spilled)
+        self.assertFalse(os.path.exists(path))
+        for chunk in chunks:
+            upload.write(chunk)
+        self.assertEqual(upload.finish().sha256, describe(path).sha256)
+        with open(path, 'rb') as f:
+            self.assertEqual(f.read(), data)
+        
+        # Announced as large: on disk from the first chunk
+        hinted = IngestStream(os.path.join(self.tmp, 'hinted'), size_hint=len(data), spill_bytes=10000)
+        hinted.write(data[:100])
+        self.assertTrue(hinted.spilled)
+        hinted.abort()
+        self.assertFalse(os.path.exists(hinted.part_path))
+    
+    def test_clamd_scans_the_stream(self):
+        daemon = FakeClamd(socket.AF_UNIX, os.path.join(self.tmp, 'clamd.ctl'))
+        self.addCleanup(daemon.close)
+        client = ClamdClient(unix_socket=os.path.join(self.tmp, 'clamd.ctl'), timeout=5)
+        self.addCleanup(client.close)
+        
+        data = b'junk' * 50000 + SIGNATURE
+        path = os.path.join(self.tmp, 'eicar.com')
+        upload = ingest(chunked(data, 1000), path, clamd=client)
+        self.assertEqual(upload.clamav, {"infected": True, "signature": "Eicar-Test-Signature"})
+        self.assertEqual(daemon.commands, ['INSTREAM'])
+        
+        # The analyzer takes the streamed verdict instead of scanning again
+        analyzer = StaticAnalyzer(yara_dir=os.path.join(self.tmp, 'rules'), clamscan='/nonexistent/clamscan',
+                                  config_path=static_config(self.tmp))
+        analyzer.vt.api_key = ''
+        res = analyzer.run(path, upload.sample, use_cache=False, clamav=upload.clamav)
+        self.assertTrue(res['clamav']['infected'])
+        self.assertEqual(res['hash'], describe(path).sha256)
+        self.assertEqual(daemon.commands, ['INSTREAM'])
+    
+    def test_failed_download(self):
+        daemon = FakeClamd(socket.AF_UNIX, os.path.join(self.tmp, 'clamd.ctl'))
+        self.addCleanup(daemon.close)
+        client = ClamdClient(unix_socket=os.path.join(self.tmp, 'clamd.ctl'), timeout=5)
+        self.addCleanup(client.close)
+        
+        def broken():
+            yield b'x' * 5000
+            raise ConnectionResetError('telegram went away')
+        
+        path = os.path.join(self.tmp, 'partial')
+        with self.assertRaises(ConnectionResetError):
+            ingest(broken(), path, spill_bytes=1000, clamd=client)
+        self.assertEqual(os.listdir(self.tmp), ['clamd.ctl'])
+        # The half-sent stream was dropped, the client still works
+        self.assertFalse(client.scan_stream([b'clean'])['infected'])
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
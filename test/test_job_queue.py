@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+"""
+Job Queue Tests
+
+Tests for priority, per-user fairness and persistence of the analysis queue.
+"""
+
+import os
+import sys
+import time
+import shutil
+import tempfile
+import unittest
+import threading
+
+# Add parent directory to path
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from job_queue import JobQueue, PRIORITY_HIGH, PRIORITY_NORMAL
+
+
+class TestJobQueue(unittest.TestCase):
+    """Test scheduling order and callbacks"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.db = os.path.join(self.tmp, "jobs.db")
+    
+    def tearDown(self):
+        shutil.rmtree(self.tmp, ignore_errors=True)
+    
+    def _run_all(self, queue: JobQueue, expected: int, timeout: float = 5):
+        """Start a single worker and wait until `expected` jobs finished"""
+        done = []
+        event = threading.Event()
+        
+        def on_done(job, result):
+            done.append(result)
+            if len(done) == expected:
+                event.set()
+        
+        for handler in queue._handlers.values():
+            handler.on_done = on_done
+        queue.start()
+        self.assertTrue(event.wait(timeout))
+        queue.stop()
+        return done
+    
+    def test_priority_first(self):
+        """High priority jobs run before normal ones"""
+        queue = JobQueue(self.db, workers=1)
+        queue.register("echo", lambda job, progress: job.payload["n"])
+        queue.submit("echo", 1, {"n": "normal"}, priority=PRIORITY_NORMAL)
+        queue.submit("echo", 1, {"n": "high"}, priority=PRIORITY_HIGH)
+        
+        self.assertEqual(self._run_all(queue, 2), ["high", "normal"])
+    
+    def test_user_round_robin(self):
+        """A user's batch does not starve other users"""
+        queue = JobQueue(self.db, workers=1)
+        queue.register("echo", lambda job, progress: (job.user_id, job.payload["n"]))
+        for n in range(3):
+            queue.submit("echo", 1, {"n": n})
+        queue.submit("echo", 2, {"n": 0})
+        
+        order = [uid for uid, _ in self._run_all(queue, 4)]
+        self.assertEqual(order[:2], [1, 2])
+    
+    def test_progress_and_error(self):
+        """Progress text and errors reach the callbacks"""
+        queue = JobQueue(self.db, workers=1)
+        messages, errors = [], []
+        event = threading.Event()
+        
+        def run(job, progress):
+            progress("step")
+            raise RuntimeError("boom")
+        
+        def on_error(job, e):
+            errors.append(str(e))
+            event.set()
+        
+        queue.register("bad", run, on_error=on_error,
+                       on_progress=lambda job, text: messages.append(text))
+        queue.submit("bad", 1, {})
+        queue.start()
+        self.assertTrue(event.wait(5))
+        queue.stop()
+        
+        self.assertEqual(messages, ["step"])
+        self.assertEqual(errors, ["boom"])
+    
+    def test_recover_after_restart(self):
+        """Queued jobs survive a restart"""
+        queue = JobQueue(self.db, workers=1)
+        queue.register("echo", lambda job, progress: job.payload["n"])
+        queue.submit("echo", 1, {"n": 42})
+        self.assertEqual(queue.get_stats()['pending'], 1)
+        
+        restarted = JobQueue(self.db, workers=1)
+        restarted.register("echo", lambda job, progress: job.payload["n"])
+        self.assertEqual(self._run_all(restarted, 1), [42])
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
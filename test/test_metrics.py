@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+Pipeline Metrics Tests
+
+Checks the Prometheus text output, histogram quantile estimates, spans
+collected into per-job traces by the job queue, the /metrics endpoint
+and that a full analysis stores its trace with the analyses row.
+"""
+
+import os
+import sys
+import shutil
+import tempfile
+import threading
+import unittest
+import urllib.request
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+import metrics
+from job_queue import JobQueue
+from sample import describe
+from dynamic import AnalysisDB, AnalysisResult
+
+
+class TestRegistry(unittest.TestCase):
+    """Test metric types and the exposition format"""
+    
+    def test_render(self):
+        registry = metrics.Registry()
+        registry.counter('jobs_total', 'Jobs', ('kind',)).inc(kind='full')
+        gauge = registry.gauge('slots', 'Slots', ('arch', 'state'))
+        gauge.set_function(lambda: {('arm64', 'busy'): 1, ('arm64', 'idle'): 2})
+        hist = registry.histogram('took_seconds', 'Took', ('stage',), buckets=(0.1, 1))
+        for value in (0.05, 0.5, 3):
+            hist.observe(value, stage='yara')
+        
+        text = registry.render()
+        for line in ('# TYPE jobs_total counter', 'jobs_total{kind="full"} 1',
+                     'slots{arch="arm64",state="idle"} 2',
+                     '# TYPE took_seconds histogram',
+                     'took_seconds_bucket{stage="yara",le="0.1"} 1',
+                     'took_seconds_bucket{stage="yara",le="1"} 2',
+                     'took_seconds_bucket{stage="yara",le="+Inf"} 3',
+                     'took_seconds_sum{stage="yara"} 3.55',
+                     'took_seconds_count{stage="yara"} 3'):
+            self.assertIn(line, text.splitlines())
+        self.assertTrue(text.endswith('\n'))
+        
+        # Same name and type: the existing metric; wrong labels are refused
+        self.assertIs(registry.histogram('took_seconds', 'Took', ('stage',)), hist)
+        with self.assertRaises(ValueError):
+            registry.gauge('took_seconds', 'Took')
+        with self.assertRaises(ValueError):
+            hist.observe(1, arch='x64')
+    
+    def test_quantile(self):
+        hist = metrics.Histogram('q_seconds', 'Q', buckets=(1, 2, 4))
+        self.assertIsNone(hist.quantile(0.5))
+        for value in [0.5] * 50 + [1.5] * 49 + [3]:
+            hist.observe(value)
+        self.assertAlmostEqual(hist.quantile(0.5), 1.0)
+        self.assertAlmostEqual(hist.quantile(0.99), 2.0)
+        self.assertAlmostEqual(hist.quantile(0.995), 3.0)
+        hist.observe(100)
+        self.assertEqual(hist.quantile(1.0), 4)
+    
+    def test_exporter(self):
+        registry = metrics.Registry()
+        registry.gauge('up', 'Up').set(1)
+        server = metrics.serve(0, registry=registry)
+        self.addCleanup(server.server_close)
+        self.addCleanup(server.shutdown)
+        url = f"http://127.0.0.1:{server.server_address[1]}/metrics"
+        with urllib.request.urlopen(url, timeout=5) as r:
+            self.assertTrue(r.headers['Content-Type'].startswith('text/plain; version=0.0.4'))
+            self.assertIn('up 1', r.read().decode().splitlines())
+
+
+class TestTraces(unittest.TestCase):
+    """Test spans and per-job traces"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+    
+    def test_spans(self):
+        before = metrics.STAGE_SECONDS.count(stage='test_stage')
+        with metrics.trace('job') as t:
+            with metrics.span('test_stage', vm='arm') as attrs:
+                attrs['cached'] = True
+            with self.assertRaises(KeyError):
+                with metrics.span('test_stage'):
+                    raise KeyError('x')
+            metrics.record('guest_execute', 2.0)
+            # Other threads do not write into this job's trace
+            other = threading.Thread(target=lambda: metrics.record('test_stage', 1))
+            other.start()
+            other.join()
+        self.assertIsNone(metrics.current_trace())
+        
+        spans = t.to_dict()['spans']
+        self.assertEqual([(s['stage'], s.get('cached'), s.get('error')) for s in spans],
+                         [('test_stage', True, None), ('test_stage', None, 'KeyError'),
+                          ('guest_execute', None, None)])
+        self.assertEqual(spans[0]['vm'], 'arm')
+        self.assertEqual(t.totals()['guest_execute'], 2.0)
+        self.assertEqual(metrics.STAGE_SECONDS.count(stage='test_stage'), before + 3)
+    
+    def test_job_trace(self):
+        path = os.path.join(self.tmp, 'a.sh')
+        with open(path, 'w') as f:
+            f.write('#!/bin/sh\necho hi\n')
+        queue = JobQueue(os.path.join(self.tmp, 'jobs.db'), workers=1)
+        done = []
+        event = threading.Event()
+        
+        def run(job, progress):
+            with metrics.span('download'):
+                pass
+            return describe(job.payload['path']).file_type
+        
+        def on_done(job, result):
+            done.append((result, job.trace))
+            event.set()
+        
+        jobs = metrics.JOB_SECONDS.count(kind='traced', state='done')
+        queue.register('traced', run, on_done=on_done)
+        job = queue.submit('traced', 1, {'path': path})
+        queue.start()
+        self.assertTrue(event.wait(5))
+        queue.stop()
+        
+        result, trace = done[0]
+        self.assertEqual(result, 'shell')
+        self.assertEqual(trace['name'], f'traced:{job.id}')
+        self.assertEqual([s['stage'] for s in trace['spans']], ['download', 'hash'])
+        self.assertEqual(metrics.JOB_SECONDS.count(kind='traced', state='done'), jobs + 1)
+        self.assertGreaterEqual(metrics.QUEUE_WAIT_SECONDS.count(kind='traced'), 1)
+    
+    def test_trace_stored_with_analysis(self):
+        db = AnalysisDB(os.path.join(self.tmp, 'analysis.db'))
+        self.addCleanup(db.close)
+        result = AnalysisResult(verdict='CLEAN', threat_score=0, reasons=[], events=[], duration=1.0,
+                                file_type='shell', file_hash='h1', yara_matches=[], mitre_techniques=[])
+        trace = {'name': 'full:1', 'spans': [{'stage': 'vm', 'start': 0.1, 'duration': 0.9}]}
+        db.save('/tmp/a.sh', result, trace=trace)
+        self.assertEqual(db.get_by_hash('h1')['trace'], trace)
+        db.flush()
+        self.assertEqual(db.get_by_hash('h1')['trace'], trace)
+        db.save('/tmp/b.sh', AnalysisResult(**dict(vars(result), file_hash='h2')))
+        db.flush()
+        self.assertIsNone(db.get_by_hash('h2')['trace'])
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
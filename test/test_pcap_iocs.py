@@ -0,0 +1,216 @@
+#!/usr/bin/env python3
+"""
+Pcap IOC Tests
+
+Builds captures from crafted packets and checks DNS query, HTTP request
+and TLS SNI extraction, the suffix index over suspicious domains and that
+captures written by the guest agent's packet monitor parse on the host.
+"""
+
+import os
+import sys
+import time
+import shutil
+import socket
+import struct
+import tempfile
+import unittest
+
+# Add parent and agent directories to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+sys.path.insert(0, os.path.join(ROOT, 'vm_images', 'agent'))
+
+import agent
+import pcap_iocs
+from dynamic import RuleEngine, ThreatScorer, DynamicAnalyzer
+
+
+def ipv4(proto: int, payload: bytes, dst: str = '93.184.216.34') -> bytes:
+    return struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(payload), 1, 0, 64, proto, 0,
+                       socket.inet_aton('10.0.2.15'), socket.inet_aton(dst)) + payload
+
+
+def udp(dport: int, payload: bytes) -> bytes:
+    return struct.pack('!HHHH', 40001, dport, 8 + len(payload), 0) + payload
+
+
+def tcp(dport: int, payload: bytes) -> bytes:
+    return struct.pack('!HHIIBBHHH', 40000, dport, 1, 1, 5 << 4, 0x18, 1024, 0, 0) + payload
+
+
+def dns_query(name: str, response: bool = False) -> bytes:
+    qname = b''.join(bytes([len(l)]) + l.encode() for l in name.split('.')) + b'\x00'
+    return struct.pack('!HHHHHH', 0x1234, 0x8180 if response else 0x0100, 1, 0, 0, 0) + qname + b'\x00\x01\x00\x01'
+
+
+def client_hello(server_name: str) -> bytes:
+    name = server_name.encode()
+    sni = struct.pack('!HBH', len(name) + 3, 0, len(name)) + name
+    extensions = struct.pack('!HH', 0x000b, 2) + b'\x01\x00' + struct.pack('!HH', 0, len(sni)) + sni
+    body = (b'\x03\x03' + b'\x00' * 32 + b'\x00' + struct.pack('!H', 2) + b'\x13\x01' + b'\x01\x00'
+            + struct.pack('!H', len(extensions)) + extensions)
+    handshake = b'\x01' + len(body).to_bytes(3, 'big') + body
+    return b'\x16\x03\x01' + struct.pack('!H', len(handshake)) + handshake
+
+
+def pcap(packets, linktype: int = pcap_iocs.LINKTYPE_RAW, link_header: bytes = b'') -> bytes:
+    out = [pcap_iocs.PCAP_HEADER.pack(pcap_iocs.PCAP_MAGIC, 2, 4, 0, 0, 65535, linktype)]
+    for i, packet in enumerate(packets):
+        frame = link_header + packet
+        out.append(pcap_iocs.PCAP_RECORD.pack(1000 + i, 0, len(frame), len(frame)) + frame)
+    return b''.join(out)
+
+
+class TestExtraction(unittest.TestCase):
+    """Test the protocol parsers over whole captures"""
+    
+    def test_dns_http_sni(self):
+        http = (b'GET /bot123/sendMessage HTTP/1.1\r\nHost: API.Telegram.org:80\r\n'
+                b'User-Agent: python-requests/2.31\r\n\r\n')
+        data = pcap([
+            ipv4(17, udp(53, dns_query('Evil.XYZ'))),
+            ipv4(17, udp(53, dns_query('evil.xyz'))),
+            ipv4(17, udp(53, dns_query('evil.xyz', response=True))),
+            ipv4(6, tcp(80, http)),
+            ipv4(6, tcp(443, client_hello('pastebin.com'))),
+            ipv4(6, tcp(443, b'\x17\x03\x03\x00\x10' + b'\x00' * 16)),
+        ])
+        iocs = pcap_iocs.extract_iocs(data)
+        self.assertEqual([(i.kind, i.host, i.dst_port) for i in iocs],
+                         [('dns', 'evil.xyz', 53), ('http', 'api.telegram.org', 80), ('sni', 'pastebin.com', 443)])
+        self.assertEqual((iocs[1].path, iocs[1].user_agent), ('/bot123/sendMessage', 'python-requests/2.31'))
+    
+    def test_link_layers(self):
+        packet = ipv4(17, udp(53, dns_query('a.example')))
+        ethernet = b'\x00' * 12 + struct.pack('!H', pcap_iocs.ETHERTYPE_IP)
+        sll = b'\x00' * 14 + struct.pack('!H', pcap_iocs.ETHERTYPE_IP)
+        for linktype, header in ((pcap_iocs.LINKTYPE_ETHERNET, ethernet), (pcap_iocs.LINKTYPE_LINUX_SLL, sll)):
+            iocs = pcap_iocs.extract_iocs(pcap([packet], linktype, header))
+            self.assertEqual([i.host for i in iocs], ['a.example'])
+    
+    def test_malformed_input(self):
+        self.assertEqual(pcap_iocs.extract_iocs(b'not a pcap'), [])
+        truncated = pcap([ipv4(6, tcp(443, client_hello('x.example')))])[:-30]
+        self.assertEqual(pcap_iocs.extract_iocs(truncated), [])
+        self.assertIsNone(pcap_iocs.parse_tls_sni(memoryview(client_hello('x.example')[:60])))
+        self.assertEqual(pcap_iocs.extract_file('/nonexistent.pcap'), [])
+
+
+class TestDomainIndex(unittest.TestCase):
+    """Test matching names against patterns.yaml indicators"""
+    
+    def setUp(self):
+        self.index = pcap_iocs.DomainIndex.from_rules({'network': {
+            'suspicious_tlds': ['.xyz'],
+            'suspicious_endpoints': [{'host': 'discord.com/api/webhooks', 'score': 25, 'description': 'webhook'}],
+            'suspicious_paths': ['/sendMessage'],
+            'suspicious_user_agents': [{'pattern': 'wget/', 'score': 10, 'description': 'wget UA'}],
+        }}, hosts={'telegram.org': ('T1102', 20, 'Telegram')})
+    
+    def test_suffix_match(self):
+        self.assertEqual(self.index.match_host('api.telegram.org'), [(20, 'T1102', 'Telegram')])
+        self.assertEqual(self.index.match_host('nottelegram.org'), [])
+        self.assertEqual([m[0] for m in self.index.match_host('c2.evil.xyz.')], [pcap_iocs.TLD_SCORE])
+        # Endpoints with a path need a matching request path
+        self.assertEqual(self.index.match_host('discord.com'), [])
+        self.assertEqual(self.index.match_host('discord.com', '/api/webhooks/1/x'), [(25, 'T1102', 'webhook')])
+    
+    def test_http_fields(self):
+        hits = self.index.match({'kind': 'http', 'host': '10.1.1.1', 'path': '/bot1/sendMessage',
+                                 'user_agent': 'Wget/1.21'})
+        self.assertEqual(sorted(h[0] for h in hits), [10, 10])
+    
+    def test_scoring_and_replay(self):
+        rules = RuleEngine(os.path.join(ROOT, 'patterns.yaml'))
+        analyzer = DynamicAnalyzer.__new__(DynamicAnalyzer)
+        analyzer.rules = rules
+        scorer = ThreatScorer(rules)
+        analyzer._process_vm_events(scorer, {'iocs': [
+            {'kind': 'sni', 'host': 'api.telegram.org', 'dst_addr': '149.154.167.220', 'dst_port': 443},
+            {'kind': 'dns', 'host': 'example.com', 'dst_addr': '10.0.2.3', 'dst_port': 53},
+        ]})
+        self.assertEqual([e.mitre for e in scorer.events], ['T1102'])
+        self.assertIn('api.telegram.org', scorer.events[0].details)
+    
+    def test_capture_deleted_after_extraction(self):
+        """The fetched pcap is read once, then removed unless capture.keep_pcap"""
+        from types import SimpleNamespace
+        from test_rescore import FakeVMManager
+        tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmp, True)
+        capture = os.path.join(tmp, 'run.pcap')
+        sample = os.path.join(tmp, 'sample.sh')
+        with open(sample, 'w') as f:
+            f.write('true\n')
+        
+        class CapturingVM(FakeVMManager):
+            config = SimpleNamespace(keep_pcap=False)
+            
+            def analyze_file(self, *args, **kwargs):
+                with open(capture, 'wb') as f:
+                    f.write(pcap([ipv4(17, udp(53, dns_query('evil.xyz')))]))
+                result = super().analyze_file(*args, **kwargs)
+                result.pcap_path = capture
+                return result
+        
+        analyzer = DynamicAnalyzer(db_path=os.path.join(tmp, 'dyn.db'), yara_dir=os.path.join(tmp, 'rules'),
+                                   vm_config_path='', cache_path=os.path.join(tmp, 'results.db'),
+                                   yara_cache_dir=os.path.join(tmp, 'yara_cache'))
+        self.addCleanup(analyzer.db.close)
+        analyzer._vm_manager, analyzer._vm_available = CapturingVM(), True
+        
+        result = analyzer.run(sample, use_cache=False)
+        self.assertEqual([i['host'] for i in result['sandbox']['iocs']], ['evil.xyz'])
+        self.assertIsNone(result['sandbox']['pcap'])
+        self.assertFalse(os.path.exists(capture))
+        
+        CapturingVM.config.keep_pcap = True
+        result = analyzer.run(sample, use_cache=False)
+        self.assertEqual(result['sandbox']['pcap'], capture)
+        self.assertTrue(os.path.exists(capture))
+
+
+class TestGuestCapture(unittest.TestCase):
+    """Captures written by the guest agent parse on the host"""
+    
+    def test_writer_roundtrip(self):
+        path = tempfile.mktemp(suffix='.pcap')
+        self.addCleanup(lambda: os.path.exists(path) and os.unlink(path))
+        packet = ipv4(17, udp(53, dns_query('beacon.top')))
+        writer = agent.PcapWriter(path, max_bytes=agent.PCAP_HEADER.size + 2 * (16 + len(packet)))
+        for _ in range(3):
+            writer.write(time.time(), packet, len(packet))
+        writer.close()
+        self.assertEqual(writer.dropped, 1)
+        self.assertEqual([i['host'] for i in pcap_iocs.extract_file(path)], ['beacon.top'])
+    
+    def test_kernel_capture(self):
+        """Full-payload capture covers ports outside the event filter"""
+        path = tempfile.mktemp(suffix='.pcap')
+        self.addCleanup(lambda: os.path.exists(path) and os.unlink(path))
+        sink = agent.EventSink()
+        monitor = agent.PacketMonitor(sink, [8081], pcap_path=path)
+        try:
+            monitor.open()
+        except OSError as e:
+            self.skipTest(f"packet sockets unavailable: {e}")
+        monitor.start()
+        sender = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        try:
+            sender.sendto(dns_query('loop.xyz'), ('127.0.0.1', 53))
+            sender.sendto(b'x', ('127.0.0.1', 8081))
+            deadline = time.time() + 2
+            while not sink.get_events('network') and time.time() < deadline:
+                time.sleep(0.05)
+            time.sleep(0.1)
+        finally:
+            sender.close()
+            monitor.stop()
+        self.assertEqual([e['dst_port'] for e in sink.get_events('network')], [8081])
+        iocs = pcap_iocs.extract_file(path)
+        self.assertEqual([(i['kind'], i['host']) for i in iocs], [('dns', 'loop.xyz')])
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""
+Rescore Tests
+
+Runs analyses against a temporary patterns.yaml with a stand-in VM
+manager, edits the rules and checks that only affected samples are
+replayed and that rescored results are served without a VM run.
+"""
+
+import os
+import sys
+import shutil
+import tempfile
+import unittest
+from types import SimpleNamespace
+
+import yaml
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+from dynamic import DynamicAnalyzer
+from rescore import Rescorer, RulesDiff
+
+
+class FakeVMManager:
+    """Streams one network event and reports a successful run"""
+    
+    def __init__(self):
+        self.runs = 0
+    
+    def analyze_file(self, file_path, arch=None, timeout=None, on_event=None, **kwargs):
+        self.runs += 1
+        if on_event:
+            on_event({'network': [{'dst_addr': '10.0.0.7', 'dst_port': 4444}]})
+        return SimpleNamespace(
+            success=True, error=None, duration=0.1, stdout='', stderr='', exit_code=0,
+            syscalls=[], network_activity=[], file_activity=[], process_activity=[],
+            events=[], event_counts={}, cancelled=False, dropped_events=0, architecture='x64',
+            emulator=None, pcap_path=None)
+
+
+def _patterns(socket_score=20, thresholds=(10, 30, 60)):
+    return {
+        'verdict_thresholds': dict(zip(('clean', 'suspicious', 'malicious'), thresholds)),
+        'scripts': {
+            'python': {'network': [{'pattern': r'socket\.socket\(', 'score': socket_score,
+                                    'description': 'raw socket'}]},
+            'shell': {'download': [{'pattern': r'curl\s', 'score': 10, 'description': 'curl'}]},
+        },
+    }
+
+
+class TestRescore(unittest.TestCase):
+    """Test offline re-evaluation after rule edits"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.db_path = os.path.join(self.tmp, 'dyn.db')
+        self.patterns = os.path.join(self.tmp, 'patterns.yaml')
+        self.rules_dir = os.path.join(self.tmp, 'rules')
+        os.makedirs(self.rules_dir)
+        self.py = self._write('dropper.py', 'import socket\ns = socket.socket()\n')
+        self.sh = self._write('fetch.sh', '#!/bin/sh\ncurl http://x\n')
+        self._set_patterns(_patterns())
+    
+    def tearDown(self):
+        shutil.rmtree(self.tmp, ignore_errors=True)
+    
+    def _write(self, name, text):
+        path = os.path.join(self.tmp, name)
+        with open(path, 'w') as f:
+            f.write(text)
+        return path
+    
+    def _set_patterns(self, patterns):
+        with open(self.patterns, 'w') as f:
+            yaml.safe_dump(patterns, f)
+    
+    def _analyzer(self, vm=None):
+        analyzer = DynamicAnalyzer(db_path=self.db_path, yara_dir=self.rules_dir,
+                                   patterns_file=self.patterns, vm_config_path='',
+                                   cache_path=os.path.join(self.tmp, 'results.db'),
+                                   yara_cache_dir=os.path.join(self.tmp, 'yara_cache'))
+        if vm:
+            analyzer._vm_manager, analyzer._vm_available = vm, True
+        self.addCleanup(analyzer.db.close)
+        return analyzer
+    
+    def test_raw_inputs_are_stored(self):
+        analyzer = self._analyzer(FakeVMManager())
+        result = analyzer.run(self.py, use_cache=False)
+        self.assertEqual(result['threat_score'], 25)
+        row = analyzer.db.get_by_hash(result['file_hash'], with_raw=True)
+        self.assertEqual(row['rules_version'], analyzer.ruleset()[0])
+        self.assertTrue(row['raw']['sandbox_ok'])
+        self.assertIn('socket.socket()', row['raw']['script'])
+        self.assertEqual(row['raw']['vm']['network'], [{'dst_addr': '10.0.0.7', 'dst_port': 4444}])
+    
+    def test_only_affected_language_is_replayed(self):
+        first = self._analyzer(FakeVMManager())
+        py_hash = first.run(self.py, use_cache=False)['file_hash']
+        first.run(self.sh, use_cache=False)
+        first.db.close()
+        
+        self._set_patterns(_patterns(socket_score=50))
+        vm = FakeVMManager()
+        analyzer = self._analyzer(vm)
+        stats = Rescorer(analyzer).run()
+        self.assertEqual(stats['checked'], 2)
+        self.assertEqual((stats['rescored'], stats['changed'], stats['unaffected']), (1, 1, 1))
+        self.assertEqual(vm.runs, 0)
+        
+        row = analyzer.db.get_by_hash(py_hash)
+        self.assertEqual((row['threat_score'], row['verdict']), (55, 'MALICIOUS'))
+        self.assertEqual(Rescorer(analyzer).run()['current'], 2)
+        
+        # The rescored result is served without booting a VM
+        result = analyzer.run(self.py)
+        self.assertEqual(result['threat_score'], 55)
+        self.assertTrue(result['sandbox']['from_history'])
+        self.assertEqual(vm.runs, 0)
+    
+    def test_threshold_change_affects_all(self):
+        first = self._analyzer()
+        first.run(self.py, use_cache=False)
+        first.run(self.sh, use_cache=False)
+        first.db.close()
+        
+        self._set_patterns(_patterns(thresholds=(5, 15, 100)))
+        analyzer = self._analyzer()
+        stats = Rescorer(analyzer).run(dry_run=True)
+        self.assertEqual((stats['rescored'], stats['changed']), (2, 2))
+        # Nothing was written by the dry run
+        self.assertEqual(Rescorer(analyzer).run()['rescored'], 2)
+    
+    def test_yara_diff(self):
+        old = {'patterns': {}, 'yara': {'a.yar': {'sha1': '1', 'rules': ['Old_A']},
+                                        'b.yar': {'sha1': '2', 'rules': ['Keep_B']}}}
+        removed = RulesDiff.between(old, {'patterns': {}, 'yara': {'b.yar': old['yara']['b.yar']}})
+        self.assertEqual(removed.yara_stale, {'Old_A'})
+        self.assertFalse(removed.yara_rescan)
+        self.assertTrue(removed.affects({'file_type': 'elf_x64', 'yara_matches': ['Old_A']}, False))
+        self.assertFalse(removed.affects({'file_type': 'elf_x64', 'yara_matches': ['Keep_B']}, True))
+        
+        added = RulesDiff.between(old, dict(old, yara=dict(old['yara'], **{'c.yar': {'sha1': '3', 'rules': []}})))
+        self.assertTrue(added.yara_rescan)
+        self.assertTrue(added.affects({'file_type': 'elf_x64', 'yara_matches': []}, True))
+        self.assertFalse(added.affects({'file_type': 'elf_x64', 'yara_matches': []}, False))
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
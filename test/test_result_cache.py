@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""
+Result Cache Tests
+
+Checks version-keyed storage, single-flight deduplication of concurrent
+analyses and that the static and dynamic analyzers reuse results.
+"""
+
+import os
+import sys
+import time
+import shutil
+import tempfile
+import unittest
+import threading
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+from result_cache import ResultCache, fingerprint
+from sample import describe
+
+HASH = 'a' * 64
+
+
+class TestResultCache(unittest.TestCase):
+    """Test storage and in-flight deduplication"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.cache = ResultCache(os.path.join(self.tmp, 'results.db'))
+        self.addCleanup(self.cache.close)
+    
+    def tearDown(self):
+        shutil.rmtree(self.tmp, ignore_errors=True)
+    
+    def test_version_is_part_of_key(self):
+        self.assertEqual(self.cache.get_or_compute(HASH, 'static', 'v1', lambda: {'n': 1}), ({'n': 1}, False))
+        self.assertEqual(self.cache.get_or_compute(HASH, 'static', 'v1', lambda: {'n': 2}), ({'n': 1}, True))
+        self.assertIsNone(self.cache.get(HASH, 'dynamic', 'v1'))
+        # A new ruleset version replaces the old entry
+        self.assertEqual(self.cache.get_or_compute(HASH, 'static', 'v2', lambda: {'n': 3}), ({'n': 3}, False))
+        self.assertIsNone(self.cache.get(HASH, 'static', 'v1'))
+        self.assertNotEqual(fingerprint('rules', {'a': 1}), fingerprint('rules', {'a': 2}))
+    
+    def test_concurrent_requests_share_one_run(self):
+        calls = []
+        release = threading.Event()
+        
+        def compute():
+            calls.append(1)
+            release.wait(5)
+            return {'verdict': 'MALICIOUS'}
+        results = []
+        threads = [threading.Thread(target=lambda: results.append(
+            self.cache.get_or_compute(HASH, 'dynamic', 'v', compute))) for _ in range(8)]
+        for t in threads:
+            t.start()
+        time.sleep(0.1)
+        release.set()
+        for t in threads:
+            t.join(5)
+        
+        self.assertEqual(len(calls), 1)
+        self.assertEqual(len(results), 8)
+        self.assertEqual(sorted(shared for _, shared in results), [False] + [True] * 7)
+        self.assertTrue(all(r == {'verdict': 'MALICIOUS'} for r, _ in results))
+    
+    def test_failures_are_not_kept(self):
+        result, _ = self.cache.get_or_compute(HASH, 'dynamic', 'v', lambda: {'ok': False},
+                                              keep=lambda r: r['ok'])
+        self.assertEqual(result, {'ok': False})
+        self.assertIsNone(self.cache.get(HASH, 'dynamic', 'v'))
+        
+        def fail():
+            raise RuntimeError('vm crashed')
+        with self.assertRaises(RuntimeError):
+            self.cache.get_or_compute(HASH, 'dynamic', 'v', fail)
+        self.assertEqual(self.cache.get_or_compute(HASH, 'dynamic', 'v', lambda: {'ok': True})[0], {'ok': True})
+    
+    def test_entries_expire(self):
+        self.cache.ttl = 0.1
+        self.cache.put(HASH, 'static', 'v', {'n': 1})
+        self.assertIsNotNone(self.cache.get(HASH, 'static', 'v'))
+        time.sleep(0.2)
+        self.assertIsNone(self.cache.get(HASH, 'static', 'v'))
+
+
+class TestAnalyzersUseCache(unittest.TestCase):
+    """Re-uploads of a known sample skip the scans"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.sample = os.path.join(self.tmp, 'dropper.py')
+        with open(self.sample, 'w') as f:
+            f.write('import socket, subprocess\n')
+        self.cache_db = os.path.join(self.tmp, 'results.db')
+    
+    def tearDown(self):
+        ResultCache._instances.pop(os.path.abspath(self.cache_db), None)
+        shutil.rmtree(self.tmp, ignore_errors=True)
+    
+    def test_static_rescan_is_cached(self):
+        from static import StaticAnalyzer
+        from test_virustotal import static_config
+        analyzer = StaticAnalyzer(os.path.join(self.tmp, 'no_rules'),
+                                  config_path=static_config(self.tmp, result_cache_db=self.cache_db))
+        analyzer.vt.check_hash = lambda h: {'found': False}
+        scans = []
+        scan_file = analyzer.imports.analyze_file
+        analyzer.imports.analyze_file = lambda path: scans.append(path) or scan_file(path)
+        
+        first = analyzer.run(self.sample)
+        second = analyzer.run(self.sample)
+        self.assertEqual(len(scans), 1)
+        self.assertNotIn('cached', first)
+        self.assertTrue(second['cached'])
+        self.assertEqual(second['suspicious_imports'], ['subprocess', 'socket'])
+        self.assertEqual(second['score'], first['score'])
+        analyzer.run(self.sample, use_cache=False)
+        self.assertEqual(len(scans), 2)
+    
+    def test_dynamic_concurrent_uploads_run_once(self):
+        from dynamic import DynamicAnalyzer
+        analyzer = DynamicAnalyzer(db_path=os.path.join(self.tmp, 'dyn.db'),
+                                   yara_dir=os.path.join(self.tmp, 'no_rules'),
+                                   vm_config_path=os.path.join(self.tmp, 'none.yaml'),
+                                   cache_path=self.cache_db, yara_cache_dir=os.path.join(self.tmp, 'yara_cache'))
+        self.addCleanup(analyzer.db.close)
+        runs = []
+        analyze = analyzer._analyze
+        
+        def slow_analyze(*args):
+            runs.append(1)
+            time.sleep(0.2)
+            return analyze(*args)
+        analyzer._analyze = slow_analyze
+        desc = describe(self.sample)
+        
+        results = []
+        threads = [threading.Thread(target=lambda: results.append(analyzer.run(self.sample, sample=desc)))
+                   for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join(5)
+        self.assertEqual(len(runs), 1)
+        self.assertEqual(sum(1 for r in results if r.get('cached')), 3)
+        self.assertEqual(len({r['threat_score'] for r in results}), 1)
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+Script Rule Matching Tests
+
+Checks that the compiled ScriptMatcher behind RuleEngine.match_script and
+the single-pass ImportAnalyzer report exactly what evaluating every
+pattern on its own would, on the script samples in this directory.
+"""
+
+import os
+import re
+import sys
+import unittest
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+from dynamic import RuleEngine, ScriptMatcher, required_literal
+from static import ImportAnalyzer, SUSPICIOUS_IMPORTS
+
+TEST_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# Samples are read as text only, never imported or executed
+SAMPLES = {
+    'test_malicious.py': 'python',
+    'test_suspicious.py': 'python',
+    'test_js.js': 'javascript',
+    'test_shell.sh': 'shell',
+}
+
+
+def _read(name: str) -> str:
+    with open(os.path.join(TEST_DIR, name), 'r', encoding='utf-8', errors='ignore') as f:
+        return f.read()
+
+
+class TestScriptMatcher(unittest.TestCase):
+    """Test the compiled script matcher"""
+    
+    @classmethod
+    def setUpClass(cls):
+        cls.engine = RuleEngine(os.path.join(ROOT, 'patterns.yaml'))
+    
+    def _naive(self, language, code):
+        hits = []
+        for category, patterns in self.engine.patterns['scripts'][language].items():
+            if isinstance(patterns, list):
+                for p in patterns:
+                    if isinstance(p, dict) and p.get('pattern'):
+                        m = re.search(p['pattern'], code)
+                        if m:
+                            hits.append((category, p['description'], m.start()))
+        return hits
+    
+    def test_same_matches_as_naive_search(self):
+        for name, language in SAMPLES.items():
+            code = _read(name)
+            with self.subTest(sample=name):
+                events = self.engine.match_script(language, code)
+                got = [(e.event_type, e.details, e.offset) for e in events]
+                self.assertEqual(got, self._naive(language, code))
+                self.assertTrue(got)
+    
+    def test_no_false_candidates_without_literals(self):
+        """Code without any rule literal matches nothing"""
+        self.assertEqual(self.engine.match_script('python', 'x = 1\n' * 1000), [])
+    
+    def test_unknown_language(self):
+        self.assertEqual(self.engine.match_script('cobol', 'DISPLAY "HI"'), [])
+    
+    def test_required_literal(self):
+        self.assertEqual(required_literal(r'os\.system\s*\('), 'os.system')
+        self.assertEqual(required_literal(r'(?i)powershell'), '')
+        self.assertEqual(required_literal(r'(eval|exec)\('), '(')
+        self.assertEqual(required_literal(r'(unclosed'), '')
+    
+    def test_overlapping_literals(self):
+        """A literal that is a prefix of another is still seen"""
+        matcher = ScriptMatcher([
+            ('a', {'pattern': r'eval\('}),
+            ('b', {'pattern': r'evaluate'}),
+            ('c', {'pattern': r'[bad'}),
+        ])
+        self.assertEqual(len(matcher.rules), 2)
+        hits = matcher.scan('x = evaluate(1); eval(2)')
+        self.assertEqual([(c, off) for c, _, off in hits], [('a', 17), ('b', 4)])
+
+
+class TestImportAnalyzer(unittest.TestCase):
+    """Test single-pass suspicious import detection"""
+    
+    def test_same_as_per_import_search(self):
+        analyzer = ImportAnalyzer()
+        for name, language in SAMPLES.items():
+            code = _read(name)
+            expected = [imp for imp in SUSPICIOUS_IMPORTS.get(language, [])
+                        if re.search(rf'\b{re.escape(imp)}\b', code)]
+            with self.subTest(sample=name):
+                self.assertEqual(analyzer.analyze_file(os.path.join(TEST_DIR, name)), expected)
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""
+Sample Descriptor Tests
+
+Checks single-pass hashing and in-process type sniffing, and that the
+static analyzer takes hash and type from a given descriptor.
+"""
+
+import os
+import sys
+import struct
+import shutil
+import hashlib
+import tempfile
+import unittest
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+import sample
+from sample import describe, sniff_type
+
+
+def _elf_header(machine: int, big_endian: bool = False) -> bytes:
+    endian = '>' if big_endian else '<'
+    ident = b'\x7fELF' + bytes([2, 2 if big_endian else 1, 1]) + b'\x00' * 9
+    return ident + struct.pack(endian + 'HHI', 2, machine, 1) + b'\x00' * 40
+
+
+def _elf_with_phdrs(machine: int, p_types) -> bytes:
+    """64-bit little-endian ELF with one program header per type"""
+    header = bytearray(_elf_header(machine))
+    struct.pack_into('<Q', header, 32, 64)
+    struct.pack_into('<HH', header, 54, 56, len(p_types))
+    return bytes(header) + b''.join(struct.pack('<I', t) + b'\x00' * 52 for t in p_types)
+
+
+class TestDescribe(unittest.TestCase):
+    """Test descriptor hashing"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+    
+    def tearDown(self):
+        shutil.rmtree(self.tmp, ignore_errors=True)
+    
+    def _write(self, name: str, data: bytes) -> str:
+        path = os.path.join(self.tmp, name)
+        with open(path, 'wb') as f:
+            f.write(data)
+        return path
+    
+    def test_hashes_match_hashlib(self):
+        data = os.urandom(sample.HASH_CHUNK * 2 + 123)
+        desc = describe(self._write('blob', data))
+        self.assertEqual(desc.size, len(data))
+        self.assertEqual(desc.sha256, hashlib.sha256(data).hexdigest())
+        self.assertEqual(desc.md5, hashlib.md5(data).hexdigest())
+        self.assertEqual(desc.sha1, hashlib.sha1(data).hexdigest())
+        self.assertEqual(desc.file_type, 'unknown')
+    
+    def test_empty_and_missing(self):
+        desc = describe(self._write('empty', b''))
+        self.assertEqual(desc.sha256, hashlib.sha256(b'').hexdigest())
+        self.assertIsNone(describe(os.path.join(self.tmp, 'missing')))
+    
+    def test_elf_type(self):
+        desc = describe(self._write('bin', _elf_header(183) + os.urandom(1000)))
+        self.assertEqual((desc.file_type, desc.arch), ('elf_arm64', 'arm64'))
+        self.assertTrue(desc.is_elf)
+        self.assertFalse(desc.is_script)
+    
+    def test_static_linkage(self):
+        PT_LOAD = 1
+        static = describe(self._write('static', _elf_with_phdrs(62, [PT_LOAD, PT_LOAD])))
+        self.assertEqual((static.file_type, static.static), ('elf_x64', True))
+        dynamic = describe(self._write('dynamic', _elf_with_phdrs(62, [6, sample.PT_INTERP, PT_LOAD])))
+        self.assertFalse(dynamic.static)
+        # No program headers, or headers past the end of the file
+        self.assertIsNone(describe(self._write('bare', _elf_header(62))).static)
+        self.assertIsNone(sample.elf_is_static(_elf_with_phdrs(62, [PT_LOAD])[:100]))
+        self.assertIsNone(describe(self._write('s.py', b'print(1)\n')).static)
+
+
+class TestSniff(unittest.TestCase):
+    """Test in-process type detection"""
+    
+    def test_elf_machines(self):
+        self.assertEqual(sniff_type(_elf_header(62)), ('elf_x64', 'x64'))
+        self.assertEqual(sniff_type(_elf_header(3)), ('elf_x86', 'x64'))
+        self.assertEqual(sniff_type(_elf_header(183, big_endian=True)), ('elf_arm64', 'arm64'))
+        self.assertEqual(sniff_type(_elf_header(8)), ('elf', None))
+        self.assertEqual(sniff_type(b'\x7fELF\x02'), ('unknown', None))
+    
+    def test_scripts(self):
+        self.assertEqual(sniff_type(b'', 'a.py'), ('python', None))
+        self.assertEqual(sniff_type(b'#!/usr/bin/env python3\n', 'run'), ('python', None))
+        self.assertEqual(sniff_type(b'#!/usr/bin/node\n', 'run'), ('javascript', None))
+        self.assertEqual(sniff_type(b'#! /bin/sh -e\n', 'run'), ('shell', None))
+        self.assertEqual(sniff_type(b'#!/usr/bin/perl\n', 'run'), ('unknown', None))
+        self.assertEqual(sniff_type(b'#!\n', 'run'), ('unknown', None))
+
+
+class TestStaticUsesDescriptor(unittest.TestCase):
+    """The static stage reuses a descriptor instead of hashing again"""
+    
+    def test_run_with_sample(self):
+        from static import StaticAnalyzer
+        from test_virustotal import static_config
+        tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmp, True)
+        analyzer = StaticAnalyzer(os.path.join(ROOT, 'yara_rules'), config_path=static_config(tmp))
+        analyzer.vt.check_hash = lambda h: {'found': False, 'hash': h}
+        path = os.path.join(ROOT, 'test', 'test_shell.sh')
+        desc = describe(path)
+        desc.sha256 = 'f' * 64
+        
+        result = analyzer.run(path, desc)
+        self.assertEqual(result['hash'], 'f' * 64)
+        self.assertEqual(result['md5'], desc.md5)
+        self.assertEqual(result['file_type'], 'shell')
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
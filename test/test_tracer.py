@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""
+Native Tracer Tests
+
+Builds tracer_lib/sbtrace and checks that the agent's SyscallTracer reads
+its binary records: syscalls are seen from exec on, with decoded path and
+socket address arguments.
+"""
+
+import os
+import sys
+import shutil
+import socket
+import tempfile
+import unittest
+import subprocess
+
+# Add parent and agent directories to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+sys.path.insert(0, os.path.join(ROOT, 'vm_images', 'agent'))
+
+import agent
+
+
+def _build_tracer(dest: str) -> str:
+    """Build sbtrace in a scratch copy of tracer_lib"""
+    src = os.path.join(dest, 'tracer_lib')
+    shutil.copytree(os.path.join(ROOT, 'tracer_lib'), src)
+    subprocess.run(['make', '-s', '-C', src], check=True, capture_output=True)
+    return os.path.join(src, 'sbtrace')
+
+
+@unittest.skipUnless(shutil.which('make') and shutil.which('cc'), "C toolchain not available")
+class TestNativeTracer(unittest.TestCase):
+    """Test sbtrace through SyscallTracer"""
+    
+    @classmethod
+    def setUpClass(cls):
+        cls.tmp = tempfile.mkdtemp()
+        cls.tracer = _build_tracer(cls.tmp)
+        probe = subprocess.run([cls.tracer, '-o', os.devnull, '--', 'true'])
+        if probe.returncode != 0:
+            raise unittest.SkipTest("ptrace/seccomp not permitted here")
+    
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls.tmp, ignore_errors=True)
+    
+    def _trace(self, cmd, syscalls):
+        sink = agent.EventSink()
+        tracer = agent.SyscallTracer(sink, syscalls, tracer_path=self.tracer)
+        self.assertTrue(tracer.native)
+        process = subprocess.Popen(tracer.wrap(cmd), stdout=subprocess.PIPE,
+                                   pass_fds=tracer.pass_fds)
+        tracer.start(process.pid)
+        stdout, _ = process.communicate(timeout=30)
+        tracer.stop()
+        return process.returncode, stdout, sink.get_events('syscalls')
+    
+    def test_traces_from_exec(self):
+        """The sample's own execve and file opens are recorded"""
+        code, stdout, events = self._trace(
+            ['/bin/sh', '-c', 'cat /etc/hostname > /dev/null; echo done; exit 3'],
+            ['execve', 'openat', 'open'])
+        
+        self.assertEqual(code, 3)
+        self.assertEqual(stdout, b'done\n')
+        execs = [e['args'][0] for e in events if e['syscall'] == 'execve']
+        self.assertEqual(execs[0], '/bin/sh')
+        opened = [e['args'][1] for e in events if e['syscall'] == 'openat']
+        self.assertIn('/etc/hostname', opened)
+        self.assertTrue(all(e['pid'] > 0 for e in events))
+    
+    def test_filter_and_sockaddr(self):
+        """Only selected syscalls are reported; connect shows the address"""
+        server = socket.socket()
+        server.bind(('127.0.0.1', 0))
+        server.listen(1)
+        self.addCleanup(server.close)
+        port = server.getsockname()[1]
+        
+        script = f"import socket; socket.create_connection(('127.0.0.1', {port})).close()"
+        _, _, events = self._trace([sys.executable, '-c', script], ['connect'])
+        
+        self.assertEqual({e['syscall'] for e in events}, {'connect'})
+        self.assertIn(f'127.0.0.1:{port}', [e['args'][1] for e in events])
+
+
+class TestRecordParsing(unittest.TestCase):
+    """Malformed sbtrace output stops the reader instead of crashing or desyncing it"""
+    
+    def _read(self, data: bytes):
+        sink = agent.EventSink()
+        tracer = agent.SyscallTracer(sink, tracer_path=os.devnull)
+        read_fd, write_fd = os.pipe()
+        os.write(write_fd, data)
+        os.close(write_fd)
+        tracer._read_fd = read_fd
+        tracer._read_records()
+        return sink.get_events('syscalls')
+    
+    def _record(self, rec_type, body=b'', nr=59, length=None):
+        if length is None:
+            length = agent.SBT_HEADER.size + len(body)
+        return agent.SBT_HEADER.pack(length, rec_type, nr, 42, 0, 10 ** 9) + body
+    
+    def _syscall(self):
+        return self._record(agent.SBT_REC_SYSCALL, agent.SBT_SYSCALL.pack(1, 2, 3, 4, 5, 6, 0))
+    
+    def test_valid_records(self):
+        data = self._record(agent.SBT_REC_NAME, b'execve') + self._syscall()
+        events = self._read(data)
+        self.assertEqual([e['syscall'] for e in events], ['execve'])
+    
+    def test_short_length(self):
+        """A length below the header size would read backwards into the stream"""
+        data = self._syscall() + self._record(agent.SBT_REC_SYSCALL, length=4) + self._syscall()
+        self.assertEqual(len(self._read(data)), 1)
+    
+    def test_huge_length(self):
+        data = self._record(agent.SBT_REC_SYSCALL, length=0xFFFFFFFF) + self._syscall()
+        self.assertEqual(self._read(data), [])
+    
+    def test_truncated_syscall_body(self):
+        data = self._syscall() + self._record(agent.SBT_REC_SYSCALL, b'\0' * 8) + self._syscall()
+        self.assertEqual(len(self._read(data)), 1)
+    
+    def test_truncated_stream(self):
+        self.assertEqual(self._read(self._syscall()[:-10]), [])
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""
+VirusTotal Lookup Tests
+
+Checks the token bucket, lookup coalescing, the TTL cache and the
+deferred static verdict with requests.get replaced by a stub.
+"""
+
+import os
+import sys
+import time
+import shutil
+import tempfile
+import unittest
+import threading
+from unittest import mock
+
+import yaml
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+import static
+from static import TokenBucket, VirusTotalChecker, StaticAnalyzer
+
+HASH = 'a' * 64
+
+
+def static_config(tmp: str, **static) -> str:
+    """config.yaml for a StaticAnalyzer that keeps its databases and caches in tmp"""
+    path = os.path.join(tmp, 'config.yaml')
+    with open(path, 'w') as f:
+        yaml.safe_dump({'static': {'virustotal_cache_db': os.path.join(tmp, 'vt_cache.db'),
+                                   'result_cache_db': os.path.join(tmp, 'results.db'),
+                                   'yara_cache_dir': os.path.join(tmp, 'yara_cache'), **static}}, f)
+    return path
+
+
+class FakeResponse:
+    def __init__(self, status, malicious=0):
+        self.status_code = status
+        self._malicious = malicious
+    
+    def json(self):
+        return {"data": {"attributes": {"last_analysis_stats": {"malicious": self._malicious}}}}
+
+
+class FakeAPI:
+    """Stand-in for requests.get; requests block while the gate is cleared"""
+    
+    def __init__(self, responses=None):
+        self.calls = []
+        self.responses = list(responses or [])
+        self.gate = threading.Event()
+        self.gate.set()
+    
+    def get(self, url, headers=None, timeout=None):
+        self.calls.append(url.rsplit('/', 1)[-1])
+        self.gate.wait(5)
+        return self.responses.pop(0) if self.responses else FakeResponse(200, malicious=7)
+
+
+class TestTokenBucket(unittest.TestCase):
+    """Test quota limiting"""
+    
+    def test_burst_then_rate(self):
+        bucket = TokenBucket(2, per=0.2)
+        self.assertTrue(bucket.acquire(timeout=0))
+        self.assertTrue(bucket.acquire(timeout=0))
+        self.assertFalse(bucket.acquire(timeout=0))
+        start = time.monotonic()
+        self.assertTrue(bucket.acquire(timeout=1))
+        self.assertGreater(time.monotonic() - start, 0.05)
+    
+    def test_pause(self):
+        bucket = TokenBucket(5, per=0.1)
+        bucket.pause(0.2)
+        self.assertFalse(bucket.acquire(timeout=0.1))
+        self.assertTrue(bucket.acquire(timeout=0.5))
+
+
+class TestVirusTotalChecker(unittest.TestCase):
+    """Test lookups against a stubbed API"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.api = FakeAPI()
+        patcher = mock.patch.object(static, 'requests', mock.Mock(get=self.api.get))
+        patcher.start()
+        self.addCleanup(patcher.stop)
+    
+    def tearDown(self):
+        shutil.rmtree(self.tmp, ignore_errors=True)
+    
+    def _checker(self, **kwargs):
+        return VirusTotalChecker('key', cache_path=os.path.join(self.tmp, 'vt.db'), **kwargs)
+    
+    def test_duplicate_lookups_share_one_request(self):
+        vt = self._checker()
+        self.api.gate.clear()
+        results = []
+        done = threading.Event()
+        
+        def collect(result):
+            results.append(result)
+            if len(results) == 3:
+                done.set()
+        for _ in range(3):
+            self.assertIsNone(vt.lookup(HASH, collect))
+        self.api.gate.set()
+        
+        self.assertTrue(done.wait(5))
+        self.assertEqual(self.api.calls, [HASH])
+        self.assertEqual(results[0], {"found": True, "malicious": 7, "suspicious": 0})
+    
+    def test_cache_and_ttl(self):
+        vt = self._checker(negative_ttl=0.2)
+        self.assertTrue(vt.check_hash(HASH)['found'])
+        # Answered from the cache, also by a new instance
+        self.assertTrue(self._checker().lookup(HASH)['found'])
+        self.assertEqual(len(self.api.calls), 1)
+        
+        self.api.responses = [FakeResponse(404), FakeResponse(404)]
+        other = 'b' * 64
+        self.assertFalse(vt.check_hash(other)['found'])
+        self.assertFalse(vt.lookup(other)['found'])
+        time.sleep(0.3)
+        self.assertIsNone(vt.cached(other))
+        self.assertFalse(vt.check_hash(other)['found'])
+        self.assertEqual(len(self.api.calls), 3)
+    
+    def test_rate_limited_requests_wait(self):
+        vt = self._checker(rate_per_min=1)
+        vt._minute = TokenBucket(1, per=0.2)
+        start = time.monotonic()
+        vt.check_hash('c' * 64)
+        vt.check_hash('d' * 64)
+        self.assertGreater(time.monotonic() - start, 0.15)
+    
+    def test_retry_after_429(self):
+        vt = self._checker()
+        vt._minute = TokenBucket(4, per=0.1)
+        vt.RETRY_AFTER = 0.1
+        self.api.responses = [FakeResponse(429)]
+        self.assertEqual(vt.check_hash(HASH)['malicious'], 7)
+        self.assertEqual(self.api.calls, [HASH, HASH])
+    
+    def test_blocking_lookup_times_out_as_pending(self):
+        vt = self._checker()
+        vt.RETRY_AFTER = 3600
+        self.api.responses = [FakeResponse(429)]
+        start = time.monotonic()
+        self.assertEqual(vt.check_hash(HASH, timeout=0.2),
+                         {"found": False, "malicious": 0, "pending": True})
+        self.assertLess(time.monotonic() - start, 2)
+    
+    def test_static_verdict_updates_when_vt_answers(self):
+        analyzer = StaticAnalyzer(os.path.join(self.tmp, 'no_rules'), config_path=static_config(self.tmp))
+        analyzer.vt = self._checker()
+        sample = os.path.join(self.tmp, 'sample.txt')
+        with open(sample, 'w') as f:
+            f.write('hello')
+        self.api.gate.clear()
+        
+        result = analyzer.run(sample, wait_vt=False)
+        self.assertTrue(result['virustotal']['pending'])
+        self.assertEqual(result['verdict'], 'CLEAN')
+        
+        updates = []
+        done = threading.Event()
+        self.assertTrue(analyzer.update_with_vt(result, lambda r: (updates.append(r), done.set())))
+        self.api.gate.set()
+        self.assertTrue(done.wait(5))
+        self.assertEqual(updates[0]['score'], result['score'] + 25)
+        self.assertEqual(updates[0]['verdict'], 'SUSPICIOUS')
+        self.assertFalse(analyzer.update_with_vt(updates[0], lambda r: None))
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
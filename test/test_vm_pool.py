@@ -0,0 +1,575 @@
+#!/usr/bin/env python3
+"""
+VM Pool Tests
+
+Tests for clone configuration and idle-clone dispatch of the VM pool.
+"""
+
+import os
+import sys
+import time
+import unittest
+import threading
+
+# Add parent directory to path
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from vm_manager.vm_config import VMConfig, VMArchitecture
+from vm_manager.vm_pool import VMPool
+
+
+def make_config(pool_size: int = 3) -> VMConfig:
+    return VMConfig(
+        name="test",
+        architecture=VMArchitecture.ARM64,
+        image_path="/tmp/test.qcow2",
+        pool_size=pool_size,
+    )
+
+
+class TestVMConfigClones(unittest.TestCase):
+    """Test clone configuration generation"""
+    
+    def test_clone_names_unique(self):
+        """Each clone gets its own name, image and sockets"""
+        clones = make_config(3).clones()
+        self.assertEqual(len(clones), 3)
+        self.assertEqual(clones[0].name, "test")
+        self.assertEqual(len({c.name for c in clones}), 3)
+        self.assertEqual(len({c.image_path for c in clones}), 3)
+        
+        agents = {c.get_socket_paths("/tmp")['agent'] for c in clones}
+        self.assertEqual(len(agents), 3)
+    
+    def test_single_clone_default(self):
+        """Default pool has exactly the VM itself"""
+        config = VMConfig(name="test", architecture=VMArchitecture.X64,
+                          image_path="/tmp/test.qcow2")
+        clones = config.clones()
+        self.assertEqual(len(clones), 1)
+        self.assertEqual(clones[0].image_path, "/tmp/test.qcow2")
+
+
+class TestVMPool(unittest.TestCase):
+    """Test idle clone dispatch"""
+    
+    def test_acquire_distinct(self):
+        """Concurrent acquires get different clones"""
+        pool = VMPool(make_config(2).clones())
+        a = pool.acquire(timeout=0.1)
+        b = pool.acquire(timeout=0.1)
+        self.assertIsNotNone(a)
+        self.assertIsNotNone(b)
+        self.assertNotEqual(a.name, b.name)
+        self.assertEqual(pool.idle_count(), 0)
+    
+    def test_acquire_timeout(self):
+        """Acquire times out when every clone is busy"""
+        pool = VMPool(make_config(1).clones())
+        pool.acquire(timeout=0.1)
+        start = time.time()
+        self.assertIsNone(pool.acquire(timeout=0.1))
+        self.assertGreaterEqual(time.time() - start, 0.1)
+    
+    def test_release_wakes_waiter(self):
+        """Released clone goes to a blocked caller"""
+        pool = VMPool(make_config(1).clones())
+        slot = pool.acquire(timeout=0.1)
+        got = []
+        
+        t = threading.Thread(target=lambda: got.append(pool.acquire(timeout=5)))
+        t.start()
+        time.sleep(0.05)
+        pool.release(slot)
+        t.join(timeout=5)
+        
+        self.assertEqual(len(got), 1)
+        self.assertEqual(got[0].name, slot.name)
+        self.assertEqual(got[0].jobs_done, 1)
+    
+    def test_prefers_clean_clone(self):
+        """Idle clones with a finished restore are dispatched first"""
+        pool = VMPool(make_config(2).clones())
+        pool.slots[1].clean = True
+        self.assertEqual(pool.acquire(timeout=0.1).name, pool.slots[1].name)
+
+
+class TestBackgroundRevert(unittest.TestCase):
+    """Test that the post-analysis restore is off the caller's path"""
+    
+    def test_result_before_revert(self):
+        """analyze_file returns while the clone is still reverting"""
+        from vm_manager.vm_manager import VMManager, AnalysisResult
+        from vm_manager.vm_config import VMManagerConfig
+        import shutil
+        import tempfile
+        
+        tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmp, True)
+        config = VMManagerConfig(images_dir=tmp, sockets_dir=tmp, logs_dir=tmp,
+                                 arm64_config=make_config(1))
+        manager = VMManager(config=config)
+        restores = []
+        revert_gate = threading.Event()
+        
+        def fake_restore(arch, snapshot_name="clean", vm_name=None):
+            revert_gate.wait(5)
+            restores.append(vm_name)
+            return 0.0
+        
+        manager.restore_snapshot = fake_restore
+        manager.launcher.is_running = lambda name: True
+        manager._analyze_on_clone = lambda slot, arch, path, *args: AnalysisResult(
+            success=True, file_path=path, architecture=arch.value, duration=0)
+        
+        sample = os.path.join(tmp, "sample")
+        open(sample, 'w').close()
+        
+        result = manager.analyze_file(sample, arch=VMArchitecture.ARM64)
+        self.assertTrue(result.success)
+        self.assertEqual(restores, [])
+        
+        pool = manager.get_pool(VMArchitecture.ARM64)
+        self.assertEqual(pool.idle_count(), 0)
+        
+        revert_gate.set()
+        manager.wait_for_reverts(5)
+        self.assertEqual(restores, ["test"])
+        self.assertTrue(pool.slots[0].clean)
+        self.assertEqual(pool.idle_count(), 1)
+
+
+class TestPrewarm(unittest.TestCase):
+    """Test background boot of the idle clones"""
+    
+    def test_prewarm_boots_idle_clones(self):
+        from vm_manager.vm_manager import VMManager
+        from vm_manager.vm_config import VMManagerConfig
+        import shutil
+        import tempfile
+        
+        tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmp, True)
+        config = VMManagerConfig(images_dir=tmp, sockets_dir=tmp, logs_dir=tmp,
+                                 arm64_config=make_config(3))
+        manager = VMManager(config=config)
+        pool = manager.get_pool(VMArchitecture.ARM64)
+        running, busy, cold = pool.slots
+        self.assertTrue(pool.try_acquire(busy))
+        booted = []
+        
+        def fake_start(vm_config):
+            # Held while booting: a job cannot take the same clone
+            self.assertTrue(pool.get_slot(vm_config.name).busy)
+            booted.append(vm_config.name)
+            return True
+        
+        manager.launcher.is_running = lambda name: name == running.name
+        manager._start_clone = fake_start
+        self.assertEqual(manager.prewarm(), 1)
+        self.assertEqual(booted, [cold.name])
+        self.assertFalse(cold.busy)
+        self.assertEqual(cold.jobs_done, 0)
+        self.assertTrue(busy.busy)
+
+
+class TestOverlayMode(unittest.TestCase):
+    """Test per-job qcow2 overlays over a shared base image"""
+    
+    def setUp(self):
+        import shutil
+        import tempfile
+        from unittest import mock
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+        self.base = os.path.join(self.tmp, "base.qcow2")
+        open(self.base, 'w').close()
+        # qemu-img stand-in: just create the overlay file
+        patcher = mock.patch('vm_manager.snapshot.subprocess.run',
+                             side_effect=lambda cmd, **kw: open(cmd[-1], 'w').close())
+        patcher.start()
+        self.addCleanup(patcher.stop)
+    
+    def _config(self, pool_size=2):
+        return VMConfig(name="ov", architecture=VMArchitecture.ARM64, image_path=self.base,
+                        pool_size=pool_size, disk_mode="overlay")
+    
+    def test_clones_share_base(self):
+        clones = self._config(3).clones()
+        self.assertEqual({c.image_path for c in clones}, {self.base})
+        self.assertEqual(len({c.name for c in clones}), 3)
+    
+    def test_overlay_goes_to_ram_when_available(self):
+        from unittest import mock
+        from vm_manager.snapshot import ExternalSnapshotManager
+        ram, disk = os.path.join(self.tmp, "shm"), os.path.join(self.tmp, "disk")
+        overlays = ExternalSnapshotManager(self.base, disk, ram_dir=ram, ram_reserve_mb=512)
+        
+        with mock.patch('vm_manager.snapshot.mem_available_mb', return_value=8192):
+            path = overlays.create_overlay("a", ram_needed_mb=4096)
+        self.assertEqual(os.path.dirname(path), ram)
+        with mock.patch('vm_manager.snapshot.mem_available_mb', return_value=4096):
+            path = overlays.create_overlay("b", ram_needed_mb=4096)
+        self.assertEqual(os.path.dirname(path), disk)
+        self.assertEqual(sorted(overlays.list_overlays()), ["a", "b"])
+        
+        overlays.delete_overlay("a")
+        overlays.delete_overlay("b")
+        self.assertEqual(overlays.list_overlays(), [])
+    
+    def test_reset_boots_fresh_overlay(self):
+        from vm_manager.vm_manager import VMManager
+        from vm_manager.vm_config import VMManagerConfig
+        config = VMManagerConfig(images_dir=self.tmp, sockets_dir=self.tmp, logs_dir=self.tmp,
+                                 overlay_dir=os.path.join(self.tmp, "overlays"), overlay_ram_dir=None,
+                                 arm64_config=self._config(1))
+        manager = VMManager(config=config)
+        running = set()
+        launched = []
+        
+        def launch(vm_config, anti_vm):
+            launched.append(vm_config.image_path)
+            running.add(vm_config.name)
+            return type('P', (), {'monitor_socket': os.path.join(self.tmp, 'mon.sock'), 'events': None})()
+        
+        manager.launcher.launch = launch
+        manager.launcher.stop = lambda name, force=False: running.discard(name)
+        manager.launcher.is_running = lambda name: name in running
+        manager._wait_for_vm_ready = lambda vm_config, timeout: True
+        manager.restore_snapshot = lambda *a, **kw: self.fail("overlay mode must not loadvm")
+        
+        slot = manager.get_pool(VMArchitecture.ARM64).slots[0]
+        self.assertTrue(manager._start_clone(slot.config))
+        self.assertTrue(slot.clean)
+        first = launched[0]
+        self.assertNotEqual(first, self.base)
+        self.assertTrue(os.path.exists(first))
+        
+        slot.clean = False
+        self.assertTrue(manager._reset_clone(VMArchitecture.ARM64, slot))
+        self.assertEqual(len(launched), 2)
+        self.assertTrue(slot.clean)
+        self.assertTrue(os.path.exists(launched[1]))
+        
+        manager.stop_all()
+        self.assertEqual(os.listdir(config.overlay_dir), [])
+        self.assertTrue(os.path.exists(self.base))
+
+
+class TestMemoryTemplate(unittest.TestCase):
+    """Test reverts restored from a clean RAM image instead of a boot"""
+    
+    def setUp(self):
+        import shutil
+        import tempfile
+        from unittest import mock
+        from vm_manager.snapshot import SnapshotManager
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+        self.base = os.path.join(self.tmp, "base.qcow2")
+        open(self.base, 'w').close()
+        self.qemu_img = []
+        
+        def qemu_img(cmd, **kw):
+            self.qemu_img.append(cmd)
+            open(cmd[-1], 'w').close()
+        self.saved, self.loaded = [], []
+        
+        def save(sm, path, timeout=60):
+            self.saved.append(path)
+            open(path, 'w').close()
+            return 0.1
+        for patcher in (mock.patch('vm_manager.snapshot.subprocess.run', side_effect=qemu_img),
+                        mock.patch.object(SnapshotManager, 'save_device_state', save),
+                        mock.patch.object(SnapshotManager, 'load_device_state',
+                                          lambda sm, path, timeout=30: self.loaded.append(path) or 0.01)):
+            patcher.start()
+            self.addCleanup(patcher.stop)
+    
+    def test_launch_args(self):
+        from vm_manager.qemu_launcher import QEMULauncher
+        config = VMConfig(name="m", architecture=VMArchitecture.ARM64, image_path=self.base, ram_mb=2048,
+                          memory_file="/dev/shm/m.ram", memory_shared=False, incoming="defer")
+        args = QEMULauncher(self.tmp)._generate_memory_args(config)
+        self.assertIn('memory-backend-file,id=ram0,size=2048M,mem-path=/dev/shm/m.ram,share=off', args)
+        self.assertEqual(args[-2:], ['-incoming', 'defer'])
+        self.assertEqual(QEMULauncher(self.tmp)._generate_memory_args(make_config()), [])
+    
+    def test_reset_restores_template(self):
+        from vm_manager.vm_manager import VMManager
+        from vm_manager.vm_config import VMManagerConfig
+        config = VMManagerConfig(images_dir=self.tmp, sockets_dir=self.tmp, logs_dir=self.tmp,
+                                 overlay_dir=os.path.join(self.tmp, "overlays"), overlay_ram_dir=None,
+                                 memory_state_dir=os.path.join(self.tmp, "state"),
+                                 arm64_config=VMConfig(name="mem", architecture=VMArchitecture.ARM64,
+                                                       image_path=self.base, disk_mode="memory"))
+        manager = VMManager(config=config)
+        running = set()
+        launched = []
+        readies = []
+        
+        def launch(vm_config, anti_vm):
+            launched.append(vm_config)
+            if vm_config.memory_shared:
+                # QEMU creates the shared RAM file
+                open(vm_config.memory_file, 'w').close()
+            running.add(vm_config.name)
+            return type('P', (), {'monitor_socket': os.path.join(self.tmp, 'mon.sock'), 'events': None})()
+        
+        manager.launcher.launch = launch
+        manager.launcher.stop = lambda name, force=False: running.discard(name)
+        manager.launcher.is_running = lambda name: name in running
+        manager._wait_for_vm_ready = lambda vm_config, timeout: readies.append(timeout) or True
+        
+        slot = manager.get_pool(VMArchitecture.ARM64).slots[0]
+        self.assertTrue(manager._start_clone(slot.config))
+        template, clone = launched
+        self.assertTrue(template.memory_shared)
+        self.assertIsNone(template.incoming)
+        self.assertEqual((clone.memory_file, clone.memory_shared, clone.incoming),
+                         (template.memory_file, False, 'defer'))
+        # The clone's overlay is stacked on the template's frozen disk
+        self.assertEqual(self.qemu_img[-1][-2], os.path.abspath(template.image_path))
+        self.assertEqual(len(self.saved), 1)
+        self.assertEqual(readies, [slot.config.boot_timeout, slot.config.snapshot_timeout])
+        self.assertTrue(manager.get_status()['arm64']['memory_template_ready'])
+        
+        slot.clean = False
+        self.assertTrue(manager._reset_clone(VMArchitecture.ARM64, slot))
+        self.assertTrue(slot.clean)
+        self.assertEqual(len(launched), 3)
+        self.assertEqual(len(self.saved), 1)
+        self.assertEqual(len(self.loaded), 2)
+        self.assertFalse(launched[2].memory_shared)
+        
+        manager.stop_all()
+        # Only the template disk outlives the clones
+        self.assertEqual(os.listdir(config.overlay_dir), [os.path.basename(template.image_path)])
+    
+    def _manager(self, **vm):
+        from vm_manager.vm_manager import VMManager
+        from vm_manager.vm_config import VMManagerConfig
+        config = VMManagerConfig(images_dir=self.tmp, sockets_dir=self.tmp, logs_dir=self.tmp,
+                                 overlay_dir=os.path.join(self.tmp, "overlays"), overlay_ram_dir=None,
+                                 memory_state_dir=os.path.join(self.tmp, "state"),
+                                 arm64_config=VMConfig(name="mem", architecture=VMArchitecture.ARM64,
+                                                       image_path=self.base, disk_mode="memory", **vm))
+        manager = VMManager(config=config)
+        running = set()
+        manager.launched = []
+        
+        def launch(vm_config, anti_vm):
+            manager.launched.append(vm_config)
+            if vm_config.memory_shared:
+                open(vm_config.memory_file, 'w').close()
+            running.add(vm_config.name)
+            return type('P', (), {'monitor_socket': os.path.join(self.tmp, 'mon.sock'), 'events': None})()
+        
+        manager.launcher.launch = launch
+        manager.launcher.stop = lambda name, force=False: running.discard(name)
+        manager.launcher.is_running = lambda name: name in running
+        manager._wait_for_vm_ready = lambda vm_config, timeout: True
+        return manager
+    
+    def test_template_kept_across_restarts(self):
+        first = self._manager(start_mode="resume")
+        self.assertTrue(first._start_clone(first.get_pool(VMArchitecture.ARM64).slots[0].config))
+        first.stop_all()
+        self.assertEqual(len(self.saved), 1)
+        
+        # Same configuration: the next run restores without capturing again
+        second = self._manager(start_mode="resume")
+        self.assertTrue(second.get_status()['arm64']['memory_template_ready'])
+        self.assertTrue(second._start_clone(second.get_pool(VMArchitecture.ARM64).slots[0].config))
+        self.assertEqual([c.incoming for c in second.launched], ['defer'])
+        self.assertEqual(len(self.saved), 1)
+        second.stop_all()
+        
+        # Changed configuration or cold-boot mode: the saved state is dropped
+        self.assertFalse(self._manager(start_mode="resume", ram_mb=2048).get_status()['arm64']['memory_template_ready'])
+        self.assertFalse(os.path.exists(os.path.join(self.tmp, "state", "mem.state")))
+
+
+class TestStartModes(unittest.TestCase):
+    """Test resuming snapshot-mode clones, fast boot and QEMU crash handling"""
+    
+    def setUp(self):
+        import shutil
+        import tempfile
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+        self.image = os.path.join(self.tmp, "img.qcow2")
+        open(self.image, 'w').close()
+    
+    def _manager(self, missing_snapshot=False, **vm):
+        from vm_manager.vm_manager import VMManager
+        from vm_manager.vm_config import VMManagerConfig
+        config = VMManagerConfig(images_dir=self.tmp, sockets_dir=self.tmp, logs_dir=self.tmp,
+                                 arm64_config=VMConfig(name="snap", architecture=VMArchitecture.ARM64,
+                                                       image_path=self.image, **vm))
+        manager = VMManager(config=config)
+        running = set()
+        manager.launched, manager.readies = [], []
+        
+        def launch(vm_config, anti_vm):
+            manager.launched.append(vm_config)
+            if vm_config.loadvm and missing_snapshot:
+                raise RuntimeError("QEMU exited: Snapshot 'clean' does not exist")
+            running.add(vm_config.name)
+            return type('P', (), {'monitor_socket': os.path.join(self.tmp, 'mon.sock'), 'events': None})()
+        
+        manager.launcher.launch = launch
+        manager.launcher.stop = lambda name, force=False: running.discard(name)
+        manager.launcher.is_running = lambda name: name in running
+        manager._wait_for_vm_ready = lambda vm_config, timeout: manager.readies.append(timeout) or True
+        return manager
+    
+    def test_resume_from_snapshot(self):
+        manager = self._manager(start_mode="resume")
+        slot = manager.get_pool(VMArchitecture.ARM64).slots[0]
+        self.assertTrue(manager._start_clone(slot.config))
+        self.assertEqual([c.loadvm for c in manager.launched], ['clean'])
+        self.assertEqual(manager.readies, [slot.config.snapshot_timeout])
+        # Already in the clean state
+        self.assertTrue(slot.clean)
+    
+    def test_resume_falls_back_to_boot(self):
+        manager = self._manager(missing_snapshot=True, start_mode="resume")
+        slot = manager.get_pool(VMArchitecture.ARM64).slots[0]
+        self.assertTrue(manager._start_clone(slot.config))
+        self.assertEqual([c.loadvm for c in manager.launched], ['clean', None])
+        self.assertEqual(manager.readies, [slot.config.boot_timeout])
+        self.assertFalse(slot.clean)
+    
+    def test_launch_args(self):
+        from dataclasses import replace
+        from vm_manager.qemu_launcher import QEMULauncher
+        from vm_manager.vm_config import AntiVMConfig
+        launcher = QEMULauncher(self.tmp)
+        fast = VMConfig(name="f", architecture=VMArchitecture.ARM64, image_path=self.image, disk_mode="memory",
+                        kernel="/k/vmlinuz", initrd="/k/initrd.img", loadvm="clean")
+        args = launcher.build_command(fast, AntiVMConfig(), event_fd=9)
+        self.assertEqual(args[args.index('-kernel') + 1], "/k/vmlinuz")
+        self.assertEqual(args[args.index('-append') + 1], fast.get_kernel_append())
+        self.assertNotIn('-bios', args)
+        self.assertEqual(args[args.index('-loadvm') + 1], "clean")
+        self.assertIn('socket,id=qmpev,fd=9', args)
+        self.assertNotIn('-kernel', launcher.build_command(make_config(), AntiVMConfig()))
+        # Saved states stay valid across launches, not across config changes
+        self.assertEqual(launcher.fingerprint(fast, AntiVMConfig()),
+                         launcher.fingerprint(fast.clone(1), AntiVMConfig()))
+        self.assertNotEqual(launcher.fingerprint(fast, AntiVMConfig()),
+                            launcher.fingerprint(replace(fast, kernel=None), AntiVMConfig()))
+    
+    def test_qmp_events(self):
+        import json
+        import socket
+        from vm_manager.qemu_launcher import QMPEvents
+        ours, qemu = socket.socketpair()
+        closed = []
+        events = QMPEvents(ours, on_close=closed.append)
+        self.addCleanup(qemu.close)
+        send = lambda msg: qemu.sendall((json.dumps(msg) + '\n').encode())
+        
+        self.assertFalse(events.wait_ready(0.05))
+        send({'QMP': {'version': {}}})
+        self.assertTrue(events.wait_ready(1))
+        self.assertIn(b'qmp_capabilities', qemu.recv(4096))
+        
+        send({'event': 'STOP'})
+        mark = events.wait_for({'STOP'}, 1) and events.mark()
+        self.assertEqual(mark, 1)
+        self.assertIsNone(events.wait_for({'STOP'}, 0.05, after=mark))
+        threading.Timer(0.05, send, [{'event': 'MIGRATION', 'data': {'status': 'active'}}]).start()
+        threading.Timer(0.1, send, [{'event': 'MIGRATION', 'data': {'status': 'completed'}}]).start()
+        done = events.wait_for({'MIGRATION'}, 2, after=mark,
+                               match=lambda e: e['data']['status'] == 'completed')
+        self.assertEqual(done['data']['status'], 'completed')
+        
+        send({'event': 'SHUTDOWN', 'data': {'guest': True, 'reason': 'guest-panic'}})
+        qemu.close()
+        self.assertIsNone(events.wait_for({'RESUME'}, 2))
+        self.assertTrue(events.closed)
+        events._thread.join(2)
+        self.assertEqual(closed[0]['data']['reason'], 'guest-panic')
+    
+    def test_crashed_clone_restarts(self):
+        manager = self._manager()
+        slot = manager.get_pool(VMArchitecture.ARM64).slots[0]
+        self.assertTrue(manager._start_clone(slot.config))
+        manager.launcher.stop(slot.name)
+        
+        manager._on_vm_exit(slot.name, None)
+        manager.wait_for_reverts(5)
+        self.assertEqual(len(manager.launched), 2)
+        self.assertTrue(manager.launcher.is_running(slot.name))
+        self.assertEqual((slot.busy, slot.jobs_done), (False, 0))
+        
+        # Crash loop: left stopped
+        manager._on_vm_exit(slot.name, None)
+        manager.wait_for_reverts(5)
+        self.assertEqual(len(manager.launched), 2)
+        self.assertEqual(manager.get_state(VMArchitecture.ARM64).value, 'error')
+
+
+class TestExecutionTier(unittest.TestCase):
+    """Test user-mode emulation of static x86 ELFs in the ARM64 VM"""
+    
+    def setUp(self):
+        import shutil
+        import struct
+        import tempfile
+        from vm_manager.vm_manager import VMManager
+        from vm_manager.vm_config import VMManagerConfig
+        self.tmp = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, self.tmp, True)
+        config = VMManagerConfig(
+            images_dir=self.tmp, sockets_dir=self.tmp, logs_dir=self.tmp, user_mode_max_mb=1,
+            arm64_config=VMConfig(name="arm", architecture=VMArchitecture.ARM64, image_path="/tmp/a.qcow2"),
+            x64_config=VMConfig(name="x64", architecture=VMArchitecture.X64, image_path="/tmp/x.qcow2"))
+        self.manager = VMManager(config=config)
+        
+        def elf(name, p_types, padding=0):
+            header = bytearray(b'\x7fELF\x02\x01\x01' + b'\x00' * 57)
+            struct.pack_into('<HHIQQ', header, 16, 2, 62, 1, 0, 64)
+            struct.pack_into('<HH', header, 54, 56, len(p_types))
+            path = os.path.join(self.tmp, name)
+            with open(path, 'wb') as f:
+                f.write(bytes(header) + b''.join(struct.pack('<I', t) + b'\x00' * 52 for t in p_types))
+                f.write(b'\x00' * padding)
+            return path
+        self.static = elf("static", [1])
+        self.dynamic = elf("dynamic", [3, 1])
+        self.large = elf("large", [1], padding=2 * 1024 * 1024)
+    
+    def test_select_tier(self):
+        self.assertEqual(self.manager._select_tier(self.static), (VMArchitecture.ARM64, 'qemu-x86_64'))
+        self.assertEqual(self.manager._select_tier(self.dynamic), (VMArchitecture.X64, None))
+        self.assertEqual(self.manager._select_tier(self.large), (VMArchitecture.X64, None))
+        self.manager.config.user_mode_emulators = {}
+        self.assertEqual(self.manager._select_tier(self.static), (VMArchitecture.X64, None))
+    
+    def test_missing_emulator_falls_back(self):
+        from vm_manager.vm_manager import AnalysisResult
+        runs = []
+        
+        def run(slot, arch, path, timeout, start, on_event, trace, sample, emulator=None, monitors=None):
+            runs.append((arch, emulator))
+            if emulator:
+                return AnalysisResult(success=False, file_path=path, architecture=arch.value, duration=0,
+                                      error=f"Emulator not available: {emulator}", emulator=emulator)
+            return AnalysisResult(success=True, file_path=path, architecture=arch.value, duration=0)
+        self.manager._analyze_on_clone = run
+        self.manager._reset_clone = lambda arch, slot: True
+        
+        result = self.manager.analyze_file(self.static)
+        self.manager.wait_for_reverts(5)
+        self.assertTrue(result.success)
+        self.assertEqual(runs, [(VMArchitecture.ARM64, 'qemu-x86_64'), (VMArchitecture.X64, None)])
+        # An explicit architecture is never re-tiered
+        self.manager.analyze_file(self.static, arch=VMArchitecture.X64)
+        self.assertEqual(runs[-1], (VMArchitecture.X64, None))
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
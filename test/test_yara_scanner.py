@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""
+YARA Scanner Tests
+
+Runs YaraScanner against a stand-in yara module to check the compiled
+rules cache, reload on source changes and per-sample match sharing
+between the static and dynamic analyzers.
+"""
+
+import os
+import sys
+import types
+import shutil
+import tempfile
+import unittest
+from unittest import mock
+
+# Add parent directory to path
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+from dynamic import YaraScanner, DynamicAnalyzer
+from sample import describe
+
+
+class FakeMatch:
+    def __init__(self, rule):
+        self.rule = rule
+        self.meta = {'score': 20, 'description': rule}
+        self.strings = []
+
+
+class FakeRules:
+    def __init__(self, sources):
+        self.sources = sources
+        self.scans = 0
+    
+    def match(self, path):
+        self.scans += 1
+        return [FakeMatch(os.path.splitext(name)[0]) for name in self.sources]
+    
+    def save(self, path):
+        with open(path, 'w') as f:
+            f.write('\n'.join(self.sources))
+
+
+def _fake_yara():
+    yara = types.ModuleType('yara')
+    yara.__version__ = 'test'
+    yara.compiled = 0
+    
+    def compile(filepaths):
+        yara.compiled += 1
+        return FakeRules(sorted(filepaths))
+    
+    def load(path):
+        with open(path) as f:
+            return FakeRules(f.read().split('\n'))
+    
+    yara.compile, yara.load = compile, load
+    return yara
+
+
+class TestYaraScanner(unittest.TestCase):
+    """Test compiled rules caching and match sharing"""
+    
+    def setUp(self):
+        self.tmp = tempfile.mkdtemp()
+        self.rules_dir = os.path.join(self.tmp, 'rules')
+        self.cache_dir = os.path.join(self.tmp, 'cache')
+        os.makedirs(self.rules_dir)
+        self._write_rule('first.yar')
+        self.sample = os.path.join(self.tmp, 'sample.bin')
+        with open(self.sample, 'wb') as f:
+            f.write(b'payload')
+        self.yara = _fake_yara()
+        patcher = mock.patch.dict(sys.modules, {'yara': self.yara})
+        patcher.start()
+        self.addCleanup(patcher.stop)
+        self.addCleanup(YaraScanner._instances.clear)
+    
+    def tearDown(self):
+        shutil.rmtree(self.tmp, ignore_errors=True)
+    
+    def _write_rule(self, name):
+        with open(os.path.join(self.rules_dir, name), 'w') as f:
+            f.write('rule x { condition: true }\n')
+    
+    def test_compiled_rules_reused(self):
+        first = YaraScanner(self.rules_dir, self.cache_dir)
+        self.assertTrue(first.available)
+        self.assertEqual(self.yara.compiled, 1)
+        self.assertEqual(len(os.listdir(self.cache_dir)), 1)
+        
+        second = YaraScanner(self.rules_dir, self.cache_dir)
+        self.assertEqual(self.yara.compiled, 1)
+        self.assertEqual(second.version, first.version)
+        self.assertEqual([m.rule for m in second.scan(self.sample)], ['first'])
+    
+    def test_reload_on_source_change(self):
+        scanner = YaraScanner(self.rules_dir, self.cache_dir)
+        scanner.RELOAD_CHECK_INTERVAL = 0
+        version = scanner.version
+        self._write_rule('second.yar')
+        
+        self.assertEqual([m.rule for m in scanner.scan(self.sample)], ['first', 'second'])
+        self.assertNotEqual(scanner.version, version)
+        self.assertEqual(self.yara.compiled, 2)
+        # Only the current compiled set is kept
+        self.assertEqual(os.listdir(self.cache_dir), [f"rules-{scanner.version}.yarc"])
+    
+    def test_one_scan_per_sample(self):
+        scanner = YaraScanner.shared(self.rules_dir, self.cache_dir)
+        self.assertIs(YaraScanner.shared(self.rules_dir, self.cache_dir), scanner)
+        desc = describe(self.sample)
+        
+        first = scanner.scan(self.sample, desc)
+        self.assertIs(scanner.scan(self.sample, desc), first)
+        self.assertEqual(scanner.rules.scans, 1)
+        scanner.scan(self.sample)
+        self.assertEqual(scanner.rules.scans, 2)
+    
+    def test_dynamic_analyzer_scans_once(self):
+        analyzer = DynamicAnalyzer(db_path=os.path.join(self.tmp, 'dyn.db'), yara_dir=self.rules_dir,
+                                   vm_config_path=os.path.join(self.tmp, 'none.yaml'),
+                                   cache_path=os.path.join(self.tmp, 'results.db'),
+                                   yara_cache_dir=os.path.join(self.tmp, 'yara_cache'))
+        # Static stage of the same upload
+        from static import StaticAnalyzer
+        from test_virustotal import static_config
+        static = StaticAnalyzer(self.rules_dir, config_path=static_config(self.tmp))
+        static.vt.check_hash = lambda h: {'found': False}
+        desc = describe(self.sample)
+        
+        static_result = static.run(self.sample, desc)
+        result = analyzer.run(self.sample, use_cache=False, sample=desc)
+        self.assertIs(analyzer.yara, static.yara)
+        self.assertEqual(static_result['yara_matches'], ['first'])
+        self.assertEqual(result['yara_matches'], ['first'])
+        self.assertEqual(analyzer.yara.rules.scans, 1)
+
+
+if __name__ == '__main__':
+    unittest.main(verbosity=2)
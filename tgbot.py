@@ -1,12 +1,19 @@
 import os
 import json
+import time
 from datetime import datetime
 import telebot
 from telebot.types import InlineKeyboardMarkup, InlineKeyboardButton
 from dotenv import load_dotenv
+import requests
 import yaml
 
-from static import StaticAnalyzer
+from analyzers import Analyzers
+from sample import describe
+from job_queue import JobQueue, PRIORITY_HIGH, PRIORITY_NORMAL
+from bulk import safe_name
+from ingest import ingest
+import metrics
 
 load_dotenv()
 
@@ -19,15 +26,28 @@ bot = telebot.TeleBot(BOT_TOKEN)
 with open("config.yaml", "r") as f:
     config = yaml.safe_load(f)
 
-static_analyzer = StaticAnalyzer(config)
+# Built on first use; warm_up() in __main__ builds them once polling has started
+analyzers = Analyzers("config.yaml", dynamic_timeout=30, db_path="logs/dynamic_analysis.db")
 
-try:
-    from dynamic import DynamicAnalyzer
-    dynamic_analyzer = DynamicAnalyzer(timeout=30, db_path="logs/dynamic_analysis.db")
-    DYNAMIC_ENABLED = True
-except (ImportError, RuntimeError):
-    dynamic_analyzer = None
-    DYNAMIC_ENABLED = False
+queue_cfg = config.get("queue", {})
+job_queue = JobQueue(queue_cfg.get("db_path", "logs/jobs.db"), workers=queue_cfg.get("workers", 2))
+metrics_cfg = config.get("metrics", {})
+ingest_cfg = config.get("ingest", {})
+
+def start_metrics():
+    if not metrics_cfg.get("enabled", False):
+        return
+    def queue_depth():
+        stats = job_queue.get_stats()
+        return {"queued": stats["pending"], "running": stats["running"]}
+    metrics.QUEUE_JOBS.set_function(queue_depth)
+    def slot_usage():
+        # A scrape must not be the one to build the dynamic analyzer
+        if not analyzers.loaded("dynamic") or analyzers.dynamic is None:
+            return {}
+        return analyzers.dynamic.slot_usage()
+    metrics.VM_SLOTS.set_function(slot_usage)
+    metrics.serve(metrics_cfg.get("port", 9108), metrics_cfg.get("addr", "127.0.0.1"))
 
 def escape_md(text):
     for c in '_*[]()~`>#+-=|{}.!':
@@ -106,7 +126,7 @@ def files_kb(uid, is_grp=False):
 def file_kb(idx, is_grp=False):
     kb = InlineKeyboardMarkup()
     prefix = "g" if is_grp else ""
-    if DYNAMIC_ENABLED:
+    if analyzers.dynamic_enabled:
         kb.row(InlineKeyboardButton("🔬 Полный анализ", callback_data=f"{prefix}full:{idx}"))
     kb.row(InlineKeyboardButton("🔍 Статический анализ", callback_data=f"{prefix}stat:{idx}"))
     kb.row(InlineKeyboardButton("🗑 Удалить", callback_data=f"{prefix}del:{idx}"))
@@ -118,17 +138,19 @@ def group_kb():
     kb.row(InlineKeyboardButton("📂 Файлы группы", callback_data="gfiles"))
     return kb
 
-def run_static(path):
+def run_static(path, sample=None, clamav=None):
     try:
-        return static_analyzer.run(path)
+        # VirusTotal answers later via follow_vt, so quota waits don't hold the report
+        return analyzers.static.run(path, sample, wait_vt=False, clamav=clamav)
     except Exception as e:
         return {"error": str(e), "verdict": "ERROR", "score": 0}
 
-def run_dynamic(path):
-    if not DYNAMIC_ENABLED:
-        return {"error": "Недоступно"}
+def run_dynamic(path, sample=None):
     try:
-        return dynamic_analyzer.run(path)
+        dynamic_analyzer = analyzers.dynamic
+        if dynamic_analyzer is None:
+            return {"error": "Недоступно"}
+        return dynamic_analyzer.run(path, sample=sample)
     except Exception as e:
         return {"error": str(e)}
 
@@ -143,6 +165,7 @@ def format_report(res, fname, dyn=None):
         r += f"\n**YARA:** `{', '.join(res['yara_matches'][:3])}`\n"
     if res.get("clamav", {}).get("infected"):
         r += f"**ClamAV:** `{res['clamav']['signature']}`\n"
+    r += vt_line(res)
     if res.get("hash"):
         r += f"\n**SHA256:** `{res['hash']}`\n"
     
@@ -156,6 +179,145 @@ def format_report(res, fname, dyn=None):
         r += f"\n**Итог:** {fv} (score: {final})"
     return r
 
+def vt_line(res):
+    vt = res.get("virustotal", {})
+    if vt.get("pending"):
+        return "VirusTotal: ⏳ ожидание ответа...\n"
+    if vt.get("found"):
+        return f"VirusTotal: {vt.get('malicious', 0)} детектов\n"
+    return ""
+
+def follow_vt(job, res, done):
+    # Re-render the report with the rescored result once VirusTotal answers
+    analyzers.static.update_with_vt(res, lambda updated: done(job, updated))
+
+def set_status(job, text, kb=None):
+    try:
+        bot.edit_message_text(text, job.chat_id, job.message_id, reply_markup=kb, parse_mode="Markdown")
+    except Exception:
+        pass  # message deleted or not modified
+
+def notify_queued(job):
+    pos = job_queue.position(job.id)
+    if pos:
+        set_status(job, f"⏳ В очереди: {pos} перед вами")
+
+def file_chunks(info):
+    # Same URL as bot.download_file, read in chunks instead of one bytes object
+    url = (telebot.apihelper.FILE_URL or "https://api.telegram.org/file/bot{0}/{1}").format(BOT_TOKEN, info.file_path)
+    with requests.get(url, stream=True, proxies=telebot.apihelper.proxy,
+                      timeout=ingest_cfg.get("timeout", 60)) as r:
+        r.raise_for_status()
+        yield from r.iter_content(ingest_cfg.get("chunk_kb", 256) * 1024)
+
+def download(info, path, clamd=None):
+    # Hashed, typed and (with clamd) virus-scanned while it arrives
+    with metrics.span("download"):
+        return ingest(file_chunks(info), path, size_hint=info.file_size,
+                      spill_bytes=ingest_cfg.get("spill_mb", 8) << 20, clamd=clamd)
+
+def job_upload(job, progress):
+    p = job.payload
+    progress("⏳ Загрузка...")
+    info = bot.get_file(p["file_id"])
+    upload = download(info, os.path.join(p["folder"], p["fname"]), analyzers.static.clamav.clamd)
+    progress("⏳ Анализ...")
+    return run_static(upload.path, upload.sample, upload.clamav)
+
+def upload_done(job, res):
+    p = job.payload
+    fname = p["fname"]
+    v, s = res.get("verdict", "UNKNOWN"), res.get("score", 0)
+    emoji = {"CLEAN": "✅", "SUSPICIOUS": "⚠️", "MALICIOUS": "🚨"}.get(v, "❓")
+    
+    report = f"{emoji} **{escape_md(fname)}**\n\nВердикт: `{v}` | Score: {s}\n"
+    if res.get("yara_matches"):
+        report += f"YARA: {escape_md(', '.join(res['yara_matches'][:2]))}\n"
+    if res.get("clamav", {}).get("infected"):
+        report += f"ClamAV: {escape_md(res['clamav']['signature'])}\n"
+    report += vt_line(res)
+    
+    files = get_files(p["folder"])
+    idx = files.index(fname) if fname in files else 0
+    set_status(job, report, file_kb(idx, p["is_grp"]))
+    follow_vt(job, res, upload_done)
+
+def job_static(job, progress):
+    progress(f"🔍 Анализ `{job.payload['fname']}`...")
+    return run_static(job.payload["path"])
+
+def static_done(job, res):
+    p = job.payload
+    set_status(job, format_report(res, p["fname"]), file_kb(p["idx"], p["is_grp"]))
+    follow_vt(job, res, static_done)
+
+def job_full(job, progress):
+    p = job.payload
+    progress(f"🔬 Полный анализ `{p['fname']}`...\nСтатика...")
+    sample = describe(p["path"])  # hashed and typed once for both stages
+    res = run_static(p["path"], sample)
+    progress(f"🔬 Полный анализ `{p['fname']}`...\nДинамика (VM)...")
+    dyn = run_dynamic(p["path"], sample)
+    return {"static": res, "dynamic": dyn}
+
+def full_done(job, out):
+    p = job.payload
+    set_status(job, format_report(out["static"], p["fname"], out["dynamic"]), file_kb(p["idx"], p["is_grp"]))
+    follow_vt(job, out["static"], lambda job, res: full_done(job, dict(out, static=res)))
+
+def job_bulk(job, progress):
+    p = job.payload
+    progress(f"📦 Загрузка `{p['fname']}`...")
+    info = bot.get_file(p["file_id"])
+    # The archive itself is only needed while its members are streamed out
+    archive = os.path.join(analyzers.bulk.scratch_dir, f"bulk_{job.id}_{safe_name(p['fname'])}")
+    download(info, archive)
+    last = [0.0]
+    def scored(n):
+        if time.monotonic() - last[0] >= 3:  # Telegram rate-limits edits
+            last[0] = time.monotonic()
+            progress(f"📦 `{p['fname']}`: проверено {n}...")
+    try:
+        return analyzers.bulk.run(archive, p["folder"], on_progress=scored)
+    finally:
+        os.unlink(archive)
+
+def bulk_done(job, report):
+    p = job.payload
+    files = get_files(p["folder"])
+    gated = report.gated
+    r = f"📦 **{escape_md(p['fname'])}**\n\nПроверено: {len(report.results)}"
+    if report.skipped:
+        r += f" | Пропущено: {len(report.skipped)}"
+    if report.duplicates:
+        r += f" | Дубликаты: {report.duplicates}"
+    r += f"\nНа динамику (score ≥ {report.min_score}): {len(gated)}\n"
+    if report.results:
+        r += "\nТоп:\n" + "\n".join(f"• `{x.verdict}` {x.score} {escape_md(x.name)}" for x in report.top()) + "\n"
+    if gated and not analyzers.dynamic_enabled:
+        r += "\nДинамика недоступна, файлы сохранены"
+    set_status(job, r)
+    if not analyzers.dynamic_enabled:
+        return
+    for x in gated:
+        fname = os.path.basename(x.path)
+        try:
+            status = bot.send_message(job.chat_id, f"⏳ {escape_md(fname)}: в очереди на динамику", parse_mode="Markdown")
+            queued = job_queue.submit("full", job.user_id, {"path": x.path, "fname": fname, "idx": files.index(fname),
+                                                            "is_grp": p["is_grp"]},
+                                      priority=PRIORITY_NORMAL, chat_id=job.chat_id, message_id=status.message_id)
+            notify_queued(queued)
+        except Exception as e:
+            bot.send_message(job.chat_id, f"❌ {escape_md(fname)}: {e}")
+
+def job_failed(job, e):
+    set_status(job, f"❌ Ошибка: {e}")
+
+job_queue.register("upload", job_upload, on_done=upload_done, on_error=job_failed, on_progress=set_status)
+job_queue.register("static", job_static, on_done=static_done, on_error=job_failed, on_progress=set_status)
+job_queue.register("full", job_full, on_done=full_done, on_error=job_failed, on_progress=set_status)
+job_queue.register("bulk", job_bulk, on_done=bulk_done, on_error=job_failed, on_progress=set_status)
+
 def extract_file(msg):
     if msg.document:
         return msg.document.file_id, msg.document.file_name
@@ -283,48 +445,54 @@ def cmd_admin(msg):
     text = f"🔒 **Админ-панель**\n\n👑 {len(PRIVATE_ADMINS)} | 👤 {len(ADMINS)} | 👥 {len(ALLOWED_GROUPS)}"
     bot.send_message(msg.chat.id, text, reply_markup=admin_kb(), parse_mode="Markdown")
 
+def msg_folder(msg):
+    if is_group(msg):
+        return get_folder(msg.chat.id, True) if msg.chat.id in ALLOWED_GROUPS else None
+    return get_folder(msg.from_user.id) if has_access(msg.from_user.id) else None
+
+def submit_bulk(msg, doc, folder):
+    # Archive members are triaged statically; only high scores go on to the VM queue
+    try:
+        status = bot.reply_to(msg, "📦 В очереди...")
+        job = job_queue.submit("bulk", msg.from_user.id, {"file_id": doc.file_id, "fname": doc.file_name or "bulk",
+                                                          "folder": folder, "is_grp": is_group(msg)},
+                               priority=PRIORITY_NORMAL, chat_id=msg.chat.id, message_id=status.message_id)
+        notify_queued(job)
+    except Exception as e:
+        bot.reply_to(msg, f"❌ Ошибка: {e}")
+
+@bot.message_handler(commands=["bulk"])
+def cmd_bulk(msg):
+    folder = msg_folder(msg)
+    if not folder:
+        return
+    src = msg.reply_to_message
+    if not src or not src.document:
+        bot.reply_to(msg, "📦 Ответьте /bulk на zip/tar архив или отправьте архив с подписью /bulk")
+        return
+    submit_bulk(msg, src.document, folder)
+
 @bot.message_handler(content_types=["document", "photo", "video", "audio", "voice"])
 def handle_file(msg):
     uid, cid = msg.from_user.id, msg.chat.id
     is_grp = is_group(msg)
+    folder = msg_folder(msg)
+    if not folder:
+        return
     
-    if is_grp:
-        if cid not in ALLOWED_GROUPS:
-            return
-        folder = get_folder(cid, True)
-    else:
-        if not has_access(uid):
-            return
-        folder = get_folder(uid)
+    if msg.document and (msg.caption or "").startswith("/bulk"):
+        return submit_bulk(msg, msg.document, folder)
     
     file_id, fname = extract_file(msg)
     if not file_id:
         return
     
     try:
-        status = bot.reply_to(msg, "⏳ Анализ...")
-        info = bot.get_file(file_id)
-        data = bot.download_file(info.file_path)
-        path = os.path.join(folder, fname)
-        
-        with open(path, "wb") as f:
-            f.write(data)
-        
-        res = run_static(path)
-        v, s = res.get("verdict", "UNKNOWN"), res.get("score", 0)
-        emoji = {"CLEAN": "✅", "SUSPICIOUS": "⚠️", "MALICIOUS": "🚨"}.get(v, "❓")
-        
-        report = f"{emoji} **{escape_md(fname)}**\n\nВердикт: `{v}` | Score: {s}\n"
-        if res.get("yara_matches"):
-            report += f"YARA: {escape_md(', '.join(res['yara_matches'][:2]))}\n"
-        if res.get("clamav", {}).get("infected"):
-            report += f"ClamAV: {escape_md(res['clamav']['signature'])}\n"
-        
-        files = get_files(folder)
-        idx = files.index(fname) if fname in files else 0
-        
-        bot.edit_message_text(report, cid, status.message_id, 
-                              parse_mode="Markdown", reply_markup=file_kb(idx, is_grp))
+        status = bot.reply_to(msg, "⏳ В очереди...")
+        job = job_queue.submit("upload", uid, {"file_id": file_id, "fname": fname, "folder": folder,
+                                               "is_grp": is_grp},
+                               priority=PRIORITY_HIGH, chat_id=cid, message_id=status.message_id)
+        notify_queued(job)
     except Exception as e:
         bot.reply_to(msg, f"❌ Ошибка: {e}")
 
@@ -390,11 +558,9 @@ def on_cb(call):
             return
         fname = files[idx]
         path = os.path.join(folder, fname)
-        bot.edit_message_text(f"🔍 Анализ `{fname}`...", cid, call.message.message_id,
-                              parse_mode="Markdown")
-        res = run_static(path)
-        bot.edit_message_text(format_report(res, fname), cid, call.message.message_id,
-                              reply_markup=file_kb(idx, is_grp), parse_mode="Markdown")
+        job = job_queue.submit("static", uid, {"path": path, "fname": fname, "idx": idx, "is_grp": is_grp},
+                               priority=PRIORITY_HIGH, chat_id=cid, message_id=call.message.message_id)
+        notify_queued(job)
     
     elif d.startswith("full:") or d.startswith("gfull:"):
         is_grp = d.startswith("g")
@@ -406,15 +572,12 @@ def on_cb(call):
             return
         fname = files[idx]
         path = os.path.join(folder, fname)
-        if not DYNAMIC_ENABLED:
+        if not analyzers.dynamic_enabled:
             bot.answer_callback_query(call.id, "Динамика недоступна")
             return
-        bot.edit_message_text(f"🔬 Полный анализ `{fname}`...", cid, call.message.message_id,
-                              parse_mode="Markdown")
-        res = run_static(path)
-        dyn = run_dynamic(path)
-        bot.edit_message_text(format_report(res, fname, dyn), cid, call.message.message_id,
-                              reply_markup=file_kb(idx, is_grp), parse_mode="Markdown")
+        job = job_queue.submit("full", uid, {"path": path, "fname": fname, "idx": idx, "is_grp": is_grp},
+                               priority=PRIORITY_NORMAL, chat_id=cid, message_id=call.message.message_id)
+        notify_queued(job)
     
     elif d.startswith("del:") or d.startswith("gdel:"):
         is_grp = d.startswith("g")
@@ -479,5 +642,8 @@ def on_cb(call):
 if __name__ == "__main__":
     os.makedirs(DOWNLOAD_FOLDER, exist_ok=True)
     os.makedirs("logs", exist_ok=True)
+    job_queue.start()
+    start_metrics()
+    analyzers.warm_up()
     print("Bot started")
     bot.infinity_polling()
@@ -0,0 +1,594 @@
+/*
+ * sbtrace - syscall tracer for the sandbox guest agent
+ *
+ *   sbtrace [-d FD | -o FILE] [-e name,name,...] -- program [args...]
+ *
+ * Starts the program under ptrace and installs a seccomp-bpf filter before
+ * exec that returns SECCOMP_RET_TRACE only for the selected syscalls, so
+ * the tracee stops for those and runs at full speed otherwise (strace
+ * stops on every syscall). Children are followed automatically.
+ *
+ * Records (see sbtrace.h) go into an in-memory ring buffer that a writer
+ * thread drains to the output. The tracee is never blocked on a slow
+ * reader: when the ring is full records are dropped and a LOST record
+ * reports how many.
+ *
+ * Exit status is the traced program's (128 + signal if it was killed).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <netinet/in.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <elf.h>
+
+#include "sbtrace.h"
+
+#if defined(__x86_64__)
+#define SBT_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define SBT_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#else
+#error "sbtrace supports x86_64 and aarch64"
+#endif
+
+#define RING_SIZE   (4u << 20)
+#define MAX_TRACEES 4096
+#define MAX_FILTER  250
+
+enum arg_kind { ARG_NONE, ARG_STR, ARG_SOCK };
+
+struct syscall_def {
+    const char *name;
+    int nr;
+    int arg;
+    enum arg_kind kind;
+};
+
+#define SC(name, arg, kind) { #name, SYS_##name, arg, kind },
+static const struct syscall_def syscall_table[] = {
+#include "syscalls.h"
+};
+#undef SC
+
+#define TABLE_SIZE ((int)(sizeof(syscall_table) / sizeof(syscall_table[0])))
+
+/* Default selection when -e is not given */
+static const char *default_syscalls =
+    "execve,execveat,open,openat,connect,bind,listen,ptrace,clone,fork,vfork,"
+    "setuid,setgid,setreuid,setresuid,memfd_create,init_module,finit_module,"
+    "unlink,unlinkat,rename,renameat,chmod,fchmodat,process_vm_writev";
+
+/* ------------------------------------------------------------------ */
+/* Ring buffer                                                         */
+/* ------------------------------------------------------------------ */
+
+static struct {
+    unsigned char *buf;
+    size_t head;        /* total bytes written */
+    size_t tail;        /* total bytes consumed */
+    uint64_t lost;
+    int done;
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ring = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static void ring_copy_in(const void *data, size_t len)
+{
+    size_t pos = ring.head % RING_SIZE;
+    size_t first = len < RING_SIZE - pos ? len : RING_SIZE - pos;
+
+    memcpy(ring.buf + pos, data, first);
+    memcpy(ring.buf, (const unsigned char *)data + first, len - first);
+    ring.head += len;
+}
+
+static void ring_put(const void *rec, size_t len)
+{
+    struct {
+        struct sbt_header hdr;
+        uint64_t count;
+    } lost_rec;
+
+    pthread_mutex_lock(&ring.lock);
+
+    if (ring.lost && RING_SIZE - (ring.head - ring.tail) >= sizeof(lost_rec) + len) {
+        memset(&lost_rec, 0, sizeof(lost_rec));
+        lost_rec.hdr.len = sizeof(lost_rec);
+        lost_rec.hdr.type = SBT_REC_LOST;
+        lost_rec.count = ring.lost;
+        ring_copy_in(&lost_rec, sizeof(lost_rec));
+        ring.lost = 0;
+    }
+
+    if (RING_SIZE - (ring.head - ring.tail) < len)
+        ring.lost++;
+    else
+        ring_copy_in(rec, len);
+
+    pthread_cond_signal(&ring.cond);
+    pthread_mutex_unlock(&ring.lock);
+}
+
+static void *ring_writer(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&ring.lock);
+    for (;;) {
+        while (ring.head == ring.tail && !ring.done)
+            pthread_cond_wait(&ring.cond, &ring.lock);
+        if (ring.head == ring.tail)
+            break;
+
+        size_t pos = ring.tail % RING_SIZE;
+        size_t avail = ring.head - ring.tail;
+        size_t chunk = avail < RING_SIZE - pos ? avail : RING_SIZE - pos;
+        pthread_mutex_unlock(&ring.lock);
+
+        size_t off = 0;
+        while (off < chunk) {
+            ssize_t n = write(ring.fd, ring.buf + pos + off, chunk - off);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                /* Reader is gone; keep tracing, discard output */
+                off = chunk;
+                break;
+            }
+            off += (size_t)n;
+        }
+
+        pthread_mutex_lock(&ring.lock);
+        ring.tail += chunk;
+    }
+    pthread_mutex_unlock(&ring.lock);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Tracee state                                                        */
+/* ------------------------------------------------------------------ */
+
+struct tracee {
+    pid_t tid;              /* 0 = free slot */
+    int in_syscall;
+    struct sbt_syscall rec; /* filled at entry, completed at exit */
+};
+
+static struct tracee tracees[MAX_TRACEES];
+
+static struct tracee *tracee_get(pid_t tid, int create)
+{
+    struct tracee *free_slot = NULL;
+
+    for (int i = 0; i < MAX_TRACEES; i++) {
+        if (tracees[i].tid == tid)
+            return &tracees[i];
+        if (!tracees[i].tid && !free_slot)
+            free_slot = &tracees[i];
+    }
+    if (create && free_slot) {
+        memset(free_slot, 0, sizeof(*free_slot));
+        free_slot->tid = tid;
+    }
+    return create ? free_slot : NULL;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int find_def(int nr)
+{
+    for (int i = 0; i < TABLE_SIZE; i++)
+        if (syscall_table[i].nr == nr)
+            return i;
+    return -1;
+}
+
+/* ------------------------------------------------------------------ */
+/* Registers and tracee memory                                         */
+/* ------------------------------------------------------------------ */
+
+static int get_regs(pid_t tid, long *nr, uint64_t args[6], int64_t *ret)
+{
+    struct user_regs_struct regs;
+    struct iovec iov = { .iov_base = &regs, .iov_len = sizeof(regs) };
+
+    if (ptrace(PTRACE_GETREGSET, tid, (void *)NT_PRSTATUS, &iov) < 0)
+        return -1;
+
+#if defined(__x86_64__)
+    if (nr)
+        *nr = (long)regs.orig_rax;
+    if (args) {
+        args[0] = regs.rdi;
+        args[1] = regs.rsi;
+        args[2] = regs.rdx;
+        args[3] = regs.r10;
+        args[4] = regs.r8;
+        args[5] = regs.r9;
+    }
+    if (ret)
+        *ret = (int64_t)regs.rax;
+#else
+    if (nr)
+        *nr = (long)regs.regs[8];
+    if (args)
+        for (int i = 0; i < 6; i++)
+            args[i] = regs.regs[i];
+    if (ret)
+        *ret = (int64_t)regs.regs[0];
+#endif
+    return 0;
+}
+
+/* Read up to len bytes without crossing into an unmapped page */
+static size_t read_mem(pid_t tid, uint64_t addr, void *buf, size_t len, int stop_at_nul)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t done = 0;
+
+    while (done < len) {
+        size_t chunk = page - (size_t)((addr + done) % page);
+        if (chunk > len - done)
+            chunk = len - done;
+
+        struct iovec local = { .iov_base = (char *)buf + done, .iov_len = chunk };
+        struct iovec remote = { .iov_base = (void *)(uintptr_t)(addr + done), .iov_len = chunk };
+        ssize_t n = process_vm_readv(tid, &local, 1, &remote, 1, 0);
+        if (n <= 0)
+            break;
+        if (stop_at_nul && memchr((char *)buf + done, '\0', (size_t)n))
+            return done + strnlen((char *)buf + done, (size_t)n);
+        done += (size_t)n;
+    }
+    return done;
+}
+
+static size_t decode_sockaddr(pid_t tid, uint64_t addr, uint64_t addrlen, char *out, size_t size)
+{
+    struct sockaddr_storage ss;
+    size_t len = addrlen < sizeof(ss) ? (size_t)addrlen : sizeof(ss);
+    char ip[INET6_ADDRSTRLEN];
+    int n = 0;
+
+    memset(&ss, 0, sizeof(ss));
+    if (!addr || read_mem(tid, addr, &ss, len, 0) < sizeof(sa_family_t))
+        return 0;
+
+    if (ss.ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+        inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+        n = snprintf(out, size, "%s:%u", ip, ntohs(sin->sin_port));
+    } else if (ss.ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof(ip));
+        n = snprintf(out, size, "[%s]:%u", ip, ntohs(sin6->sin6_port));
+    } else if (ss.ss_family == AF_UNIX) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+        n = snprintf(out, size, "unix:%.*s", (int)sizeof(sun->sun_path), sun->sun_path);
+    } else {
+        n = snprintf(out, size, "family:%u", ss.ss_family);
+    }
+    if (n < 0)
+        return 0;
+    return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+/* ------------------------------------------------------------------ */
+/* Events                                                              */
+/* ------------------------------------------------------------------ */
+
+static void emit_syscall(struct tracee *t)
+{
+    t->rec.hdr.len = (uint32_t)(offsetof(struct sbt_syscall, data) + t->rec.hdr.len);
+    ring_put(&t->rec, t->rec.hdr.len);
+    t->in_syscall = 0;
+}
+
+static void on_syscall_enter(pid_t tid)
+{
+    struct tracee *t = tracee_get(tid, 1);
+    long nr;
+
+    if (!t || get_regs(tid, &nr, t->rec.args, NULL) < 0)
+        return;
+
+    const struct syscall_def *def = NULL;
+    int idx = find_def((int)nr);
+    if (idx >= 0)
+        def = &syscall_table[idx];
+
+    memset(&t->rec.hdr, 0, sizeof(t->rec.hdr));
+    t->rec.hdr.type = SBT_REC_SYSCALL;
+    t->rec.hdr.nr = (uint16_t)nr;
+    t->rec.hdr.tid = tid;
+    t->rec.hdr.ts_ns = now_ns();
+    t->rec.ret = 0;
+
+    /* hdr.len temporarily holds the data length, see emit_syscall() */
+    size_t data_len = 0;
+    if (def && def->kind == ARG_STR)
+        data_len = read_mem(tid, t->rec.args[def->arg], t->rec.data, SBT_MAX_DATA - 1, 1);
+    else if (def && def->kind == ARG_SOCK)
+        data_len = decode_sockaddr(tid, t->rec.args[def->arg], t->rec.args[def->arg + 1],
+                                   t->rec.data, SBT_MAX_DATA);
+    if (def && def->kind != ARG_NONE)
+        t->rec.hdr.flags = (uint32_t)(def->arg + 1);
+    t->rec.hdr.len = (uint32_t)data_len;
+
+    t->in_syscall = 1;
+}
+
+static void on_syscall_exit(pid_t tid)
+{
+    struct tracee *t = tracee_get(tid, 0);
+
+    if (!t || !t->in_syscall)
+        return;
+    get_regs(tid, NULL, NULL, &t->rec.ret);
+    emit_syscall(t);
+}
+
+static void on_tracee_exit(pid_t tid, int status)
+{
+    struct tracee *t = tracee_get(tid, 0);
+    struct {
+        struct sbt_header hdr;
+        int32_t status;
+    } rec;
+
+    if (t) {
+        if (t->in_syscall) {
+            t->rec.hdr.flags |= SBT_FLAG_NO_RETURN;
+            emit_syscall(t);
+        }
+        t->tid = 0;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.hdr.len = sizeof(rec);
+    rec.hdr.type = SBT_REC_EXIT;
+    rec.hdr.tid = tid;
+    rec.hdr.ts_ns = now_ns();
+    rec.status = status;
+    ring_put(&rec, sizeof(rec));
+}
+
+static void emit_names(const int *selected, int count)
+{
+    struct {
+        struct sbt_header hdr;
+        char name[32];
+    } rec;
+
+    for (int i = 0; i < count; i++) {
+        const struct syscall_def *def = &syscall_table[selected[i]];
+        size_t len = strnlen(def->name, sizeof(rec.name));
+
+        memset(&rec, 0, sizeof(rec));
+        rec.hdr.len = (uint32_t)(sizeof(rec.hdr) + len);
+        rec.hdr.type = SBT_REC_NAME;
+        rec.hdr.nr = (uint16_t)def->nr;
+        memcpy(rec.name, def->name, len);
+        ring_put(&rec, rec.hdr.len);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* Setup                                                               */
+/* ------------------------------------------------------------------ */
+
+static int select_syscalls(const char *list, int *selected)
+{
+    char *copy = strdup(list);
+    int count = 0;
+
+    for (char *save = NULL, *name = strtok_r(copy, ",", &save); name;
+         name = strtok_r(NULL, ",", &save)) {
+        /* Unknown names (e.g. fork on aarch64) are skipped */
+        for (int i = 0; i < TABLE_SIZE && count < MAX_FILTER; i++) {
+            if (strcmp(syscall_table[i].name, name) == 0) {
+                int dup = 0;
+                for (int j = 0; j < count; j++)
+                    dup |= selected[j] == i;
+                if (!dup)
+                    selected[count++] = i;
+                break;
+            }
+        }
+    }
+    free(copy);
+    return count;
+}
+
+static int install_filter(const int *selected, int count)
+{
+    struct sock_filter filter[MAX_FILTER + 5];
+    int n = 0;
+
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                               offsetof(struct seccomp_data, arch));
+    /* Other ABIs (e.g. int 0x80 on x86_64) are not traced */
+    filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SBT_AUDIT_ARCH,
+                                               0, (unsigned char)(count + 1));
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                               offsetof(struct seccomp_data, nr));
+    for (int i = 0; i < count; i++)
+        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                   (unsigned)syscall_table[selected[i]].nr,
+                                                   (unsigned char)(count - i), 0);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE);
+
+    struct sock_fprog prog = { .len = (unsigned short)n, .filter = filter };
+
+    /* Unprivileged filters need no_new_privs; root keeps setuid semantics intact */
+    if (geteuid() != 0 && prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
+        return -1;
+    return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: sbtrace [-d FD | -o FILE] [-e syscall,...] -- program [args...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *list = default_syscalls;
+    int out_fd = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+d:o:e:")) != -1) {
+        switch (opt) {
+        case 'd':
+            out_fd = atoi(optarg);
+            break;
+        case 'o':
+            out_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out_fd < 0) {
+                perror("sbtrace: open");
+                return 2;
+            }
+            break;
+        case 'e':
+            list = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc || out_fd < 0)
+        usage();
+
+    int selected[MAX_FILTER];
+    int count = select_syscalls(list, selected);
+
+    /* The tracee must not inherit the output descriptor */
+    fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t child = fork();
+    if (child < 0) {
+        perror("sbtrace: fork");
+        return 2;
+    }
+    if (child == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+            _exit(126);
+        raise(SIGSTOP);
+        if (install_filter(selected, count) < 0)
+            _exit(126);
+        execvp(argv[optind], &argv[optind]);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(child, &status, 0) < 0 || !WIFSTOPPED(status)) {
+        fprintf(stderr, "sbtrace: tracee did not stop\n");
+        return 2;
+    }
+    if (ptrace(PTRACE_SETOPTIONS, child, NULL,
+               (void *)(long)(PTRACE_O_TRACESECCOMP | PTRACE_O_TRACESYSGOOD |
+                              PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                              PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC |
+                              PTRACE_O_EXITKILL)) < 0) {
+        perror("sbtrace: PTRACE_SETOPTIONS");
+        kill(child, SIGKILL);
+        return 2;
+    }
+
+    ring.buf = malloc(RING_SIZE);
+    ring.fd = out_fd;
+    if (!ring.buf)
+        return 2;
+    pthread_t writer;
+    pthread_create(&writer, NULL, ring_writer, NULL);
+
+    emit_names(selected, count);
+    tracee_get(child, 1);
+    ptrace(PTRACE_CONT, child, NULL, NULL);
+
+    int child_status = 0;
+    for (;;) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;  /* ECHILD: all tracees are gone */
+        }
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            on_tracee_exit(tid, status);
+            if (tid == child)
+                child_status = status;
+            continue;
+        }
+        if (!WIFSTOPPED(status))
+            continue;
+
+        int sig = WSTOPSIG(status);
+        unsigned event = (unsigned)status >> 16;
+        enum __ptrace_request restart = PTRACE_CONT;
+        int inject = 0;
+
+        if (sig == SIGTRAP && event == PTRACE_EVENT_SECCOMP) {
+            on_syscall_enter(tid);
+            /* Stop once more at syscall exit to read the return value */
+            restart = PTRACE_SYSCALL;
+        } else if (sig == (SIGTRAP | 0x80)) {
+            on_syscall_exit(tid);
+        } else if (sig == SIGTRAP && event) {
+            /* fork/clone/exec notifications; new tracees report themselves */
+            struct tracee *t = tracee_get(tid, 0);
+            if (t && t->in_syscall)
+                restart = PTRACE_SYSCALL;
+        } else if (sig == SIGSTOP && !tracee_get(tid, 0)) {
+            /* Initial stop of an auto-attached child */
+            tracee_get(tid, 1);
+        } else {
+            inject = sig;
+        }
+
+        ptrace(restart, tid, NULL, (void *)(long)inject);
+    }
+
+    pthread_mutex_lock(&ring.lock);
+    ring.done = 1;
+    pthread_cond_signal(&ring.cond);
+    pthread_mutex_unlock(&ring.lock);
+    pthread_join(writer, NULL);
+
+    if (WIFSIGNALED(child_status))
+        return 128 + WTERMSIG(child_status);
+    return WEXITSTATUS(child_status);
+}
@@ -0,0 +1,42 @@
+/*
+ * sbtrace - syscall tracer for the sandbox guest agent
+ *
+ * Binary record format written to the output descriptor. All fields are
+ * in the guest's native byte order (little-endian on x86_64 and aarch64).
+ * Every record starts with struct sbt_header; hdr.len is the size of the
+ * whole record, so readers can skip record types they do not know.
+ */
+
+#ifndef SBTRACE_H
+#define SBTRACE_H
+
+#include <stdint.h>
+
+#define SBT_REC_NAME     1   /* nr -> name mapping, data = name (no NUL) */
+#define SBT_REC_SYSCALL  2   /* struct sbt_syscall */
+#define SBT_REC_EXIT     3   /* tracee exited, data = int32 wait status */
+#define SBT_REC_LOST     4   /* records dropped (ring full), data = uint64 count */
+
+/* SYSCALL flags: low byte = 1 + index of the decoded argument (0 = none) */
+#define SBT_FLAG_ARG_MASK   0xff
+#define SBT_FLAG_NO_RETURN  0x100   /* tracee died before the syscall returned */
+
+#define SBT_MAX_DATA 256
+
+struct sbt_header {
+    uint32_t len;      /* record size including this header */
+    uint16_t type;     /* SBT_REC_* */
+    uint16_t nr;       /* native syscall number */
+    int32_t  tid;      /* thread that made the call */
+    uint32_t flags;
+    uint64_t ts_ns;    /* CLOCK_REALTIME at syscall entry */
+};
+
+struct sbt_syscall {
+    struct sbt_header hdr;
+    uint64_t args[6];
+    int64_t  ret;
+    char     data[SBT_MAX_DATA];   /* decoded argument, trimmed by hdr.len */
+};
+
+#endif /* SBTRACE_H */
@@ -0,0 +1,178 @@
+/*
+ * Syscalls that can be selected with -e, as
+ *     SC(name, index of the argument to decode or -1, ARG_NONE/ARG_STR/ARG_SOCK)
+ * Entries not defined on the build architecture (e.g. open and fork on
+ * aarch64) are left out by the preprocessor.
+ */
+
+#ifdef SYS_execve
+SC(execve, 0, ARG_STR)
+#endif
+#ifdef SYS_execveat
+SC(execveat, 1, ARG_STR)
+#endif
+#ifdef SYS_open
+SC(open, 0, ARG_STR)
+#endif
+#ifdef SYS_openat
+SC(openat, 1, ARG_STR)
+#endif
+#ifdef SYS_creat
+SC(creat, 0, ARG_STR)
+#endif
+#ifdef SYS_unlink
+SC(unlink, 0, ARG_STR)
+#endif
+#ifdef SYS_unlinkat
+SC(unlinkat, 1, ARG_STR)
+#endif
+#ifdef SYS_rename
+SC(rename, 0, ARG_STR)
+#endif
+#ifdef SYS_renameat
+SC(renameat, 1, ARG_STR)
+#endif
+#ifdef SYS_renameat2
+SC(renameat2, 1, ARG_STR)
+#endif
+#ifdef SYS_chmod
+SC(chmod, 0, ARG_STR)
+#endif
+#ifdef SYS_fchmodat
+SC(fchmodat, 1, ARG_STR)
+#endif
+#ifdef SYS_chown
+SC(chown, 0, ARG_STR)
+#endif
+#ifdef SYS_fchownat
+SC(fchownat, 1, ARG_STR)
+#endif
+#ifdef SYS_mkdir
+SC(mkdir, 0, ARG_STR)
+#endif
+#ifdef SYS_mkdirat
+SC(mkdirat, 1, ARG_STR)
+#endif
+#ifdef SYS_rmdir
+SC(rmdir, 0, ARG_STR)
+#endif
+#ifdef SYS_symlink
+SC(symlink, 1, ARG_STR)
+#endif
+#ifdef SYS_symlinkat
+SC(symlinkat, 2, ARG_STR)
+#endif
+#ifdef SYS_link
+SC(link, 0, ARG_STR)
+#endif
+#ifdef SYS_linkat
+SC(linkat, 1, ARG_STR)
+#endif
+#ifdef SYS_truncate
+SC(truncate, 0, ARG_STR)
+#endif
+#ifdef SYS_chroot
+SC(chroot, 0, ARG_STR)
+#endif
+#ifdef SYS_mount
+SC(mount, 1, ARG_STR)
+#endif
+#ifdef SYS_umount2
+SC(umount2, 0, ARG_STR)
+#endif
+#ifdef SYS_memfd_create
+SC(memfd_create, 0, ARG_STR)
+#endif
+#ifdef SYS_delete_module
+SC(delete_module, 0, ARG_STR)
+#endif
+#ifdef SYS_socket
+SC(socket, -1, ARG_NONE)
+#endif
+#ifdef SYS_connect
+SC(connect, 1, ARG_SOCK)
+#endif
+#ifdef SYS_bind
+SC(bind, 1, ARG_SOCK)
+#endif
+#ifdef SYS_listen
+SC(listen, -1, ARG_NONE)
+#endif
+#ifdef SYS_accept
+SC(accept, -1, ARG_NONE)
+#endif
+#ifdef SYS_accept4
+SC(accept4, -1, ARG_NONE)
+#endif
+#ifdef SYS_sendto
+SC(sendto, 4, ARG_SOCK)
+#endif
+#ifdef SYS_ptrace
+SC(ptrace, -1, ARG_NONE)
+#endif
+#ifdef SYS_process_vm_readv
+SC(process_vm_readv, -1, ARG_NONE)
+#endif
+#ifdef SYS_process_vm_writev
+SC(process_vm_writev, -1, ARG_NONE)
+#endif
+#ifdef SYS_setuid
+SC(setuid, -1, ARG_NONE)
+#endif
+#ifdef SYS_setgid
+SC(setgid, -1, ARG_NONE)
+#endif
+#ifdef SYS_setreuid
+SC(setreuid, -1, ARG_NONE)
+#endif
+#ifdef SYS_setregid
+SC(setregid, -1, ARG_NONE)
+#endif
+#ifdef SYS_setresuid
+SC(setresuid, -1, ARG_NONE)
+#endif
+#ifdef SYS_setresgid
+SC(setresgid, -1, ARG_NONE)
+#endif
+#ifdef SYS_init_module
+SC(init_module, -1, ARG_NONE)
+#endif
+#ifdef SYS_finit_module
+SC(finit_module, -1, ARG_NONE)
+#endif
+#ifdef SYS_kexec_load
+SC(kexec_load, -1, ARG_NONE)
+#endif
+#ifdef SYS_fork
+SC(fork, -1, ARG_NONE)
+#endif
+#ifdef SYS_vfork
+SC(vfork, -1, ARG_NONE)
+#endif
+#ifdef SYS_clone
+SC(clone, -1, ARG_NONE)
+#endif
+#ifdef SYS_clone3
+SC(clone3, -1, ARG_NONE)
+#endif
+#ifdef SYS_kill
+SC(kill, -1, ARG_NONE)
+#endif
+#ifdef SYS_tgkill
+SC(tgkill, -1, ARG_NONE)
+#endif
+#ifdef SYS_mprotect
+SC(mprotect, -1, ARG_NONE)
+#endif
+#ifdef SYS_prctl
+SC(prctl, -1, ARG_NONE)
+#endif
+#ifdef SYS_personality
+SC(personality, -1, ARG_NONE)
+#endif
+#ifdef SYS_bpf
+SC(bpf, -1, ARG_NONE)
+#endif
+#ifdef SYS_reboot
+SC(reboot, -1, ARG_NONE)
+#endif
@@ -8,14 +8,20 @@ import os
 import sys
 import json
 import time
+import queue
+import ctypes
+import select
+import struct
 import socket
 import signal
+import shutil
 import hashlib
 import logging
 import tempfile
 import threading
 import subprocess
-from dataclasses import dataclass, field, asdict
+from collections import OrderedDict, deque
+from dataclasses import dataclass, field, fields, asdict, astuple
 from typing import Dict, List, Optional, Any, Callable
 from datetime import datetime
 from pathlib import Path
@@ -91,23 +97,291 @@ class AnalysisResult:
     processes: List[Dict] = field(default_factory=list)
     events: List[Dict] = field(default_factory=list)
     error: Optional[str] = None
+    # Events seen per kind / lost to buffer limits
+    event_counts: Dict[str, int] = field(default_factory=dict)
+    dropped_events: Dict[str, int] = field(default_factory=dict)
+    # Reason given by the host when it stopped the run early
+    cancelled: Optional[str] = None
+    # Guest path of the packet capture, if one was written
+    pcap: Optional[str] = None
+    # Seconds spent per phase: setup (monitors), execute (sample), collect
+    timings: Dict[str, float] = field(default_factory=dict)
 
 
-class SyscallTracer:
-    """Trace syscalls using strace"""
+def kill_process_tree(process: subprocess.Popen):
+    """Kill the sample and everything it spawned (it runs in its own session)"""
+    try:
+        os.killpg(process.pid, signal.SIGKILL)
+    except OSError:
+        process.kill()
+
+
+class RunControl:
+    """Lets the host stop a running analysis (see the cancel command)"""
     
     def __init__(self):
-        self.events: List[SyscallEvent] = []
+        self.reason: Optional[str] = None
+        self._process: Optional[subprocess.Popen] = None
+        self._lock = threading.Lock()
+    
+    def attach(self, process: subprocess.Popen):
+        """Register the sample process; kills it if cancel came first"""
+        with self._lock:
+            self._process = process
+            if self.reason:
+                kill_process_tree(process)
+    
+    def cancel(self, reason: str):
+        with self._lock:
+            self.reason = reason
+            if self._process and self._process.poll() is None:
+                kill_process_tree(self._process)
+
+
+# Streamed event batching (see EventSink)
+EVENT_BATCH_SIZE = 256
+EVENT_FLUSH_INTERVAL = 0.2
+# Events waiting to be sent; beyond this new events are dropped and counted
+MAX_QUEUED_EVENTS = 4096
+# Events kept per kind when the host did not ask for streaming
+MAX_COLLECTED_EVENTS = 10000
+
+EVENT_TYPES = {
+    'syscalls': SyscallEvent,
+    'files': FileEvent,
+    'network': NetworkEvent,
+    'processes': ProcessEvent,
+}
+
+
+class EventSink:
+    """
+    Bounded event buffer shared by the monitors of one analysis.
+    
+    With `emit` set, a flusher thread sends batches as events arrive, so
+    the buffer only holds what the host has not received yet. A batch
+    carries rows as lists in dataclass field order plus the field names:
+        {'seq': 1, 'fields': {'syscalls': [...]}, 'syscalls': [[...], ...],
+         'dropped': {...}}
+    Sends block while the host is not reading; the monitors never do,
+    events beyond MAX_QUEUED_EVENTS are dropped and counted instead.
+    
+    Without `emit`, events are collected for the final response.
+    """
+    
+    def __init__(self, emit: Optional[Callable[[Dict[str, Any]], None]] = None):
+        self._emit = emit
+        self._cond = threading.Condition()
+        self._queue: deque = deque()
+        self._collected: Dict[str, List] = {kind: [] for kind in EVENT_TYPES}
+        self._seq = 0
+        self._running = False
+        self._thread: Optional[threading.Thread] = None
+        self.counts: Dict[str, int] = {}
+        self.dropped: Dict[str, int] = {}
+    
+    @property
+    def streaming(self) -> bool:
+        return self._emit is not None
+    
+    def start(self):
+        """Start the flusher thread (streaming mode only)"""
+        if not self._emit:
+            return
+        self._running = True
+        self._thread = threading.Thread(target=self._flush_loop, daemon=True)
+        self._thread.start()
+    
+    def add(self, kind: str, event: Any):
+        """Record an event from a monitor thread"""
+        with self._cond:
+            self.counts[kind] = self.counts.get(kind, 0) + 1
+            if self._emit:
+                if not self._running or len(self._queue) >= MAX_QUEUED_EVENTS:
+                    self.dropped[kind] = self.dropped.get(kind, 0) + 1
+                    return
+                self._queue.append((kind, event))
+                if len(self._queue) >= EVENT_BATCH_SIZE:
+                    self._cond.notify()
+            else:
+                rows = self._collected[kind]
+                if len(rows) >= MAX_COLLECTED_EVENTS:
+                    self.dropped[kind] = self.dropped.get(kind, 0) + 1
+                    return
+                rows.append(event)
+    
+    def add_dropped(self, kind: str, count: int):
+        """Count events lost before they reached the sink"""
+        with self._cond:
+            self.dropped[kind] = self.dropped.get(kind, 0) + count
+    
+    def _take_batch(self) -> Optional[Dict[str, Any]]:
+        """Pop up to EVENT_BATCH_SIZE events as a compact batch (lock held)"""
+        if not self._queue:
+            return None
+        batch: Dict[str, Any] = {'fields': {}}
+        for _ in range(min(EVENT_BATCH_SIZE, len(self._queue))):
+            kind, event = self._queue.popleft()
+            if kind not in batch:
+                batch[kind] = []
+                batch['fields'][kind] = [f.name for f in fields(EVENT_TYPES[kind])]
+            batch[kind].append(astuple(event))
+        self._seq += 1
+        batch['seq'] = self._seq
+        batch['dropped'] = dict(self.dropped)
+        return batch
+    
+    def _flush_loop(self):
+        """Send batches when full or every EVENT_FLUSH_INTERVAL"""
+        while True:
+            with self._cond:
+                if self._running and len(self._queue) < EVENT_BATCH_SIZE:
+                    self._cond.wait(EVENT_FLUSH_INTERVAL)
+                batch = self._take_batch()
+                if batch is None and not self._running:
+                    return
+            if batch is None:
+                continue
+            try:
+                self._emit(batch)
+            except OSError as e:
+                # Host is gone, nobody will read the rest
+                logger.warning(f"Event stream lost: {e}")
+                with self._cond:
+                    self._running = False
+                    for kind, _ in self._queue:
+                        self.dropped[kind] = self.dropped.get(kind, 0) + 1
+                    self._queue.clear()
+                return
+    
+    def stop(self):
+        """Flush queued events and stop the flusher"""
+        with self._cond:
+            self._running = False
+            self._cond.notify()
+        if self._thread:
+            self._thread.join(timeout=10)
+    
+    def get_events(self, kind: str) -> List[Dict]:
+        """Collected events of one kind (empty in streaming mode)"""
+        with self._cond:
+            return [asdict(e) for e in self._collected[kind]]
+
+
+# Native tracer from tracer_lib ("make install" puts it next to agent.py)
+SBTRACE_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'sbtrace')
+
+# sbtrace record format, see tracer_lib/sbtrace.h
+SBT_HEADER = struct.Struct('<IHHiIQ')
+SBT_SYSCALL = struct.Struct('<6Qq')
+SBT_REC_NAME = 1
+SBT_REC_SYSCALL = 2
+SBT_REC_LOST = 4
+SBT_FLAG_ARG_MASK = 0xff
+SBT_FLAG_NO_RETURN = 0x100
+SBT_MAX_DATA = 256
+# Largest record sbtrace writes (a syscall with a full decoded argument)
+SBT_MAX_RECORD = SBT_HEADER.size + SBT_SYSCALL.size + SBT_MAX_DATA
+# Smallest body of the record types that carry fixed fields
+SBT_MIN_BODY = {SBT_REC_SYSCALL: SBT_SYSCALL.size, SBT_REC_LOST: 8}
+
+# Traced when the host does not send its syscall list
+DEFAULT_TRACE_SYSCALLS = [
+    'execve', 'execveat', 'open', 'openat', 'connect', 'bind', 'listen',
+    'ptrace', 'clone', 'fork', 'vfork', 'setuid', 'setgid', 'setreuid',
+    'setresuid', 'memfd_create', 'init_module', 'finit_module', 'unlink',
+    'unlinkat', 'rename', 'renameat', 'chmod', 'fchmodat', 'process_vm_writev',
+]
+
+
+class SyscallTracer:
+    """
+    Trace syscalls of the sample.
+    
+    With the native sbtrace tracer installed, the sample is started under
+    it (see wrap()), so tracing begins at exec and the sample only stops
+    on the selected syscalls. Otherwise strace is attached to the running
+    process and its text output parsed.
+    """
+    
+    def __init__(self, sink: EventSink, syscalls: Optional[List[str]] = None,
+                 tracer_path: str = SBTRACE_PATH):
+        self.sink = sink
+        self.syscalls = list(syscalls or DEFAULT_TRACE_SYSCALLS)
+        self.tracer_path = tracer_path
+        self.native = os.access(tracer_path, os.X_OK)
         self._process: Optional[subprocess.Popen] = None
         self._thread: Optional[threading.Thread] = None
         self._running = False
+        self._read_fd: Optional[int] = None
+        self._write_fd: Optional[int] = None
+    
+    def wrap(self, cmd: List[str]) -> List[str]:
+        """Command line running the sample under the native tracer"""
+        if not self.native:
+            return cmd
+        self._read_fd, self._write_fd = os.pipe()
+        return [self.tracer_path, '-d', str(self._write_fd),
+                '-e', ','.join(self.syscalls), '--'] + cmd
+    
+    @property
+    def pass_fds(self) -> tuple:
+        """Descriptors the wrapped command must inherit"""
+        return (self._write_fd,) if self._write_fd is not None else ()
     
     def start(self, pid: int):
         """Start tracing a process"""
         self._running = True
-        self._thread = threading.Thread(target=self._trace, args=(pid,), daemon=True)
+        if self._read_fd is not None:
+            # Only the tracer holds the write end now, EOF follows its exit
+            os.close(self._write_fd)
+            self._write_fd = None
+            self._thread = threading.Thread(target=self._read_records, daemon=True)
+        else:
+            self._thread = threading.Thread(target=self._trace, args=(pid,), daemon=True)
         self._thread.start()
     
+    def _read_records(self):
+        """Read binary records from sbtrace"""
+        names: Dict[int, str] = {}
+        try:
+            with os.fdopen(self._read_fd, 'rb') as f:
+                while True:
+                    header = f.read(SBT_HEADER.size)
+                    if len(header) < SBT_HEADER.size:
+                        break
+                    length, rec_type, nr, tid, flags, ts_ns = SBT_HEADER.unpack(header)
+                    if not SBT_HEADER.size <= length <= SBT_MAX_RECORD:
+                        # Lost sync with the stream, nothing after this can be trusted
+                        logger.error(f"Tracer record with bad length {length}, stopping")
+                        break
+                    body = f.read(length - SBT_HEADER.size)
+                    if len(body) < length - SBT_HEADER.size:
+                        break
+                    if len(body) < SBT_MIN_BODY.get(rec_type, 0):
+                        logger.error(f"Truncated tracer record of type {rec_type}, stopping")
+                        break
+                    
+                    if rec_type == SBT_REC_NAME:
+                        names[nr] = body.decode('ascii', errors='replace')
+                    elif rec_type == SBT_REC_SYSCALL:
+                        *regs, ret = SBT_SYSCALL.unpack_from(body)
+                        args = [hex(r) for r in regs]
+                        arg_index = flags & SBT_FLAG_ARG_MASK
+                        if arg_index:
+                            args[arg_index - 1] = body[SBT_SYSCALL.size:].decode('utf-8', errors='replace')
+                        self.sink.add('syscalls', SyscallEvent(
+                            timestamp=ts_ns / 1e9,
+                            syscall=names.get(nr, str(nr)),
+                            args=args,
+                            result='?' if flags & SBT_FLAG_NO_RETURN else str(ret),
+                            pid=tid
+                        ))
+                    elif rec_type == SBT_REC_LOST:
+                        self.sink.add_dropped('syscalls', struct.unpack_from('<Q', body)[0])
+        except Exception as e:
+            logger.error(f"Tracer read error: {e}")
+    
     def _trace(self, pid: int):
         """Run strace in background"""
         try:
@@ -172,7 +446,7 @@ class SyscallTracer:
                 result=result,
                 pid=0
             )
-            self.events.append(event)
+            self.sink.add('syscalls', event)
             
         except Exception:
             pass
@@ -186,19 +460,77 @@ class SyscallTracer:
                 self._process.wait(timeout=2)
             except subprocess.TimeoutExpired:
                 self._process.kill()
+        
+        if self.native:
+            if self._thread:
+                # Tracer exits with the sample; wait for its last records
+                self._thread.join(timeout=2)
+            else:
+                # Sample never started
+                for fd in (self._read_fd, self._write_fd):
+                    if fd is not None:
+                        os.close(fd)
+            self._read_fd = self._write_fd = None
+
+
+# Watched when the host sends no filesystem.critical_paths
+DEFAULT_WATCH_PATHS = ['/tmp', '/home', '/etc', '/var']
+# Captured when the host sends no network.capture_ports
+DEFAULT_CAPTURE_PORTS = [53, 80, 443, 8080]
+
+# Monitor threads yield to the sample under load (they drop, it runs)
+MONITOR_NICE = 10
+# Identical events remembered per monitor to suppress repeats
+RECENT_EVENTS = 4096
+
+
+def _lower_thread_priority():
+    """Renice the calling thread (Linux nice values are per thread)"""
+    try:
+        os.setpriority(os.PRIO_PROCESS, threading.get_native_id(), MONITOR_NICE)
+    except (AttributeError, OSError):
+        pass
+
+
+def _reap(process: Optional[subprocess.Popen]):
+    """Terminate a monitor child and wait for it"""
+    if process is None or process.poll() is not None:
+        return
+    process.terminate()
+    try:
+        process.wait(timeout=2)
+    except subprocess.TimeoutExpired:
+        process.kill()
+        process.wait()
+
+
+class RecentSet:
+    """Bounded set of recently seen keys (oldest forgotten first)"""
     
-    def get_events(self) -> List[Dict]:
-        return [asdict(e) for e in self.events]
+    def __init__(self, size: int = RECENT_EVENTS):
+        self.size = size
+        self._keys: OrderedDict = OrderedDict()
+    
+    def add(self, key) -> bool:
+        """Remember a key; False if it was already known"""
+        if key in self._keys:
+            self._keys.move_to_end(key)
+            return False
+        self._keys[key] = None
+        if len(self._keys) > self.size:
+            self._keys.popitem(last=False)
+        return True
 
 
 class FileMonitor:
-    """Monitor file system changes using inotify"""
+    """Monitor file system changes using inotifywait (fallback for FanotifyMonitor)"""
     
-    def __init__(self, watch_paths: List[str] = None):
-        self.events: List[FileEvent] = []
+    def __init__(self, sink: EventSink, watch_paths: List[str] = None):
+        self.sink = sink
         self._thread: Optional[threading.Thread] = None
+        self._process: Optional[subprocess.Popen] = None
         self._running = False
-        self.watch_paths = watch_paths or ['/tmp', '/home', '/etc', '/var']
+        self.watch_paths = watch_paths or DEFAULT_WATCH_PATHS
     
     def start(self):
         """Start monitoring"""
@@ -212,20 +544,18 @@ class FileMonitor:
             cmd = ['inotifywait', '-m', '-r', '--format', '%T %w%f %e', '--timefmt', '%s']
             cmd.extend(self.watch_paths)
             
-            process = subprocess.Popen(
+            self._process = subprocess.Popen(
                 cmd,
                 stdout=subprocess.PIPE,
                 stderr=subprocess.DEVNULL,
                 text=True
             )
             
-            for line in process.stdout:
+            for line in self._process.stdout:
                 if not self._running:
                     break
                 self._parse_inotify_line(line.strip())
             
-            process.terminate()
-            
         except Exception as e:
             logger.error(f"File monitor error: {e}")
     
@@ -258,24 +588,25 @@ class FileMonitor:
                 path=path,
                 pid=0
             )
-            self.events.append(event)
+            self.sink.add('files', event)
             
         except Exception:
             pass
     
     def stop(self):
-        """Stop monitoring"""
+        """Stop monitoring and reap inotifywait"""
         self._running = False
-    
-    def get_events(self) -> List[Dict]:
-        return [asdict(e) for e in self.events]
+        _reap(self._process)
+        if self._thread:
+            self._thread.join(timeout=2)
 
 
 class NetworkMonitor:
-    """Monitor network activity"""
+    """Monitor network activity with tcpdump (fallback for PacketMonitor)"""
     
-    def __init__(self):
-        self.events: List[NetworkEvent] = []
+    def __init__(self, sink: EventSink, ports: Optional[List[int]] = None):
+        self.sink = sink
+        self.ports = ports or DEFAULT_CAPTURE_PORTS
         self._process: Optional[subprocess.Popen] = None
         self._thread: Optional[threading.Thread] = None
         self._running = False
@@ -291,7 +622,7 @@ class NetworkMonitor:
         try:
             self._process = subprocess.Popen(
                 ['tcpdump', '-l', '-n', '-q', '-i', 'any',
-                 'port 53 or port 80 or port 443 or port 8080'],
+                 ' or '.join(f'port {p}' for p in self.ports)],
                 stdout=subprocess.PIPE,
                 stderr=subprocess.DEVNULL,
                 text=True
@@ -340,19 +671,647 @@ class NetworkMonitor:
                 dst_port=port,
                 protocol=protocol
             )
-            self.events.append(event)
+            self.sink.add('network', event)
             
         except Exception:
             pass
     
     def stop(self):
-        """Stop monitoring"""
+        """Stop monitoring and reap tcpdump"""
         self._running = False
-        if self._process:
-            self._process.terminate()
+        _reap(self._process)
+        if self._thread:
+            self._thread.join(timeout=2)
+
+
+# fanotify(7) constants
+FAN_CLOEXEC = 0x01
+FAN_NONBLOCK = 0x02
+FAN_CLASS_NOTIF = 0x00
+FAN_MARK_ADD = 0x01
+FAN_MARK_MOUNT = 0x10
+FAN_MODIFY = 0x02
+FAN_CLOSE_WRITE = 0x08
+FAN_OPEN = 0x20
+FAN_OPEN_EXEC = 0x1000
+FAN_Q_OVERFLOW = 0x4000
+FAN_NOFD = -1
+FANOTIFY_METADATA_VERSION = 3
+FAN_EVENT = struct.Struct('=IBBHQii')
+
+# Most significant kind first when the kernel merged several events
+FAN_EVENT_TYPES = ((FAN_OPEN_EXEC, 'exec'), (FAN_CLOSE_WRITE, 'write'),
+                   (FAN_MODIFY, 'modify'), (FAN_OPEN, 'open'))
+
+# Fixed read buffer of the native monitors
+MONITOR_BUFFER = 64 * 1024
+
+
+def parse_fanotify_events(buf, length: int):
+    """
+    Decode fanotify_event_metadata records.
+    
+    Yields:
+        (mask, fd, pid); fd is FAN_NOFD for queue overflow events
+    """
+    offset = 0
+    while offset + FAN_EVENT.size <= length:
+        event_len, vers, _, _, mask, fd, pid = FAN_EVENT.unpack_from(buf, offset)
+        if vers != FANOTIFY_METADATA_VERSION or event_len < FAN_EVENT.size:
+            return
+        yield mask, fd, pid
+        offset += event_len
+
+
+def _under(path: str, roots: List[str]) -> bool:
+    return any(path == r or path.startswith(r.rstrip('/') + '/') for r in roots)
+
+
+class FanotifyMonitor:
+    """
+    Monitor file access with fanotify.
+    
+    Marks the mounts holding the watched paths, so the kernel only
+    queues opens, writes and execs there, and reports the acting pid
+    (inotify cannot). The kernel queue is bounded: on overflow it sends
+    FAN_Q_OVERFLOW, which is counted as a dropped event. Creates and
+    deletes are not reported in this (fd-based) mode; a created file
+    shows up as its open and write. Needs CAP_SYS_ADMIN.
+    """
+    
+    def __init__(self, sink: EventSink, watch_paths: Optional[List[str]] = None):
+        self.sink = sink
+        self.watch_paths = [os.path.abspath(p) for p in (watch_paths or DEFAULT_WATCH_PATHS)]
+        self._fd: Optional[int] = None
+        self._thread: Optional[threading.Thread] = None
+        self._running = False
+        self._recent = RecentSet()
+    
+    def open(self):
+        """Create the fanotify group and marks (raises OSError if unavailable)"""
+        libc = ctypes.CDLL(None, use_errno=True)
+        libc.fanotify_mark.argtypes = [ctypes.c_int, ctypes.c_uint, ctypes.c_uint64,
+                                       ctypes.c_int, ctypes.c_char_p]
+        fd = libc.fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK,
+                                os.O_RDONLY | os.O_CLOEXEC | getattr(os, 'O_LARGEFILE', 0))
+        if fd < 0:
+            err = ctypes.get_errno()
+            raise OSError(err, f"fanotify_init: {os.strerror(err)}")
+        try:
+            mask = FAN_OPEN | FAN_MODIFY | FAN_CLOSE_WRITE | FAN_OPEN_EXEC
+            for path in self.watch_paths:
+                if not os.path.exists(path):
+                    continue
+                if libc.fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MOUNT, mask, -1, path.encode()) < 0:
+                    err = ctypes.get_errno()
+                    # FAN_OPEN_EXEC needs Linux 5.0
+                    if err == 22 and mask & FAN_OPEN_EXEC:
+                        mask &= ~FAN_OPEN_EXEC
+                        if libc.fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MOUNT, mask, -1,
+                                              path.encode()) == 0:
+                            continue
+                        err = ctypes.get_errno()
+                    raise OSError(err, f"fanotify_mark {path}: {os.strerror(err)}")
+        except Exception:
+            os.close(fd)
+            raise
+        self._fd = fd
+    
+    def start(self):
+        """Start monitoring"""
+        if self._fd is None:
+            self.open()
+        self._running = True
+        self._thread = threading.Thread(target=self._monitor, daemon=True)
+        self._thread.start()
+    
+    def _monitor(self):
+        _lower_thread_priority()
+        buf = bytearray(MONITOR_BUFFER)
+        poller = select.poll()
+        poller.register(self._fd, select.POLLIN)
+        own_pid = os.getpid()
+        
+        while self._running:
+            if not poller.poll(200):
+                continue
+            try:
+                length = os.readv(self._fd, [buf])
+            except BlockingIOError:
+                continue
+            except OSError as e:
+                logger.error(f"fanotify read error: {e}")
+                return
+            now = time.time()
+            for mask, fd, pid in parse_fanotify_events(buf, length):
+                if mask & FAN_Q_OVERFLOW:
+                    self.sink.add_dropped('files', 1)
+                    continue
+                if fd == FAN_NOFD:
+                    continue
+                try:
+                    path = os.readlink(f'/proc/self/fd/{fd}')
+                except OSError:
+                    path = ''
+                finally:
+                    os.close(fd)
+                self._record(now, mask, path, pid, own_pid)
+    
+    def _record(self, timestamp: float, mask: int, path: str, pid: int, own_pid: int):
+        if pid == own_pid or not _under(path, self.watch_paths):
+            return
+        event_type = next((name for bit, name in FAN_EVENT_TYPES if mask & bit), 'open')
+        if self._recent.add((pid, event_type, path)):
+            self.sink.add('files', FileEvent(timestamp=timestamp, event_type=event_type,
+                                             path=path, pid=pid))
+    
+    def stop(self):
+        """Stop monitoring and close the fanotify group"""
+        self._running = False
+        if self._thread:
+            self._thread.join(timeout=2)
+        if self._fd is not None:
+            os.close(self._fd)
+            self._fd = None
+
+
+# Classic BPF (linux/filter.h) and packet socket constants
+BPF_LD_B_ABS = 0x30
+BPF_LD_H_ABS = 0x28
+BPF_LD_H_IND = 0x48
+BPF_LDX_B_MSH = 0xb1
+BPF_ALU_RSH_K = 0x74
+BPF_JEQ_K = 0x15
+BPF_JSET_K = 0x45
+BPF_RET_K = 0x06
+SO_ATTACH_FILTER = 26
+SOL_PACKET = 263
+PACKET_STATISTICS = 6
+PACKET_OUTGOING = 4
+ETH_P_ALL = 0x0003
+ETH_P_IP = 0x0800
+ETH_P_IPV6 = 0x86dd
+IPPROTO_TCP = 6
+IPPROTO_UDP = 17
+TCP_SYN = 0x02
+TCP_ACK = 0x10
+
+# Bytes kept per packet: IP and TCP/UDP headers
+CAPTURE_SNAPLEN = 128
+# Kernel receive queue of the capture socket; beyond it packets are dropped
+CAPTURE_RCVBUF = 1024 * 1024
+
+# Full-payload capture for the host's DNS/HTTP/TLS extraction: bytes kept
+# per packet (request heads and ClientHellos fit) and capture size limit
+PCAP_SNAPLEN = 4096
+PCAP_MAX_BYTES = 32 * 1024 * 1024
+# pcap global header (v2.4, microseconds) and per-packet record header
+PCAP_HEADER = struct.Struct('<IHHiIII')
+PCAP_RECORD = struct.Struct('<IIII')
+LINKTYPE_RAW = 101
+
+
+def build_port_filter(ports: List[int], snaplen: int = CAPTURE_SNAPLEN) -> List[tuple]:
+    """
+    Classic BPF program accepting IPv4/IPv6 TCP and UDP packets with a
+    source or destination port in `ports` (any port if empty).
+    
+    Runs on SOCK_DGRAM packet sockets, so offsets start at the IP
+    header. IPv4 fragments are rejected (no ports), IPv6 extension
+    headers are not walked.
+    
+    Returns:
+        (code, jt, jf, k) instructions
+    """
+    prog: List[list] = []
+    labels: Dict[str, int] = {}
+    
+    def op(code, k=0, jt=None, jf=None):
+        prog.append([code, jt, jf, k])
+    
+    def label(name):
+        labels[name] = len(prog)
+    
+    def port_checks(src_k: int, ind: bool):
+        load = BPF_LD_H_IND if ind else BPF_LD_H_ABS
+        if not ports:
+            op(BPF_RET_K, snaplen)
+            return
+        for k in (src_k, src_k + 2):
+            op(load, k)
+            for port in ports:
+                op(BPF_JEQ_K, port, jt='accept')
+        op(BPF_RET_K, 0)
+    
+    op(BPF_LD_B_ABS, 0)
+    op(BPF_ALU_RSH_K, 4)
+    op(BPF_JEQ_K, 4, jt='v4')
+    op(BPF_JEQ_K, 6, jt='v6', jf='drop')
+    
+    label('v4')
+    op(BPF_LD_B_ABS, 9)
+    op(BPF_JEQ_K, IPPROTO_TCP, jt='v4_ports')
+    op(BPF_JEQ_K, IPPROTO_UDP, jf='drop')
+    label('v4_ports')
+    op(BPF_LD_H_ABS, 6)
+    op(BPF_JSET_K, 0x1fff, jt='drop')
+    op(BPF_LDX_B_MSH, 0)
+    port_checks(0, ind=True)
+    
+    label('v6')
+    op(BPF_LD_B_ABS, 6)
+    op(BPF_JEQ_K, IPPROTO_TCP, jt='v6_ports')
+    op(BPF_JEQ_K, IPPROTO_UDP, jf='drop')
+    label('v6_ports')
+    port_checks(40, ind=False)
+    
+    label('drop')
+    op(BPF_RET_K, 0)
+    label('accept')
+    op(BPF_RET_K, snaplen)
+    
+    program = []
+    for i, (code, jt, jf, k) in enumerate(prog):
+        jt = labels[jt] - i - 1 if jt else 0
+        jf = labels[jf] - i - 1 if jf else 0
+        if jt > 255 or jf > 255:
+            raise ValueError("Too many capture ports for one BPF program")
+        program.append((code, jt, jf, k))
+    return program
+
+
+class PcapWriter:
+    """
+    Append IP packets to a pcap file (LINKTYPE_RAW, no link headers).
+    
+    Writes are buffered; once max_bytes are written further packets are
+    counted in `dropped` instead.
+    """
+    
+    def __init__(self, path: str, snaplen: int = PCAP_SNAPLEN, max_bytes: int = PCAP_MAX_BYTES):
+        self.path = path
+        self.max_bytes = max_bytes
+        self.dropped = 0
+        self._file = open(path, 'wb', buffering=256 * 1024)
+        self._file.write(PCAP_HEADER.pack(0xa1b2c3d4, 2, 4, 0, 0, snaplen, LINKTYPE_RAW))
+        self._size = PCAP_HEADER.size
+    
+    def write(self, ts: float, data, orig_len: int):
+        if self._size + PCAP_RECORD.size + len(data) > self.max_bytes:
+            self.dropped += 1
+            return
+        sec = int(ts)
+        self._file.write(PCAP_RECORD.pack(sec, int((ts - sec) * 1e6), len(data), max(orig_len, len(data))))
+        self._file.write(data)
+        self._size += PCAP_RECORD.size + len(data)
+    
+    def close(self):
+        self._file.close()
+
+
+def ip_length(data, proto: int) -> int:
+    """Length of an IP packet according to its header (0 if unknown)"""
+    if proto == ETH_P_IP and len(data) >= 4:
+        return struct.unpack_from('!H', data, 2)[0]
+    if proto == ETH_P_IPV6 and len(data) >= 6:
+        return 40 + struct.unpack_from('!H', data, 4)[0]
+    return 0
+
+
+def parse_packet(data, proto: int) -> Optional[tuple]:
+    """
+    Flow of an outgoing IP packet that opens a connection.
+    
+    Returns:
+        (protocol, src, dst, src_port, dst_port) for TCP SYNs and UDP
+        datagrams, None otherwise
+    """
+    if proto == ETH_P_IP and len(data) >= 20:
+        ihl = (data[0] & 0x0f) * 4
+        l4, offset = data[9], ihl
+        src, dst = socket.inet_ntop(socket.AF_INET, bytes(data[12:16])), \
+            socket.inet_ntop(socket.AF_INET, bytes(data[16:20]))
+    elif proto == ETH_P_IPV6 and len(data) >= 40:
+        l4, offset = data[6], 40
+        src, dst = socket.inet_ntop(socket.AF_INET6, bytes(data[8:24])), \
+            socket.inet_ntop(socket.AF_INET6, bytes(data[24:40]))
+    else:
+        return None
+    
+    if len(data) < offset + 4:
+        return None
+    sport, dport = struct.unpack_from('!HH', data, offset)
+    if l4 == IPPROTO_TCP:
+        if len(data) < offset + 14 or (data[offset + 13] & (TCP_SYN | TCP_ACK)) != TCP_SYN:
+            return None
+        return 'tcp', src, dst, sport, dport
+    if l4 == IPPROTO_UDP:
+        return 'udp', src, dst, sport, dport
+    return None
+
+
+class PacketMonitor:
+    """
+    Capture connection attempts with an AF_PACKET socket.
+    
+    A classic BPF filter on the socket keeps only TCP/UDP packets on the
+    capture ports, truncated to their headers, so the kernel discards
+    everything else before it is copied. Only outgoing TCP SYNs and UDP
+    datagrams become events, one per flow. When the bounded socket queue
+    overflows the kernel drops packets; its count (PACKET_STATISTICS) is
+    reported as dropped network events. Needs CAP_NET_RAW.
+    
+    With pcap_path set, TCP/UDP packets on any port are kept with up to
+    PCAP_SNAPLEN bytes of payload and written to that file in both
+    directions; events are still limited to the capture ports.
+    """
+    
+    def __init__(self, sink: EventSink, ports: Optional[List[int]] = None,
+                 pcap_path: Optional[str] = None):
+        self.sink = sink
+        self.ports = [int(p) for p in (ports or DEFAULT_CAPTURE_PORTS)]
+        self.pcap_path = pcap_path
+        self._port_set = set(self.ports)
+        self._sock: Optional[socket.socket] = None
+        self._pcap: Optional[PcapWriter] = None
+        self._thread: Optional[threading.Thread] = None
+        self._running = False
+        self._flows = RecentSet()
+    
+    def open(self):
+        """Create the capture socket (raises OSError if unavailable)"""
+        sock = socket.socket(socket.AF_PACKET, socket.SOCK_DGRAM, socket.htons(ETH_P_ALL))
+        try:
+            if self.pcap_path:
+                program = build_port_filter([], snaplen=PCAP_SNAPLEN)
+            else:
+                program = build_port_filter(self.ports)
+            insns = ctypes.create_string_buffer(b''.join(struct.pack('HBBI', *i) for i in program))
+            sock.setsockopt(socket.SOL_SOCKET, SO_ATTACH_FILTER,
+                            struct.pack('HP', len(program), ctypes.addressof(insns)))
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, CAPTURE_RCVBUF)
+            # Packets queued before the filter was attached
+            sock.setblocking(False)
+            try:
+                while True:
+                    sock.recv(1)
+            except BlockingIOError:
+                pass
+            sock.settimeout(0.2)
+            if self.pcap_path:
+                self._pcap = PcapWriter(self.pcap_path)
+        except Exception:
+            sock.close()
+            raise
+        self._sock = sock
+    
+    def start(self):
+        """Start capturing"""
+        if self._sock is None:
+            self.open()
+        self._running = True
+        self._thread = threading.Thread(target=self._monitor, daemon=True)
+        self._thread.start()
+    
+    def _monitor(self):
+        _lower_thread_priority()
+        buf = bytearray(PCAP_SNAPLEN if self._pcap else CAPTURE_SNAPLEN)
+        view = memoryview(buf)
+        while self._running:
+            try:
+                length, addr = self._sock.recvfrom_into(buf)
+            except socket.timeout:
+                continue
+            except OSError as e:
+                if self._running:
+                    logger.error(f"Packet capture error: {e}")
+                return
+            packet = view[:length]
+            outgoing = addr[2] == PACKET_OUTGOING
+            # Loopback packets are seen twice; keep the outgoing copy
+            if self._pcap and (outgoing or addr[0] != 'lo'):
+                self._pcap.write(time.time(), packet, ip_length(packet, addr[1]))
+            if outgoing:
+                self._record(parse_packet(packet, addr[1]))
+    
+    def _record(self, flow: Optional[tuple]):
+        if flow is None or not (self._port_set & {flow[3], flow[4]}) or not self._flows.add(flow):
+            return
+        protocol, src, dst, _, dport = flow
+        self.sink.add('network', NetworkEvent(
+            timestamp=time.time(),
+            event_type='dns' if protocol == 'udp' and dport == 53 else 'connect',
+            src_addr=src, dst_addr=dst, dst_port=dport, protocol=protocol
+        ))
+    
+    def stop(self):
+        """Stop capturing, report kernel drops and close the socket"""
+        self._running = False
+        if self._thread:
+            self._thread.join(timeout=2)
+        if self._sock is not None:
+            try:
+                _, drops = struct.unpack('II', self._sock.getsockopt(SOL_PACKET, PACKET_STATISTICS, 8))
+                if drops:
+                    self.sink.add_dropped('network', drops)
+            except OSError:
+                pass
+            self._sock.close()
+            self._sock = None
+        if self._pcap is not None:
+            self._pcap.close()
+            if self._pcap.dropped:
+                logger.warning(f"pcap limit reached, {self._pcap.dropped} packets not written")
+            self._pcap = None
+
+
+def open_monitors(sink: EventSink, watch_paths: Optional[List[str]] = None,
+                  capture_ports: Optional[List[int]] = None,
+                  pcap_path: Optional[str] = None) -> list:
+    """
+    File and network monitors, native where the kernel allows it.
     
-    def get_events(self) -> List[Dict]:
-        return [asdict(e) for e in self.events]
+    The pcap is only written by the native packet monitor.
+    """
+    monitors = []
+    for native, fallback, arg in ((FanotifyMonitor, FileMonitor, watch_paths),
+                                  (PacketMonitor, NetworkMonitor, capture_ports)):
+        monitor = native(sink, arg, pcap_path) if native is PacketMonitor else native(sink, arg)
+        try:
+            monitor.open()
+        except (OSError, AttributeError) as e:
+            logger.warning(f"{native.__name__} unavailable ({e}), using {fallback.__name__}")
+            monitor = fallback(sink, arg)
+        monitors.append(monitor)
+    return monitors
+
+
+# File transfer chunk size (put_file/get_file streaming)
+CHUNK_SIZE = 64 * 1024
+
+# Frame protocol, must match vm_manager/agent_channel.py:
+#   u32 payload length | u32 request id | u8 frame type | payload
+FRAME_HEADER = struct.Struct('>IIB')
+MAX_FRAME_SIZE = 16 * 1024 * 1024
+
+FRAME_REQUEST = 1
+FRAME_RESPONSE = 2
+FRAME_DATA = 3
+FRAME_EVENT = 4
+FRAME_HELLO = 5
+FRAME_CREDIT = 6
+
+# Commands that exchange DATA frames with the host
+STREAM_COMMANDS = {'put_file', 'get_file'}
+
+# DATA frames buffered per upload before the reader blocks (backpressure)
+INBOX_FRAMES = 64
+
+
+class AgentConnection:
+    """
+    Framed connection to the host.
+    
+    Wraps the virtio port or a client socket. One reader thread parses
+    frames; requests are handled on their own threads and may reply
+    concurrently, so writes are serialized.
+    """
+    
+    def __init__(self, recv_into: Callable[[memoryview], int], send: Callable[[bytes], Any]):
+        """
+        Args:
+            recv_into: Read into buffer, returns byte count (0 = disconnected)
+            send: Write all bytes
+        """
+        self._recv_into = recv_into
+        self._send = send
+        self._send_lock = threading.Lock()
+        self._inboxes: Dict[int, queue.Queue] = {}
+        self._lock = threading.Lock()
+        # EVENT frames each request may still send; absent = no flow control
+        self._credit: Dict[int, int] = {}
+        self._credit_cond = threading.Condition(self._lock)
+        self.closed = False
+    
+    def _recv_exact(self, size: int) -> bytearray:
+        buf = bytearray(size)
+        view = memoryview(buf)
+        while view:
+            n = self._recv_into(view)
+            if not n:
+                self.closed = True
+                raise ConnectionError("Host disconnected")
+            view = view[n:]
+        return buf
+    
+    def read_frame(self):
+        """Read one frame; returns (frame_type, request_id, payload)"""
+        length, request_id, frame_type = FRAME_HEADER.unpack(self._recv_exact(FRAME_HEADER.size))
+        if length > MAX_FRAME_SIZE:
+            self.closed = True
+            raise ConnectionError(f"Frame too large: {length}")
+        payload = bytes(self._recv_exact(length)) if length else b''
+        return frame_type, request_id, payload
+    
+    def send_frame(self, frame_type: int, request_id: int, payload: bytes = b''):
+        with self._send_lock:
+            self._send(FRAME_HEADER.pack(len(payload), request_id, frame_type) + payload)
+    
+    def send_json(self, frame_type: int, request_id: int, obj: Dict[str, Any]):
+        self.send_frame(frame_type, request_id, json.dumps(obj).encode())
+    
+    def open_events(self, request_id: int, credit: Optional[int]):
+        """Start the event window of a request (hosts without credit send none)"""
+        if credit is None:
+            return
+        with self._lock:
+            self._credit[request_id] = int(credit)
+    
+    def close_events(self, request_id: int):
+        with self._lock:
+            self._credit.pop(request_id, None)
+    
+    def grant(self, request_id: int, events: int):
+        """Host consumed events of a request; allow that many more"""
+        with self._credit_cond:
+            if request_id in self._credit:
+                self._credit[request_id] += events
+                self._credit_cond.notify_all()
+    
+    def send_event(self, request_id: int, obj: Dict[str, Any]):
+        """
+        Send an EVENT frame, waiting for credit while the host is behind.
+        
+        Only this request waits; responses and other requests keep going.
+        """
+        with self._credit_cond:
+            while self._credit.get(request_id, 1) <= 0 and not self.closed:
+                self._credit_cond.wait(0.5)
+            if request_id in self._credit:
+                self._credit[request_id] -= 1
+        self.send_json(FRAME_EVENT, request_id, obj)
+    
+    def open_inbox(self, request_id: int) -> queue.Queue:
+        """Create the DATA frame queue of a stream request"""
+        inbox = queue.Queue(maxsize=INBOX_FRAMES)
+        with self._lock:
+            self._inboxes[request_id] = inbox
+        return inbox
+    
+    def close_inbox(self, request_id: int):
+        """Drop the inbox of a finished request and wake a reader blocked on it"""
+        with self._lock:
+            inbox = self._inboxes.pop(request_id, None)
+        if inbox is not None:
+            self._drain(inbox)
+    
+    @staticmethod
+    def _drain(inbox: queue.Queue):
+        while True:
+            try:
+                inbox.get_nowait()
+            except queue.Empty:
+                return
+    
+    def deliver(self, request_id: int, payload: bytes):
+        """
+        Route a DATA frame to its request.
+        
+        Blocks while the inbox is full, until the handler reads or closes
+        it; frames of a closed or unknown request are dropped.
+        """
+        with self._lock:
+            inbox = self._inboxes.get(request_id)
+        while inbox is not None:
+            try:
+                inbox.put(payload, timeout=0.5)
+                return
+            except queue.Full:
+                with self._lock:
+                    if self._inboxes.get(request_id) is not inbox:
+                        return
+    
+    def fail_inboxes(self):
+        """Wake up stream handlers and event senders after the connection was lost"""
+        with self._lock:
+            self.closed = True
+            self._credit_cond.notify_all()
+            inboxes, self._inboxes = self._inboxes, {}
+        for inbox in inboxes.values():
+            # Frames still queued are useless once the upload cannot finish
+            self._drain(inbox)
+            inbox.put_nowait(None)
+    
+    @staticmethod
+    def read_data(inbox: queue.Queue):
+        """Yield DATA payloads of a request until the empty end-of-stream frame"""
+        while True:
+            chunk = inbox.get()
+            if chunk is None:
+                raise ConnectionError("Host disconnected during transfer")
+            if not chunk:
+                return
+            yield chunk
 
 
 class SandboxAgent:
@@ -362,6 +1321,9 @@ class SandboxAgent:
         self.virtio_path = "/dev/virtio-ports/org.sandbox.agent"
         self._running = False
         self._sock: Optional[socket.socket] = None
+        # Running analyses by host-assigned analysis_id
+        self._runs: Dict[str, RunControl] = {}
+        self._runs_lock = threading.Lock()
     
     def _get_file_hash(self, path: str) -> str:
         """Calculate SHA256 hash of file"""
@@ -389,23 +1351,62 @@ class SandboxAgent:
         except Exception:
             pass
     
-    def analyze(self, file_path: str, timeout: int = 60) -> AnalysisResult:
-        """Run analysis on a file"""
+    def analyze(self, file_path: str, timeout: int = 60,
+                emit: Optional[Callable[[Dict[str, Any]], None]] = None,
+                control: Optional[RunControl] = None,
+                syscalls: Optional[List[str]] = None,
+                file_hash: Optional[str] = None,
+                file_type: Optional[str] = None,
+                emulator: Optional[str] = None,
+                watch_paths: Optional[List[str]] = None,
+                capture_ports: Optional[List[int]] = None,
+                pcap_path: Optional[str] = None) -> AnalysisResult:
+        """
+        Run analysis on a file.
+        
+        Args:
+            file_path: File to execute
+            timeout: Execution timeout
+            emit: Send event batches while the sample runs (see EventSink);
+                  the result then only carries counts, not the events
+            control: Allows the host to stop the sample before the timeout
+            syscalls: Syscall names to trace (host's patterns.yaml set)
+            file_hash: SHA-256 known to the host (verified on upload)
+            file_type: Type detected by the host (elf_x64, python, ...)
+            emulator: User-mode emulator to run a foreign ELF under
+                      (e.g. qemu-x86_64); monitors see the emulator process
+            watch_paths: Directories the file monitor reports on
+            capture_ports: TCP/UDP ports the network monitor captures
+            pcap_path: Write the sample's TCP/UDP traffic to this pcap
+                       for the host to fetch
+        """
         logger.info(f"Analyzing: {file_path}")
         
         start_time = time.time()
-        file_hash = self._get_file_hash(file_path)
-        file_type = self._detect_file_type(file_path)
+        file_hash = file_hash or self._get_file_hash(file_path)
+        file_type = file_type or self._detect_file_type(file_path)
+        
+        emulator_path = shutil.which(emulator) if emulator else None
+        if emulator and not emulator_path:
+            # Host falls back to the full-system VM of the sample's architecture
+            now = time.time()
+            return AnalysisResult(
+                success=False, file_hash=file_hash, start_time=start_time, end_time=now,
+                duration=now - start_time, exit_code=None, stdout="", stderr="",
+                error=f"Emulator not available: {emulator}"
+            )
         
         # Initialize monitors
-        file_monitor = FileMonitor()
-        network_monitor = NetworkMonitor()
-        syscall_tracer = SyscallTracer()
+        sink = EventSink(emit)
+        monitors = open_monitors(sink, watch_paths, capture_ports, pcap_path)
+        syscall_tracer = SyscallTracer(sink, syscalls)
         
         # Determine how to execute
-        if 'python' in file_type or file_path.endswith('.py'):
+        if emulator_path:
+            cmd = [emulator_path, file_path]
+        elif 'python' in file_type or file_path.endswith('.py'):
             cmd = ['python3', file_path]
-        elif 'node' in file_type or file_path.endswith('.js'):
+        elif 'node' in file_type or 'javascript' in file_type or file_path.endswith('.js'):
             cmd = ['node', file_path]
         elif 'shell' in file_type or file_path.endswith('.sh'):
             cmd = ['/bin/bash', file_path]
@@ -418,10 +1419,13 @@ class SandboxAgent:
             cmd = [file_path]
         
         logger.info(f"Executing: {' '.join(cmd)}")
+        cmd = syscall_tracer.wrap(cmd)
         
         # Start monitors
-        file_monitor.start()
-        network_monitor.start()
+        sink.start()
+        for monitor in monitors:
+            monitor.start()
+        started = time.time()
         
         stdout = ""
         stderr = ""
@@ -436,10 +1440,16 @@ class SandboxAgent:
                 stderr=subprocess.PIPE,
                 stdin=subprocess.DEVNULL,
                 cwd=os.path.dirname(file_path) or '/tmp',
-                env={**os.environ, 'HOME': '/tmp', 'TERM': 'xterm'}
+                env={**os.environ, 'HOME': '/tmp', 'TERM': 'xterm'},
+                # Own process group, so children holding the pipes die with it
+                start_new_session=True,
+                pass_fds=syscall_tracer.pass_fds
             )
             
-            # Start syscall tracing
+            if control:
+                control.attach(process)
+            
+            # Start syscall tracing (native tracer already runs the sample)
             syscall_tracer.start(process.pid)
             
             # Wait for completion or timeout
@@ -449,7 +1459,7 @@ class SandboxAgent:
                 stderr = stderr.decode('utf-8', errors='ignore')
                 exit_code = process.returncode
             except subprocess.TimeoutExpired:
-                process.kill()
+                kill_process_tree(process)
                 stdout, stderr = process.communicate()
                 stdout = stdout.decode('utf-8', errors='ignore')
                 stderr = stderr.decode('utf-8', errors='ignore')
@@ -461,12 +1471,14 @@ class SandboxAgent:
             logger.error(f"Execution error: {e}")
         
         # Stop monitors
-        file_monitor.stop()
-        network_monitor.stop()
+        executed = time.time()
+        for monitor in monitors:
+            monitor.stop()
         syscall_tracer.stop()
         
         # Wait a bit for events to be collected
         time.sleep(0.5)
+        sink.stop()
         
         end_time = time.time()
         
@@ -479,19 +1491,32 @@ class SandboxAgent:
             exit_code=exit_code,
             stdout=stdout[:10000],  # Limit size
             stderr=stderr[:10000],
-            syscalls=syscall_tracer.get_events(),
-            files=file_monitor.get_events(),
-            network=network_monitor.get_events(),
+            syscalls=sink.get_events('syscalls'),
+            files=sink.get_events('files'),
+            network=sink.get_events('network'),
             processes=[],
             events=[],
-            error=error
+            error=error,
+            event_counts=dict(sink.counts),
+            dropped_events=dict(sink.dropped),
+            cancelled=control.reason if control else None,
+            pcap=pcap_path if pcap_path and os.path.exists(pcap_path) else None,
+            timings={'setup': round(started - start_time, 4), 'execute': round(executed - started, 4),
+                     'collect': round(end_time - executed, 4)}
         )
         
         logger.info(f"Analysis complete: {result.duration:.2f}s, exit={exit_code}")
         return result
     
-    def handle_command(self, command: Dict[str, Any]) -> Dict[str, Any]:
-        """Handle a command from the host"""
+    def handle_command(self, command: Dict[str, Any],
+                       emit: Optional[Callable[[Dict[str, Any]], None]] = None) -> Dict[str, Any]:
+        """
+        Handle a command from the host.
+        
+        Args:
+            command: JSON command
+            emit: Send an intermediate EVENT message for this request
+        """
         cmd = command.get('command', '')
         
         if cmd == 'ping':
@@ -504,9 +1529,41 @@ class SandboxAgent:
             if not file_path or not os.path.exists(file_path):
                 return {'success': False, 'error': 'File not found'}
             
-            result = self.analyze(file_path, timeout)
+            stream = emit if command.get('stream_events') else None
+            analysis_id = command.get('analysis_id')
+            control = RunControl()
+            pcap_path = None
+            if command.get('pcap'):
+                pcap_path = f"/tmp/capture_{analysis_id or int(time.time())}.pcap"
+            if analysis_id:
+                with self._runs_lock:
+                    self._runs[analysis_id] = control
+            try:
+                result = self.analyze(file_path, timeout, emit=stream, control=control,
+                                      syscalls=command.get('trace_syscalls'),
+                                      file_hash=command.get('file_hash'),
+                                      file_type=command.get('file_type'),
+                                      emulator=command.get('emulator'),
+                                      watch_paths=command.get('watch_paths'),
+                                      capture_ports=command.get('capture_ports'),
+                                      pcap_path=pcap_path)
+            finally:
+                if analysis_id:
+                    with self._runs_lock:
+                        self._runs.pop(analysis_id, None)
             return asdict(result)
         
+        elif cmd == 'cancel':
+            # Stop a running analysis; its analyze request still returns the result
+            with self._runs_lock:
+                control = self._runs.get(command.get('analysis_id'))
+            if not control:
+                return {'success': False, 'error': 'No such analysis'}
+            reason = command.get('reason', 'Cancelled by host')
+            logger.info(f"Cancelling analysis: {reason}")
+            control.cancel(reason)
+            return {'success': True}
+        
         elif cmd == 'execute':
             cmd_line = command.get('cmd')
             timeout = command.get('timeout', 30)
@@ -530,6 +1587,7 @@ class SandboxAgent:
             except Exception as e:
                 return {'success': False, 'error': str(e)}
         
+        # Legacy hex-in-JSON transfer, superseded by put_file/get_file
         elif cmd == 'write_file':
             path = command.get('path')
             data = command.get('data', '')
@@ -565,6 +1623,170 @@ class SandboxAgent:
         else:
             return {'success': False, 'error': f'Unknown command: {cmd}'}
     
+    def handle_stream_command(self, command: Dict[str, Any], conn: AgentConnection,
+                              request_id: int, inbox: queue.Queue):
+        """Handle commands that exchange DATA frames with the host"""
+        cmd = command.get('command', '')
+        
+        try:
+            if cmd == 'put_file':
+                self._put_file(command, conn, request_id, inbox)
+            elif cmd == 'get_file':
+                self._get_file(command, conn, request_id)
+        finally:
+            conn.close_inbox(request_id)
+    
+    def _put_file(self, command: Dict[str, Any], conn: AgentConnection,
+                  request_id: int, inbox: queue.Queue):
+        """
+        Receive a file from the host.
+        
+        Protocol: host sends {command, path, size, sha256, mode}; agent replies
+        with an EVENT {offset} holding the resume offset of an existing
+        partial upload; host streams the rest as DATA frames ending with an
+        empty one; agent verifies the checksum and sends the RESPONSE.
+        """
+        path = command.get('path')
+        size = int(command.get('size', 0))
+        expected = command.get('sha256', '')
+        part_path = path + '.part'
+        
+        offset = 0
+        if command.get('resume', True) and os.path.exists(part_path):
+            offset = os.path.getsize(part_path)
+            if offset > size:
+                os.unlink(part_path)
+                offset = 0
+        
+        conn.send_json(FRAME_EVENT, request_id, {'offset': offset})
+        
+        h = hashlib.sha256()
+        error = None
+        try:
+            with open(part_path, 'ab' if offset else 'wb') as f:
+                if offset:
+                    with open(part_path, 'rb') as existing:
+                        for chunk in iter(lambda: existing.read(CHUNK_SIZE), b''):
+                            h.update(chunk)
+                for chunk in conn.read_data(inbox):
+                    if error is None:
+                        try:
+                            f.write(chunk)
+                            h.update(chunk)
+                        except OSError as e:
+                            # Keep draining so the stream stays in sync
+                            error = str(e)
+        except ConnectionError:
+            # Keep the partial file so the host can resume
+            return
+        except Exception as e:
+            error = str(e)
+        
+        if error:
+            conn.send_json(FRAME_RESPONSE, request_id, {'success': False, 'error': error})
+            return
+        
+        if expected and h.hexdigest() != expected:
+            os.unlink(part_path)
+            conn.send_json(FRAME_RESPONSE, request_id, {'success': False, 'error': 'Checksum mismatch'})
+            return
+        
+        os.replace(part_path, path)
+        os.chmod(path, command.get('mode', 0o644))
+        conn.send_json(FRAME_RESPONSE, request_id, {'success': True, 'sha256': h.hexdigest()})
+    
+    def _get_file(self, command: Dict[str, Any], conn: AgentConnection, request_id: int):
+        """
+        Send a file to the host.
+        
+        Protocol: host sends {command, path, offset}; agent replies with an
+        EVENT {size, sha256, offset}, streams the rest of the file as DATA
+        frames ending with an empty one and then sends the RESPONSE.
+        """
+        path = command.get('path')
+        offset = int(command.get('offset', 0))
+        
+        try:
+            size = os.path.getsize(path)
+            sha256 = self._get_file_hash(path)
+            if offset > size:
+                offset = 0
+        except Exception as e:
+            conn.send_json(FRAME_RESPONSE, request_id, {'success': False, 'error': str(e)})
+            return
+        
+        conn.send_json(FRAME_EVENT, request_id, {'size': size, 'sha256': sha256, 'offset': offset})
+        
+        with open(path, 'rb') as f:
+            f.seek(offset)
+            for chunk in iter(lambda: f.read(CHUNK_SIZE), b''):
+                conn.send_frame(FRAME_DATA, request_id, chunk)
+        conn.send_frame(FRAME_DATA, request_id)
+        conn.send_json(FRAME_RESPONSE, request_id, {'success': True})
+    
+    def _dispatch(self, command: Dict[str, Any], conn: AgentConnection, request_id: int):
+        """Run one request and send its response"""
+        try:
+            response = self.handle_command(
+                command, emit=lambda msg: conn.send_event(request_id, msg))
+        except Exception as e:
+            logger.error(f"Command error: {e}")
+            response = {'success': False, 'error': str(e)}
+        finally:
+            conn.close_events(request_id)
+        try:
+            conn.send_json(FRAME_RESPONSE, request_id, response)
+        except OSError as e:
+            logger.warning(f"Failed to send response {request_id}: {e}")
+    
+    def _serve(self, conn: AgentConnection):
+        """
+        Process frames from a connection until it closes.
+        
+        Each request runs on its own thread, so a ping or a file transfer
+        is answered while an analysis is still running.
+        """
+        conn.send_json(FRAME_HELLO, 0, {'pid': os.getpid(), 'hostname': socket.gethostname()})
+        try:
+            while self._running:
+                frame_type, request_id, payload = conn.read_frame()
+                
+                if frame_type == FRAME_DATA:
+                    conn.deliver(request_id, payload)
+                    continue
+                if frame_type == FRAME_CREDIT:
+                    try:
+                        conn.grant(request_id, int(json.loads(payload).get('events', 0)))
+                    except (ValueError, TypeError, AttributeError):
+                        pass
+                    continue
+                if frame_type != FRAME_REQUEST:
+                    continue
+                
+                try:
+                    command = json.loads(payload.decode())
+                except (json.JSONDecodeError, UnicodeDecodeError):
+                    conn.send_json(FRAME_RESPONSE, request_id, {'success': False, 'error': 'Bad request'})
+                    continue
+                
+                if command.get('command') in STREAM_COMMANDS:
+                    # Inbox must exist before the host starts sending DATA
+                    inbox = conn.open_inbox(request_id)
+                    target, args = self._stream_worker, (command, conn, request_id, inbox)
+                else:
+                    conn.open_events(request_id, command.get('event_credit'))
+                    target, args = self._dispatch, (command, conn, request_id)
+                threading.Thread(target=target, args=args, daemon=True).start()
+        finally:
+            conn.fail_inboxes()
+    
+    def _stream_worker(self, command: Dict[str, Any], conn: AgentConnection,
+                       request_id: int, inbox: queue.Queue):
+        try:
+            self.handle_stream_command(command, conn, request_id, inbox)
+        except Exception as e:
+            logger.error(f"Transfer error: {e}")
+    
     def _get_uptime(self) -> float:
         """Get system uptime"""
         try:
@@ -574,7 +1796,13 @@ class SandboxAgent:
             return 0
     
     def run_virtio(self):
-        """Run agent listening on virtio-serial port"""
+        """
+        Run agent listening on virtio-serial port.
+        
+        Reads block in the kernel while the host is connected; while it is
+        not, reads return 0 and writes block, so after a host disconnect the
+        HELLO of the next session simply waits until the host reconnects.
+        """
         logger.info(f"Starting agent on virtio port: {self.virtio_path}")
         
         while not os.path.exists(self.virtio_path):
@@ -587,24 +1815,22 @@ class SandboxAgent:
             try:
                 with open(self.virtio_path, 'r+b', buffering=0) as port:
                     logger.info("Connected to virtio port")
-                    buffer = b''
+                    
+                    def send(data: bytes):
+                        view = memoryview(data)
+                        while view:
+                            view = view[port.write(view):]
                     
                     while self._running:
-                        data = port.read(4096)
-                        if data:
-                            buffer += data
-                            
-                            while b'\n' in buffer:
-                                line, buffer = buffer.split(b'\n', 1)
-                                try:
-                                    command = json.loads(line.decode())
-                                    response = self.handle_command(command)
-                                    port.write((json.dumps(response) + '\n').encode())
-                                except json.JSONDecodeError:
-                                    pass
-                        else:
-                            time.sleep(0.1)
-                            
+                        started = time.time()
+                        try:
+                            self._serve(AgentConnection(port.readinto, send))
+                        except ConnectionError:
+                            logger.info("Host disconnected")
+                        # Guard against a port that never blocks
+                        if time.time() - started < 0.1:
+                            time.sleep(0.5)
+                    
             except Exception as e:
                 logger.error(f"Virtio error: {e}")
                 time.sleep(1)
@@ -633,22 +1859,10 @@ class SandboxAgent:
     
     def _handle_client(self, client: socket.socket):
         """Handle a client connection"""
-        buffer = b''
         try:
-            while self._running:
-                data = client.recv(4096)
-                if not data:
-                    break
-                buffer += data
-                
-                while b'\n' in buffer:
-                    line, buffer = buffer.split(b'\n', 1)
-                    try:
-                        command = json.loads(line.decode())
-                        response = self.handle_command(command)
-                        client.send((json.dumps(response) + '\n').encode())
-                    except json.JSONDecodeError:
-                        pass
+            self._serve(AgentConnection(client.recv_into, client.sendall))
+        except ConnectionError:
+            pass
         except Exception as e:
             logger.error(f"Client error: {e}")
         finally:
@@ -45,7 +45,8 @@ install_packages() {
         net-tools \
         curl wget \
         jq \
-        acl
+        acl \
+        qemu-user  # x86 ELFs in the ARM64 VM (tiering in vm_config.yaml)
     
     # Python packages for agent
     pip3 install --user psutil watchdog pyinotify
@@ -351,7 +352,7 @@ main() {
     
     log_info "Guest setup complete!"
     log_info "Next steps:"
-    log_info "  1. Copy agent.py to /opt/sandbox/"
+    log_info "  1. Copy agent.py to /opt/sandbox/ and install tracer_lib (make install)"
     log_info "  2. Run /opt/sandbox/prepare_snapshot.sh"
     log_info "  3. Create a 'clean' snapshot from host"
 }
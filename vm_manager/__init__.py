@@ -8,6 +8,8 @@ with support for fast snapshots and anti-VM detection evasion.
 from .vm_config import VMConfig, VMArchitecture
 from .qemu_launcher import QEMULauncher
 from .snapshot import SnapshotManager
+from .vm_pool import VMPool
+from .agent_channel import AgentChannel
 from .vm_manager import VMManager
 
 __all__ = [
@@ -15,6 +17,8 @@ __all__ = [
     'VMArchitecture', 
     'QEMULauncher',
     'SnapshotManager',
+    'VMPool',
+    'AgentChannel',
     'VMManager'
 ]
 
@@ -0,0 +1,323 @@
+"""
+Agent Channel - Persistent, multiplexed connection to the guest agent
+
+One long-lived connection per VM carries length-prefixed frames tagged
+with a request ID, so ping/status/analyze calls and file transfers can
+overlap on the same virtio-serial port. A reader thread routes incoming
+frames to the waiting request; nothing polls.
+
+The reader never blocks on a consumer. EVENT frames are credit based:
+every request grants the agent PENDING_FRAMES events, and the host hands
+credit back as the consumer takes them. When scoring falls behind, only
+that request's event stream pauses in the guest (its EventSink fills up
+and drops), while responses and DATA frames of other requests keep
+flowing and host memory stays bounded.
+
+Frame layout (big-endian):
+    u32 payload length | u32 request id | u8 frame type | payload
+"""
+
+import json
+import queue
+import socket
+import struct
+import logging
+import threading
+from typing import Optional, Dict, List, Any, Callable, Tuple
+
+logger = logging.getLogger(__name__)
+
+FRAME_HEADER = struct.Struct('>IIB')
+MAX_FRAME_SIZE = 16 * 1024 * 1024
+
+# EVENT frames a request may have in flight (credit window)
+PENDING_FRAMES = 64
+# Consumed events returned to the agent in one CREDIT frame
+CREDIT_BATCH = PENDING_FRAMES // 2
+
+FRAME_REQUEST = 1    # host -> guest, JSON command
+FRAME_RESPONSE = 2   # guest -> host, JSON final response
+FRAME_DATA = 3       # either way, raw bytes; empty payload ends the stream
+FRAME_EVENT = 4      # guest -> host, JSON intermediate message
+FRAME_HELLO = 5      # guest -> host, agent is listening (request id 0)
+FRAME_CREDIT = 6     # host -> guest, JSON {'events': n} more EVENT frames allowed
+
+
+def decode_event_batch(batch: Dict[str, Any]) -> Dict[str, List[Dict[str, Any]]]:
+    """
+    Expand a streamed event batch into event dicts per kind.
+    
+    The agent sends rows as lists with the field names once per batch
+    ({'fields': {'syscalls': [...]}, 'syscalls': [[...], ...]}).
+    """
+    return {
+        kind: [dict(zip(names, row)) for row in batch.get(kind, [])]
+        for kind, names in batch.get('fields', {}).items()
+    }
+
+
+class ChannelClosed(Exception):
+    """Connection to the agent was lost"""
+
+
+class PendingRequest:
+    """In-flight request; receives frames routed by the reader thread"""
+
+    def __init__(self, channel: 'AgentChannel', request_id: int):
+        self.channel = channel
+        self.request_id = request_id
+        # Unbounded: EVENT frames are limited by credit, the rest are few or consumed at once
+        self.frames: "queue.Queue[Optional[Tuple[int, bytes]]]" = queue.Queue()
+        # Set once nobody reads the frames any more (closed or connection lost)
+        self.done = threading.Event()
+        self.dropped_events = 0
+        self._queued_events = 0
+        self._consumed_events = 0
+        self._lock = threading.Lock()
+
+    def next_frame(self, timeout: Optional[float] = None) -> Tuple[int, bytes]:
+        """
+        Wait for the next frame of this request.
+
+        Raises:
+            socket.timeout: No frame within timeout
+            ChannelClosed: Connection lost
+        """
+        try:
+            frame = self.frames.get(timeout=timeout)
+        except queue.Empty:
+            raise socket.timeout(f"No reply to request {self.request_id}")
+        if frame is None:
+            raise ChannelClosed("Agent connection closed")
+        if frame[0] == FRAME_EVENT:
+            self._event_consumed()
+        return frame
+
+    def _event_consumed(self):
+        """Return credit to the agent once CREDIT_BATCH events were taken"""
+        with self._lock:
+            self._queued_events -= 1
+            self._consumed_events += 1
+            if self._consumed_events < CREDIT_BATCH:
+                return
+            credit, self._consumed_events = self._consumed_events, 0
+        try:
+            self.channel.send_frame(FRAME_CREDIT, self.request_id,
+                                    json.dumps({'events': credit}).encode())
+        except ChannelClosed:
+            pass
+
+    def send_data(self, data: bytes):
+        """Send a DATA frame for this request"""
+        self.channel.send_frame(FRAME_DATA, self.request_id, data)
+
+    def deliver(self, frame: Tuple[int, bytes]):
+        """
+        Queue a frame without blocking the reader.
+
+        Frames are dropped once the request is done, and EVENT frames
+        beyond the credit window (an agent ignoring CREDIT) are dropped too.
+        """
+        if self.done.is_set():
+            return
+        if frame[0] == FRAME_EVENT:
+            with self._lock:
+                if self._queued_events >= PENDING_FRAMES:
+                    self.dropped_events += 1
+                    return
+                self._queued_events += 1
+        self.frames.put(frame)
+
+    def fail(self):
+        """Wake up the consumer with ChannelClosed"""
+        self.done.set()
+        self.frames.put(None)
+
+    def close(self):
+        self.done.set()
+        self.channel._forget(self.request_id)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.close()
+
+
+class AgentChannel:
+    """
+    Persistent connection to one guest agent.
+
+    Connects lazily and reconnects after a failure. Thread-safe: any
+    number of requests may be in flight at once.
+    """
+
+    def __init__(self, socket_path: str, connect_timeout: float = 5):
+        self.socket_path = socket_path
+        self.connect_timeout = connect_timeout
+        self._sock: Optional[socket.socket] = None
+        self._reader: Optional[threading.Thread] = None
+        self._lock = threading.Lock()
+        self._send_lock = threading.Lock()
+        self._pending: Dict[int, PendingRequest] = {}
+        self._next_id = 1
+        self._hello = threading.Event()
+        self.hello_info: Dict[str, Any] = {}
+
+    @property
+    def connected(self) -> bool:
+        return self._sock is not None
+
+    def connect(self):
+        """Connect if not connected"""
+        with self._lock:
+            if self._sock is not None:
+                return
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.settimeout(self.connect_timeout)
+            try:
+                sock.connect(self.socket_path)
+            except Exception:
+                sock.close()
+                raise
+            # Reader blocks indefinitely; request timeouts are per request
+            sock.settimeout(None)
+            self._sock = sock
+            self._hello.clear()
+            self._reader = threading.Thread(target=self._read_loop, args=(sock,),
+                                            name=f"agent-reader-{self.socket_path}", daemon=True)
+            self._reader.start()
+
+    def close(self):
+        """Close connection; in-flight requests fail with ChannelClosed"""
+        with self._lock:
+            sock, self._sock = self._sock, None
+        if sock:
+            try:
+                sock.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+            sock.close()
+        self._fail_pending()
+
+    def reset(self):
+        """Drop the connection (e.g. after a snapshot revert); next call reconnects"""
+        self.close()
+
+    def wait_hello(self, timeout: float) -> bool:
+        """Wait for the agent's HELLO frame on the current connection"""
+        return self._hello.wait(timeout)
+
+    def send_frame(self, frame_type: int, request_id: int, payload: bytes = b''):
+        """Send one frame"""
+        sock = self._sock
+        if sock is None:
+            raise ChannelClosed("Not connected")
+        header = FRAME_HEADER.pack(len(payload), request_id, frame_type)
+        try:
+            with self._send_lock:
+                sock.sendall(header)
+                if payload:
+                    sock.sendall(payload)
+        except OSError as e:
+            self.close()
+            raise ChannelClosed(str(e))
+
+    def open_request(self, command: Dict[str, Any]) -> PendingRequest:
+        """Send a command and return the pending request to read frames from"""
+        command = dict(command, event_credit=PENDING_FRAMES)
+        self.connect()
+        with self._lock:
+            request_id = self._next_id
+            self._next_id = self._next_id % 0xFFFFFFFF + 1
+            pending = PendingRequest(self, request_id)
+            self._pending[request_id] = pending
+        try:
+            self.send_frame(FRAME_REQUEST, request_id, json.dumps(command).encode())
+        except Exception:
+            self._forget(request_id)
+            raise
+        return pending
+
+    def request(self, command: Dict[str, Any], timeout: float = 30,
+                on_event: Optional[Callable[[Dict[str, Any]], None]] = None) -> Dict[str, Any]:
+        """
+        Send a command and wait for its response.
+
+        Args:
+            command: JSON command
+            timeout: Max seconds between frames of this request
+            on_event: Called with each intermediate EVENT message
+
+        Returns:
+            Response dict
+        """
+        with self.open_request(command) as pending:
+            while True:
+                frame_type, payload = pending.next_frame(timeout)
+                if frame_type == FRAME_RESPONSE:
+                    if pending.dropped_events:
+                        logger.warning(f"Dropped {pending.dropped_events} events of request "
+                                       f"{pending.request_id} beyond the credit window")
+                    return json.loads(payload)
+                if frame_type == FRAME_EVENT and on_event:
+                    on_event(json.loads(payload))
+
+    def _forget(self, request_id: int):
+        with self._lock:
+            self._pending.pop(request_id, None)
+
+    def _fail_pending(self):
+        with self._lock:
+            pending, self._pending = self._pending, {}
+        for p in pending.values():
+            p.fail()
+
+    def _recv_exact(self, sock: socket.socket, size: int) -> bytearray:
+        buf = bytearray(size)
+        view = memoryview(buf)
+        while view:
+            n = sock.recv_into(view)
+            if not n:
+                raise ChannelClosed("Agent connection closed")
+            view = view[n:]
+        return buf
+
+    def _read_loop(self, sock: socket.socket):
+        """Route incoming frames to pending requests"""
+        try:
+            while True:
+                length, request_id, frame_type = FRAME_HEADER.unpack(
+                    self._recv_exact(sock, FRAME_HEADER.size))
+                if length > MAX_FRAME_SIZE:
+                    raise ChannelClosed(f"Frame too large: {length}")
+                payload = bytes(self._recv_exact(sock, length)) if length else b''
+
+                if frame_type == FRAME_HELLO:
+                    try:
+                        self.hello_info = json.loads(payload) if payload else {}
+                    except ValueError:
+                        self.hello_info = {}
+                    self._hello.set()
+                    continue
+
+                with self._lock:
+                    pending = self._pending.get(request_id)
+                if pending:
+                    pending.deliver((frame_type, payload))
+                    if frame_type == FRAME_RESPONSE:
+                        self._forget(request_id)
+        except (ChannelClosed, OSError, struct.error) as e:
+            logger.debug(f"Agent channel {self.socket_path} closed: {e}")
+        finally:
+            with self._lock:
+                owned = self._sock is sock
+                if owned:
+                    self._sock = None
+            try:
+                sock.close()
+            except OSError:
+                pass
+            # After close()/reconnect the pending requests belong to the new connection
+            if owned:
+                self._fail_pending()
@@ -0,0 +1,147 @@
+"""
+File Transfer - Streaming binary file copy over the guest agent channel
+
+Replaces the hex-in-JSON write_file/read_file commands. A transfer is a
+put_file/get_file request on the AgentChannel followed by raw DATA frames
+in fixed-size chunks (an empty DATA frame ends the stream), so neither
+side holds the whole file in memory. Transfers are verified with SHA-256
+and resume from the partial file left by an interrupted attempt.
+"""
+
+import os
+import json
+import hashlib
+import logging
+from typing import Optional, Dict, Any
+
+from .agent_channel import (AgentChannel, PendingRequest, FRAME_RESPONSE,
+                            FRAME_DATA, FRAME_EVENT)
+
+logger = logging.getLogger(__name__)
+
+CHUNK_SIZE = 64 * 1024
+
+
+class TransferError(Exception):
+    """File transfer failed"""
+
+
+def file_sha256(path: str) -> str:
+    """Calculate SHA-256 of a file in chunks"""
+    h = hashlib.sha256()
+    with open(path, 'rb') as f:
+        for chunk in iter(lambda: f.read(CHUNK_SIZE), b''):
+            h.update(chunk)
+    return h.hexdigest()
+
+
+def _expect(pending: PendingRequest, frame_type: int, timeout: float) -> bytes:
+    """Read next frame of a transfer, failing on an early error response"""
+    got_type, payload = pending.next_frame(timeout)
+    if got_type == FRAME_RESPONSE and frame_type != FRAME_RESPONSE:
+        raise TransferError(json.loads(payload).get('error', 'Transfer rejected'))
+    if got_type != frame_type:
+        raise TransferError(f"Unexpected frame type {got_type}")
+    return payload
+
+
+def put_file(channel: AgentChannel, local_path: str, guest_path: str,
+             mode: int = 0o644, sha256: Optional[str] = None,
+             timeout: float = 60) -> Dict[str, Any]:
+    """
+    Upload a file to the guest.
+
+    Args:
+        channel: Agent channel
+        local_path: Local file
+        guest_path: Destination path in guest
+        mode: File mode in guest
+        sha256: Precomputed checksum (computed if not given)
+        timeout: Max seconds to wait for each agent reply
+
+    Returns:
+        Final agent response
+
+    Raises:
+        TransferError: Rejected transfer or checksum mismatch
+        ChannelClosed: Connection lost (retry resumes)
+    """
+    size = os.path.getsize(local_path)
+    command = {
+        'command': 'put_file',
+        'path': guest_path,
+        'size': size,
+        'sha256': sha256 or file_sha256(local_path),
+        'mode': mode,
+        'resume': True,
+    }
+
+    with channel.open_request(command) as pending:
+        ready = json.loads(_expect(pending, FRAME_EVENT, timeout))
+        offset = int(ready.get('offset', 0))
+        if offset:
+            logger.info(f"Resuming upload of {guest_path} at {offset}/{size}")
+
+        with open(local_path, 'rb') as f:
+            f.seek(offset)
+            for chunk in iter(lambda: f.read(CHUNK_SIZE), b''):
+                pending.send_data(chunk)
+        pending.send_data(b'')
+
+        response = json.loads(_expect(pending, FRAME_RESPONSE, timeout))
+
+    if not response.get('success'):
+        raise TransferError(response.get('error', 'put_file failed'))
+    return response
+
+
+def get_file(channel: AgentChannel, guest_path: str, local_path: str,
+             timeout: float = 60) -> Dict[str, Any]:
+    """
+    Download a file from the guest into local_path.
+
+    Resumes from local_path + '.part' if a previous attempt was interrupted.
+
+    Raises:
+        TransferError: Rejected transfer or checksum mismatch
+        ChannelClosed: Connection lost (retry resumes)
+    """
+    part_path = local_path + '.part'
+    offset = os.path.getsize(part_path) if os.path.exists(part_path) else 0
+
+    with channel.open_request({'command': 'get_file', 'path': guest_path,
+                               'offset': offset}) as pending:
+        header = json.loads(_expect(pending, FRAME_EVENT, timeout))
+        size = int(header['size'])
+        offset = int(header.get('offset', 0))
+        if offset:
+            logger.info(f"Resuming download of {guest_path} at {offset}/{size}")
+
+        h = hashlib.sha256()
+        with open(part_path, 'r+b' if offset else 'wb') as f:
+            remaining = offset
+            while remaining > 0:
+                chunk = f.read(min(CHUNK_SIZE, remaining))
+                h.update(chunk)
+                remaining -= len(chunk)
+            f.seek(offset)
+            f.truncate()
+
+            while True:
+                chunk = _expect(pending, FRAME_DATA, timeout)
+                if not chunk:
+                    break
+                f.write(chunk)
+                h.update(chunk)
+
+        response = json.loads(_expect(pending, FRAME_RESPONSE, timeout))
+
+    if not response.get('success'):
+        raise TransferError(response.get('error', 'get_file failed'))
+
+    if h.hexdigest() != header.get('sha256'):
+        os.unlink(part_path)
+        raise TransferError("Checksum mismatch")
+
+    os.replace(part_path, local_path)
+    return header
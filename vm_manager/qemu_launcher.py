@@ -3,18 +3,142 @@ QEMU Launcher - Handles QEMU process management and command generation
 """
 
 import os
+import json
+import shutil
+import hashlib
 import subprocess
 import time
 import signal
 import socket
 import logging
-from typing import Optional, List, Dict, Any
-from dataclasses import dataclass
+import threading
+from collections import deque
+from typing import Optional, List, Dict, Any, Callable, Set
+from dataclasses import dataclass, asdict
 
 from .vm_config import VMConfig, VMArchitecture, AntiVMConfig
 
 logger = logging.getLogger(__name__)
 
+# Recent QMP events kept per process
+QMP_EVENT_BACKLOG = 256
+
+# Root bus slot of the balloon: well above the auto-assigned slots and free
+# on both q35 and virt (q35 keeps 0x1f for the LPC bridge)
+BALLOON_PCI_ADDR = '0x10'
+
+
+class QMPEvents:
+    """
+    Event stream of a QEMU process on a private QMP monitor.
+    
+    The launcher hands one end of a socketpair to QEMU as an extra
+    control monitor, so nothing has to be polled: the greeting arrives
+    once QEMU has created its chardevs (the monitor and agent sockets
+    exist), asynchronous events (RESUME, STOP, SHUTDOWN, MIGRATION, ...)
+    are delivered as they happen, and EOF means the process is gone.
+    """
+    
+    def __init__(self, sock: socket.socket,
+                 on_close: Optional[Callable[[Optional[Dict[str, Any]]], None]] = None):
+        """
+        Args:
+            sock: Connected end of the monitor socketpair
+            on_close: Called with the last SHUTDOWN event (or None) at EOF
+        """
+        self._sock = sock
+        self._on_close = on_close
+        self._cond = threading.Condition()
+        self._events: deque = deque(maxlen=QMP_EVENT_BACKLOG)
+        self._count = 0
+        self._shutdown: Optional[Dict[str, Any]] = None
+        self.greeting: Optional[Dict[str, Any]] = None
+        self.closed = False
+        self._thread = threading.Thread(target=self._read, name="qmp-events", daemon=True)
+        self._thread.start()
+    
+    def _read(self):
+        try:
+            for line in self._sock.makefile('rb'):
+                try:
+                    msg = json.loads(line)
+                except ValueError:
+                    continue
+                with self._cond:
+                    if 'QMP' in msg:
+                        self.greeting = msg
+                        # Leave negotiation mode so events are sent
+                        self._sock.sendall(b'{"execute": "qmp_capabilities"}\n')
+                    elif 'event' in msg:
+                        if msg['event'] == 'SHUTDOWN':
+                            self._shutdown = msg
+                        self._events.append(msg)
+                        self._count += 1
+                    self._cond.notify_all()
+        except (OSError, ValueError):
+            pass
+        finally:
+            with self._cond:
+                self.closed = True
+                self._cond.notify_all()
+            self._sock.close()
+            if self._on_close:
+                try:
+                    self._on_close(self._shutdown)
+                except Exception as e:
+                    logger.error(f"QMP close handler failed: {e}")
+    
+    def wait_ready(self, timeout: float) -> bool:
+        """Wait for the QMP greeting (False on timeout or if QEMU exited)"""
+        deadline = time.time() + timeout
+        with self._cond:
+            while self.greeting is None and not self.closed:
+                remaining = deadline - time.time()
+                if remaining <= 0:
+                    break
+                self._cond.wait(remaining)
+            return self.greeting is not None and not self.closed
+    
+    def mark(self) -> int:
+        """Position in the stream; pass to wait_for() to skip earlier events"""
+        with self._cond:
+            return self._count
+    
+    def wait_for(self, names: Set[str], timeout: float, after: int = 0,
+                 match: Optional[Callable[[Dict[str, Any]], bool]] = None) -> Optional[Dict[str, Any]]:
+        """
+        Wait for an event.
+        
+        Args:
+            names: Event names to wait for
+            timeout: Max seconds to wait
+            after: Only consider events after this mark()
+            match: Optional extra condition on the event
+            
+        Returns:
+            The event, or None on timeout or when QEMU exited
+        """
+        deadline = time.time() + timeout
+        with self._cond:
+            while True:
+                first = self._count - len(self._events)
+                for i in range(max(after, first), self._count):
+                    msg = self._events[i - first]
+                    if msg['event'] in names and (match is None or match(msg)):
+                        return msg
+                after = self._count
+                remaining = deadline - time.time()
+                if self.closed or remaining <= 0:
+                    return None
+                self._cond.wait(remaining)
+    
+    def close(self):
+        try:
+            self._sock.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+        self._sock.close()
+
 
 @dataclass
 class QEMUProcess:
@@ -24,6 +148,9 @@ class QEMUProcess:
     monitor_socket: str
     serial_socket: str
     pid: int
+    events: Optional[QMPEvents] = None
+    # Set by stop(), so the exit is not reported as a crash
+    stopping: bool = False
     
     def is_running(self) -> bool:
         return self.process.poll() is None
@@ -47,6 +174,8 @@ class QEMULauncher:
     def __init__(self, sockets_dir: str = "/tmp/vm_sandbox"):
         self.sockets_dir = sockets_dir
         self._processes: Dict[str, QEMUProcess] = {}
+        # Called with (vm_name, SHUTDOWN event or None) when a VM exits unasked
+        self.on_exit: Optional[Callable[[str, Optional[Dict[str, Any]]], None]] = None
         os.makedirs(sockets_dir, exist_ok=True)
     
     def _check_qemu_available(self, binary: str) -> bool:
@@ -85,6 +214,53 @@ class QEMULauncher:
         
         return args
     
+    def fingerprint(self, config: VMConfig, anti_vm: AntiVMConfig) -> str:
+        """
+        Identify what a saved VM state depends on: the VM and anti-VM
+        configuration, the disk image and the QEMU binary.
+        
+        Per-launch values (random serial and MAC, socket paths) are left
+        out; the restored guest keeps the ones it booted with.
+        """
+        def stat(path: Optional[str]):
+            try:
+                st = os.stat(path)
+                return [os.path.realpath(path), st.st_size, st.st_mtime_ns]
+            except (OSError, TypeError):
+                return None
+        
+        vm = {k: v for k, v in asdict(config).items()
+              if k not in ('name', 'clone_index', 'pool_size', 'monitor_socket', 'serial_socket',
+                           'agent_socket', 'memory_file', 'memory_shared', 'incoming', 'loadvm',
+                           'start_mode')}
+        data = {
+            'vm': vm, 'anti_vm': asdict(anti_vm), 'image': stat(config.image_path),
+            'kernel': stat(config.kernel), 'initrd': stat(config.initrd),
+            'qemu': stat(shutil.which(config.qemu_binary) if config.qemu_binary else None),
+        }
+        return hashlib.sha1(json.dumps(data, sort_keys=True, default=str).encode()).hexdigest()
+    
+    def _generate_memory_args(self, config: VMConfig) -> List[str]:
+        """File-backed guest RAM and saved-state starts (memory templates, resume)"""
+        args = []
+        
+        if config.memory_file:
+            share = 'on' if config.memory_shared else 'off'
+            args.extend([
+                '-object', f'memory-backend-file,id=ram0,size={config.ram_mb}M,'
+                           f'mem-path={config.memory_file},share={share}',
+                '-machine', 'memory-backend=ram0',
+            ])
+        
+        if config.incoming:
+            args.extend(['-incoming', config.incoming])
+        
+        # Start from an internal snapshot instead of booting
+        if config.loadvm:
+            args.extend(['-loadvm', config.loadvm])
+        
+        return args
+    
     def _generate_storage_args(self, config: VMConfig, anti_vm: AntiVMConfig) -> List[str]:
         """Generate storage-related arguments"""
         args = []
@@ -223,7 +399,23 @@ class QEMULauncher:
         
         return args
     
-    def _generate_communication_args(self, config: VMConfig) -> List[str]:
+    def _generate_balloon_args(self, config: VMConfig) -> List[str]:
+        """
+        Generate the balloon device arguments.
+        
+        Added after every other device and on a fixed PCI slot, so the
+        other devices keep the addresses they have without it. The device
+        set still differs, so internal snapshots taken without the balloon
+        cannot be loaded with it (and the other way round).
+        """
+        if not config.balloon:
+            return []
+        # Free page reporting hands pages the guest frees back to the host;
+        # the balloon itself shrinks idle clones (deflated again on guest OOM)
+        return ['-device', f'virtio-balloon-pci,id=balloon0,addr={BALLOON_PCI_ADDR},'
+                           'deflate-on-oom=on,free-page-reporting=on']
+    
+    def _generate_communication_args(self, config: VMConfig, event_fd: Optional[int] = None) -> List[str]:
         """Generate QMP monitor and serial communication arguments"""
         args = []
         
@@ -234,6 +426,13 @@ class QEMULauncher:
             '-qmp', f"unix:{sockets['monitor']},server,nowait"
         ])
         
+        # Second QMP monitor on an inherited socket, read by QMPEvents
+        if event_fd is not None:
+            args.extend([
+                '-chardev', f'socket,id=qmpev,fd={event_fd}',
+                '-mon', 'chardev=qmpev,mode=control'
+            ])
+        
         # Serial port for communication with guest agent
         args.extend([
             '-chardev', f"socket,id=serial0,path={sockets['serial']},server=on,wait=off",
@@ -250,9 +449,17 @@ class QEMULauncher:
         return args
     
     def _generate_firmware_args(self, config: VMConfig) -> List[str]:
-        """Generate firmware arguments (UEFI for ARM64)"""
+        """Generate firmware arguments (UEFI for ARM64, or a direct kernel boot)"""
         args = []
         
+        # Fast-boot profile: no UEFI and no bootloader
+        if config.kernel:
+            args.extend(['-kernel', config.kernel])
+            if config.initrd:
+                args.extend(['-initrd', config.initrd])
+            args.extend(['-append', config.get_kernel_append()])
+            return args
+        
         if config.architecture == VMArchitecture.ARM64:
             # UEFI firmware paths (common locations)
             uefi_paths = [
@@ -268,11 +475,13 @@ class QEMULauncher:
         
         return args
     
-    def build_command(self, config: VMConfig, anti_vm: AntiVMConfig) -> List[str]:
+    def build_command(self, config: VMConfig, anti_vm: AntiVMConfig,
+                      event_fd: Optional[int] = None) -> List[str]:
         """Build complete QEMU command with all arguments"""
         args = []
         
         args.extend(self._generate_base_args(config))
+        args.extend(self._generate_memory_args(config))
         args.extend(self._generate_firmware_args(config))
         args.extend(self._generate_cpu_args(config, anti_vm))
         args.extend(self._generate_smbios_args(anti_vm))
@@ -280,7 +489,8 @@ class QEMULauncher:
         args.extend(self._generate_network_args(config, anti_vm))
         args.extend(self._generate_display_args(config))
         args.extend(self._generate_device_args(config))
-        args.extend(self._generate_communication_args(config))
+        args.extend(self._generate_communication_args(config, event_fd))
+        args.extend(self._generate_balloon_args(config))
         
         # Daemon mode
         args.append('-daemonize')
@@ -296,8 +506,11 @@ class QEMULauncher:
         if not os.path.exists(config.image_path):
             raise FileNotFoundError(f"VM image not found: {config.image_path}")
         
+        # QEMU's end of the event monitor is inherited by the child
+        ours, theirs = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+        
         # Build command
-        cmd = self.build_command(config, anti_vm)
+        cmd = self.build_command(config, anti_vm, event_fd=theirs.fileno())
         
         logger.info(f"Launching VM: {config.name}")
         logger.debug(f"QEMU command: {' '.join(cmd)}")
@@ -315,25 +528,16 @@ class QEMULauncher:
             # Remove -daemonize for subprocess management
             cmd_no_daemon = [arg for arg in cmd if arg != '-daemonize']
             
-            process = subprocess.Popen(
-                cmd_no_daemon,
-                stdout=subprocess.PIPE,
-                stderr=subprocess.PIPE,
-                stdin=subprocess.DEVNULL,
-            )
-            
-            # Wait for monitor socket to be created
-            start_time = time.time()
-            while time.time() - start_time < config.boot_timeout:
-                if os.path.exists(sockets['monitor']):
-                    break
-                if process.poll() is not None:
-                    stdout, stderr = process.communicate()
-                    raise RuntimeError(f"QEMU exited: {stderr.decode()}")
-                time.sleep(0.1)
-            else:
-                process.kill()
-                raise TimeoutError("QEMU monitor socket not created")
+            try:
+                process = subprocess.Popen(
+                    cmd_no_daemon,
+                    stdout=subprocess.PIPE,
+                    stderr=subprocess.PIPE,
+                    stdin=subprocess.DEVNULL,
+                    pass_fds=(theirs.fileno(),),
+                )
+            finally:
+                theirs.close()
             
             qemu_proc = QEMUProcess(
                 process=process,
@@ -342,6 +546,18 @@ class QEMULauncher:
                 serial_socket=sockets['serial'],
                 pid=process.pid,
             )
+            qemu_proc.events = QMPEvents(ours, on_close=lambda event: self._exited(qemu_proc, event))
+            
+            # The greeting comes once chardevs (and their sockets) exist
+            if not qemu_proc.events.wait_ready(config.boot_timeout):
+                if process.poll() is not None or qemu_proc.events.closed:
+                    qemu_proc.stopping = True
+                    process.kill()
+                    stdout, stderr = process.communicate()
+                    raise RuntimeError(f"QEMU exited: {stderr.decode()}")
+                qemu_proc.stopping = True
+                process.kill()
+                raise TimeoutError("QEMU monitor not ready")
             
             self._processes[config.name] = qemu_proc
             logger.info(f"VM {config.name} started with PID {process.pid}")
@@ -349,15 +565,26 @@ class QEMULauncher:
             return qemu_proc
             
         except Exception as e:
+            ours.close()
             logger.error(f"Failed to launch VM: {e}")
             raise
     
+    def _exited(self, proc: QEMUProcess, event: Optional[Dict[str, Any]]):
+        """Event monitor hit EOF: report VMs that were not stopped by us"""
+        if proc.stopping or self._processes.get(proc.config.name) is not proc:
+            return
+        reason = (event or {}).get('data', {}).get('reason', 'process exited')
+        logger.warning(f"VM {proc.config.name} exited unexpectedly: {reason}")
+        if self.on_exit:
+            self.on_exit(proc.config.name, event)
+    
     def stop(self, vm_name: str, force: bool = False):
         """Stop a running VM"""
         if vm_name not in self._processes:
             return
         
         proc = self._processes[vm_name]
+        proc.stopping = True
         
         if force:
             proc.process.kill()
@@ -371,6 +598,8 @@ class QEMULauncher:
         
         proc.process.wait()
         del self._processes[vm_name]
+        if proc.events:
+            proc.events.close()
         
         # Clean up sockets
         sockets = proc.config.get_socket_paths(self.sockets_dir)
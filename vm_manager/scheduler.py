@@ -0,0 +1,209 @@
+"""
+Resource Scheduler - Admit VM clones by host headroom
+
+A guest's RAM is only touched as it runs, so MemAvailable alone would
+admit a second 4 GB clone on an 8 GB host and the first one would later
+push the host into swap. Admission instead charges every running clone
+for the RAM it may still grow into (configured size minus current RSS of
+its QEMU) and boots another clone only if that still leaves
+mem_reserve_mb free. Jobs also wait while the load average or the SoC
+temperature is above its limit.
+
+vCPU threads are pinned to cores outside the host's share, native ARM64
+(KVM) clones first, so emulated x64 vCPUs land on whatever is left.
+"""
+
+import os
+import glob
+import logging
+import threading
+from dataclasses import dataclass, asdict
+from typing import Optional, Dict, List, Any, Iterable, Tuple
+
+from .vm_config import SchedulerConfig
+
+logger = logging.getLogger(__name__)
+
+# (configured RAM in MB, QEMU pid or None while it is being launched)
+Commitment = Tuple[int, Optional[int]]
+
+
+@dataclass
+class HostStats:
+    """Snapshot of host resources"""
+    mem_total_mb: int
+    mem_available_mb: int
+    load_per_cpu: float
+    cpus: int
+    temp_c: Optional[float] = None
+
+
+def read_host_stats(proc_root: str = "/proc", sys_root: str = "/sys") -> HostStats:
+    """Read memory, load and the hottest thermal zone"""
+    meminfo = {}
+    with open(os.path.join(proc_root, 'meminfo')) as f:
+        for line in f:
+            key, _, value = line.partition(':')
+            meminfo[key] = int(value.split()[0])
+    
+    with open(os.path.join(proc_root, 'loadavg')) as f:
+        load = float(f.read().split()[0])
+    cpus = os.cpu_count() or 1
+    
+    temps = []
+    for path in glob.glob(os.path.join(sys_root, 'class/thermal/thermal_zone*/temp')):
+        try:
+            with open(path) as f:
+                temps.append(int(f.read()) / 1000)
+        except (OSError, ValueError):
+            continue
+    
+    return HostStats(
+        mem_total_mb=meminfo.get('MemTotal', 0) // 1024,
+        # Kernels before 3.14 have no MemAvailable
+        mem_available_mb=meminfo.get('MemAvailable', meminfo.get('MemFree', 0)) // 1024,
+        load_per_cpu=load / cpus,
+        cpus=cpus,
+        temp_c=max(temps) if temps else None,
+    )
+
+
+def process_rss_mb(pid: int, proc_root: str = "/proc") -> int:
+    """Resident memory of a process (0 once it has exited)"""
+    try:
+        with open(os.path.join(proc_root, str(pid), 'status')) as f:
+            for line in f:
+                if line.startswith('VmRSS:'):
+                    return int(line.split()[1]) // 1024
+    except (OSError, ValueError):
+        pass
+    return 0
+
+
+class ResourceScheduler:
+    """
+    Admission control and vCPU placement for VM clones.
+    
+    Callers hold `lock` across admit_boot() and marking the clone as
+    starting, so clones admitted together are charged for each other.
+    """
+    
+    def __init__(self, config: SchedulerConfig, cores: Optional[List[int]] = None,
+                 proc_root: str = "/proc", sys_root: str = "/sys"):
+        """
+        Initialize scheduler.
+        
+        Args:
+            config: Scheduler settings
+            cores: Cores vCPUs may use (default: this process's affinity)
+            proc_root: procfs mount (tests)
+            sys_root: sysfs mount (tests)
+        """
+        self.config = config
+        self.proc_root = proc_root
+        self.sys_root = sys_root
+        self.lock = threading.RLock()
+        if cores is None:
+            cores = sorted(os.sched_getaffinity(0))
+        # The host's share is the lowest cores; keep at least one for vCPUs
+        self.cores = cores[config.host_cores:] or cores
+        # vm_name -> pinned cores, and whether the clone runs natively
+        self._pinned: Dict[str, Tuple[List[int], bool]] = {}
+    
+    def stats(self) -> HostStats:
+        return read_host_stats(self.proc_root, self.sys_root)
+    
+    def busy_reason(self, stats: Optional[HostStats] = None) -> Optional[str]:
+        """Why no job may start now, or None"""
+        stats = stats or self.stats()
+        if stats.temp_c is not None and stats.temp_c >= self.config.max_temp_c:
+            return f"temperature {stats.temp_c:.0f}C"
+        if stats.load_per_cpu >= self.config.max_load:
+            return f"load {stats.load_per_cpu:.2f}/core"
+        return None
+    
+    def headroom_mb(self, commitments: Iterable[Commitment], stats: Optional[HostStats] = None) -> int:
+        """
+        Memory left once every running guest has touched all of its RAM.
+        
+        Args:
+            commitments: Clones that are running or being launched
+            stats: Host stats (read when not given)
+        """
+        stats = stats or self.stats()
+        growth = 0
+        for ram_mb, pid in commitments:
+            rss = process_rss_mb(pid, self.proc_root) if pid else 0
+            growth += max(0, ram_mb - rss)
+        return stats.mem_available_mb - self.config.mem_reserve_mb - growth
+    
+    def admit_job(self) -> bool:
+        """Whether a job may start on an already running clone"""
+        reason = self.busy_reason()
+        if reason:
+            logger.debug(f"Job deferred: {reason}")
+        return reason is None
+    
+    def admit_boot(self, ram_mb: int, commitments: Iterable[Commitment]) -> bool:
+        """Whether one more clone of ram_mb fits next to the running ones"""
+        stats = self.stats()
+        reason = self.busy_reason(stats)
+        if reason is None:
+            headroom = self.headroom_mb(commitments, stats)
+            if headroom >= ram_mb:
+                return True
+            reason = f"{headroom} MB headroom for {ram_mb} MB guest"
+        logger.debug(f"Clone boot deferred: {reason}")
+        return False
+    
+    def shortfall_mb(self, commitments: Iterable[Commitment]) -> int:
+        """MB of guest RAM to stop so that the reserve holds (0 if it does)"""
+        return max(0, -self.headroom_mb(commitments))
+    
+    def assign_cores(self, vm_name: str, count: int, native: bool) -> List[int]:
+        """
+        Pick cores for a clone's vCPU threads.
+        
+        Native clones take the cores with the fewest pinned threads;
+        for emulated ones native vCPUs count double, so they go to
+        cores the native tier leaves free first.
+        
+        Args:
+            vm_name: Clone name (replaces an earlier assignment)
+            count: Number of vCPU threads
+            native: KVM clone (ARM64 tier)
+        """
+        with self.lock:
+            self._pinned.pop(vm_name, None)
+            load = {c: 0 for c in self.cores}
+            native_load = dict(load)
+            for cores, is_native in self._pinned.values():
+                for c in cores:
+                    if c in load:
+                        load[c] += 1
+                        native_load[c] += is_native
+            
+            weight = load if native else {c: load[c] + native_load[c] for c in self.cores}
+            chosen = []
+            for _ in range(count):
+                core = min(self.cores, key=lambda c: (weight[c], c))
+                chosen.append(core)
+                weight[core] += 1
+            self._pinned[vm_name] = (chosen, native)
+            return chosen
+    
+    def release_cores(self, vm_name: str):
+        with self.lock:
+            self._pinned.pop(vm_name, None)
+    
+    def get_status(self, commitments: Iterable[Commitment]) -> Dict[str, Any]:
+        """Host stats, headroom and vCPU placement"""
+        stats = self.stats()
+        with self.lock:
+            pinned = {name: cores for name, (cores, _) in self._pinned.items()}
+        return {
+            'host': asdict(stats),
+            'headroom_mb': self.headroom_mb(commitments, stats),
+            'busy': self.busy_reason(stats),
+            'pinned': pinned,
+        }
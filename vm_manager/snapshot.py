@@ -4,9 +4,11 @@ Snapshot Manager - Fast VM state save/restore for sandbox analysis
 
 import os
 import json
+import shlex
 import socket
 import time
 import logging
+import threading
 import subprocess
 from typing import Optional, Dict, List, Any
 from dataclasses import dataclass
@@ -32,17 +34,21 @@ class SnapshotManager:
     
     Uses QEMU's internal snapshots (savevm/loadvm) for speed,
     as they are stored within the qcow2 image and can be restored
-    in 1-3 seconds without full VM restart.
+    in 1-3 seconds without full VM restart. save_device_state() and
+    load_device_state() implement the faster MemoryTemplate revert.
     """
     
-    def __init__(self, socket_path: str):
+    def __init__(self, socket_path: str, events=None):
         """
         Initialize snapshot manager.
         
         Args:
             socket_path: Path to QEMU QMP monitor socket
+            events: QMPEvents of the process; migrations then wait for
+                    events instead of polling their status
         """
         self.socket_path = socket_path
+        self.events = events
         self._sock: Optional[socket.socket] = None
     
     def _connect(self):
@@ -192,6 +198,104 @@ class SnapshotManager:
             logger.error(f"Failed to delete snapshot: {e}")
             raise
     
+    def _set_ignore_shared(self):
+        capabilities = [{'capability': 'x-ignore-shared', 'state': True}]
+        if self.events:
+            capabilities.append({'capability': 'events', 'state': True})
+        self._execute('migrate-set-capabilities', {'capabilities': capabilities})
+    
+    def save_device_state(self, path: str, timeout: float = 60) -> float:
+        """
+        Pause the VM and write its CPU and device state to a file.
+        
+        The VM must run on a shared file-backed memory backend: with
+        x-ignore-shared its RAM is left out of the stream, so only a few
+        MB are written and the backing file itself becomes the RAM image.
+        The VM stays paused afterwards.
+        
+        Args:
+            path: Output file for the device state
+            timeout: Seconds to wait for the migration to finish
+            
+        Returns:
+            Time taken in seconds
+        """
+        start_time = time.time()
+        self._execute('stop')
+        self._set_ignore_shared()
+        mark = self.events.mark() if self.events else 0
+        self._execute('migrate', {'uri': f'exec:cat > {shlex.quote(path)}'})
+        
+        deadline = start_time + timeout
+        if self.events:
+            done = self.events.wait_for(
+                {'MIGRATION'}, timeout, after=mark,
+                match=lambda e: e.get('data', {}).get('status') in ('completed', 'failed', 'cancelled'))
+            if done is None:
+                raise TimeoutError("Saving device state timed out")
+            if done['data']['status'] != 'completed':
+                info = self._execute('query-migrate')
+                raise RuntimeError(f"Saving device state {done['data']['status']}: "
+                                   f"{info.get('error-desc', '')}")
+        else:
+            while True:
+                info = self._execute('query-migrate')
+                status = info.get('status')
+                if status == 'completed':
+                    break
+                if status in ('failed', 'cancelled'):
+                    raise RuntimeError(f"Saving device state {status}: {info.get('error-desc', '')}")
+                if time.time() > deadline:
+                    raise TimeoutError("Saving device state timed out")
+                time.sleep(0.02)
+        
+        duration = time.time() - start_time
+        logger.info(f"Device state saved to {path} in {duration:.2f}s")
+        return duration
+    
+    def load_device_state(self, path: str, timeout: float = 30) -> float:
+        """
+        Load a save_device_state() file and resume the VM.
+        
+        The VM must have been started with -incoming defer on the RAM
+        image of the saved VM (mapped private, so the image stays clean).
+        
+        Args:
+            path: Device state file
+            timeout: Seconds to wait for the VM to resume
+            
+        Returns:
+            Time taken in seconds
+        """
+        start_time = time.time()
+        self._set_ignore_shared()
+        mark = self.events.mark() if self.events else 0
+        self._execute('migrate-incoming', {'uri': f'exec:cat {shlex.quote(path)}'})
+        
+        # QEMU exits if loading fails, which surfaces as ConnectionError
+        deadline = start_time + timeout
+        if self.events:
+            # Without -S the VM resumes as soon as the state is loaded
+            if self.events.wait_for({'RESUME'}, timeout, after=mark) is None:
+                if self.events.closed:
+                    raise ConnectionError("QEMU exited while loading device state")
+                raise TimeoutError("Loading device state timed out")
+        else:
+            while True:
+                status = self._execute('query-status').get('status')
+                if status == 'running':
+                    break
+                if status != 'inmigrate':
+                    self._execute('cont')
+                    break
+                if time.time() > deadline:
+                    raise TimeoutError("Loading device state timed out")
+                time.sleep(0.01)
+        
+        duration = time.time() - start_time
+        logger.info(f"Device state loaded from {path} in {duration:.2f}s")
+        return duration
+    
     def list_snapshots(self) -> List[SnapshotInfo]:
         """List all snapshots for the VM"""
         try:
@@ -223,6 +327,15 @@ class SnapshotManager:
         snapshots = self.list_snapshots()
         return any(s.name == name for s in snapshots)
     
+    def vcpu_threads(self) -> List[int]:
+        """Host thread ids of the vCPUs, in vCPU order"""
+        cpus = self._execute('query-cpus-fast')
+        return [cpu['thread-id'] for cpu in sorted(cpus, key=lambda c: c['cpu-index'])]
+    
+    def set_balloon(self, target_mb: int):
+        """Set the guest RAM the balloon driver should leave the guest"""
+        self._execute('balloon', {'value': target_mb * 1024 * 1024})
+    
     def close(self):
         """Close the snapshot manager"""
         self._disconnect()
@@ -234,43 +347,91 @@ class SnapshotManager:
         self.close()
 
 
+def mem_available_mb() -> int:
+    """MemAvailable from /proc/meminfo (0 if unknown)"""
+    try:
+        with open('/proc/meminfo') as f:
+            for line in f:
+                if line.startswith('MemAvailable:'):
+                    return int(line.split()[1]) // 1024
+    except (OSError, ValueError, IndexError):
+        pass
+    return 0
+
+
 class ExternalSnapshotManager:
     """
     Alternative snapshot manager using external qcow2 snapshots.
     
     This approach creates a new overlay file for each analysis,
     which can be faster for some use cases but uses more disk space.
+    The base image is only ever opened read-only (as backing file), so
+    any number of VMs can run on overlays of one base. With ram_dir
+    (a tmpfs such as /dev/shm) overlays are created in RAM while enough
+    memory is available, otherwise in snapshots_dir.
     """
     
-    def __init__(self, base_image: str, snapshots_dir: str):
+    def __init__(self, base_image: str, snapshots_dir: str, ram_dir: Optional[str] = None,
+                 ram_reserve_mb: int = 1024):
         """
         Initialize external snapshot manager.
         
         Args:
             base_image: Path to base qcow2 image
             snapshots_dir: Directory for overlay files
+            ram_dir: Optional tmpfs directory preferred for overlays
+            ram_reserve_mb: Memory to leave free when placing an overlay in ram_dir
         """
         self.base_image = base_image
         self.snapshots_dir = snapshots_dir
+        self.ram_dir = ram_dir
+        self.ram_reserve_mb = ram_reserve_mb
         os.makedirs(snapshots_dir, exist_ok=True)
+        if ram_dir:
+            try:
+                os.makedirs(ram_dir, exist_ok=True)
+            except OSError as e:
+                logger.warning(f"Overlay RAM directory unavailable ({ram_dir}): {e}")
+                self.ram_dir = None
     
-    def create_overlay(self, name: str) -> str:
+    def _dirs(self) -> List[str]:
+        return [d for d in (self.ram_dir, self.snapshots_dir) if d]
+    
+    def overlay_path(self, name: str) -> Optional[str]:
+        """Path of an existing overlay"""
+        for d in self._dirs():
+            path = os.path.join(d, f"{name}.qcow2")
+            if os.path.exists(path):
+                return path
+        return None
+    
+    def create_overlay(self, name: str, ram_needed_mb: int = 0,
+                       backing: Optional[str] = None) -> str:
         """
         Create a new overlay image based on the base image.
         
         Args:
             name: Overlay name
+            ram_needed_mb: Memory the VM using the overlay will take (the
+                           overlay goes to ram_dir only if this plus the
+                           reserve is still available)
+            backing: Image to use instead of the base image (e.g. the
+                     frozen disk of a MemoryTemplate)
             
         Returns:
             Path to overlay image
         """
-        overlay_path = os.path.join(self.snapshots_dir, f"{name}.qcow2")
+        self.delete_overlay(name)
+        directory = self.snapshots_dir
+        if self.ram_dir and mem_available_mb() >= ram_needed_mb + self.ram_reserve_mb:
+            directory = self.ram_dir
+        overlay_path = os.path.join(directory, f"{name}.qcow2")
         
         cmd = [
             'qemu-img', 'create',
             '-f', 'qcow2',
             '-F', 'qcow2',
-            '-b', os.path.abspath(self.base_image),
+            '-b', os.path.abspath(backing or self.base_image),
             overlay_path
         ]
         
@@ -281,8 +442,8 @@ class ExternalSnapshotManager:
     
     def delete_overlay(self, name: str):
         """Delete an overlay image"""
-        overlay_path = os.path.join(self.snapshots_dir, f"{name}.qcow2")
-        if os.path.exists(overlay_path):
+        overlay_path = self.overlay_path(name)
+        if overlay_path:
             os.unlink(overlay_path)
             logger.info(f"Deleted overlay: {overlay_path}")
     
@@ -291,7 +452,7 @@ class ExternalSnapshotManager:
         Commit overlay changes to base image.
         WARNING: This modifies the base image!
         """
-        overlay_path = os.path.join(self.snapshots_dir, f"{name}.qcow2")
+        overlay_path = self.overlay_path(name) or os.path.join(self.snapshots_dir, f"{name}.qcow2")
         
         cmd = ['qemu-img', 'commit', overlay_path]
         subprocess.run(cmd, check=True, capture_output=True)
@@ -300,7 +461,7 @@ class ExternalSnapshotManager:
     
     def rebase_overlay(self, name: str, new_base: str):
         """Rebase overlay to a new base image"""
-        overlay_path = os.path.join(self.snapshots_dir, f"{name}.qcow2")
+        overlay_path = self.overlay_path(name) or os.path.join(self.snapshots_dir, f"{name}.qcow2")
         
         cmd = [
             'qemu-img', 'rebase',
@@ -314,7 +475,7 @@ class ExternalSnapshotManager:
     
     def get_overlay_info(self, name: str) -> Dict[str, Any]:
         """Get information about an overlay image"""
-        overlay_path = os.path.join(self.snapshots_dir, f"{name}.qcow2")
+        overlay_path = self.overlay_path(name) or os.path.join(self.snapshots_dir, f"{name}.qcow2")
         
         cmd = ['qemu-img', 'info', '--output=json', overlay_path]
         result = subprocess.run(cmd, check=True, capture_output=True)
@@ -324,9 +485,10 @@ class ExternalSnapshotManager:
     def list_overlays(self) -> List[str]:
         """List all overlay images"""
         overlays = []
-        for f in os.listdir(self.snapshots_dir):
-            if f.endswith('.qcow2'):
-                overlays.append(f[:-6])  # Remove .qcow2 extension
+        for d in self._dirs():
+            for f in os.listdir(d):
+                if f.endswith('.qcow2'):
+                    overlays.append(f[:-6])  # Remove .qcow2 extension
         return overlays
     
     def cleanup_old_overlays(self, max_age_hours: int = 24):
@@ -334,8 +496,81 @@ class ExternalSnapshotManager:
         import time
         cutoff = time.time() - (max_age_hours * 3600)
         
-        for f in os.listdir(self.snapshots_dir):
-            path = os.path.join(self.snapshots_dir, f)
-            if os.path.getmtime(path) < cutoff:
+        for d in self._dirs():
+            for f in os.listdir(d):
+                path = os.path.join(d, f)
+                if os.path.getmtime(path) < cutoff:
+                    os.unlink(path)
+                    logger.info(f"Cleaned up old overlay: {f}")
+
+
+class MemoryTemplate:
+    """
+    Clean state of a booted VM that clones are restored from by remapping.
+    
+    A template VM boots on a shared file-backed memory backend in
+    state_dir (tmpfs, or hugetlbfs for hugepages). Once its agent is
+    ready it is paused and only device state is saved; the RAM file is
+    then the clean memory image and the template's overlay the clean
+    disk. A revert starts QEMU with -incoming defer on a private
+    (copy-on-write) mapping of the RAM file and a fresh overlay backed
+    by the template disk, then loads the small device state file, so no
+    guest RAM is read or copied. All clones of a pool share one template.
+    """
+    
+    def __init__(self, state_dir: str, name: str):
+        """
+        Initialize a memory template.
+        
+        Args:
+            state_dir: Directory for the RAM and device state files
+            name: Template name (the VM config it was taken from)
+        """
+        self.name = name
+        self.ram_path = os.path.join(state_dir, f"{name}.ram")
+        self.state_path = os.path.join(state_dir, f"{name}.state")
+        # What the state was saved from, for reuse after a restart
+        self.meta_path = os.path.join(state_dir, f"{name}.json")
+        # Overlay holding the disk as the template saw it
+        self.disk_name = f"{name}.template"
+        self.disk_path: Optional[str] = None
+        # Held while the template is being captured
+        self.lock = threading.Lock()
+        os.makedirs(state_dir, exist_ok=True)
+    
+    @property
+    def ready(self) -> bool:
+        return (self.disk_path is not None and os.path.exists(self.disk_path)
+                and os.path.exists(self.ram_path) and os.path.exists(self.state_path))
+    
+    def save(self, fingerprint: str):
+        """Record the launch fingerprint and disk of a captured template"""
+        with open(self.meta_path, 'w') as f:
+            json.dump({'fingerprint': fingerprint, 'disk_path': self.disk_path}, f)
+    
+    def load(self, fingerprint: str) -> bool:
+        """
+        Adopt a template saved by an earlier run.
+        
+        Returns:
+            True if one exists and was saved with the same fingerprint
+        """
+        try:
+            with open(self.meta_path) as f:
+                meta = json.load(f)
+        except (OSError, ValueError):
+            return False
+        if meta.get('fingerprint') != fingerprint:
+            return False
+        self.disk_path = meta.get('disk_path')
+        if not self.ready:
+            self.disk_path = None
+            return False
+        return True
+    
+    def delete(self):
+        """Remove the RAM, device state and metadata files"""
+        for path in (self.ram_path, self.state_path, self.meta_path):
+            if os.path.exists(path):
                 os.unlink(path)
-                logger.info(f"Cleaned up old overlay: {f}")
+        self.disk_path = None
@@ -5,7 +5,7 @@ VM Configuration - Data classes for VM configuration
 import os
 import yaml
 from enum import Enum
-from dataclasses import dataclass, field
+from dataclasses import dataclass, field, replace
 from typing import Optional, Dict, List, Any
 
 
@@ -42,6 +42,17 @@ class VMConfig:
     
     # Snapshots
     snapshot_name: str = "clean"
+    # "snapshot": each clone reverts its own image with loadvm;
+    # "overlay": every job boots from a throwaway qcow2 overlay on image_path;
+    # "memory": overlays, restored from a MemoryTemplate instead of booting
+    disk_mode: str = "snapshot"
+    # "boot": cold boot; "resume": start from the saved agent-ready state
+    # (-loadvm of snapshot_name, or a memory template kept across restarts)
+    start_mode: str = "boot"
+    
+    # Pool of pre-booted clones
+    pool_size: int = 1
+    clone_index: int = 0
     
     # QEMU specific
     enable_kvm: bool = True  # Use KVM if available
@@ -50,6 +61,21 @@ class VMConfig:
     # Paths
     qemu_binary: Optional[str] = None
     
+    # Fast-boot profile: boot this kernel directly (no UEFI, no bootloader)
+    kernel: Optional[str] = None
+    initrd: Optional[str] = None
+    kernel_append: Optional[str] = None
+    
+    # Guest RAM in this file instead of anonymous memory (set per launch)
+    memory_file: Optional[str] = None
+    memory_shared: bool = True
+    # Start paused waiting for migrate-incoming ("defer")
+    incoming: Optional[str] = None
+    # Start from this internal snapshot instead of booting
+    loadvm: Optional[str] = None
+    # virtio-balloon with free page reporting (see SchedulerConfig.balloon)
+    balloon: bool = False
+    
     # Communication
     monitor_socket: Optional[str] = None
     serial_socket: Optional[str] = None
@@ -74,6 +100,50 @@ class VMConfig:
             if self.cpus > 2:
                 self.cpus = 2
     
+    def clone(self, index: int) -> 'VMConfig':
+        """
+        Create configuration for pool clone #index.
+        
+        Clone 0 is the VM itself; other clones get their own name (and
+        therefore their own sockets) and a private copy of the disk image,
+        since QEMU cannot run several VMs on one writable qcow2. In overlay
+        mode all clones share image_path as read-only base.
+        """
+        if index == 0:
+            return replace(self, clone_index=0)
+        
+        stem, ext = os.path.splitext(self.image_path)
+        return replace(
+            self,
+            name=f"{self.name}_{index}",
+            image_path=self.image_path if self.uses_overlays else f"{stem}.clone{index}{ext}",
+            clone_index=index,
+        )
+    
+    @property
+    def uses_overlays(self) -> bool:
+        return self.disk_mode in ("overlay", "memory")
+    
+    @property
+    def uses_memory_template(self) -> bool:
+        return self.disk_mode == "memory"
+    
+    @property
+    def resumes(self) -> bool:
+        return self.start_mode == "resume"
+    
+    def get_kernel_append(self) -> str:
+        """Kernel command line of the fast-boot profile"""
+        if self.kernel_append:
+            return self.kernel_append
+        if self.architecture == VMArchitecture.ARM64:
+            return "root=/dev/vda1 ro quiet console=ttyAMA0"
+        return "root=/dev/sda1 ro quiet console=ttyS0"
+    
+    def clones(self) -> List['VMConfig']:
+        """Get configurations for all pool clones"""
+        return [self.clone(i) for i in range(max(1, self.pool_size))]
+    
     def get_socket_paths(self, base_dir: str) -> Dict[str, str]:
         """Generate socket paths for this VM"""
         vm_id = f"{self.name}_{os.getpid()}"
@@ -118,6 +188,30 @@ class AntiVMConfig:
     hide_vm_modules: bool = True
 
 
+@dataclass
+class SchedulerConfig:
+    """Host resource admission for VM clones (vm_manager.scheduler)"""
+    
+    # Off: every clone boots at start_vm and jobs start whenever one is idle
+    enabled: bool = False
+    # MemAvailable kept free after every running guest has grown to its full RAM
+    mem_reserve_mb: int = 1024
+    # No job starts while the 1-minute load average per core is above this
+    max_load: float = 2.0
+    # ... or while the hottest thermal zone is above this (Pi 5 throttles at 85)
+    max_temp_c: float = 80.0
+    # Seconds between admission retries while the host is short
+    poll_interval: float = 2.0
+    # Pin vCPU threads to cores, native ARM64 clones first
+    pin_vcpus: bool = True
+    # Lowest cores left to the host (bot, static triage), never pinned
+    host_cores: int = 1
+    # Guest RAM of idle clones is reclaimed through the balloon. Adds a PCI
+    # device: internal (loadvm) snapshots must be retaken when this changes
+    balloon: bool = False
+    idle_ram_mb: int = 1024
+
+
 @dataclass 
 class VMManagerConfig:
     """Main configuration for VM Manager"""
@@ -126,6 +220,16 @@ class VMManagerConfig:
     images_dir: str = "vm_images"
     sockets_dir: str = "/tmp/vm_sandbox"
     logs_dir: str = "logs/vm"
+    # Overlays (disk_mode: overlay) go to overlay_ram_dir while
+    # MemAvailable covers the guest plus overlay_ram_reserve_mb
+    overlay_dir: str = "vm_images/overlays"
+    overlay_ram_dir: Optional[str] = "/dev/shm/vm_sandbox"
+    overlay_ram_reserve_mb: int = 1024
+    # RAM images and device state of memory templates (disk_mode: memory);
+    # must be tmpfs or hugetlbfs
+    memory_state_dir: str = "/dev/shm/vm_sandbox/state"
+    # Packet captures fetched from the guest, one per analysis
+    pcap_dir: str = "logs/vm/pcap"
     
     # VM configurations
     arm64_config: Optional[VMConfig] = None
@@ -134,9 +238,27 @@ class VMManagerConfig:
     # Anti-VM settings
     anti_vm: AntiVMConfig = field(default_factory=AntiVMConfig)
     
+    # Host resource scheduler
+    scheduler: SchedulerConfig = field(default_factory=SchedulerConfig)
+    
     # Defaults
     default_ram_mb: int = 4096
     default_analysis_timeout: int = 60
+    pool_acquire_timeout: int = 600
+    
+    # Statically linked x86 ELFs up to user_mode_max_mb run under these
+    # user-mode emulators in the ARM64 VM instead of the TCG x64 VM
+    user_mode_emulators: Dict[str, str] = field(default_factory=lambda: {
+        'elf_x64': 'qemu-x86_64',
+        'elf_x86': 'qemu-i386',
+    })
+    user_mode_max_mb: int = 16
+    
+    # Have the guest write a pcap of the sample's traffic (DNS, HTTP and
+    # TLS names are extracted from it on the host)
+    capture_pcap: bool = True
+    # Keep <analysis id>.pcap in pcap_dir after the IOCs were extracted
+    keep_pcap: bool = False
     
     @classmethod
     def from_yaml(cls, path: str) -> 'VMManagerConfig':
@@ -150,6 +272,16 @@ class VMManagerConfig:
         config.images_dir = data.get('paths', {}).get('images_dir', config.images_dir)
         config.sockets_dir = data.get('paths', {}).get('sockets_dir', config.sockets_dir)
         config.logs_dir = data.get('paths', {}).get('logs_dir', config.logs_dir)
+        config.overlay_dir = data.get('paths', {}).get('overlay_dir', config.overlay_dir)
+        config.overlay_ram_dir = data.get('paths', {}).get('overlay_ram_dir', config.overlay_ram_dir)
+        config.overlay_ram_reserve_mb = data.get('paths', {}).get('overlay_ram_reserve_mb',
+                                                                  config.overlay_ram_reserve_mb)
+        config.memory_state_dir = data.get('paths', {}).get('memory_state_dir', config.memory_state_dir)
+        config.pcap_dir = data.get('paths', {}).get('pcap_dir', config.pcap_dir)
+        
+        # Parse scheduler settings
+        config.scheduler = _parse_scheduler(data.get('scheduler') or {})
+        balloon = config.scheduler.enabled and config.scheduler.balloon
         
         # Parse VM configs
         vm_data = data.get('vm', {})
@@ -163,6 +295,11 @@ class VMManagerConfig:
                 ram_mb=_parse_ram(arm_data.get('ram', '4G')),
                 cpus=arm_data.get('cpus', 4),
                 snapshot_name=arm_data.get('snapshot', 'clean'),
+                disk_mode=arm_data.get('disk_mode', 'snapshot'),
+                start_mode=arm_data.get('start_mode', 'boot'),
+                pool_size=arm_data.get('pool_size', 1),
+                balloon=balloon,
+                **_parse_fast_boot(arm_data),
             )
         
         if 'x64' in vm_data:
@@ -174,7 +311,12 @@ class VMManagerConfig:
                 ram_mb=_parse_ram(x64_data.get('ram', '4G')),
                 cpus=x64_data.get('cpus', 2),
                 snapshot_name=x64_data.get('snapshot', 'clean'),
+                disk_mode=x64_data.get('disk_mode', 'snapshot'),
+                start_mode=x64_data.get('start_mode', 'boot'),
+                pool_size=x64_data.get('pool_size', 1),
                 enable_kvm=False,  # TCG emulation on ARM host
+                balloon=balloon,
+                **_parse_fast_boot(x64_data),
             )
         
         # Parse anti-VM config
@@ -191,6 +333,19 @@ class VMManagerConfig:
         # Parse timeouts
         timeouts = data.get('timeouts', {})
         config.default_analysis_timeout = timeouts.get('analysis', 60)
+        config.pool_acquire_timeout = timeouts.get('pool_acquire', config.pool_acquire_timeout)
+        
+        # Parse execution tiering
+        tiering = data.get('tiering', {})
+        if not tiering.get('user_mode', True):
+            config.user_mode_emulators = {}
+        else:
+            config.user_mode_emulators = tiering.get('emulators', config.user_mode_emulators)
+        config.user_mode_max_mb = tiering.get('user_mode_max_mb', config.user_mode_max_mb)
+        
+        # Parse capture settings
+        config.capture_pcap = data.get('capture', {}).get('pcap', config.capture_pcap)
+        config.keep_pcap = data.get('capture', {}).get('keep_pcap', config.keep_pcap)
         
         return config
     
@@ -201,6 +356,11 @@ class VMManagerConfig:
                 'images_dir': self.images_dir,
                 'sockets_dir': self.sockets_dir,
                 'logs_dir': self.logs_dir,
+                'overlay_dir': self.overlay_dir,
+                'overlay_ram_dir': self.overlay_ram_dir,
+                'overlay_ram_reserve_mb': self.overlay_ram_reserve_mb,
+                'memory_state_dir': self.memory_state_dir,
+                'pcap_dir': self.pcap_dir,
             },
             'vm': {},
             'anti_vm': {
@@ -213,6 +373,27 @@ class VMManagerConfig:
             },
             'timeouts': {
                 'analysis': self.default_analysis_timeout,
+                'pool_acquire': self.pool_acquire_timeout,
+            },
+            'tiering': {
+                'user_mode': bool(self.user_mode_emulators),
+                'emulators': self.user_mode_emulators,
+                'user_mode_max_mb': self.user_mode_max_mb,
+            },
+            'capture': {
+                'pcap': self.capture_pcap,
+                'keep_pcap': self.keep_pcap,
+            },
+            'scheduler': {
+                'enabled': self.scheduler.enabled,
+                'mem_reserve_mb': self.scheduler.mem_reserve_mb,
+                'max_load': self.scheduler.max_load,
+                'max_temp_c': self.scheduler.max_temp_c,
+                'poll_interval': self.scheduler.poll_interval,
+                'pin_vcpus': self.scheduler.pin_vcpus,
+                'host_cores': self.scheduler.host_cores,
+                'balloon': self.scheduler.balloon,
+                'idle_ram': f"{self.scheduler.idle_ram_mb}M",
             }
         }
         
@@ -222,7 +403,16 @@ class VMManagerConfig:
                 'ram': f"{self.arm64_config.ram_mb // 1024}G",
                 'cpus': self.arm64_config.cpus,
                 'snapshot': self.arm64_config.snapshot_name,
+                'disk_mode': self.arm64_config.disk_mode,
+                'start_mode': self.arm64_config.start_mode,
+                'pool_size': self.arm64_config.pool_size,
             }
+            if self.arm64_config.kernel:
+                data['vm']['arm64']['fast_boot'] = {
+                    'kernel': self.arm64_config.kernel,
+                    'initrd': self.arm64_config.initrd,
+                    'append': self.arm64_config.kernel_append,
+                }
         
         if self.x64_config:
             data['vm']['x64'] = {
@@ -230,7 +420,16 @@ class VMManagerConfig:
                 'ram': f"{self.x64_config.ram_mb // 1024}G",
                 'cpus': self.x64_config.cpus,
                 'snapshot': self.x64_config.snapshot_name,
+                'disk_mode': self.x64_config.disk_mode,
+                'start_mode': self.x64_config.start_mode,
+                'pool_size': self.x64_config.pool_size,
             }
+            if self.x64_config.kernel:
+                data['vm']['x64']['fast_boot'] = {
+                    'kernel': self.x64_config.kernel,
+                    'initrd': self.x64_config.initrd,
+                    'append': self.x64_config.kernel_append,
+                }
         
         with open(path, 'w') as f:
             yaml.dump(data, f, default_flow_style=False)
@@ -245,3 +444,29 @@ def _parse_ram(value: str) -> int:
         return int(value[:-1])
     else:
         return int(value)
+
+
+def _parse_fast_boot(vm_data: Dict[str, Any]) -> Dict[str, Optional[str]]:
+    """VMConfig kernel fields from a vm section's fast_boot block"""
+    fast_boot = vm_data.get('fast_boot') or {}
+    return {
+        'kernel': fast_boot.get('kernel'),
+        'initrd': fast_boot.get('initrd'),
+        'kernel_append': fast_boot.get('append'),
+    }
+
+
+def _parse_scheduler(data: Dict[str, Any]) -> SchedulerConfig:
+    """SchedulerConfig from the scheduler section"""
+    defaults = SchedulerConfig()
+    return SchedulerConfig(
+        enabled=data.get('enabled', defaults.enabled),
+        mem_reserve_mb=data.get('mem_reserve_mb', defaults.mem_reserve_mb),
+        max_load=data.get('max_load', defaults.max_load),
+        max_temp_c=data.get('max_temp_c', defaults.max_temp_c),
+        poll_interval=data.get('poll_interval', defaults.poll_interval),
+        pin_vcpus=data.get('pin_vcpus', defaults.pin_vcpus),
+        host_cores=data.get('host_cores', defaults.host_cores),
+        balloon=data.get('balloon', defaults.balloon),
+        idle_ram_mb=_parse_ram(str(data.get('idle_ram', f"{defaults.idle_ram_mb}M"))),
+    )
@@ -3,22 +3,39 @@ VM Manager - High-level API for VM-based malware analysis
 """
 
 import os
-import json
 import time
+import uuid
+import shutil
 import socket
 import logging
-import subprocess
 import threading
-from typing import Optional, Dict, List, Any, Callable
-from dataclasses import dataclass, field
+from typing import Optional, Dict, List, Any, Callable, Tuple
+from dataclasses import dataclass, field, replace
 from enum import Enum
 
 from .vm_config import VMConfig, VMArchitecture, AntiVMConfig, VMManagerConfig
 from .qemu_launcher import QEMULauncher, QEMUProcess
-from .snapshot import SnapshotManager
+from .snapshot import SnapshotManager, ExternalSnapshotManager, MemoryTemplate
+from .vm_pool import VMPool, VMSlot
+from .scheduler import ResourceScheduler
+from .agent_channel import AgentChannel, ChannelClosed, decode_event_batch
+from .file_transfer import TransferError, put_file, get_file
+
+import metrics
+from sample import SampleDescriptor, describe, sniff_file
 
 logger = logging.getLogger(__name__)
 
+# Attempts per file transfer; retries resume from the partial file
+TRANSFER_ATTEMPTS = 3
+
+# Agent error when a user-mode emulator is not installed in the guest
+EMULATOR_MISSING = "Emulator not available"
+
+# An idle clone whose QEMU died is restarted at once, unless it already
+# died this many seconds before (crash loop)
+CRASH_RESTART_INTERVAL = 60
+
 
 class VMState(Enum):
     """VM states"""
@@ -46,6 +63,14 @@ class AnalysisResult:
     stdout: str = ""
     stderr: str = ""
     exit_code: Optional[int] = None
+    event_counts: Dict[str, int] = field(default_factory=dict)
+    dropped_events: Dict[str, int] = field(default_factory=dict)
+    # Set when on_event ended the run before the timeout
+    cancelled: Optional[str] = None
+    # User-mode emulator the sample ran under (x86 ELF in the ARM64 VM)
+    emulator: Optional[str] = None
+    # Host copy of the guest's packet capture
+    pcap_path: Optional[str] = None
 
 
 class VMManager:
@@ -57,6 +82,20 @@ class VMManager:
     - File transfer to/from VMs
     - Running analysis with automatic snapshot restore
     - Collecting analysis results
+    
+    Each architecture is backed by a pool of pre-booted clones
+    (vm.<arch>.pool_size in vm_config.yaml). analyze_file() runs on
+    whichever clone is idle, so concurrent callers analyze in parallel.
+    Methods taking `arch` address the first clone unless `vm_name`
+    selects another one.
+    
+    With disk_mode: overlay a clone boots from a fresh qcow2 overlay over
+    the shared read-only base image; resetting it after a job means
+    killing QEMU, unlinking the overlay and booting on a new one instead
+    of a loadvm revert. disk_mode: memory goes further: the first clone
+    to start captures a MemoryTemplate and every (re)start after that
+    restores it (private mapping of the clean RAM file plus its device
+    state) instead of booting the guest.
     """
     
     def __init__(self, config: Optional[VMManagerConfig] = None, config_path: Optional[str] = None):
@@ -79,13 +118,50 @@ class VMManager:
         self._snapshot_managers: Dict[str, SnapshotManager] = {}
         self._processes: Dict[str, QEMUProcess] = {}
         self._states: Dict[str, VMState] = {}
+        self._pools: Dict[VMArchitecture, VMPool] = {}
+        self._reverts: Dict[str, threading.Thread] = {}
+        # Persistent agent connections by socket path
+        self._channels: Dict[str, AgentChannel] = {}
+        # Last unexpected QEMU exit per clone
+        self._crashes: Dict[str, float] = {}
+        self.launcher.on_exit = self._on_vm_exit
+        # Host admission and vCPU placement (scheduler.enabled)
+        self.scheduler = ResourceScheduler(self.config.scheduler) if self.config.scheduler.enabled else None
+        
+        # Overlay managers by architecture (disk_mode: overlay only)
+        self._overlays: Dict[VMArchitecture, ExternalSnapshotManager] = {}
+        # Clean RAM templates by architecture (disk_mode: memory only)
+        self._templates: Dict[VMArchitecture, MemoryTemplate] = {}
+        
+        for arch in VMArchitecture:
+            vm_config = self.get_vm_config(arch)
+            if vm_config:
+                self._pools[arch] = VMPool(vm_config.clones())
+                if vm_config.uses_overlays:
+                    overlays = ExternalSnapshotManager(
+                        vm_config.image_path, self.config.overlay_dir,
+                        ram_dir=self.config.overlay_ram_dir,
+                        ram_reserve_mb=self.config.overlay_ram_reserve_mb)
+                    # Left behind by a previous run
+                    for clone in vm_config.clones():
+                        overlays.delete_overlay(clone.name)
+                    self._overlays[arch] = overlays
+                if vm_config.uses_memory_template:
+                    template = MemoryTemplate(self.config.memory_state_dir, vm_config.name)
+                    # Device state only matches the configuration it was saved from
+                    if vm_config.resumes and template.load(self._template_fingerprint(vm_config)):
+                        logger.info(f"Reusing memory template {template.name}")
+                    else:
+                        template.delete()
+                        overlays.delete_overlay(template.disk_name)
+                    self._templates[arch] = template
         
         # Create directories
         os.makedirs(self.config.images_dir, exist_ok=True)
         os.makedirs(self.config.sockets_dir, exist_ok=True)
         os.makedirs(self.config.logs_dir, exist_ok=True)
         
-        # Communication lock
+        # Guards the process/snapshot manager maps (not held during VM I/O)
         self._lock = threading.Lock()
     
     def get_vm_config(self, arch: VMArchitecture) -> Optional[VMConfig]:
@@ -96,21 +172,145 @@ class VMManager:
             return self.config.x64_config
         return None
     
-    def start_vm(self, arch: VMArchitecture) -> bool:
+    def get_pool(self, arch: VMArchitecture) -> Optional[VMPool]:
+        """Get clone pool for architecture"""
+        return self._pools.get(arch)
+    
+    def _resolve_clone(self, arch: VMArchitecture, vm_name: Optional[str] = None) -> Optional[VMConfig]:
+        """Get config of a pool clone (first clone if vm_name is not given)"""
+        pool = self._pools.get(arch)
+        if not pool:
+            return None
+        if vm_name is None:
+            return pool.slots[0].config
+        slot = pool.get_slot(vm_name)
+        return slot.config if slot else None
+    
+    def start_vm(self, arch: VMArchitecture, vm_name: Optional[str] = None) -> bool:
         """
-        Start a VM for the specified architecture.
+        Start VMs for the specified architecture.
+        
+        Boots every clone of the pool in parallel, or only `vm_name`.
         
         Args:
             arch: VM architecture (ARM64 or X64)
+            vm_name: Optional clone name
             
         Returns:
-            True if VM started successfully
+            True if at least one clone started successfully
         """
-        vm_config = self.get_vm_config(arch)
-        if not vm_config:
+        pool = self._pools.get(arch)
+        if not pool:
             logger.error(f"No configuration for architecture: {arch}")
             return False
         
+        if vm_name is not None:
+            vm_config = self._resolve_clone(arch, vm_name)
+            return self._start_clone(vm_config) if vm_config else False
+        
+        configs = [slot.config for slot in pool.slots]
+        if self.scheduler:
+            configs = self._admit_boots(configs)
+            if not configs:
+                logger.warning(f"Pool {arch.value}: no headroom to boot a clone")
+                return False
+        if len(configs) == 1:
+            return self._start_clone(configs[0])
+        
+        results: Dict[str, bool] = {}
+        threads = [
+            threading.Thread(
+                target=lambda c=c: results.__setitem__(c.name, self._start_clone(c)),
+                daemon=True
+            )
+            for c in configs
+        ]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        
+        started = sum(1 for ok in results.values() if ok)
+        logger.info(f"Pool {arch.value}: {started}/{len(configs)} clones ready")
+        return started > 0
+    
+    def prewarm(self, archs: Optional[List[VMArchitecture]] = None) -> int:
+        """
+        Boot the idle clones that are not running yet, in parallel.
+        
+        Each clone is held in its pool while it boots, so a job arriving
+        meanwhile takes another clone (or waits) instead of starting the
+        same one twice. Clones already busy with a job are left to it.
+        
+        Args:
+            archs: Architectures to warm (all configured pools if None)
+        
+        Returns:
+            Number of clones booted
+        """
+        held: List[Tuple[VMPool, VMSlot]] = []
+        for arch in archs or list(self._pools):
+            pool = self._pools.get(arch)
+            for slot in pool.slots if pool else []:
+                if not self.launcher.is_running(slot.name) and pool.try_acquire(slot):
+                    held.append((pool, slot))
+        configs = [slot.config for _, slot in held]
+        if self.scheduler:
+            configs = self._admit_boots(configs)
+        
+        results: Dict[str, bool] = {}
+        threads = [
+            threading.Thread(
+                target=lambda c=c: results.__setitem__(c.name, self._start_clone(c)),
+                daemon=True
+            )
+            for c in configs
+        ]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        for pool, slot in held:
+            pool.release(slot, job_done=False)
+        
+        started = sum(1 for ok in results.values() if ok)
+        if held:
+            logger.info(f"Pre-warmed {started}/{len(held)} clones")
+        return started
+    
+    def _prepare_clone_image(self, vm_config: VMConfig):
+        """Create private disk image for a clone from the base image"""
+        if vm_config.clone_index == 0 or vm_config.uses_overlays or os.path.exists(vm_config.image_path):
+            return
+        
+        base = self.get_pool_base_image(vm_config)
+        logger.info(f"Creating clone image {vm_config.image_path} from {base}")
+        # Plain copy keeps internal snapshots (savevm) of the base image
+        tmp_path = vm_config.image_path + '.tmp'
+        shutil.copyfile(base, tmp_path)
+        os.replace(tmp_path, vm_config.image_path)
+    
+    def _get_slot(self, vm_name: str) -> Optional[VMSlot]:
+        """Find pool slot of a clone"""
+        for pool in self._pools.values():
+            slot = pool.get_slot(vm_name)
+            if slot:
+                return slot
+        return None
+    
+    def get_pool_base_image(self, vm_config: VMConfig) -> str:
+        """Get image path of the first clone for a clone config"""
+        for pool in self._pools.values():
+            if pool.get_slot(vm_config.name):
+                return pool.slots[0].config.image_path
+        return vm_config.image_path
+    
+    def _template_fingerprint(self, vm_config: VMConfig) -> str:
+        """Launch fingerprint of a pool's memory template (same for every clone)"""
+        return self.launcher.fingerprint(vm_config, self.config.anti_vm)
+    
+    def _start_clone(self, vm_config: VMConfig) -> bool:
+        """Start a single pool clone"""
         vm_name = vm_config.name
         
         with self._lock:
@@ -120,19 +320,66 @@ class VMManager:
                     return True
         
         self._states[vm_name] = VMState.STARTING
+        overlays = self._overlays.get(vm_config.architecture)
+        template = self._templates.get(vm_config.architecture)
         
         try:
-            logger.info(f"Starting VM: {vm_name} ({arch.value})")
+            logger.info(f"Starting VM: {vm_name} ({vm_config.architecture.value})")
+            
+            if template and not template.ready:
+                with template.lock:
+                    if not template.ready:
+                        self._capture_template(vm_config, template)
+            
+            launch_config = vm_config
+            if template:
+                overlay = overlays.create_overlay(vm_name, ram_needed_mb=vm_config.ram_mb,
+                                                  backing=template.disk_path)
+                launch_config = replace(vm_config, image_path=overlay, memory_file=template.ram_path,
+                                        memory_shared=False, incoming='defer')
+            elif overlays:
+                overlay = overlays.create_overlay(vm_name, ram_needed_mb=vm_config.ram_mb)
+                launch_config = replace(vm_config, image_path=overlay)
+            else:
+                self._prepare_clone_image(vm_config)
+                if vm_config.resumes:
+                    launch_config = replace(vm_config, loadvm=vm_config.snapshot_name)
             
-            process = self.launcher.launch(vm_config, self.config.anti_vm)
+            try:
+                process = self.launcher.launch(launch_config, self.config.anti_vm)
+            except RuntimeError as e:
+                if not launch_config.loadvm:
+                    raise
+                # QEMU refuses to start when the image has no such snapshot
+                logger.warning(f"Cannot resume {vm_name} from snapshot {launch_config.loadvm}, booting: {e}")
+                launch_config = replace(launch_config, loadvm=None)
+                process = self.launcher.launch(launch_config, self.config.anti_vm)
             
             with self._lock:
                 self._processes[vm_name] = process
-                self._snapshot_managers[vm_name] = SnapshotManager(process.monitor_socket)
+                self._snapshot_managers[vm_name] = SnapshotManager(process.monitor_socket, process.events)
+            
+            timeout = vm_config.boot_timeout
+            resumed = bool(template or launch_config.loadvm)
+            if template:
+                self._snapshot_managers[vm_name].load_device_state(
+                    template.state_path, timeout=vm_config.snapshot_timeout)
+            if resumed:
+                # The restored agent was talking to the saved VM's socket
+                sockets = vm_config.get_socket_paths(self.config.sockets_dir)
+                self._get_channel(sockets['agent']).reset()
+                timeout = vm_config.snapshot_timeout
             
             # Wait for VM to be ready
-            if self._wait_for_vm_ready(vm_name, vm_config.boot_timeout):
+            if self._wait_for_vm_ready(vm_config, timeout):
                 self._states[vm_name] = VMState.RUNNING
+                if overlays or resumed:
+                    # Booted on an untouched overlay or restored the clean
+                    # snapshot: no revert needed before the first job
+                    slot = self._get_slot(vm_name)
+                    if slot:
+                        slot.clean = True
+                self._place_clone(vm_config)
                 logger.info(f"VM {vm_name} is ready")
                 return True
             else:
@@ -143,27 +390,217 @@ class VMManager:
         except Exception as e:
             logger.error(f"Failed to start VM {vm_name}: {e}")
             self._states[vm_name] = VMState.ERROR
+            if overlays:
+                overlays.delete_overlay(vm_name)
             return False
     
-    def stop_vm(self, arch: VMArchitecture, force: bool = False):
-        """Stop a running VM"""
-        vm_config = self.get_vm_config(arch)
-        if not vm_config:
+    def _commitments(self) -> List[Tuple[int, Optional[int]]]:
+        """(RAM, QEMU pid) of clones that are running or being started"""
+        commitments = []
+        for pool in self._pools.values():
+            for slot in pool.slots:
+                process = self._processes.get(slot.name)
+                if process and process.is_running():
+                    commitments.append((slot.config.ram_mb, process.pid))
+                elif self._states.get(slot.name) == VMState.STARTING:
+                    commitments.append((slot.config.ram_mb, None))
+        return commitments
+    
+    def _boot_need_mb(self, vm_config: VMConfig) -> int:
+        """Headroom an x64 boot needs: its RAM, plus a native clone's while none runs"""
+        need = vm_config.ram_mb
+        arm_pool = self._pools.get(VMArchitecture.ARM64)
+        if vm_config.architecture == VMArchitecture.X64 and arm_pool:
+            committed = {name for name, state in self._states.items() if state == VMState.STARTING}
+            if not any(self.launcher.is_running(s.name) or s.name in committed for s in arm_pool.slots):
+                need += arm_pool.slots[0].config.ram_mb
+        return need
+    
+    def _admit(self, slot: VMSlot) -> bool:
+        """Pool admission: a cool, unloaded host, and room to boot a stopped clone"""
+        with self.scheduler.lock:
+            if self.launcher.is_running(slot.name):
+                return self.scheduler.admit_job()
+            if not self.scheduler.admit_boot(self._boot_need_mb(slot.config), self._commitments()):
+                return False
+            # Charged to later admissions until its QEMU is running
+            self._states[slot.name] = VMState.STARTING
+            return True
+    
+    def _admit_boots(self, configs: List[VMConfig]) -> List[VMConfig]:
+        """Clones of a pool that fit on the host now; the others boot on demand"""
+        admitted = []
+        with self.scheduler.lock:
+            for vm_config in configs:
+                if self.launcher.is_running(vm_config.name):
+                    admitted.append(vm_config)
+                elif self.scheduler.admit_boot(self._boot_need_mb(vm_config), self._commitments()):
+                    self._states[vm_config.name] = VMState.STARTING
+                    admitted.append(vm_config)
+        if len(admitted) < len(configs):
+            logger.info(f"Booting {len(admitted)}/{len(configs)} clones, the rest when headroom allows")
+        return admitted
+    
+    def _place_clone(self, vm_config: VMConfig):
+        """Pin a started clone's vCPU threads and shrink it while idle"""
+        if not self.scheduler:
+            return
+        sm = self._snapshot_managers.get(vm_config.name)
+        if sm and self.scheduler.config.pin_vcpus:
+            try:
+                threads = sm.vcpu_threads()
+                native = vm_config.architecture == VMArchitecture.ARM64 and vm_config.enable_kvm
+                cores = self.scheduler.assign_cores(vm_config.name, len(threads), native)
+                for tid, core in zip(threads, cores):
+                    os.sched_setaffinity(tid, {core})
+                logger.info(f"VM {vm_config.name}: vCPUs pinned to cores {cores}")
+            except Exception as e:
+                logger.warning(f"Cannot pin vCPUs of {vm_config.name}: {e}")
+        self._set_balloon(vm_config, idle=True)
+    
+    def _set_balloon(self, vm_config: VMConfig, idle: bool):
+        """Inflate the balloon of an idle clone, or give a clone its full RAM for a job"""
+        if not self.scheduler or not self.scheduler.config.balloon or not vm_config.balloon:
+            return
+        sm = self._snapshot_managers.get(vm_config.name)
+        if not sm:
             return
+        target = min(self.scheduler.config.idle_ram_mb, vm_config.ram_mb) if idle else vm_config.ram_mb
+        try:
+            sm.set_balloon(target)
+        except Exception as e:
+            logger.warning(f"Balloon of {vm_config.name} not set: {e}")
+    
+    def _trim_pools(self):
+        """Stop idle clones while running guests could outgrow host memory"""
+        if not self.scheduler:
+            return
+        short = self.scheduler.shortfall_mb(self._commitments())
+        # Emulated x64 clones go first; the native tier keeps one clone
+        for arch, keep in ((VMArchitecture.X64, 0), (VMArchitecture.ARM64, 1)):
+            pool = self._pools.get(arch)
+            if not pool:
+                continue
+            running = [s for s in pool.slots if self.launcher.is_running(s.name)]
+            for slot in reversed(running[keep:]):
+                if short <= 0:
+                    return
+                if not pool.try_acquire(slot):
+                    continue
+                try:
+                    logger.info(f"Stopping idle {slot.name}: host memory {short} MB short")
+                    self._stop_clone(slot.config, force=True)
+                finally:
+                    pool.release(slot, job_done=False)
+                short -= slot.config.ram_mb
+    
+    def _capture_template(self, vm_config: VMConfig, template: MemoryTemplate):
+        """Boot a VM on the template's RAM file and save its clean state"""
+        overlays = self._overlays[vm_config.architecture]
+        logger.info(f"Capturing memory template {template.name} on {vm_config.name}")
+        
+        disk = overlays.create_overlay(template.disk_name)
+        launch_config = replace(vm_config, image_path=disk, memory_file=template.ram_path,
+                                memory_shared=True)
+        sockets = vm_config.get_socket_paths(self.config.sockets_dir)
+        try:
+            process = self.launcher.launch(launch_config, self.config.anti_vm)
+            if not self._wait_for_vm_ready(vm_config, vm_config.boot_timeout):
+                raise RuntimeError("template VM failed to become ready")
+            with SnapshotManager(process.monitor_socket, process.events) as sm:
+                sm.save_device_state(template.state_path)
+            template.disk_path = disk
+            template.save(self._template_fingerprint(vm_config))
+        except Exception:
+            template.delete()
+            overlays.delete_overlay(template.disk_name)
+            raise
+        finally:
+            with self._lock:
+                channel = self._channels.pop(sockets['agent'], None)
+            if channel:
+                channel.close()
+            # Paused after the save; the RAM file and disk are all that is kept
+            self.launcher.stop(vm_config.name, force=True)
+    
+    def _on_vm_exit(self, vm_name: str, event: Optional[Dict[str, Any]]):
+        """QEMU of a clone exited without being stopped (crash, guest poweroff)"""
+        slot = self._get_slot(vm_name)
+        if not slot:
+            return
+        self._states[vm_name] = VMState.ERROR
+        slot.clean = False
         
+        now = time.time()
+        last = self._crashes.get(vm_name, 0)
+        self._crashes[vm_name] = now
+        if now - last < CRASH_RESTART_INTERVAL:
+            logger.error(f"VM {vm_name} exited again within {CRASH_RESTART_INTERVAL}s, not restarting")
+            return
+        
+        # A busy clone fails its job; the next job on it starts it again
+        pool = self._pools[slot.config.architecture]
+        if not pool.try_acquire(slot):
+            return
+        
+        def restart():
+            try:
+                self._stop_clone(slot.config, force=True)
+                self._start_clone(slot.config)
+            except Exception as e:
+                logger.error(f"Restart of {vm_name} failed: {e}")
+            finally:
+                with self._lock:
+                    self._reverts.pop(vm_name, None)
+                pool.release(slot, job_done=False)
+        
+        logger.info(f"Restarting VM {vm_name}")
+        thread = threading.Thread(target=restart, name=f"restart-{vm_name}", daemon=True)
+        with self._lock:
+            self._reverts[vm_name] = thread
+        thread.start()
+    
+    def stop_vm(self, arch: VMArchitecture, force: bool = False, vm_name: Optional[str] = None):
+        """Stop running VMs of an architecture (all clones, or only `vm_name`)"""
+        pool = self._pools.get(arch)
+        if not pool:
+            return
+        
+        for slot in pool.slots:
+            if vm_name is None or slot.name == vm_name:
+                self._stop_clone(slot.config, force=force)
+    
+    def _stop_clone(self, vm_config: VMConfig, force: bool = False):
+        """Stop a single pool clone"""
         vm_name = vm_config.name
         
+        slot = self._get_slot(vm_name)
+        if slot:
+            slot.clean = False
+        if self.scheduler:
+            self.scheduler.release_cores(vm_name)
+        
         with self._lock:
             if vm_name in self._snapshot_managers:
                 self._snapshot_managers[vm_name].close()
                 del self._snapshot_managers[vm_name]
         
+        sockets = vm_config.get_socket_paths(self.config.sockets_dir)
+        with self._lock:
+            channel = self._channels.pop(sockets['agent'], None)
+        if channel:
+            channel.close()
+        
         self.launcher.stop(vm_name, force=force)
         
         with self._lock:
             if vm_name in self._processes:
                 del self._processes[vm_name]
         
+        overlays = self._overlays.get(vm_config.architecture)
+        if overlays:
+            overlays.delete_overlay(vm_name)
+        
         self._states[vm_name] = VMState.STOPPED
         logger.info(f"VM {vm_name} stopped")
     
@@ -172,32 +609,52 @@ class VMManager:
         for arch in VMArchitecture:
             self.stop_vm(arch, force=True)
     
-    def is_running(self, arch: VMArchitecture) -> bool:
-        """Check if VM is running"""
-        vm_config = self.get_vm_config(arch)
-        if not vm_config:
+    def is_running(self, arch: VMArchitecture, vm_name: Optional[str] = None) -> bool:
+        """Check if VM is running (any clone, or only `vm_name`)"""
+        pool = self._pools.get(arch)
+        if not pool:
             return False
-        return self.launcher.is_running(vm_config.name)
+        return any(
+            self.launcher.is_running(slot.name)
+            for slot in pool.slots
+            if vm_name is None or slot.name == vm_name
+        )
     
-    def get_state(self, arch: VMArchitecture) -> VMState:
+    def get_state(self, arch: VMArchitecture, vm_name: Optional[str] = None) -> VMState:
         """Get VM state"""
-        vm_config = self.get_vm_config(arch)
+        vm_config = self._resolve_clone(arch, vm_name)
         if not vm_config:
             return VMState.STOPPED
         return self._states.get(vm_config.name, VMState.STOPPED)
     
-    def restore_snapshot(self, arch: VMArchitecture, snapshot_name: str = "clean") -> float:
+    def _reset_clone(self, arch: VMArchitecture, slot: VMSlot) -> bool:
+        """Bring a clone back to its clean state (loadvm, or a fresh overlay/template)"""
+        start = time.monotonic()
+        if arch not in self._overlays:
+            self.restore_snapshot(arch, slot.config.snapshot_name, vm_name=slot.name)
+            ok = True
+        else:
+            # Nothing in the guest is worth a clean shutdown
+            self._stop_clone(slot.config, force=True)
+            ok = self._start_clone(slot.config)
+        if ok:
+            metrics.RESTORE_SECONDS.observe(time.monotonic() - start, arch=arch.value)
+        return ok
+    
+    def restore_snapshot(self, arch: VMArchitecture, snapshot_name: str = "clean",
+                         vm_name: Optional[str] = None) -> float:
         """
         Restore VM to a snapshot.
         
         Args:
             arch: VM architecture
             snapshot_name: Name of snapshot to restore
+            vm_name: Optional clone name
             
         Returns:
             Time taken in seconds
         """
-        vm_config = self.get_vm_config(arch)
+        vm_config = self._resolve_clone(arch, vm_name)
         if not vm_config:
             raise ValueError(f"No configuration for architecture: {arch}")
         
@@ -207,10 +664,15 @@ class VMManager:
         try:
             with self._lock:
                 sm = self._snapshot_managers.get(vm_name)
-                if not sm:
-                    raise RuntimeError(f"VM {vm_name} not running")
-                
-                duration = sm.restore_snapshot(snapshot_name)
+            if not sm:
+                raise RuntimeError(f"VM {vm_name} not running")
+            
+            # Each clone has its own QMP connection, restores run in parallel
+            duration = sm.restore_snapshot(snapshot_name)
+            
+            # The reverted agent knows nothing of requests in flight; start a new session
+            sockets = vm_config.get_socket_paths(self.config.sockets_dir)
+            self._get_channel(sockets['agent']).reset()
             
             self._states[vm_name] = VMState.RUNNING
             return duration
@@ -219,9 +681,10 @@ class VMManager:
             self._states[vm_name] = VMState.ERROR
             raise
     
-    def create_snapshot(self, arch: VMArchitecture, snapshot_name: str, description: str = ""):
+    def create_snapshot(self, arch: VMArchitecture, snapshot_name: str, description: str = "",
+                        vm_name: Optional[str] = None):
         """Create a new snapshot"""
-        vm_config = self.get_vm_config(arch)
+        vm_config = self._resolve_clone(arch, vm_name)
         if not vm_config:
             raise ValueError(f"No configuration for architecture: {arch}")
         
@@ -229,26 +692,31 @@ class VMManager:
         
         with self._lock:
             sm = self._snapshot_managers.get(vm_name)
-            if not sm:
-                raise RuntimeError(f"VM {vm_name} not running")
-            
-            sm.create_snapshot(snapshot_name, description)
+        if not sm:
+            raise RuntimeError(f"VM {vm_name} not running")
+        
+        sm.create_snapshot(snapshot_name, description)
     
-    def copy_to_guest(self, arch: VMArchitecture, local_path: str, guest_path: str) -> bool:
+    @metrics.timed('copy_to_guest')
+    def copy_to_guest(self, arch: VMArchitecture, local_path: str, guest_path: str,
+                      vm_name: Optional[str] = None, sha256: Optional[str] = None) -> bool:
         """
         Copy a file to the guest VM.
         
-        Uses virtio-serial channel to transfer file data.
+        Streams the file over the virtio-serial channel in chunks with a
+        SHA-256 check; an interrupted upload resumes where it stopped.
         
         Args:
             arch: VM architecture
             local_path: Path to local file
             guest_path: Destination path in guest
+            vm_name: Optional clone name
+            sha256: Known checksum of local_path (saves hashing it again)
             
         Returns:
             True if successful
         """
-        vm_config = self.get_vm_config(arch)
+        vm_config = self._resolve_clone(arch, vm_name)
         if not vm_config:
             return False
         
@@ -259,29 +727,24 @@ class VMManager:
             if not process:
                 return False
         
-        try:
-            # Read local file
-            with open(local_path, 'rb') as f:
-                file_data = f.read()
-            
-            # Send via agent socket
-            sockets = vm_config.get_socket_paths(self.config.sockets_dir)
-            
-            command = {
-                'command': 'write_file',
-                'path': guest_path,
-                'data': file_data.hex(),  # Hex-encode binary data
-                'mode': 0o755
-            }
-            
-            response = self._send_agent_command(sockets['agent'], command)
-            return response.get('success', False)
-            
-        except Exception as e:
-            logger.error(f"Failed to copy file to guest: {e}")
-            return False
+        sockets = vm_config.get_socket_paths(self.config.sockets_dir)
+        
+        channel = self._get_channel(sockets['agent'])
+        
+        for attempt in range(TRANSFER_ATTEMPTS):
+            try:
+                put_file(channel, local_path, guest_path, mode=0o755, sha256=sha256)
+                return True
+            except (TransferError, ChannelClosed, OSError) as e:
+                logger.warning(f"Upload to {vm_name} failed (attempt {attempt + 1}): {e}")
+            except Exception as e:
+                logger.error(f"Failed to copy file to guest: {e}")
+                return False
+        
+        return False
     
-    def copy_from_guest(self, arch: VMArchitecture, guest_path: str, local_path: str) -> bool:
+    def copy_from_guest(self, arch: VMArchitecture, guest_path: str, local_path: str,
+                        vm_name: Optional[str] = None) -> bool:
         """
         Copy a file from the guest VM.
         
@@ -289,11 +752,12 @@ class VMManager:
             arch: VM architecture
             guest_path: Path in guest
             local_path: Destination local path
+            vm_name: Optional clone name
             
         Returns:
             True if successful
         """
-        vm_config = self.get_vm_config(arch)
+        vm_config = self._resolve_clone(arch, vm_name)
         if not vm_config:
             return False
         
@@ -304,29 +768,24 @@ class VMManager:
             if not process:
                 return False
         
-        try:
-            sockets = vm_config.get_socket_paths(self.config.sockets_dir)
-            
-            command = {
-                'command': 'read_file',
-                'path': guest_path,
-            }
-            
-            response = self._send_agent_command(sockets['agent'], command)
-            
-            if response.get('success') and 'data' in response:
-                file_data = bytes.fromhex(response['data'])
-                with open(local_path, 'wb') as f:
-                    f.write(file_data)
+        sockets = vm_config.get_socket_paths(self.config.sockets_dir)
+        
+        channel = self._get_channel(sockets['agent'])
+        
+        for attempt in range(TRANSFER_ATTEMPTS):
+            try:
+                get_file(channel, guest_path, local_path)
                 return True
-            
-            return False
-            
-        except Exception as e:
-            logger.error(f"Failed to copy file from guest: {e}")
-            return False
+            except (TransferError, ChannelClosed, OSError) as e:
+                logger.warning(f"Download from {vm_name} failed (attempt {attempt + 1}): {e}")
+            except Exception as e:
+                logger.error(f"Failed to copy file from guest: {e}")
+                return False
+        
+        return False
     
-    def run_command(self, arch: VMArchitecture, command: str, timeout: int = 30) -> Dict[str, Any]:
+    def run_command(self, arch: VMArchitecture, command: str, timeout: int = 30,
+                    vm_name: Optional[str] = None) -> Dict[str, Any]:
         """
         Run a command in the guest VM.
         
@@ -334,11 +793,12 @@ class VMManager:
             arch: VM architecture
             command: Command to run
             timeout: Timeout in seconds
+            vm_name: Optional clone name
             
         Returns:
             Dict with stdout, stderr, exit_code
         """
-        vm_config = self.get_vm_config(arch)
+        vm_config = self._resolve_clone(arch, vm_name)
         if not vm_config:
             return {'error': 'No VM config'}
         
@@ -365,23 +825,49 @@ class VMManager:
             return {'error': str(e)}
     
     def analyze_file(self, file_path: str, arch: Optional[VMArchitecture] = None, 
-                     timeout: Optional[int] = None) -> AnalysisResult:
+                     timeout: Optional[int] = None,
+                     on_event: Optional[Callable[[Dict[str, List[Dict]]], Optional[str]]] = None,
+                     trace_syscalls: Optional[List[str]] = None,
+                     sample: Optional[SampleDescriptor] = None,
+                     monitors: Optional[Dict[str, Any]] = None) -> AnalysisResult:
         """
         Analyze a file in the VM sandbox.
         
         This is the main analysis method that:
-        1. Detects file architecture if not specified
-        2. Ensures VM is running
-        3. Restores clean snapshot
-        4. Copies file to VM
-        5. Runs analysis agent
-        6. Collects results
-        7. Restores snapshot again for next analysis
+        1. Detects file architecture if not specified (see _select_tier)
+        2. Takes an idle clone from the architecture's pool
+        3. Ensures the clone is running
+        4. Restores clean snapshot (overlay mode: boots on a fresh overlay)
+        5. Copies file to VM
+        6. Runs analysis agent
+        7. Collects results
+        8. Resets the clone again and returns it to the pool
+        
+        The post-analysis restore runs in the background: the result is
+        returned as soon as the agent responds, and the clone goes back to
+        the pool (marked clean) once its revert has finished. The next
+        sample on that clone then skips the pre-analysis restore.
+        
+        Safe to call from several threads: each call runs on its own clone
+        and blocks while all clones of the pool are busy.
+        
+        With `on_event`, the agent streams events while the sample runs and
+        on_event is called (in the caller's thread) with each batch as
+        {'syscalls': [...], 'files': [...], 'network': [...]}. The returned
+        result then has empty event lists, only event_counts. If on_event
+        returns a reason string, the sample is killed in the guest and the
+        clone is freed without waiting for the timeout (result.cancelled).
         
         Args:
             file_path: Path to file to analyze
             arch: Architecture (auto-detected if not specified)
             timeout: Analysis timeout (uses config default if not specified)
+            on_event: Incremental event callback
+            trace_syscalls: Syscall names for the guest tracer (agent default if None)
+            sample: Descriptor of file_path; its hash and type are reused on
+                    the host and sent to the agent instead of recomputed
+            monitors: Guest monitor filters: watch_paths (file monitor) and
+                      capture_ports (packet filter); agent defaults if None
             
         Returns:
             AnalysisResult object
@@ -398,13 +884,54 @@ class VMManager:
             )
         
         # Auto-detect architecture
+        emulator = None
         if arch is None:
-            arch = self._detect_file_architecture(file_path)
+            arch, emulator = self._select_tier(file_path, sample)
         
         timeout = timeout or self.config.default_analysis_timeout
         
-        vm_config = self.get_vm_config(arch)
-        if not vm_config:
+        result = self._run_on_pool(arch, file_path, timeout, start_time, on_event,
+                                   trace_syscalls, sample, emulator, monitors)
+        if emulator and result.error and result.error.startswith(EMULATOR_MISSING) \
+                and VMArchitecture.X64 in self._pools:
+            logger.warning(f"{result.error} in the ARM64 VM, using the x64 VM")
+            result = self._run_on_pool(VMArchitecture.X64, file_path, timeout, start_time, on_event,
+                                       trace_syscalls, sample, None, monitors)
+        return result
+    
+    def _select_tier(self, file_path: str,
+                     sample: Optional[SampleDescriptor] = None) -> Tuple[VMArchitecture, Optional[str]]:
+        """
+        Pick the VM a sample runs in, and the user-mode emulator if any.
+        
+        Statically linked x86 ELFs that fit user_mode_max_mb need no x86
+        kernel or libraries, so they run under qemu-user in the native
+        ARM64 VM (same agent monitors) instead of the full-system TCG x64
+        VM. Dynamically linked and large binaries keep the x64 VM.
+        
+        Returns:
+            (architecture, emulator or None)
+        """
+        arch = self._detect_file_architecture(file_path, sample)
+        if arch != VMArchitecture.X64 or VMArchitecture.ARM64 not in self._pools:
+            return arch, None
+        
+        if sample is None:
+            sample = describe(file_path)
+        emulator = self.config.user_mode_emulators.get(sample.file_type) if sample else None
+        if emulator and sample.static and sample.size <= self.config.user_mode_max_mb * 1024 * 1024:
+            return VMArchitecture.ARM64, emulator
+        return arch, None
+    
+    def _run_on_pool(self, arch: VMArchitecture, file_path: str, timeout: int, start_time: float,
+                     on_event: Optional[Callable] = None,
+                     trace_syscalls: Optional[List[str]] = None,
+                     sample: Optional[SampleDescriptor] = None,
+                     emulator: Optional[str] = None,
+                     monitors: Optional[Dict[str, Any]] = None) -> AnalysisResult:
+        """Run one analysis on an idle clone of an architecture's pool"""
+        pool = self._pools.get(arch)
+        if not pool:
             return AnalysisResult(
                 success=False,
                 file_path=file_path,
@@ -413,12 +940,81 @@ class VMManager:
                 error=f"No VM configuration for {arch}"
             )
         
+        with metrics.span('pool_acquire', arch=arch.value):
+            if self.scheduler:
+                slot = pool.acquire(self.config.pool_acquire_timeout, admit=self._admit,
+                                    poll_interval=self.scheduler.config.poll_interval)
+            else:
+                slot = pool.acquire(self.config.pool_acquire_timeout)
+        if slot is None:
+            return AnalysisResult(
+                success=False,
+                file_path=file_path,
+                architecture=arch.value,
+                duration=time.time() - start_time,
+                error="No idle VM available"
+            )
+        
+        try:
+            result = self._analyze_on_clone(slot, arch, file_path, timeout, start_time, on_event,
+                                            trace_syscalls, sample, emulator, monitors)
+        except BaseException:
+            pool.release(slot)
+            raise
+        
+        self._revert_in_background(pool, slot, arch)
+        return result
+    
+    def _revert_in_background(self, pool: VMPool, slot: VMSlot, arch: VMArchitecture):
+        """Restore clean snapshot off the caller's path, then release the clone"""
+        slot.clean = False
+        
+        def revert():
+            try:
+                if self.launcher.is_running(slot.name):
+                    slot.clean = self._reset_clone(arch, slot)
+                    if slot.clean:
+                        self._set_balloon(slot.config, idle=True)
+            except Exception as e:
+                logger.error(f"Background restore of {slot.name} failed: {e}")
+            finally:
+                with self._lock:
+                    self._reverts.pop(slot.name, None)
+                pool.release(slot)
+            try:
+                self._trim_pools()
+            except Exception as e:
+                logger.error(f"Pool trim failed: {e}")
+        
+        thread = threading.Thread(target=revert, name=f"revert-{slot.name}", daemon=True)
+        with self._lock:
+            self._reverts[slot.name] = thread
+        thread.start()
+    
+    def wait_for_reverts(self, timeout: Optional[float] = None):
+        """Wait until all background snapshot restores have finished"""
+        with self._lock:
+            threads = list(self._reverts.values())
+        for thread in threads:
+            thread.join(timeout)
+    
+    def _analyze_on_clone(self, slot: VMSlot, arch: VMArchitecture, file_path: str,
+                          timeout: int, start_time: float,
+                          on_event: Optional[Callable] = None,
+                          trace_syscalls: Optional[List[str]] = None,
+                          sample: Optional[SampleDescriptor] = None,
+                          emulator: Optional[str] = None,
+                          monitors: Optional[Dict[str, Any]] = None) -> AnalysisResult:
+        """Run the analysis pipeline on an acquired pool clone"""
+        vm_config = slot.config
         vm_name = vm_config.name
         
         try:
             # Ensure VM is running
-            if not self.is_running(arch):
-                if not self.start_vm(arch):
+            if not self.launcher.is_running(vm_name):
+                with metrics.span('vm_start', vm=vm_name):
+                    started = self._start_clone(vm_config)
+                if not started:
                     return AnalysisResult(
                         success=False,
                         file_path=file_path,
@@ -427,14 +1023,27 @@ class VMManager:
                         error="Failed to start VM"
                     )
             
-            self._states[vm_name] = VMState.ANALYZING
+            # Restore clean state unless the last background reset (or the boot) did it
+            if not slot.clean:
+                with metrics.span('vm_restore', vm=vm_name):
+                    reset = self._reset_clone(arch, slot)
+                if not reset:
+                    return AnalysisResult(
+                        success=False,
+                        file_path=file_path,
+                        architecture=arch.value,
+                        duration=time.time() - start_time,
+                        error="Failed to reset VM"
+                    )
+            slot.clean = False
+            self._set_balloon(vm_config, idle=False)
             
-            # Restore clean snapshot
-            self.restore_snapshot(arch, vm_config.snapshot_name)
+            self._states[vm_name] = VMState.ANALYZING
             
             # Copy file to guest
             guest_path = f"/tmp/sample_{os.path.basename(file_path)}"
-            if not self.copy_to_guest(arch, file_path, guest_path):
+            if not self.copy_to_guest(arch, file_path, guest_path, vm_name=vm_name,
+                                      sha256=sample.sha256 if sample else None):
                 return AnalysisResult(
                     success=False,
                     file_path=file_path,
@@ -446,13 +1055,49 @@ class VMManager:
             # Run analysis
             sockets = vm_config.get_socket_paths(self.config.sockets_dir)
             
+            analysis_id = uuid.uuid4().hex
             analysis_cmd = {
                 'command': 'analyze',
                 'file_path': guest_path,
-                'timeout': timeout
+                'timeout': timeout,
+                'stream_events': on_event is not None,
+                'analysis_id': analysis_id
             }
+            if trace_syscalls:
+                analysis_cmd['trace_syscalls'] = trace_syscalls
+            if sample:
+                # The upload was verified against this hash in the guest
+                analysis_cmd['file_hash'] = sample.sha256
+                analysis_cmd['file_type'] = sample.file_type
+            if emulator:
+                analysis_cmd['emulator'] = emulator
+            if self.config.capture_pcap:
+                analysis_cmd['pcap'] = True
+            for key, value in (monitors or {}).items():
+                if value:
+                    analysis_cmd[key] = value
+            cancel_sent = False
+            
+            def handle_batch(batch: Dict[str, Any]):
+                nonlocal cancel_sent
+                try:
+                    reason = on_event(decode_event_batch(batch))
+                except Exception as e:
+                    logger.error(f"Event callback failed: {e}")
+                    return
+                if reason and not cancel_sent:
+                    cancel_sent = True
+                    logger.info(f"Stopping analysis on {vm_name} early: {reason}")
+                    self._send_agent_command(sockets['agent'], {
+                        'command': 'cancel', 'analysis_id': analysis_id, 'reason': reason
+                    }, timeout=5)
             
-            response = self._send_agent_command(sockets['agent'], analysis_cmd, timeout + 10)
+            with metrics.span('guest_run', vm=vm_name):
+                response = self._send_agent_command(sockets['agent'], analysis_cmd, timeout + 10,
+                                                    on_event=handle_batch if on_event else None)
+            # Where the time went inside the guest (setup, execute, collect)
+            for stage, seconds in (response.get('timings') or {}).items():
+                metrics.record(f"guest_{stage}", seconds)
             
             # Process results
             duration = time.time() - start_time
@@ -470,7 +1115,12 @@ class VMManager:
                     process_activity=response.get('processes', []),
                     stdout=response.get('stdout', ''),
                     stderr=response.get('stderr', ''),
-                    exit_code=response.get('exit_code')
+                    exit_code=response.get('exit_code'),
+                    event_counts=response.get('event_counts', {}),
+                    dropped_events=response.get('dropped_events', {}),
+                    cancelled=response.get('cancelled'),
+                    emulator=emulator,
+                    pcap_path=self._fetch_pcap(arch, vm_name, response.get('pcap'), analysis_id)
                 )
             else:
                 result = AnalysisResult(
@@ -480,124 +1130,116 @@ class VMManager:
                     duration=duration,
                     error=response.get('error', 'Analysis failed'),
                     stdout=response.get('stdout', ''),
-                    stderr=response.get('stderr', '')
+                    stderr=response.get('stderr', ''),
+                    emulator=emulator
                 )
             
-            # Restore snapshot for next analysis
-            self.restore_snapshot(arch, vm_config.snapshot_name)
-            
             self._states[vm_name] = VMState.RUNNING
             return result
             
         except Exception as e:
-            logger.error(f"Analysis failed: {e}")
+            logger.error(f"Analysis failed on {vm_name}: {e}")
             self._states[vm_name] = VMState.ERROR
             return AnalysisResult(
                 success=False,
                 file_path=file_path,
-                architecture=arch.value if arch else "unknown",
+                architecture=arch.value,
                 duration=time.time() - start_time,
                 error=str(e)
             )
     
-    def _wait_for_vm_ready(self, vm_name: str, timeout: int) -> bool:
-        """Wait for VM to be ready (agent responding)"""
-        vm_config = None
-        for arch in VMArchitecture:
-            cfg = self.get_vm_config(arch)
-            if cfg and cfg.name == vm_name:
-                vm_config = cfg
-                break
-        
-        if not vm_config:
-            return False
-        
+    @metrics.timed('pcap_fetch')
+    def _fetch_pcap(self, arch: VMArchitecture, vm_name: str, guest_path: Optional[str],
+                    analysis_id: str) -> Optional[str]:
+        """Copy the guest's packet capture to pcap_dir (None if there is none)"""
+        if not guest_path:
+            return None
+        os.makedirs(self.config.pcap_dir, exist_ok=True)
+        local_path = os.path.join(self.config.pcap_dir, f"{analysis_id}.pcap")
+        if self.copy_from_guest(arch, guest_path, local_path, vm_name=vm_name):
+            return local_path
+        logger.warning(f"Could not fetch packet capture from {vm_name}")
+        return None
+    
+    def _wait_for_vm_ready(self, vm_config: VMConfig, timeout: int) -> bool:
+        """Wait for VM to be ready (agent sent HELLO or answers ping)"""
         sockets = vm_config.get_socket_paths(self.config.sockets_dir)
-        start_time = time.time()
+        channel = self._get_channel(sockets['agent'])
+        deadline = time.time() + timeout
         
-        while time.time() - start_time < timeout:
+        while time.time() < deadline:
+            if not self.launcher.is_running(vm_config.name):
+                return False
             try:
-                response = self._send_agent_command(sockets['agent'], {'command': 'ping'}, timeout=5)
-                if response.get('success'):
-                    return True
-            except Exception:
-                pass
-            time.sleep(1)
+                channel.connect()
+            except OSError:
+                # QEMU has not created the chardev socket yet
+                time.sleep(0.2)
+                continue
+            
+            # The agent greets every new connection as soon as it is listening
+            if channel.wait_hello(min(5, max(0, deadline - time.time()))):
+                return True
+            
+            # Agent may have been mid-session (e.g. restored snapshot); ask directly
+            response = self._send_agent_command(sockets['agent'], {'command': 'ping'}, timeout=2)
+            if response.get('success'):
+                return True
         
         return False
     
+    def _get_channel(self, socket_path: str) -> AgentChannel:
+        """Get the persistent agent connection for a socket"""
+        with self._lock:
+            channel = self._channels.get(socket_path)
+            if channel is None:
+                channel = AgentChannel(socket_path)
+                self._channels[socket_path] = channel
+            return channel
+    
     def _send_agent_command(self, socket_path: str, command: Dict[str, Any], 
-                           timeout: float = 30) -> Dict[str, Any]:
-        """Send command to guest agent via virtio-serial"""
-        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
-        sock.settimeout(timeout)
-        
+                           timeout: float = 30,
+                           on_event: Optional[Callable[[Dict[str, Any]], None]] = None) -> Dict[str, Any]:
+        """Send command to guest agent over its persistent channel"""
         try:
-            sock.connect(socket_path)
-            
-            # Send command
-            data = json.dumps(command) + '\n'
-            sock.send(data.encode())
-            
-            # Receive response
-            buffer = b''
-            while True:
-                chunk = sock.recv(4096)
-                if not chunk:
-                    break
-                buffer += chunk
-                if b'\n' in buffer:
-                    break
-            
-            if buffer:
-                return json.loads(buffer.decode().strip())
-            
-            return {'success': False, 'error': 'No response'}
-            
+            return self._get_channel(socket_path).request(command, timeout=timeout, on_event=on_event)
         except socket.timeout:
             return {'success': False, 'error': 'Timeout'}
         except Exception as e:
             return {'success': False, 'error': str(e)}
-        finally:
-            sock.close()
     
-    def _detect_file_architecture(self, file_path: str) -> VMArchitecture:
-        """Detect file architecture using file command"""
+    def _detect_file_architecture(self, file_path: str,
+                                  sample: Optional[SampleDescriptor] = None) -> VMArchitecture:
+        """Detect file architecture from the ELF header"""
         try:
-            result = subprocess.run(
-                ['file', '-b', file_path],
-                capture_output=True,
-                text=True,
-                timeout=5
-            )
-            
-            output = result.stdout.lower()
-            
-            # Check for x86-64
-            if 'x86-64' in output or 'x86_64' in output or 'amd64' in output:
-                return VMArchitecture.X64
-            
-            # Check for ARM64/AArch64
-            if 'aarch64' in output or 'arm64' in output:
-                return VMArchitecture.ARM64
+            arch = sample.arch if sample else sniff_file(file_path)[1]
             
-            # Check for 32-bit x86 (run in x64 VM)
-            if 'x86' in output or 'i386' in output or 'i686' in output:
+            # x86 binaries (32-bit too) run in the x64 VM
+            if arch == 'x64':
                 return VMArchitecture.X64
             
-            # Check file extension for scripts
-            ext = os.path.splitext(file_path)[1].lower()
-            if ext in ['.py', '.js', '.sh', '.bash']:
-                # Scripts can run on either, prefer native ARM64
-                return VMArchitecture.ARM64
-            
-            # Default to ARM64 (native on RPi5)
+            # ARM binaries, scripts and unknown files: native ARM64 on RPi5
             return VMArchitecture.ARM64
             
         except Exception as e:
             logger.warning(f"Failed to detect architecture: {e}")
             return VMArchitecture.ARM64
     
+    def slot_usage(self) -> Dict[Tuple[str, str], int]:
+        """Clones per (architecture, busy/idle/stopped), for the sandbox_vm_slots gauge"""
+        usage = {}
+        for arch, pool in self._pools.items():
+            counts = {'busy': 0, 'idle': 0, 'stopped': 0}
+            for clone in pool.get_status()['clones']:
+                if clone['busy']:
+                    counts['busy'] += 1
+                elif self.launcher.is_running(clone['name']):
+                    counts['idle'] += 1
+                else:
+                    counts['stopped'] += 1
+            usage.update({(arch.value, state): n for state, n in counts.items()})
+        return usage
+    
     def get_status(self) -> Dict[str, Any]:
         """Get overall VM Manager status"""
         status = {
@@ -621,6 +1263,22 @@ class VMManager:
             status['x64']['running'] = self.is_running(VMArchitecture.X64)
             status['x64']['state'] = self.get_state(VMArchitecture.X64).value
         
+        for arch, key in ((VMArchitecture.ARM64, 'arm64'), (VMArchitecture.X64, 'x64')):
+            pool = self._pools.get(arch)
+            if pool:
+                pool_status = pool.get_status()
+                for clone in pool_status['clones']:
+                    clone['running'] = self.launcher.is_running(clone['name'])
+                    clone['state'] = self._states.get(clone['name'], VMState.STOPPED).value
+                status[key]['pool'] = pool_status
+                status[key]['disk_mode'] = pool.slots[0].config.disk_mode
+                status[key]['start_mode'] = pool.slots[0].config.start_mode
+                if arch in self._templates:
+                    status[key]['memory_template_ready'] = self._templates[arch].ready
+        
+        if self.scheduler:
+            status['scheduler'] = self.scheduler.get_status(self._commitments())
+        
         return status
     
     def __enter__(self):
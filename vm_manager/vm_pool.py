@@ -0,0 +1,134 @@
+"""
+VM Pool - Warm pool of pre-booted VM clones per architecture
+"""
+
+import time
+import logging
+import threading
+from typing import Optional, Dict, List, Any, Callable
+from dataclasses import dataclass
+
+from .vm_config import VMConfig
+
+logger = logging.getLogger(__name__)
+
+
+@dataclass
+class VMSlot:
+    """A single VM clone in the pool"""
+    config: VMConfig
+    busy: bool = False
+    jobs_done: int = 0
+    acquired_at: float = 0.0
+    # True when the last snapshot restore finished and nothing ran since
+    clean: bool = False
+
+    @property
+    def name(self) -> str:
+        return self.config.name
+
+
+class VMPool:
+    """
+    Pool of VM clones for one architecture.
+
+    Samples are dispatched to whichever clone is idle; callers block
+    in acquire() until a clone is released when all of them are busy.
+    """
+
+    def __init__(self, configs: List[VMConfig]):
+        """
+        Initialize pool.
+
+        Args:
+            configs: Clone configurations (see VMConfig.clones())
+        """
+        self._slots: List[VMSlot] = [VMSlot(config=c) for c in configs]
+        self._cond = threading.Condition()
+
+    @property
+    def slots(self) -> List[VMSlot]:
+        return list(self._slots)
+
+    @property
+    def size(self) -> int:
+        return len(self._slots)
+
+    def idle_count(self) -> int:
+        with self._cond:
+            return sum(1 for s in self._slots if not s.busy)
+
+    def get_slot(self, vm_name: str) -> Optional[VMSlot]:
+        """Find slot by clone name"""
+        for slot in self._slots:
+            if slot.name == vm_name:
+                return slot
+        return None
+
+    def acquire(self, timeout: Optional[float] = None,
+                admit: Optional[Callable[[VMSlot], bool]] = None,
+                poll_interval: float = 2.0) -> Optional[VMSlot]:
+        """
+        Take an idle clone out of the pool.
+
+        Args:
+            timeout: Max seconds to wait for a free clone (None waits forever)
+            admit: Called (under the pool lock) for an idle clone before it
+                   is taken; False leaves it idle, e.g. while the host has
+                   no headroom to boot it
+            poll_interval: Re-check interval while idle clones are refused,
+                           since host headroom changes without a release
+
+        Returns:
+            VMSlot or None on timeout
+        """
+        deadline = None if timeout is None else time.time() + timeout
+
+        with self._cond:
+            while True:
+                # Prefer clones whose clean snapshot is already restored
+                idle = sorted((s for s in self._slots if not s.busy), key=lambda s: not s.clean)
+                for slot in idle:
+                    if admit is None or admit(slot):
+                        slot.busy = True
+                        slot.acquired_at = time.time()
+                        return slot
+
+                wait = poll_interval if idle else None
+                if deadline is not None:
+                    remaining = deadline - time.time()
+                    if remaining <= 0:
+                        logger.warning("No idle VM clone available" if not idle
+                                       else "Host has no headroom for an idle VM clone")
+                        return None
+                    wait = min(wait, remaining) if wait else remaining
+                self._cond.wait(wait)
+
+    def try_acquire(self, slot: VMSlot) -> bool:
+        """Take a specific clone if it is idle"""
+        with self._cond:
+            if slot.busy:
+                return False
+            slot.busy = True
+            slot.acquired_at = time.time()
+            return True
+
+    def release(self, slot: VMSlot, job_done: bool = True):
+        """Return a clone to the pool"""
+        with self._cond:
+            slot.busy = False
+            if job_done:
+                slot.jobs_done += 1
+            self._cond.notify()
+
+    def get_status(self) -> Dict[str, Any]:
+        """Get pool status"""
+        with self._cond:
+            return {
+                'size': len(self._slots),
+                'idle': sum(1 for s in self._slots if not s.busy),
+                'clones': [
+                    {'name': s.name, 'busy': s.busy, 'clean': s.clean, 'jobs_done': s.jobs_done}
+                    for s in self._slots
+                ],
+            }